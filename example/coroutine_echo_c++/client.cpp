@@ -0,0 +1,202 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// A client keeping -concurrency requests in flight by coroutines, callbacks
+// or synchronous calls in bthreads, to compare their throughput and memory.
+
+#include <gflags/gflags.h>
+#include <bthread/bthread.h>
+#include <bthread/coroutine.h>
+#include <butil/logging.h>
+#include <brpc/channel.h>
+#include <brpc/coroutine.h>
+#include <bvar/bvar.h>
+#include "echo.pb.h"
+
+DEFINE_string(mode, "coroutine", "How requests are sent: coroutine, "
+              "callback or sync");
+DEFINE_int32(concurrency, 10000, "Number of requests in flight");
+DEFINE_int32(request_size, 16, "Bytes of each request");
+DEFINE_string(protocol, "baidu_std", "Protocol type. Defined in src/brpc/options.proto");
+DEFINE_string(connection_type, "", "Connection type. Available values: single, pooled, short");
+DEFINE_string(server, "0.0.0.0:8000", "IP Address of server");
+DEFINE_string(load_balancer, "", "The algorithm for load balancing");
+DEFINE_int32(timeout_ms, 1000, "RPC timeout in milliseconds");
+DEFINE_int32(max_retry, 3, "Max retries(not including the first RPC)"); 
+
+std::string g_request;
+
+bvar::LatencyRecorder g_latency_recorder("client");
+bvar::Adder<int> g_error_count("client_error_count");
+
+static void HandleResult(const brpc::Controller& cntl) {
+    if (!cntl.Failed()) {
+        g_latency_recorder << cntl.latency_us();
+    } else {
+        g_error_count << 1;
+        LOG_EVERY_SECOND(WARNING) << "error=" << cntl.ErrorText()
+                                  << " latency=" << cntl.latency_us();
+    }
+}
+
+// Coroutine: a suspended coroutine only occupies its frame.
+static bthread::Awaitable<void> SendInCoroutine(
+    example::EchoService_Stub* stub, bthread::CountdownEvent* quit) {
+    while (!brpc::IsAskedToQuit()) {
+        example::EchoRequest request;
+        example::EchoResponse response;
+        brpc::Controller cntl;
+        request.set_message(g_request);
+        brpc::AwaitableDone done;
+        stub->Echo(&cntl, &request, &response, &done);
+        co_await done;
+        HandleResult(cntl);
+        if (cntl.Failed()) {
+            // Don't spin when the server is down.
+            co_await bthread::sleep_for(50000);
+        }
+    }
+    quit->signal();
+}
+
+// Callback: state of the call must be put on heap and the next call is
+// issued in the callback.
+class CallbackSender {
+public:
+    CallbackSender(example::EchoService_Stub* stub,
+                   bthread::CountdownEvent* quit)
+        : _stub(stub), _quit(quit) {
+        _request.set_message(g_request);
+    }
+
+    void Send() {
+        _cntl.Reset();
+        _response.Clear();
+        _stub->Echo(&_cntl, &_request, &_response,
+                    brpc::NewCallback(OnResponse, this));
+    }
+
+private:
+    static void OnResponse(CallbackSender* sender) {
+        HandleResult(sender->_cntl);
+        if (brpc::IsAskedToQuit()) {
+            sender->_quit->signal();
+            delete sender;
+            return;
+        }
+        if (sender->_cntl.Failed()) {
+            bthread_usleep(50000);
+        }
+        sender->Send();
+    }
+
+    example::EchoService_Stub* _stub;
+    bthread::CountdownEvent* _quit;
+    example::EchoRequest _request;
+    example::EchoResponse _response;
+    brpc::Controller _cntl;
+};
+
+// Sync: each request in flight blocks a bthread along with its stack.
+static void* SendInBthread(void* arg) {
+    example::EchoService_Stub* stub = static_cast<example::EchoService_Stub*>(arg);
+    while (!brpc::IsAskedToQuit()) {
+        example::EchoRequest request;
+        example::EchoResponse response;
+        brpc::Controller cntl;
+        request.set_message(g_request);
+        stub->Echo(&cntl, &request, &response, NULL);
+        HandleResult(cntl);
+        if (cntl.Failed()) {
+            bthread_usleep(50000);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    // Parse gflags. We recommend you to use gflags as well.
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+
+    // A Channel represents a communication line to a Server. Notice that 
+    // Channel is thread-safe and can be shared by all threads in your program.
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = FLAGS_protocol;
+    options.connection_type = FLAGS_connection_type;
+    options.timeout_ms = FLAGS_timeout_ms;
+    options.max_retry = FLAGS_max_retry;
+    if (channel.Init(FLAGS_server.c_str(), FLAGS_load_balancer.c_str(), &options) != 0) {
+        LOG(ERROR) << "Fail to initialize channel";
+        return -1;
+    }
+    if (FLAGS_request_size <= 0) {
+        LOG(ERROR) << "Bad request_size=" << FLAGS_request_size;
+        return -1;
+    }
+    g_request.resize(FLAGS_request_size, 'r');
+    if (FLAGS_concurrency <= 0) {
+        LOG(ERROR) << "Bad concurrency=" << FLAGS_concurrency;
+        return -1;
+    }
+
+    example::EchoService_Stub stub(&channel);
+    bthread::CountdownEvent quit(FLAGS_concurrency);
+    std::vector<bthread_t> bids;
+    if (FLAGS_mode == "coroutine") {
+        for (int i = 0; i < FLAGS_concurrency; ++i) {
+            bthread::spawn(SendInCoroutine(&stub, &quit));
+        }
+    } else if (FLAGS_mode == "callback") {
+        for (int i = 0; i < FLAGS_concurrency; ++i) {
+            (new CallbackSender(&stub, &quit))->Send();
+        }
+    } else if (FLAGS_mode == "sync") {
+        bids.resize(FLAGS_concurrency);
+        for (int i = 0; i < FLAGS_concurrency; ++i) {
+            if (bthread_start_background(
+                    &bids[i], NULL, SendInBthread, &stub) != 0) {
+                LOG(ERROR) << "Fail to create bthread";
+                return -1;
+            }
+        }
+    } else {
+        LOG(ERROR) << "Unknown mode=" << FLAGS_mode;
+        return -1;
+    }
+
+    while (!brpc::IsAskedToQuit()) {
+        sleep(1);
+        LOG(INFO) << "Sending EchoRequest by " << FLAGS_mode
+                  << " at qps=" << g_latency_recorder.qps(1)
+                  << " latency=" << g_latency_recorder.latency(1)
+                  << " rss=" << bvar::Variable::describe_exposed(
+                      "process_memory_resident")
+                  << " bthreads=" << bvar::Variable::describe_exposed(
+                      "bthread_count");
+    }
+
+    LOG(INFO) << "EchoClient is going to quit";
+    if (FLAGS_mode == "sync") {
+        for (size_t i = 0; i < bids.size(); ++i) {
+            bthread_join(bids[i], NULL);
+        }
+    } else {
+        quit.wait();
+    }
+    return 0;
+}
@@ -28,9 +28,10 @@ namespace brpc {
 
 static const int INITIAL_CONNECTION_CAP = 65536;
 
-Acceptor::Acceptor(bthread_keytable_pool_t* pool)
+Acceptor::Acceptor(bthread_keytable_pool_t* pool, bthread_tag_t bthread_tag)
     : InputMessenger()
     , _keytable_pool(pool)
+    , _bthread_tag(bthread_tag)
     , _status(UNINITIALIZED)
     , _idle_timeout_sec(-1)
     , _close_idle_tid(INVALID_BTHREAD)
@@ -79,6 +80,7 @@ int Acceptor::StartAccept(int listened_fd, int idle_timeout_sec,
     SocketOptions options;
     options.fd = listened_fd;
     options.user = this;
+    options.bthread_tag = _bthread_tag;
     options.on_edge_triggered_events = OnNewConnections;
     if (Socket::Create(options, &_acception_id) != 0) {
         // Close-idle-socket thread will be stopped inside destructor
@@ -268,6 +270,7 @@ void Acceptor::OnNewConnectionsUntilEAGAIN(Socket* acception) {
         SocketId socket_id;
         SocketOptions options;
         options.keytable_pool = am->_keytable_pool;
+        options.bthread_tag = am->_bthread_tag;
         options.fd = in_fd;
         options.remote_side = butil::EndPoint(*(sockaddr_in*)&in_addr);
         options.user = acception->user();
@@ -43,7 +43,8 @@ public:
     };
 
 public:
-    explicit Acceptor(bthread_keytable_pool_t* pool = NULL);
+    explicit Acceptor(bthread_keytable_pool_t* pool = NULL,
+                      bthread_tag_t bthread_tag = BTHREAD_TAG_INVALID);
     ~Acceptor();
 
     // [thread-safe] Accept connections from `listened_fd'. Ownership of
@@ -91,6 +92,8 @@ private:
     void BeforeRecycle(Socket* sock) override;
 
     bthread_keytable_pool_t* _keytable_pool; // owned by Server
+    // Accepted connections are processed by workers with this tag.
+    bthread_tag_t _bthread_tag;
     Status _status;
     int _idle_timeout_sec;
     bthread_t _close_idle_tid;
@@ -24,6 +24,7 @@
 
 namespace bthread {
 void print_task(std::ostream& os, bthread_t tid);
+void print_sched_stats(std::ostream& os);
 }
 
 
@@ -40,7 +41,8 @@ void BthreadsService::default_method(::google::protobuf::RpcController* cntl_bas
     const std::string& constraint = cntl->http_request().unresolved_path();
     
     if (constraint.empty()) {
-        os << "Use /bthreads/<bthread_id>";
+        os << "Use /bthreads/<bthread_id> to show a bthread\n\n";
+        ::bthread::print_sched_stats(os);
     } else {
         char* endptr = NULL;
         bthread_t tid = strtoull(constraint.c_str(), &endptr, 10);
@@ -108,6 +108,18 @@ static std::string BriefName(const std::string& cname) {
     return tmp;
 }
 
+// "inflight/max_concurrency" of the client-side concurrency limiter.
+static std::string ClientConcurrency(const Socket* ptr) {
+    int inflight = 0;
+    int max_concurrency = 0;
+    if (!ptr->GetClientConcurrencyStats(&inflight, &max_concurrency)) {
+        return "-";
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d/%d", inflight, max_concurrency);
+    return buf;
+}
+
 void ConnectionsService::PrintConnections(
     std::ostream& os, const std::vector<SocketId>& conns,
     bool use_html, const Server* server, bool is_channel_conn) const {
@@ -121,7 +133,8 @@ void ConnectionsService::PrintConnections(
         if (is_channel_conn) {
             os << "<th>Local</th>"
                 "<th>RecentErr</th>"
-                "<th>nbreak</th>";
+                "<th>nbreak</th>"
+                "<th>Conc/Limit</th>";
         }
         os << "<th>SSL</th>"
             "<th>Protocol</th>"
@@ -140,7 +153,7 @@ void ConnectionsService::PrintConnections(
     } else {
         os << "CreatedTime               |RemoteSide         |";
         if (is_channel_conn) {
-            os << "Local|RecentErr|nbreak|";
+            os << "Local|RecentErr|nbreak|Conc/Limit|";
         }
         os << "SSL|Protocol    |fd   |"
             "InBytes/s|In/s  |InBytes/m |In/m    |"
@@ -178,7 +191,8 @@ void ConnectionsService::PrintConnections(
             if (is_channel_conn) {
                 os << min_width(ptr->local_side().port, 5) << bar
                    << min_width(ptr->recent_error_count(), 10) << bar
-                   << min_width(ptr->isolated_times(), 7) << bar;
+                   << min_width(ptr->isolated_times(), 7) << bar
+                   << min_width(ClientConcurrency(ptr.get()), 10) << bar;
             }
             os << min_width("-", 3) << bar
                << min_width("-", 12) << bar
@@ -284,7 +298,8 @@ void ConnectionsService::PrintConnections(
                     os << min_width("-", 5) << bar;
                 }
                 os << min_width(ptr->recent_error_count(), 10) << bar
-                   << min_width(ptr->isolated_times(), 7) << bar;
+                   << min_width(ptr->isolated_times(), 7) << bar
+                   << min_width(ClientConcurrency(ptr.get()), 10) << bar;
             }
             os << SSLStateToYesNo(ptr->ssl_state(), use_html) << bar;
             char protname[32];
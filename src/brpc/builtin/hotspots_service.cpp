@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <thread>
 #include <gflags/gflags.h>
+#include "butil/atomicops.h"
 #include "butil/files/file_enumerator.h"
 #include "butil/file_util.h"                     // butil::FilePath
 #include "butil/popen.h"                         // butil::read_command_output
@@ -31,6 +32,8 @@
 #include "brpc/builtin/flamegraph_perl.h"
 #include "brpc/builtin/hotspots_service.h"
 #include "brpc/details/tcmalloc_extension.h"
+#include "bthread/contention_sampler.h"
+#include "bthread/cpu_sampler.h"
 
 extern "C" {
 int __attribute__((weak)) ProfilerStart(const char* fname);
@@ -233,6 +236,22 @@ static int ReadSeconds(const Controller* cntl) {
     return seconds;
 }
 
+// Read non-negative integer in query `name', returns -1 on error.
+static int ReadIntQuery(const Controller* cntl, const char* name,
+                        int default_value) {
+    const std::string* param = cntl->http_request().uri().GetQuery(name);
+    if (param == NULL) {
+        return default_value;
+    }
+    char* endptr = NULL;
+    const long value = strtol(param->c_str(), &endptr, 10);
+    if (endptr != param->c_str() + param->length() ||
+        value < 0 || value > INT_MAX) {
+        return -1;
+    }
+    return value;
+}
+
 static const char* GetBaseName(const std::string* full_base_name) {
     if (full_base_name == NULL) {
         return NULL;
@@ -306,7 +325,10 @@ static int MakeCacheName(char* cache_name, size_t len,
     }
 }
 
-static int MakeProfName(ProfilingType type, char* buf, size_t buf_len) {
+// `seq' is put into the name if it's not 0, to distinguish profiles made in
+// a same second.
+static int MakeProfName(ProfilingType type, char* buf, size_t buf_len,
+                        int seq = 0) {
     int nr = snprintf(buf, buf_len, "%s/%s/", FLAGS_rpc_profiling_dir.c_str(),
                       GetProgramChecksum());
     if (nr < 0) {
@@ -321,6 +343,14 @@ static int MakeProfName(ProfilingType type, char* buf, size_t buf_len) {
     const size_t nw = strftime(buf, buf_len, "%Y%m%d.%H%M%S", timeinfo);
     buf += nw;
     buf_len -= nw;
+    if (seq != 0) {
+        nr = snprintf(buf, buf_len, ".%d", seq);
+        if (nr < 0) {
+            return -1;
+        }
+        buf += nr;
+        buf_len -= nr;
+    }
 
     // We have checksum in the path, getpid() is not necessary now.
     snprintf(buf, buf_len, ".%s", ProfilingType2String(type));
@@ -604,6 +634,71 @@ static void DisplayResult(Controller* cntl,
     }
 }
 
+// Dump stacks sampled continuously by bthread/cpu_sampler.h or
+// bthread/contention_sampler.h and display them. Unlike profiling, this
+// neither blocks nor uses the profilers, so concurrent dumps are not
+// serialized.
+static void DumpSampledProfile(ProfilingType type, Controller* cntl,
+                               google::protobuf::Closure* done,
+                               const butil::IOBuf& result_prefix) {
+    ClosureGuard done_guard(done);
+    butil::IOBuf& resp = cntl->response_attachment();
+    const bool use_html = UseHTML(cntl->http_request());
+    butil::IOBufBuilder os;
+    os << result_prefix;
+
+    // Concurrent dumps in a second are written into different files.
+    static butil::atomic<uint32_t> s_sampled_seq(0);
+    const int seq = (int)(s_sampled_seq.fetch_add(
+            1, butil::memory_order_relaxed) % 1000000) + 1;
+    char prof_name[128];
+    if (MakeProfName(type, prof_name, sizeof(prof_name), seq) != 0) {
+        os << "Fail to create prof name: " << berror()
+           << (use_html ? "</body></html>" : "\n");
+        os.move_to(resp);
+        cntl->http_response().set_status_code(HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        return;
+    }
+#if defined(OS_MACOSX)
+    if (!has_GOOGLE_PPROF_BINARY_PATH()) {
+        os << "no GOOGLE_PPROF_BINARY_PATH in env"
+           << (use_html ? "</body></html>" : "\n");
+        os.move_to(resp);
+        cntl->http_response().set_status_code(HTTP_STATUS_FORBIDDEN);
+        return;
+    }
+#endif
+    std::string prof;
+    if (type == PROFILING_CPU) {
+        // Stacks sampled continuously, of `minutes' minutes ending `ago'
+        // minutes before, optionally only the ones of a method.
+        const int minutes = ReadIntQuery(cntl, "minutes", 1);
+        const int ago = ReadIntQuery(cntl, "ago", 0);
+        if (minutes <= 0 || ago < 0) {
+            os << "Invalid minutes or ago" << (use_html ? "</body></html>" : "\n");
+            os.move_to(resp);
+            cntl->http_response().set_status_code(HTTP_STATUS_BAD_REQUEST);
+            return;
+        }
+        const std::string* method =
+            cntl->http_request().uri().GetQuery("method");
+        bthread::dump_sampled_cpu(minutes, ago,
+                                  (method ? method->c_str() : NULL), &prof);
+    } else {
+        // Contentions sampled continuously since the program started.
+        bthread::dump_sampled_contentions(&prof);
+    }
+    if (!WriteSmallFile(prof_name, prof)) {
+        os << "Fail to write " << prof_name
+           << (use_html ? "</body></html>" : "\n");
+        os.move_to(resp);
+        cntl->http_response().set_status_code(
+            HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    DisplayResult(cntl, done_guard.release(), prof_name, os.buf());
+}
+
 static void DoProfiling(ProfilingType type,
                         ::google::protobuf::RpcController* cntl_base,
                         ::google::protobuf::Closure* done) {
@@ -674,6 +769,13 @@ static void DoProfiling(ProfilingType type,
         LOG_IF(ERROR, *endptr != '\0') << "Invalid profiling_id=" << prof_id;
     }
 
+    if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) &&
+        cntl->http_request().uri().GetQuery("sampled") != NULL) {
+        // Not queued behind the profiling running in g_env[type] which may
+        // take long, dumping the samples is quick.
+        return DumpSampledProfile(type, cntl, done_guard.release(), os.buf());
+    }
+
     {
         BAIDU_SCOPED_LOCK(g_env[type].mutex);
         if (g_env[type].client) {
@@ -751,7 +853,10 @@ static void DoProfiling(ProfilingType type,
                 HTTP_STATUS_INTERNAL_SERVER_ERROR);
             return NotifyWaiters(type, cntl, view);
         }
+        // Both use SIGPROF.
+        bthread::suspend_cpu_sampling();
         if (!ProfilerStart(prof_name)) {
+            bthread::resume_cpu_sampling();
             os << "Another profiler (not via /hotspots/cpu) is running, "
                 "try again later" << (use_html ? "</body></html>" : "\n");
             os.move_to(resp);
@@ -762,6 +867,7 @@ static void DoProfiling(ProfilingType type,
             PLOG(WARNING) << "Profiling has been interrupted";
         }
         ProfilerStop();
+        bthread::resume_cpu_sampling();
     } else if (type == PROFILING_CONTENTION) {
         if (!bthread::ContentionProfilerStart(prof_name)) {
             os << "Another profiler (not via /hotspots/contention) is running, "
@@ -846,7 +952,8 @@ static void StartProfiling(ProfilingType type,
     bool enabled = false;
     const char* extra_desc = "";
     if (type == PROFILING_CPU) {
-        enabled = cpu_profiler_enabled;
+        enabled = cpu_profiler_enabled ||
+            cntl->http_request().uri().GetQuery("sampled") != NULL;
     } else if (type == PROFILING_CONTENTION) {
         enabled = true;
     } else if (type == PROFILING_HEAP) {
@@ -993,6 +1100,20 @@ static void StartProfiling(ProfilingType type,
     if (show_ccount) {
         os << "&ccount";
     }
+    if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) &&
+        cntl->http_request().uri().GetQuery("sampled") != NULL) {
+        os << "&sampled";
+        if (type == PROFILING_CPU) {
+            const char* const window_queries[] = { "minutes", "ago", "method" };
+            for (size_t i = 0; i < arraysize(window_queries); ++i) {
+                const std::string* value =
+                    cntl->http_request().uri().GetQuery(window_queries[i]);
+                if (value) {
+                    os << '&' << window_queries[i] << '=' << *value;
+                }
+            }
+        }
+    }
     if (view) {
         os << "&view=" << *view;
     }
@@ -35,6 +35,7 @@
 #include "brpc/builtin/common.h"
 #include "brpc/details/tcmalloc_extension.h"
 #include "bthread/bthread.h"                // bthread_usleep
+#include "bthread/cpu_sampler.h"            // suspend_cpu_sampling
 #include "butil/fd_guard.h"
 
 extern "C" {
@@ -136,7 +137,10 @@ void PProfService::profile(
         cntl->SetFailed(EPERM, "Fail to create directory=`%s'",dir.value().c_str());
         return;
     }
+    // Both use SIGPROF.
+    bthread::suspend_cpu_sampling();
     if (!ProfilerStart(prof_name)) {
+        bthread::resume_cpu_sampling();
         cntl->SetFailed(EAGAIN, "Another profiler is running, try again later");
         return;
     }
@@ -144,6 +148,7 @@ void PProfService::profile(
         PLOG(WARNING) << "Profiling has been interrupted";
     }
     ProfilerStop();
+    bthread::resume_cpu_sampling();
 
     butil::fd_guard fd(open(prof_name, O_RDONLY));
     if (fd < 0) {
@@ -16,9 +16,17 @@
 // under the License.
 
 
+#include <inttypes.h>
+#include <errno.h>
+#include <cmath>
+#include <algorithm>
 #include <vector>
-#include <iomanip>
 #include <map>
+#include "butil/atomicops.h"
+#include "butil/containers/flat_map.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/string_splitter.h"
+#include "butil/synchronization/lock.h"
 #include "brpc/controller.h"                // Controller
 #include "brpc/server.h"                    // Server
 #include "brpc/closure_guard.h"             // ClosureGuard
@@ -37,146 +45,942 @@ namespace brpc {
 // Defined in server.cpp
 extern const char* const g_server_info_prefix;
 
-// This is a class that convert bvar result to prometheus output.
-// Currently the output only includes gauge and summary for two
-// reasons:
+// Metrics are output as gauges and summaries only for two reasons:
 // 1) We cannot tell gauge and counter just from name and what's
 // more counter is just another gauge.
 // 2) Histogram and summary is equivalent except that histogram
 // calculates quantiles in the server side.
-class PrometheusMetricsDumper : public bvar::Dumper {
-public:
-    explicit PrometheusMetricsDumper(butil::IOBufBuilder* os,
-                                     const std::string& server_prefix)
-        : _os(os)
-        , _server_prefix(server_prefix) {
+
+// Variables exposed by a LatencyRecorder, which are recognized by suffixes
+// of names and output as a summary.
+enum LatencyPart {
+    LATENCY_P1 = 0,
+    LATENCY_P2,
+    LATENCY_P3,
+    LATENCY_999,
+    LATENCY_9999,
+    MAX_LATENCY,
+    LATENCY_AVG,
+    LATENCY_COUNT,
+    LATENCY_NPART
+};
+// 6 is the number of bvars in LatencyRecorder that indicating percentiles
+static const int NPERCENTILES = 6;
+static const uint32_t ALL_PERCENTILES = (1 << NPERCENTILES) - 1;
+
+static const std::string* LatencySuffixes() {
+    static const std::string suffixes[NPERCENTILES] = {
+        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p1),
+        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p2),
+        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p3),
+        "_latency_999", "_latency_9999", "_max_latency"
+    };
+    return suffixes;
+}
+
+static const double* Quantiles() {
+    static const double quantiles[NPERCENTILES] = {
+        bvar::FLAGS_bvar_latency_p1 / 100.0,
+        bvar::FLAGS_bvar_latency_p2 / 100.0,
+        bvar::FLAGS_bvar_latency_p3 / 100.0,
+        0.999, 0.9999, 1
+    };
+    return quantiles;
+}
+
+static const std::string* QuantileLabels() {
+    static const std::string labels[NPERCENTILES] = {
+        butil::string_printf("quantile=\"%g\"", Quantiles()[0]),
+        butil::string_printf("quantile=\"%g\"", Quantiles()[1]),
+        butil::string_printf("quantile=\"%g\"", Quantiles()[2]),
+        "quantile=\"0.999\"", "quantile=\"0.9999\"", "quantile=\"1\""
+    };
+    return labels;
+}
+
+// Remove the suffix output by LatencyRecorder from `name' and return the
+// LatencyPart, or return -1 when `name' does not have such a suffix.
+static int CutLatencySuffix(butil::StringPiece* name) {
+    const std::string* suffixes = LatencySuffixes();
+    for (int i = 0; i < NPERCENTILES; ++i) {
+        if (name->ends_with(suffixes[i])) {
+            name->remove_suffix(suffixes[i].size());
+            return i;
+        }
+    }
+    if (name->ends_with("_latency")) {
+        name->remove_suffix(8);
+        return LATENCY_AVG;
+    }
+    if (name->ends_with("_count")) {
+        name->remove_suffix(6);
+        return LATENCY_COUNT;
+    }
+    return -1;
+}
+
+static void AppendHeader(std::string* out, const butil::StringPiece& name,
+                         const char* type) {
+    out->append("# HELP ");
+    out->append(name.data(), name.size());
+    out->append("\n# TYPE ");
+    out->append(name.data(), name.size());
+    out->push_back(' ');
+    out->append(type);
+    out->push_back('\n');
+}
+
+// Length of "# HELP <name>\n" which is not output in OpenMetrics where
+// HELP must be followed by a description.
+static size_t HelpLength(const butil::StringPiece& name) {
+    return name.size() + 8;
+}
+
+static int64_t ToInt64(const bvar::NumericValue& v) {
+    switch (v.type) {
+    case bvar::NumericValue::TYPE_INT64:
+        return v.i64;
+    case bvar::NumericValue::TYPE_UINT64:
+        return (int64_t)v.u64;
+    case bvar::NumericValue::TYPE_DOUBLE:
+        return (int64_t)v.f64;
+    default:
+        return 0;
     }
+}
 
-    bool dump(const std::string& name, const butil::StringPiece& desc) override;
+static double ToDouble(const bvar::NumericValue& v) {
+    switch (v.type) {
+    case bvar::NumericValue::TYPE_INT64:
+        return (double)v.i64;
+    case bvar::NumericValue::TYPE_UINT64:
+        return (double)v.u64;
+    case bvar::NumericValue::TYPE_DOUBLE:
+        return v.f64;
+    default:
+        return 0;
+    }
+}
+
+// Parse `str' which is a plain number. Returns true on success.
+static bool ParseNumericValue(const butil::StringPiece& str,
+                              bvar::NumericValue* v) {
+    if (str.empty() || str.size() >= 64) {
+        return false;
+    }
+    char buf[64];
+    memcpy(buf, str.data(), str.size());
+    buf[str.size()] = '\0';
+    char* endptr = NULL;
+    errno = 0;
+    const long long i = strtoll(buf, &endptr, 10);
+    if (*endptr == '\0' && errno == 0) {
+        v->type = bvar::NumericValue::TYPE_INT64;
+        v->i64 = i;
+        return true;
+    }
+    const double d = strtod(buf, &endptr);
+    if (*endptr == '\0' && endptr != buf) {
+        v->type = bvar::NumericValue::TYPE_DOUBLE;
+        v->f64 = d;
+        return true;
+    }
+    return false;
+}
+
+static void AppendValue(butil::IOBufAppender* out, const bvar::NumericValue& v) {
+    char buf[32];
+    switch (v.type) {
+    case bvar::NumericValue::TYPE_INT64:
+        out->append_decimal(v.i64);
+        return;
+    case bvar::NumericValue::TYPE_UINT64:
+        if (v.u64 <= (uint64_t)INT64_MAX) {
+            out->append_decimal((int64_t)v.u64);
+        } else {
+            out->append(buf, snprintf(buf, sizeof(buf), "%" PRIu64, v.u64));
+        }
+        return;
+    case bvar::NumericValue::TYPE_DOUBLE:
+        if (std::isnan(v.f64)) {
+            out->append("NaN");
+        } else if (std::isinf(v.f64)) {
+            out->append(v.f64 > 0 ? "+Inf" : "-Inf");
+        } else {
+            out->append(buf, snprintf(buf, sizeof(buf), "%.15g", v.f64));
+        }
+        return;
+    default:
+        out->push_back('0');
+        return;
+    }
+}
+
+// Encode messages of the protobuf format, namely length-delimited
+// MetricFamily defined in metrics.proto of prometheus/client_model.
+// The messages are simple enough to be encoded directly, without
+// bringing the .proto(with package io.prometheus.client) into brpc.
+enum PrometheusPbField {
+    // MetricFamily
+    PB_FAMILY_NAME = 1,
+    PB_FAMILY_TYPE = 3,
+    PB_FAMILY_METRIC = 4,
+    // Metric
+    PB_METRIC_LABEL = 1,
+    PB_METRIC_GAUGE = 2,
+    PB_METRIC_SUMMARY = 4,
+    // LabelPair
+    PB_LABEL_NAME = 1,
+    PB_LABEL_VALUE = 2,
+    // Gauge
+    PB_GAUGE_VALUE = 1,
+    // Summary
+    PB_SUMMARY_SAMPLE_COUNT = 1,
+    PB_SUMMARY_SAMPLE_SUM = 2,
+    PB_SUMMARY_QUANTILE = 3,
+    // Quantile
+    PB_QUANTILE_QUANTILE = 1,
+    PB_QUANTILE_VALUE = 2,
+};
+// Values of MetricType
+static const int PB_TYPE_GAUGE = 1;
+static const int PB_TYPE_SUMMARY = 2;
+
+static void PbAppendVarint(std::string* out, uint64_t v) {
+    while (v >= 0x80) {
+        out->push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out->push_back((char)v);
+}
+
+static void PbAppendVarintField(std::string* out, int field, uint64_t v) {
+    PbAppendVarint(out, (field << 3) | 0/*varint*/);
+    PbAppendVarint(out, v);
+}
+
+static void PbAppendDoubleField(std::string* out, int field, double v) {
+    PbAppendVarint(out, (field << 3) | 1/*fixed64*/);
+    uint64_t bits = 0;
+    memcpy(&bits, &v, sizeof(bits));
+    for (int i = 0; i < 8; ++i) {
+        out->push_back((char)(bits >> (i * 8)));
+    }
+}
+
+static void PbAppendBytesField(std::string* out, int field,
+                               const butil::StringPiece& bytes) {
+    PbAppendVarint(out, (field << 3) | 2/*length-delimited*/);
+    PbAppendVarint(out, bytes.size());
+    out->append(bytes.data(), bytes.size());
+}
+
+static void PbAppendFamilyHeader(std::string* out,
+                                 const butil::StringPiece& name, int type) {
+    PbAppendBytesField(out, PB_FAMILY_NAME, name);
+    PbAppendVarintField(out, PB_FAMILY_TYPE, type);
+}
+
+// Append `msg' with its length as a varint.
+static void AppendDelimited(butil::IOBufAppender* out, const std::string& msg) {
+    char buf[10];
+    size_t n = 0;
+    uint64_t v = msg.size();
+    while (v >= 0x80) {
+        buf[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (char)v;
+    out->append(buf, n);
+    out->append(msg);
+}
+
+// Append a summary metric with `labels_pb' which are encoded LabelPairs.
+static void PbAppendSummary(std::string* family, const std::string& labels_pb,
+                            const double percentiles[NPERCENTILES],
+                            double sum, int64_t count) {
+    std::string summary;
+    PbAppendVarintField(&summary, PB_SUMMARY_SAMPLE_COUNT, count);
+    PbAppendDoubleField(&summary, PB_SUMMARY_SAMPLE_SUM, sum);
+    std::string quantile;
+    for (int i = 0; i < NPERCENTILES; ++i) {
+        quantile.clear();
+        PbAppendDoubleField(&quantile, PB_QUANTILE_QUANTILE, Quantiles()[i]);
+        PbAppendDoubleField(&quantile, PB_QUANTILE_VALUE, percentiles[i]);
+        PbAppendBytesField(&summary, PB_SUMMARY_QUANTILE, quantile);
+    }
+    std::string metric = labels_pb;
+    PbAppendBytesField(&metric, PB_METRIC_SUMMARY, summary);
+    PbAppendBytesField(family, PB_FAMILY_METRIC, metric);
+}
+
+static void PbAppendGauge(std::string* family, const std::string& labels_pb,
+                          double value) {
+    std::string gauge;
+    PbAppendDoubleField(&gauge, PB_GAUGE_VALUE, value);
+    std::string metric = labels_pb;
+    PbAppendBytesField(&metric, PB_METRIC_GAUGE, gauge);
+    PbAppendBytesField(family, PB_FAMILY_METRIC, metric);
+}
+
+// Append `label' to `labels' which is empty or in the form of {...}
+static void AppendLabel(std::string* out, const butil::StringPiece& labels,
+                        const std::string& label) {
+    if (labels.size() <= 2) {
+        out->push_back('{');
+    } else {
+        out->append(labels.data(), labels.size() - 1);
+        out->push_back(',');
+    }
+    out->append(label);
+    out->push_back('}');
+}
+
+// Encode `labels' in the form of {name1="value1",...} as LabelPairs.
+static void PbAppendLabels(std::string* out, const butil::StringPiece& labels) {
+    std::string label;
+    std::string value;
+    size_t i = 1;
+    while (i < labels.size()) {
+        const size_t eq = labels.find('=', i);
+        if (eq == butil::StringPiece::npos || eq + 1 >= labels.size() ||
+            labels[eq + 1] != '"') {
+            return;
+        }
+        const butil::StringPiece name = labels.substr(i, eq - i);
+        value.clear();
+        for (i = eq + 2; i < labels.size() && labels[i] != '"'; ++i) {
+            if (labels[i] == '\\' && i + 1 < labels.size()) {
+                ++i;
+                value.push_back(labels[i] == 'n' ? '\n' : labels[i]);
+            } else {
+                value.push_back(labels[i]);
+            }
+        }
+        label.clear();
+        PbAppendBytesField(&label, PB_LABEL_NAME, name);
+        PbAppendBytesField(&label, PB_LABEL_VALUE, value);
+        PbAppendBytesField(out, PB_METRIC_LABEL, label);
+        // Skip '"' and ','
+        i += 2;
+    }
+}
+
+// Names of a LatencyRecorder rendered in all formats.
+struct PrometheusSummaryEntry {
+    // Name of the family if the LatencyRecorder is multi-dimensional,
+    // whose HELP and TYPE are output once for all label sets. Empty
+    // otherwise.
+    std::string family;
+    // "# HELP <name>\n# TYPE <name> summary\n", empty if labeled.
+    std::string header;
+    size_t help_len;
+    // "<name>{<labels>,quantile="..."} "
+    std::string quantile_prefixes[NPERCENTILES];
+    // "<name>_sum<labels> " and "<name>_count<labels> "
+    std::string sum_prefix;
+    std::string count_prefix;
+    // MetricFamily header, empty if labeled.
+    std::string pb_header;
+    // Encoded LabelPairs, empty if not labeled.
+    std::string labels_pb;
+    // Id of the latest scrape seeing this summary.
+    butil::atomic<uint64_t> scrape_id;
+};
+
+// Names of a variable rendered in all formats.
+struct PrometheusMetricEntry {
+    // Name of the family if the variable is a label set of a
+    // multi-dimensional bvar, empty otherwise.
+    std::string family;
+    // "# HELP <name>\n# TYPE <name> gauge\n<name> ", or "<name><labels> "
+    // if labeled.
+    std::string text;
+    size_t help_len;
+    // MetricFamily header, empty if labeled.
+    std::string pb_header;
+    // Encoded LabelPairs, empty if not labeled.
+    std::string labels_pb;
+    // Part of `summary', or -1 when the variable is output as a gauge.
+    int part;
+    PrometheusSummaryEntry* summary;
+    // Id of the latest scrape seeing this variable.
+    butil::atomic<uint64_t> scrape_id;
+};
+
+// Set `seen' to `scrape_id' unless it's newer. Returns true if `seen' is
+// changed, namely the entry is first seen in the scrape.
+static bool MarkSeen(butil::atomic<uint64_t>* seen, uint64_t scrape_id) {
+    uint64_t old = seen->load(butil::memory_order_relaxed);
+    while (old < scrape_id) {
+        if (seen->compare_exchange_weak(old, scrape_id,
+                                        butil::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Names of variables are rendered once and cached for later scrapes, which
+// only format values got by Variable::dump_exposed_numerics() and
+// MVariable::dump_exposed_numerics(), rather than describing all variables
+// and parsing the descriptions. Entries of variables that are not seen in
+// a scrape are removed.
+// Scrapes run concurrently, _mutex is only held for looking up and
+// inserting entries. Removed entries may still be used by other scrapes,
+// they're deleted when no scrape is running.
+class PrometheusMetricsCache {
+public:
+    PrometheusMetricsCache();
+    ~PrometheusMetricsCache();
+
+    // Returns id of the new scrape.
+    uint64_t BeginScrape();
+
+    // Get entry of the variable named `name', which is valid until
+    // EndScrape() is called.
+    PrometheusMetricEntry* GetOrNewEntry(const std::string& name);
+
+    // Remove entries not seen in the scrape which has seen `nentry'
+    // variables and `nsummary' summaries if `completed' is true.
+    void EndScrape(uint64_t scrape_id, bool completed,
+                   size_t nentry, size_t nsummary);
 
 private:
-    DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsDumper);
+    DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsCache);
+
+    PrometheusSummaryEntry* GetOrNewSummary(const std::string& family_name,
+                                            const butil::StringPiece& labels);
 
-    // Return true iff name ends with suffix output by LatencyRecorder.
-    bool DumpLatencyRecorderSuffix(const butil::StringPiece& name,
-                                   const butil::StringPiece& desc);
+    butil::Mutex _mutex;
+    butil::FlatMap<std::string, PrometheusMetricEntry*> _entries;
+    // Indexed by name of the family + labels.
+    butil::FlatMap<std::string, PrometheusSummaryEntry*> _summaries;
+    uint64_t _scrape_id;
+    int _nscraping;
+    std::vector<PrometheusMetricEntry*> _removed_entries;
+    std::vector<PrometheusSummaryEntry*> _removed_summaries;
+};
 
-    // 6 is the number of bvars in LatencyRecorder that indicating percentiles
-    static const int NPERCENTILES = 6;
+PrometheusMetricsCache::PrometheusMetricsCache()
+    : _scrape_id(0)
+    , _nscraping(0) {
+    CHECK_EQ(0, _entries.init(1024, 80));
+    CHECK_EQ(0, _summaries.init(64, 80));
+}
 
-    struct SummaryItems {
-        std::string latency_percentiles[NPERCENTILES];
-        int64_t latency_avg;
-        int64_t count;
-        std::string metric_name;
+PrometheusMetricsCache::~PrometheusMetricsCache() {
+    for (butil::FlatMap<std::string, PrometheusMetricEntry*>::iterator
+             it = _entries.begin(); it != _entries.end(); ++it) {
+        delete it->second;
+    }
+    for (butil::FlatMap<std::string, PrometheusSummaryEntry*>::iterator
+             it = _summaries.begin(); it != _summaries.end(); ++it) {
+        delete it->second;
+    }
+    for (size_t i = 0; i < _removed_entries.size(); ++i) {
+        delete _removed_entries[i];
+    }
+    for (size_t i = 0; i < _removed_summaries.size(); ++i) {
+        delete _removed_summaries[i];
+    }
+}
 
-        bool IsComplete() const { return !metric_name.empty(); }
-    };
-    const SummaryItems* ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
-                                                     const butil::StringPiece& desc);
+uint64_t PrometheusMetricsCache::BeginScrape() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    ++_nscraping;
+    return ++_scrape_id;
+}
+
+PrometheusSummaryEntry* PrometheusMetricsCache::GetOrNewSummary(
+    const std::string& family_name, const butil::StringPiece& labels) {
+    std::string key = family_name;
+    key.append(labels.data(), labels.size());
+    PrometheusSummaryEntry** psummary = _summaries.seek(key);
+    if (psummary != NULL) {
+        return *psummary;
+    }
+    PrometheusSummaryEntry* s = new PrometheusSummaryEntry;
+    if (labels.empty()) {
+        AppendHeader(&s->header, family_name, "summary");
+        s->help_len = HelpLength(family_name);
+        PbAppendFamilyHeader(&s->pb_header, family_name, PB_TYPE_SUMMARY);
+    } else {
+        s->family = family_name;
+        s->help_len = 0;
+        PbAppendLabels(&s->labels_pb, labels);
+    }
+    for (int i = 0; i < NPERCENTILES; ++i) {
+        s->quantile_prefixes[i] = family_name;
+        AppendLabel(&s->quantile_prefixes[i], labels, QuantileLabels()[i]);
+        s->quantile_prefixes[i].push_back(' ');
+    }
+    s->sum_prefix = family_name + "_sum";
+    s->sum_prefix.append(labels.data(), labels.size());
+    s->sum_prefix.push_back(' ');
+    s->count_prefix = family_name + "_count";
+    s->count_prefix.append(labels.data(), labels.size());
+    s->count_prefix.push_back(' ');
+    s->scrape_id.store(0, butil::memory_order_relaxed);
+    _summaries[key] = s;
+    return s;
+}
+
+PrometheusMetricEntry*
+PrometheusMetricsCache::GetOrNewEntry(const std::string& name) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    PrometheusMetricEntry** pentry = _entries.seek(name);
+    if (pentry != NULL) {
+        return *pentry;
+    }
+    PrometheusMetricEntry* entry = new PrometheusMetricEntry;
+    // Names of multi-dimensional bvars are in the form of
+    // name{label1="value1",...}
+    butil::StringPiece metric_name(name);
+    butil::StringPiece labels;
+    const size_t pos = metric_name.find('{');
+    if (pos != butil::StringPiece::npos) {
+        labels = metric_name.substr(pos);
+        metric_name.remove_suffix(metric_name.size() - pos);
+        entry->family = metric_name.as_string();
+        entry->help_len = 0;
+        PbAppendLabels(&entry->labels_pb, labels);
+    } else {
+        AppendHeader(&entry->text, name, "gauge");
+        entry->help_len = HelpLength(name);
+        PbAppendFamilyHeader(&entry->pb_header, name, PB_TYPE_GAUGE);
+    }
+    entry->text.append(name);
+    entry->text.push_back(' ');
+    entry->part = -1;
+    entry->summary = NULL;
+    entry->scrape_id.store(0, butil::memory_order_relaxed);
+    if (!labels.empty() || metric_name.starts_with(g_server_info_prefix)) {
+        entry->part = CutLatencySuffix(&metric_name);
+    }
+    if (entry->part >= 0) {
+        entry->summary = GetOrNewSummary(metric_name.as_string(), labels);
+    }
+    _entries[name] = entry;
+    return entry;
+}
+
+void PrometheusMetricsCache::EndScrape(uint64_t scrape_id, bool completed,
+                                       size_t nentry, size_t nsummary) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (completed && nentry < _entries.size()) {
+        std::vector<std::string> stale;
+        for (butil::FlatMap<std::string, PrometheusMetricEntry*>::iterator
+                 it = _entries.begin(); it != _entries.end(); ++it) {
+            if (it->second->scrape_id.load(butil::memory_order_relaxed) <
+                scrape_id) {
+                stale.push_back(it->first);
+                _removed_entries.push_back(it->second);
+            }
+        }
+        for (size_t i = 0; i < stale.size(); ++i) {
+            _entries.erase(stale[i]);
+        }
+    }
+    // A summary is seen iff any of its variables is seen, so it's removed
+    // along with all the variables.
+    if (completed && nsummary < _summaries.size()) {
+        std::vector<std::string> stale;
+        for (butil::FlatMap<std::string, PrometheusSummaryEntry*>::iterator
+                 it = _summaries.begin(); it != _summaries.end(); ++it) {
+            if (it->second->scrape_id.load(butil::memory_order_relaxed) <
+                scrape_id) {
+                stale.push_back(it->first);
+                _removed_summaries.push_back(it->second);
+            }
+        }
+        for (size_t i = 0; i < stale.size(); ++i) {
+            _summaries.erase(stale[i]);
+        }
+    }
+    if (--_nscraping == 0) {
+        for (size_t i = 0; i < _removed_entries.size(); ++i) {
+            delete _removed_entries[i];
+        }
+        _removed_entries.clear();
+        for (size_t i = 0; i < _removed_summaries.size(); ++i) {
+            delete _removed_summaries[i];
+        }
+        _removed_summaries.clear();
+    }
+}
+
+// Convert values of bvars to prometheus output in a scrape. Unlabeled
+// gauges are output at once. As metrics of a family must be grouped
+// together while label sets of multi-dimensional bvars and parts of
+// LatencyRecorders are dumped one by one, they are buffered and output in
+// Flush().
+class PrometheusScrape : public bvar::NumericDumper {
+public:
+    PrometheusScrape(PrometheusMetricsCache* cache, PrometheusFormat format,
+                     butil::IOBufAppender* out);
+    ~PrometheusScrape();
+
+    bool dump(const std::string& name, const bvar::NumericValue& value) override;
+
+    // Variables without numeric values are output if their descriptions
+    // are numbers.
+    bvar::Dumper* non_numeric_dumper() override { return &_text_dumper; }
+
+    // Dump all exposed variables and multi-dimensional variables.
+    // Returns 0 on success, -1 otherwise.
+    int Run();
 
 private:
-    butil::IOBufBuilder* _os;
-    const std::string _server_prefix;
-    std::map<std::string, SummaryItems> _m;
+    DISALLOW_COPY_AND_ASSIGN(PrometheusScrape);
+
+    class TextDumper : public bvar::Dumper {
+    public:
+        explicit TextDumper(PrometheusScrape* owner) : _owner(owner) {}
+        bool dump(const std::string& name,
+                  const butil::StringPiece& desc) override {
+            bvar::NumericValue value;
+            if (!ParseNumericValue(desc, &value)) {
+                // there is no necessary to monitor string in prometheus
+                return true;
+            }
+            return _owner->dump(name, value);
+        }
+    private:
+        PrometheusScrape* _owner;
+    };
+
+    // Values of a summary got in this scrape.
+    struct Summary {
+        const PrometheusSummaryEntry* entry;
+        uint32_t filled;
+        bvar::NumericValue values[LATENCY_NPART];
+        const PrometheusMetricEntry* parts[LATENCY_NPART];
+    };
+    struct Metric {
+        // Not NULL iff this is a gauge.
+        const PrometheusMetricEntry* gauge;
+        bvar::NumericValue value;
+        // Index in _summaries if this is a summary.
+        size_t summary;
+    };
+    // Metrics of a multi-dimensional bvar.
+    struct Family {
+        Family() : is_summary(false) {}
+        bool is_summary;
+        std::vector<Metric> metrics;
+    };
+
+    // Output all buffered metrics.
+    void Flush();
+    void AddGauge(const PrometheusMetricEntry* entry,
+                  const bvar::NumericValue& value);
+    void AppendGauge(const PrometheusMetricEntry& entry,
+                     const bvar::NumericValue& value);
+    void AppendSummary(const Summary& s);
+    void AppendFamily(const std::string& name, const Family& family);
+
+    PrometheusMetricsCache* _cache;
+    PrometheusFormat _format;
+    butil::IOBufAppender* _out;
+    uint64_t _scrape_id;
+    bool _completed;
+    size_t _nentry_seen;
+    TextDumper _text_dumper;
+    std::vector<Summary> _summaries;
+    std::map<const PrometheusSummaryEntry*, size_t> _summary_index;
+    std::map<std::string, Family> _families;
+    std::string _pb_family;
 };
 
-bool PrometheusMetricsDumper::dump(const std::string& name,
-                                   const butil::StringPiece& desc) {
-    if (!desc.empty() && desc[0] == '"') {
-        // there is no necessary to monitor string in prometheus
-        return true;
+PrometheusScrape::PrometheusScrape(PrometheusMetricsCache* cache,
+                                   PrometheusFormat format,
+                                   butil::IOBufAppender* out)
+    : _cache(cache)
+    , _format(format)
+    , _out(out)
+    , _scrape_id(cache->BeginScrape())
+    , _completed(false)
+    , _nentry_seen(0)
+    , _text_dumper(this) {
+}
+
+PrometheusScrape::~PrometheusScrape() {
+    _cache->EndScrape(_scrape_id, _completed, _nentry_seen,
+                      _summaries.size());
+}
+
+int PrometheusScrape::Run() {
+    if (bvar::Variable::dump_exposed_numerics(this, NULL) < 0 ||
+        bvar::MVariable::dump_exposed_numerics(this, NULL) < 0) {
+        return -1;
+    }
+    Flush();
+    _completed = true;
+    return 0;
+}
+
+bool PrometheusScrape::dump(const std::string& name,
+                            const bvar::NumericValue& value) {
+    PrometheusMetricEntry* entry = _cache->GetOrNewEntry(name);
+    if (MarkSeen(&entry->scrape_id, _scrape_id)) {
+        ++_nentry_seen;
     }
-    if (DumpLatencyRecorderSuffix(name, desc)) {
-        // Has encountered name with suffix exposed by LatencyRecorder,
-        // Leave it to DumpLatencyRecorderSuffix to output Summary.
+    if (entry->summary == NULL) {
+        AddGauge(entry, value);
         return true;
     }
-    *_os << "# HELP " << name << '\n'
-         << "# TYPE " << name << " gauge" << '\n'
-         << name << " " << desc << '\n';
+    // Parts of a LatencyRecorder are dumped in arbitrary order, output the
+    // summary after all variables are dumped.
+    PrometheusSummaryEntry* s = entry->summary;
+    std::pair<std::map<const PrometheusSummaryEntry*, size_t>::iterator,
+              bool> res = _summary_index.insert(
+                  std::make_pair(s, _summaries.size()));
+    if (res.second) {
+        MarkSeen(&s->scrape_id, _scrape_id);
+        _summaries.push_back(Summary());
+        _summaries.back().entry = s;
+        _summaries.back().filled = 0;
+    }
+    Summary& sv = _summaries[res.first->second];
+    sv.filled |= (1 << entry->part);
+    sv.values[entry->part] = value;
+    sv.parts[entry->part] = entry;
     return true;
 }
 
-const PrometheusMetricsDumper::SummaryItems*
-PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
-                                                      const butil::StringPiece& desc) {
-    static std::string latency_names[] = {
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p1),
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p2),
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p3),
-        "_latency_999", "_latency_9999", "_max_latency"
-    };
-    CHECK(NPERCENTILES == arraysize(latency_names));
-    const std::string desc_str = desc.as_string();
-    butil::StringPiece metric_name(name);
+void PrometheusScrape::AddGauge(const PrometheusMetricEntry* entry,
+                                const bvar::NumericValue& value) {
+    if (entry->family.empty()) {
+        AppendGauge(*entry, value);
+        return;
+    }
+    Metric m;
+    m.gauge = entry;
+    m.value = value;
+    m.summary = 0;
+    _families[entry->family].metrics.push_back(m);
+}
+
+void PrometheusScrape::AppendGauge(const PrometheusMetricEntry& entry,
+                                   const bvar::NumericValue& value) {
+    switch (_format) {
+    case PROMETHEUS_FORMAT_TEXT:
+        _out->append(entry.text);
+        AppendValue(_out, value);
+        _out->push_back('\n');
+        return;
+    case PROMETHEUS_FORMAT_OPENMETRICS:
+        _out->append(butil::StringPiece(entry.text).substr(entry.help_len));
+        AppendValue(_out, value);
+        _out->push_back('\n');
+        return;
+    case PROMETHEUS_FORMAT_PROTOBUF:
+        _pb_family = entry.pb_header;
+        PbAppendGauge(&_pb_family, entry.labels_pb, ToDouble(value));
+        AppendDelimited(_out, _pb_family);
+        return;
+    }
+}
+
+// Append metrics of the summary in text formats.
+static void AppendSummaryLines(butil::IOBufAppender* out,
+                               const PrometheusSummaryEntry& s,
+                               const bvar::NumericValue values[],
+                               int64_t sum, int64_t count) {
     for (int i = 0; i < NPERCENTILES; ++i) {
-        if (!metric_name.ends_with(latency_names[i])) {
+        out->append(s.quantile_prefixes[i]);
+        AppendValue(out, values[i]);
+        out->push_back('\n');
+    }
+    out->append(s.sum_prefix);
+    out->append_decimal(sum);
+    out->push_back('\n');
+    out->append(s.count_prefix);
+    out->append_decimal(count);
+    out->push_back('\n');
+}
+
+static void PbAppendSummaryMetric(std::string* family,
+                                  const PrometheusSummaryEntry& s,
+                                  const bvar::NumericValue values[],
+                                  int64_t sum, int64_t count) {
+    double percentiles[NPERCENTILES];
+    for (int i = 0; i < NPERCENTILES; ++i) {
+        percentiles[i] = ToDouble(values[i]);
+    }
+    PbAppendSummary(family, s.labels_pb, percentiles, sum, count);
+}
+
+// There is no sum of latency in bvar output, just use average * count as
+// approximation
+static int64_t SummarySum(const bvar::NumericValue values[]) {
+    return ToInt64(values[LATENCY_AVG]) * ToInt64(values[LATENCY_COUNT]);
+}
+
+void PrometheusScrape::AppendSummary(const Summary& sv) {
+    const PrometheusSummaryEntry& s = *sv.entry;
+    const int64_t count = ToInt64(sv.values[LATENCY_COUNT]);
+    const int64_t sum = SummarySum(sv.values);
+    if (_format == PROMETHEUS_FORMAT_PROTOBUF) {
+        _pb_family = s.pb_header;
+        PbAppendSummaryMetric(&_pb_family, s, sv.values, sum, count);
+        AppendDelimited(_out, _pb_family);
+        return;
+    }
+    if (_format == PROMETHEUS_FORMAT_OPENMETRICS) {
+        _out->append(butil::StringPiece(s.header).substr(s.help_len));
+    } else {
+        _out->append(s.header);
+    }
+    AppendSummaryLines(_out, s, sv.values, sum, count);
+}
+
+void PrometheusScrape::AppendFamily(const std::string& name,
+                                    const Family& family) {
+    if (_format == PROMETHEUS_FORMAT_PROTOBUF) {
+        _pb_family.clear();
+        PbAppendFamilyHeader(&_pb_family, name, (family.is_summary ?
+                                                 PB_TYPE_SUMMARY : PB_TYPE_GAUGE));
+        for (size_t i = 0; i < family.metrics.size(); ++i) {
+            const Metric& m = family.metrics[i];
+            if (m.gauge != NULL) {
+                PbAppendGauge(&_pb_family, m.gauge->labels_pb,
+                              ToDouble(m.value));
+                continue;
+            }
+            const Summary& sv = _summaries[m.summary];
+            PbAppendSummaryMetric(&_pb_family, *sv.entry, sv.values,
+                                  SummarySum(sv.values),
+                                  ToInt64(sv.values[LATENCY_COUNT]));
+        }
+        AppendDelimited(_out, _pb_family);
+        return;
+    }
+    std::string header;
+    AppendHeader(&header, name, (family.is_summary ? "summary" : "gauge"));
+    if (_format == PROMETHEUS_FORMAT_OPENMETRICS) {
+        _out->append(butil::StringPiece(header).substr(HelpLength(name)));
+    } else {
+        _out->append(header);
+    }
+    for (size_t i = 0; i < family.metrics.size(); ++i) {
+        const Metric& m = family.metrics[i];
+        if (m.gauge != NULL) {
+            _out->append(m.gauge->text);
+            AppendValue(_out, m.value);
+            _out->push_back('\n');
             continue;
         }
-        metric_name.remove_suffix(latency_names[i].size());
-        SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_percentiles[i] = desc_str;
-        if (i == NPERCENTILES - 1) {
-            // '_max_latency' is the last suffix name that appear in the sorted bvar
-            // list, which means all related percentiles have been gathered and we are
-            // ready to output a Summary.
-            si->metric_name = metric_name.as_string();
-        }
-        return si;
-    }
-    // Get the average of latency in recent window size
-    if (metric_name.ends_with("_latency")) {
-        metric_name.remove_suffix(8);
-        SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_avg = strtoll(desc_str.data(), NULL, 10);
-        return si;
-    }
-    if (metric_name.ends_with("_count")) {
-        metric_name.remove_suffix(6);
-        SummaryItems* si = &_m[metric_name.as_string()];
-        si->count = strtoll(desc_str.data(), NULL, 10);
-        return si;
-    }
-    return NULL;
-}
-
-bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
-    const butil::StringPiece& name,
-    const butil::StringPiece& desc) {
-    if (!name.starts_with(_server_prefix)) {
-        return false;
+        const Summary& sv = _summaries[m.summary];
+        AppendSummaryLines(_out, *sv.entry, sv.values, SummarySum(sv.values),
+                           ToInt64(sv.values[LATENCY_COUNT]));
     }
-    const SummaryItems* si = ProcessLatencyRecorderSuffix(name, desc);
-    if (!si) {
-        return false;
+}
+
+void PrometheusScrape::Flush() {
+    for (size_t i = 0; i < _summaries.size(); ++i) {
+        const Summary& sv = _summaries[i];
+        if ((sv.filled & ALL_PERCENTILES) != ALL_PERCENTILES) {
+            // Not a LatencyRecorder, output the variables as they are.
+            for (int j = 0; j < LATENCY_NPART; ++j) {
+                if (sv.filled & (1 << j)) {
+                    AddGauge(sv.parts[j], sv.values[j]);
+                }
+            }
+        } else if (sv.entry->family.empty()) {
+            AppendSummary(sv);
+        } else {
+            Family& family = _families[sv.entry->family];
+            family.is_summary = true;
+            Metric m;
+            m.gauge = NULL;
+            m.summary = i;
+            family.metrics.push_back(m);
+        }
     }
-    if (!si->IsComplete()) {
-        return true;
+    for (std::map<std::string, Family>::const_iterator
+             it = _families.begin(); it != _families.end(); ++it) {
+        AppendFamily(it->first, it->second);
     }
-    *_os << "# HELP " << si->metric_name << '\n'
-         << "# TYPE " << si->metric_name << " summary\n"
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p1) / 100 << "\"} "
-         << si->latency_percentiles[0] << '\n'
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p2) / 100 << "\"} "
-         << si->latency_percentiles[1] << '\n'
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p3) / 100 << "\"} "
-         << si->latency_percentiles[2] << '\n'
-         << si->metric_name << "{quantile=\"0.999\"} "
-         << si->latency_percentiles[3] << '\n'
-         << si->metric_name << "{quantile=\"0.9999\"} "
-         << si->latency_percentiles[4] << '\n'
-         << si->metric_name << "{quantile=\"1\"} "
-         << si->latency_percentiles[5] << '\n'
-         << si->metric_name << "_sum "
-         // There is no sum of latency in bvar output, just use
-         // average * count as approximation
-         << si->latency_avg * si->count << '\n'
-         << si->metric_name << "_count " << si->count << '\n';
-    return true;
+    _families.clear();
+}
+
+struct PrometheusMediaType {
+    const char* type;
+    // A parameter required to match the type, or NULL.
+    const char* param;
+    PrometheusFormat format;
+    const char* content_type;
+};
+
+static const PrometheusMediaType g_prometheus_media_types[] = {
+    { "application/vnd.google.protobuf", "proto=io.prometheus.client.MetricFamily",
+      PROMETHEUS_FORMAT_PROTOBUF,
+      "application/vnd.google.protobuf; "
+      "proto=io.prometheus.client.MetricFamily; encoding=delimited" },
+    { "application/openmetrics-text", NULL, PROMETHEUS_FORMAT_OPENMETRICS,
+      "application/openmetrics-text; version=1.0.0; charset=utf-8" },
+    { "text/plain", NULL, PROMETHEUS_FORMAT_TEXT, "text/plain" },
+    { "*/*", NULL, PROMETHEUS_FORMAT_TEXT, "text/plain" },
+};
+
+static butil::StringPiece TrimSpaces(butil::StringPiece s) {
+    while (!s.empty() && (s[0] == ' ' || s[0] == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s[s.size() - 1] == ' ' || s[s.size() - 1] == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// Choose the supported media type with the highest q-value in `accept'
+// (the Accept header), text format is used by default.
+static const PrometheusMediaType* NegotiatePrometheusFormat(
+    const std::string* accept) {
+    const PrometheusMediaType* best = &g_prometheus_media_types[
+        arraysize(g_prometheus_media_types) - 1];
+    if (accept == NULL) {
+        return best;
+    }
+    double best_q = 0;
+    for (butil::StringSplitter sp(*accept, ','); sp; ++sp) {
+        butil::StringSplitter param_sp(sp.field(), sp.field() + sp.length(), ';');
+        if (!param_sp) {
+            continue;
+        }
+        const butil::StringPiece type =
+            TrimSpaces(butil::StringPiece(param_sp.field(), param_sp.length()));
+        double q = 1;
+        std::vector<butil::StringPiece> params;
+        for (++param_sp; param_sp; ++param_sp) {
+            const butil::StringPiece param = TrimSpaces(
+                butil::StringPiece(param_sp.field(), param_sp.length()));
+            if (param.starts_with("q=")) {
+                q = strtod(param.substr(2).as_string().c_str(), NULL);
+            } else {
+                params.push_back(param);
+            }
+        }
+        if (q <= best_q) {
+            continue;
+        }
+        for (size_t i = 0; i < arraysize(g_prometheus_media_types); ++i) {
+            const PrometheusMediaType& t = g_prometheus_media_types[i];
+            if (type != t.type) {
+                continue;
+            }
+            if (t.param != NULL &&
+                std::find(params.begin(), params.end(), t.param) == params.end()) {
+                continue;
+            }
+            best = &t;
+            best_q = q;
+            break;
+        }
+    }
+    return best;
 }
 
 void PrometheusMetricsService::default_method(::google::protobuf::RpcController* cntl_base,
@@ -185,21 +989,33 @@ void PrometheusMetricsService::default_method(::google::protobuf::RpcController*
                                               ::google::protobuf::Closure* done) {
     ClosureGuard done_guard(done);
     Controller *cntl = static_cast<Controller*>(cntl_base);
-    cntl->http_response().set_content_type("text/plain");
-    if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment()) != 0) {
+    const PrometheusMediaType* media_type = NegotiatePrometheusFormat(
+        cntl->http_request().GetHeader("Accept"));
+    cntl->http_response().set_content_type(media_type->content_type);
+    // Compressed when the output is large and the client accepts gzip.
+    cntl->set_response_compress_type(COMPRESS_TYPE_GZIP);
+    if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment(),
+                                     media_type->format) != 0) {
         cntl->SetFailed("Fail to dump metrics");
         return;
     }
 }
 
 int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output) {
-    butil::IOBufBuilder os;
-    PrometheusMetricsDumper dumper(&os, g_server_info_prefix);
-    const int ndump = bvar::Variable::dump_exposed(&dumper, NULL);
-    if (ndump < 0) {
+    return DumpPrometheusMetricsToIOBuf(output, PROMETHEUS_FORMAT_TEXT);
+}
+
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output, PrometheusFormat format) {
+    butil::IOBufAppender out;
+    PrometheusScrape scrape(
+        butil::get_leaky_singleton<PrometheusMetricsCache>(), format, &out);
+    if (scrape.Run() != 0) {
         return -1;
     }
-    os.move_to(*output);
+    if (format == PROMETHEUS_FORMAT_OPENMETRICS) {
+        out.append("# EOF\n");
+    }
+    out.move_to(*output);
     return 0;
 }
 
@@ -31,8 +31,24 @@ public:
                         ::google::protobuf::Closure* done) override;
 };
 
+// Formats of metrics exposed to prometheus.
+enum PrometheusFormat {
+    // text/plain; version=0.0.4
+    PROMETHEUS_FORMAT_TEXT = 0,
+    // application/openmetrics-text; version=1.0.0
+    PROMETHEUS_FORMAT_OPENMETRICS = 1,
+    // Length-delimited io.prometheus.client.MetricFamily messages.
+    PROMETHEUS_FORMAT_PROTOBUF = 2,
+};
+
+// Dump all exposed bvars into `output' in text format.
+// Returns 0 on success, -1 otherwise.
 int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output);
 
+// Dump all exposed bvars into `output' in `format'.
+// Returns 0 on success, -1 otherwise.
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output, PrometheusFormat format);
+
 } // namepace brpc
 
 #endif  // BRPC_PROMETHEUS_METRICS_SERVICE_H
@@ -31,6 +31,7 @@
 #include "brpc/details/load_balancer_with_naming.h"
 #include "brpc/controller.h"
 #include "brpc/channel.h"
+#include "brpc/retry_budget.h"
 #include "brpc/details/usercode_backup_pool.h"       // TooManyUserCode
 #include "brpc/policy/esp_authenticator.h"
 
@@ -45,8 +46,14 @@ ChannelOptions::ChannelOptions()
     , backup_request_ms(-1)
     , max_retry(3)
     , enable_circuit_breaker(false)
+    , enable_client_concurrency_limiter(false)
+    , retry_budget_percent(-1)
+    , min_retries_per_second(10)
+    , retry_backoff_ms(0)
+    , retry_backoff_max_ms(1000)
     , protocol(PROTOCOL_BAIDU_STD)
     , connection_type(CONNECTION_TYPE_UNKNOWN)
+    , preconnect_connections(0)
     , succeed_without_server(true)
     , log_succeed_without_server(true)
     , auth(NULL)
@@ -61,6 +68,17 @@ ChannelSSLOptions* ChannelOptions::mutable_ssl_options() {
     return _ssl_options.get();
 }
 
+// Argument to Socket::PreConnect() for servers of the channel, -1 means
+// no pre-connecting.
+static int PreConnectPooledCount(const ChannelOptions& opt) {
+    if (opt.preconnect_connections <= 0 ||
+        opt.connection_type == CONNECTION_TYPE_SHORT) {
+        return -1;
+    }
+    return (opt.connection_type == CONNECTION_TYPE_POOLED ?
+            opt.preconnect_connections : 0);
+}
+
 static ChannelSignature ComputeChannelSignature(const ChannelOptions& opt) {
     if (opt.auth == NULL &&
         !opt.has_ssl_options() &&
@@ -192,6 +210,11 @@ int Channel::InitChannelOptions(const ChannelOptions* options) {
         }
     }
 
+    if (_options.retry_budget_percent >= 0) {
+        _retry_budget.reset(new RetryBudget(_options.retry_budget_percent,
+                                            _options.min_retries_per_second));
+    }
+
     // Normalize connection_group
     std::string& cg = _options.connection_group;
     if (!cg.empty() && (::isspace(cg.front()) || ::isspace(cg.back()))) {
@@ -311,6 +334,13 @@ int Channel::InitSingle(const butil::EndPoint& server_addr_and_port,
         LOG(ERROR) << "Fail to insert into SocketMap";
         return -1;
     }
+    const int npooled = PreConnectPooledCount(_options);
+    if (npooled >= 0) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(_server_id, &ptr) == 0) {
+            ptr->PreConnect(npooled);
+        }
+    }
     return 0;
 }
 
@@ -344,6 +374,7 @@ int Channel::Init(const char* ns_url,
     if (CreateSocketSSLContext(_options, &ns_opt.ssl_ctx) != 0) {
         return -1;
     }
+    lb->set_preconnect_npooled(PreConnectPooledCount(_options));
     if (lb->Init(ns_url, lb_name, _options.ns_filter, &ns_opt) != 0) {
         LOG(ERROR) << "Fail to initialize LoadBalancerWithNaming";
         delete lb;
@@ -388,9 +419,18 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     }
     cntl->_preferred_index = _preferred_index;
     cntl->_retry_policy = _options.retry_policy;
+    if (_retry_budget != NULL) {
+        _retry_budget->OnRequest();
+        cntl->_retry_budget = _retry_budget;
+    }
+    cntl->_retry_backoff_ms = _options.retry_backoff_ms;
+    cntl->_retry_backoff_max_ms = _options.retry_backoff_max_ms;
     if (_options.enable_circuit_breaker) {
         cntl->add_flag(Controller::FLAGS_ENABLED_CIRCUIT_BREAKER);
     }
+    if (_options.enable_client_concurrency_limiter) {
+        cntl->add_flag(Controller::FLAGS_ENABLED_CLIENT_CONCURRENCY_LIMITER);
+    }
     const CallId correlation_id = cntl->call_id();
     const int rc = bthread_id_lock_and_reset_range(
                     correlation_id, NULL, 2 + cntl->max_retry());
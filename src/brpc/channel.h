@@ -76,6 +76,33 @@ struct ChannelOptions {
     // Default: false
     bool enable_circuit_breaker;
 
+    // Limit concurrency of requests sent to each server according to its
+    // latency and overload errors. A server reaching its limit is skipped
+    // by selecting another one, RPC fails with ELIMIT if all tries are
+    // limited. Note that the limit of a server is shared by all channels
+    // enabling this option and accessing the server in this process.
+    // Default: false
+    bool enable_client_concurrency_limiter;
+
+    // Limit retries over this channel to `retry_budget_percent' percent of
+    // the requests in the last -retry_budget_ttl_s seconds plus
+    // `min_retries_per_second' retries per second. RPC not allowed to retry
+    // ends with the error of its last try, and is counted in bvar
+    // rpc_retry_budget_exhausted_count.
+    // Default: -1 (no budget, retries are only limited by max_retry)
+    int32_t retry_budget_percent;
+    // Default: 10
+    int32_t min_retries_per_second;
+
+    // Wait before the n-th retry for a random duration in [T/2, T] where
+    // T = min(retry_backoff_max_ms, retry_backoff_ms * 2^(n-1)). Retries are
+    // scheduled in the timer thread, no thread is blocked during the waiting.
+    // A retry that can't be sent before the deadline of RPC is not issued.
+    // Default: 0 (retry immediately)
+    int32_t retry_backoff_ms;
+    // Default: 1000
+    int32_t retry_backoff_max_ms;
+
     // Serialization protocol, defined in src/brpc/options.proto
     // NOTE: You can assign name of the protocol to this field as well, for
     // Example: options.protocol = "baidu_std";
@@ -88,6 +115,14 @@ struct ChannelOptions {
     // Possible values: "single", "pooled", "short".
     AdaptiveConnectionType connection_type;
 
+    // Connect to servers in background once they're added or revived, so
+    // that the first requests don't pay for TCP and SSL handshakes. For
+    // pooled connections, so many connections are made to each server,
+    // otherwise the single connection is made if this value is positive.
+    // Ignored by short connections.
+    // Default: 0 (connect on first request)
+    int32_t preconnect_connections;
+
     // Channel.Init() succeeds even if there's no server in the NamingService. 
     // E.g. the BNS directory is empty. All RPC over the channel will fail before
     // new nodes being added to the NamingService.
@@ -225,6 +260,9 @@ protected:
     // It will be destroyed after channel's destruction and all
     // the RPC above has finished
     butil::intrusive_ptr<SharedLoadBalancer> _lb;
+    // Shared with controllers in the same way as _lb, NULL when
+    // retry_budget_percent < 0.
+    butil::intrusive_ptr<RetryBudget> _retry_budget;
     ChannelOptions _options;
     int _preferred_index;
 };
@@ -0,0 +1,182 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "brpc/client_concurrency_limiter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <gflags/gflags.h>
+
+#include "brpc/errno.pb.h"
+#include "butil/time.h"
+
+namespace brpc {
+
+DEFINE_int32(client_cl_initial_max_concurrency, 40,
+    "Initial max concurrency of requests sent to a single server");
+DEFINE_int32(client_cl_min_concurrency, 4,
+    "The client-side max concurrency of a server never goes below this value");
+DEFINE_int32(client_cl_max_concurrency, 1000,
+    "The client-side max concurrency of a server never goes above this value");
+DEFINE_int32(client_cl_sample_window_size_ms, 100,
+    "Duration of the sampling window.");
+DEFINE_int32(client_cl_min_sample_count, 10,
+    "If the number of responses collected in the sampling window is less "
+    "than this value, the window is extended.");
+DEFINE_double(client_cl_alpha_factor_for_ema, 0.05,
+    "The smoothing coefficient used in the calculation of the long-term "
+    "latency, the value range is 0-1.");
+DEFINE_double(client_cl_latency_tolerance, 1.5,
+    "Recent latency within this multiple of the long-term latency is not "
+    "treated as a sign of overload.");
+DEFINE_double(client_cl_smoothing, 0.2,
+    "Weight of the newly computed max concurrency, the value range is 0-1.");
+DEFINE_double(client_cl_backoff_ratio, 0.9,
+    "Multiply max concurrency by this ratio when the server responds with "
+    "ELIMIT/ERPCTIMEDOUT/EOVERCROWDED in a sampling window.");
+
+static bool IsOverloadError(int error_code) {
+    return error_code == ELIMIT ||
+        error_code == ERPCTIMEDOUT ||
+        error_code == EOVERCROWDED;
+}
+
+ClientConcurrencyLimiter::ClientConcurrencyLimiter()
+    : _inflight(0)
+    , _max_concurrency(FLAGS_client_cl_initial_max_concurrency)
+    , _used(false)
+    , _sw_start_us(0)
+    , _sw_succ_count(0)
+    , _sw_overload_count(0)
+    , _sw_total_succ_us(0)
+    , _limit(FLAGS_client_cl_initial_max_concurrency)
+    , _long_latency_us(0) {
+}
+
+bool ClientConcurrencyLimiter::OnRequested() {
+    if (!_used.load(butil::memory_order_relaxed)) {
+        _used.store(true, butil::memory_order_relaxed);
+    }
+    const int n = _inflight.fetch_add(1, butil::memory_order_relaxed) + 1;
+    if (n > _max_concurrency.load(butil::memory_order_relaxed)) {
+        _inflight.fetch_sub(1, butil::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void ClientConcurrencyLimiter::OnResponded(int error_code, int64_t latency_us) {
+    _inflight.fetch_sub(1, butil::memory_order_relaxed);
+    if (error_code == 0) {
+        _sw_succ_count.fetch_add(1, butil::memory_order_relaxed);
+        _sw_total_succ_us.fetch_add(latency_us, butil::memory_order_relaxed);
+    } else if (IsOverloadError(error_code)) {
+        _sw_overload_count.fetch_add(1, butil::memory_order_relaxed);
+    } else {
+        // Other errors (connection broken, cancelled...) say nothing about
+        // the load of the server.
+        return;
+    }
+
+    const int64_t now_us = butil::cpuwide_time_us();
+    int64_t start_us = _sw_start_us.load(butil::memory_order_relaxed);
+    if (start_us == 0) {
+        _sw_start_us.compare_exchange_strong(
+            start_us, now_us, butil::memory_order_relaxed);
+        return;
+    }
+    if (now_us - start_us < FLAGS_client_cl_sample_window_size_ms * 1000L) {
+        return;
+    }
+    if (_sw_succ_count.load(butil::memory_order_relaxed) +
+        _sw_overload_count.load(butil::memory_order_relaxed) <
+        FLAGS_client_cl_min_sample_count) {
+        return;
+    }
+    // Only one thread wins the right to submit the window.
+    if (_sw_start_us.compare_exchange_strong(
+            start_us, now_us, butil::memory_order_relaxed)) {
+        UpdateMaxConcurrency(now_us);
+    }
+}
+
+void ClientConcurrencyLimiter::UpdateMaxConcurrency(int64_t /*now_us*/) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const int32_t succ_count =
+        _sw_succ_count.exchange(0, butil::memory_order_relaxed);
+    const int32_t overload_count =
+        _sw_overload_count.exchange(0, butil::memory_order_relaxed);
+    const int64_t total_succ_us =
+        _sw_total_succ_us.exchange(0, butil::memory_order_relaxed);
+
+    if (overload_count > 0) {
+        // The server told us it's overloaded, back off multiplicatively.
+        AdjustMaxConcurrency(_limit * FLAGS_client_cl_backoff_ratio);
+        return;
+    }
+    if (succ_count <= 0) {
+        return;
+    }
+    const double short_latency_us = (double)total_succ_us / succ_count;
+    if (_long_latency_us <= 0) {
+        _long_latency_us = short_latency_us;
+    } else {
+        const double alpha = FLAGS_client_cl_alpha_factor_for_ema;
+        _long_latency_us =
+            _long_latency_us * (1 - alpha) + short_latency_us * alpha;
+    }
+    // The long-term latency was recorded when the server was slow, let it
+    // catch up faster with the recovered server.
+    if (_long_latency_us > short_latency_us * 2) {
+        _long_latency_us *= 0.95;
+    }
+
+    double gradient = FLAGS_client_cl_latency_tolerance * _long_latency_us /
+        std::max(short_latency_us, 1.0);
+    gradient = std::max(0.5, std::min(1.0, gradient));
+    double next_limit = _limit * gradient + std::sqrt(_limit);
+    if (next_limit > _limit && inflight() * 2 < _limit) {
+        // The limit is not the bottleneck, don't let it grow unboundedly.
+        next_limit = _limit;
+    }
+    const double smoothing = FLAGS_client_cl_smoothing;
+    AdjustMaxConcurrency(_limit * (1 - smoothing) + next_limit * smoothing);
+}
+
+void ClientConcurrencyLimiter::AdjustMaxConcurrency(double next_max_concurrency) {
+    next_max_concurrency = std::max<double>(
+        FLAGS_client_cl_min_concurrency, next_max_concurrency);
+    next_max_concurrency = std::min<double>(
+        FLAGS_client_cl_max_concurrency, next_max_concurrency);
+    _limit = next_max_concurrency;
+    _max_concurrency.store((int)std::ceil(next_max_concurrency),
+                           butil::memory_order_relaxed);
+}
+
+void ClientConcurrencyLimiter::Reset() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _sw_start_us.store(0, butil::memory_order_relaxed);
+    _sw_succ_count.store(0, butil::memory_order_relaxed);
+    _sw_overload_count.store(0, butil::memory_order_relaxed);
+    _sw_total_succ_us.store(0, butil::memory_order_relaxed);
+    _long_latency_us = 0;
+    _limit = FLAGS_client_cl_initial_max_concurrency;
+    _max_concurrency.store(FLAGS_client_cl_initial_max_concurrency,
+                           butil::memory_order_relaxed);
+}
+
+}  // namespace brpc
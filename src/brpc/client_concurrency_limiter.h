@@ -0,0 +1,82 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_CLIENT_CONCURRENCY_LIMITER_H
+#define BRPC_CLIENT_CONCURRENCY_LIMITER_H
+
+#include "butil/atomicops.h"
+#include "butil/scoped_lock.h"
+
+namespace brpc {
+
+// Limit concurrency of requests sent from this process to a single server.
+// The limit is adjusted by comparing recent latencies with the long-term
+// latency (gradient) and is cut multiplicatively when the server returns
+// errors indicating overload (AIMD). Unlike AutoConcurrencyLimiter which
+// protects a server from all its clients, this limiter stops a client from
+// overloading a slow server before timeouts trip the CircuitBreaker.
+class ClientConcurrencyLimiter {
+public:
+    ClientConcurrencyLimiter();
+
+    // Called before sending a request to the server. Returns true if the
+    // request can be sent, false if the server reached its limit, in which
+    // case OnResponded() must NOT be called.
+    bool OnRequested();
+
+    // Called when a request accepted by OnRequested() ends.
+    // error_code: Error_code of this call, 0 means success.
+    // latency_us: Time cost of this call.
+    void OnResponded(int error_code, int64_t latency_us);
+
+    // Reset the limit to the initial value. Requests in flight are kept.
+    void Reset();
+
+    int max_concurrency() const {
+        return _max_concurrency.load(butil::memory_order_relaxed);
+    }
+
+    int inflight() const {
+        return _inflight.load(butil::memory_order_relaxed);
+    }
+
+    // True if OnRequested() was ever called.
+    bool used() const { return _used.load(butil::memory_order_relaxed); }
+
+private:
+    void UpdateMaxConcurrency(int64_t now_us);
+    void AdjustMaxConcurrency(double next_max_concurrency);
+
+    butil::atomic<int> BAIDU_CACHELINE_ALIGNMENT _inflight;
+    butil::atomic<int> _max_concurrency;
+    butil::atomic<bool> _used;
+
+    // modified per response.
+    butil::atomic<int64_t> BAIDU_CACHELINE_ALIGNMENT _sw_start_us;
+    butil::atomic<int32_t> _sw_succ_count;
+    butil::atomic<int32_t> _sw_overload_count;
+    butil::atomic<int64_t> _sw_total_succ_us;
+
+    // modified per sample-window, protected by _mutex.
+    butil::Mutex _mutex;
+    double _limit;
+    double _long_latency_us;
+};
+
+}  // namespace brpc
+
+#endif // BRPC_CLIENT_CONCURRENCY_LIMITER_H
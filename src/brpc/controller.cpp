@@ -25,6 +25,7 @@
 #include "butil/string_printf.h"
 #include "butil/logging.h"
 #include "butil/time.h"
+#include "butil/object_pool.h"     // butil::return_object
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
 #include "bvar/bvar.h"
@@ -34,11 +35,13 @@
 #include "brpc/load_balancer.h"
 #include "brpc/closure_guard.h"
 #include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/rpc_phase.h"
 #include "brpc/controller.h"
 #include "brpc/span.h"
 #include "brpc/server.h"   // Server::_session_local_data_pool
 #include "brpc/simple_data_pool.h"
 #include "brpc/retry_policy.h"
+#include "brpc/retry_budget.h"
 #include "brpc/stream_impl.h"
 #include "brpc/policy/streaming_rpc_protocol.h" // FIXME
 #include "brpc/rpc_dump.h"
@@ -116,13 +119,20 @@ const Controller* GetSubControllerOfSelectiveChannel(
 DECLARE_bool(usercode_in_pthread);
 static const int MAX_RETRY_COUNT = 1000;
 static bvar::Adder<int64_t>* g_ncontroller = NULL;
+static bvar::Adder<int64_t>* g_client_concurrency_limited = NULL;
 
 static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
 
 static void CreateVars() {
     g_ncontroller = new bvar::Adder<int64_t>("rpc_controller_count");
+    g_client_concurrency_limited = new bvar::Adder<int64_t>(
+        "rpc_client_concurrency_limited_count");
 }
 
+DEFINE_int32(client_cl_max_reselect, 2,
+             "Max times of selecting another server when the selected one "
+             "reached its client-side max concurrency");
+
 Controller::Controller() {
     CHECK_EQ(0, pthread_once(&s_create_vars_once, CreateVars));
     *g_ncontroller << 1;
@@ -173,6 +183,9 @@ void Controller::ResetNonPods() {
     if (_span) {
         Span::Submit(_span, butil::cpuwide_time_us());
     }
+    if (_phase_timeline) {
+        butil::return_object(_phase_timeline);
+    }
     _error_text.clear();
     _remote_side = butil::EndPoint();
     _local_side = butil::EndPoint();
@@ -193,6 +206,7 @@ void Controller::ResetNonPods() {
     }
     delete _sender;
     _lb.reset(NULL);
+    _retry_budget.reset(NULL);
     _current_call.Reset();
     ExcludedServers::Destroy(_accessed);
     _request_buf.clear();
@@ -225,6 +239,7 @@ void Controller::ResetPods() {
     // NOTE: Make the sequence of assignments same with the order that they're
     // defined in header. Better for cpu cache and faster for lookup.
     _span = NULL;
+    _phase_timeline = NULL;
     _flags = 0;
 #ifndef BAIDU_INTERNAL
     set_pb_bytes_to_base64(true);
@@ -242,6 +257,8 @@ void Controller::ResetPods() {
     _connection_type = CONNECTION_TYPE_UNKNOWN;
     _timeout_ms = UNSET_MAGIC_NUM;
     _backup_request_ms = UNSET_MAGIC_NUM;
+    _retry_backoff_ms = 0;
+    _retry_backoff_max_ms = 0;
     _connect_timeout_ms = UNSET_MAGIC_NUM;
     _deadline_us = -1;
     _timeout_id = 0;
@@ -279,6 +296,7 @@ Controller::Call::Call(Controller::Call* rhs)
     : nretry(rhs->nretry)
     , need_feedback(rhs->need_feedback)
     , enable_circuit_breaker(rhs->enable_circuit_breaker)
+    , acquired_concurrency(rhs->acquired_concurrency)
     , peer_id(rhs->peer_id)
     , begin_time_us(rhs->begin_time_us)
     , sending_sock(rhs->sending_sock.release())
@@ -287,6 +305,7 @@ Controller::Call::Call(Controller::Call* rhs)
     // setting all the fields to next call and _current_call.OnComplete
     // will behave incorrectly.
     rhs->need_feedback = false;
+    rhs->acquired_concurrency = false;
     rhs->peer_id = INVALID_SOCKET_ID;
     rhs->stream_user_data = NULL;
 }
@@ -299,6 +318,7 @@ void Controller::Call::Reset() {
     nretry = 0;
     need_feedback = false;
     enable_circuit_breaker = false;
+    acquired_concurrency = false;
     peer_id = INVALID_SOCKET_ID;
     begin_time_us = 0;
     sending_sock.reset(NULL);
@@ -624,6 +644,15 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
         //  * we intercepted error from _unfinished_call in OnVersionedRPCReturned
         //  * ERPCTIMEDOUT/ECANCELED are not retrying error by default.
         CHECK_EQ(current_id(), info.id) << "error_code=" << _error_code;
+        const int64_t backoff_us = RetryBackoffUs();
+        if (backoff_us > 0 && _deadline_us >= 0 &&
+            butil::gettimeofday_us() + backoff_us >= _deadline_us) {
+            // The retry can't be sent before the deadline.
+            goto END_OF_RPC;
+        }
+        if (_retry_budget != NULL && !_retry_budget->AcquireRetry()) {
+            goto END_OF_RPC;
+        }
         if (!SingleServer()) {
             if (_accessed == NULL) {
                 _accessed = ExcludedServers::Create(
@@ -644,6 +673,21 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
             _http_response->Clear();
         }
         response_attachment().clear();
+        if (backoff_us > 0) {
+            // The call has been fed back, don't feed back again if the RPC
+            // ends (say timedout) before the retry is issued.
+            _current_call.need_feedback = false;
+            bthread_timer_t backoff_timer;
+            if (bthread_timer_add(
+                    &backoff_timer,
+                    butil::microseconds_from_now(backoff_us),
+                    HandleRetryBackoff, (void*)current_id().value) == 0) {
+                // Unlock the id so that timeout and cancellation during the
+                // waiting are handled as usual.
+                CHECK_EQ(0, bthread_id_unlock(info.id));
+                return;
+            }
+        }
         return IssueRPC(butil::gettimeofday_us());
     }
 
@@ -702,6 +746,47 @@ void* Controller::RunEndRPC(void* arg) {
     return NULL;
 }
 
+int64_t Controller::RetryBackoffUs() const {
+    if (_retry_backoff_ms <= 0) {
+        return 0;
+    }
+    // _current_call.nretry is 0 for the first retry.
+    const int shift = std::min(_current_call.nretry, 20);
+    const int64_t max_backoff_us = std::min<int64_t>(
+        (int64_t)_retry_backoff_ms << shift, _retry_backoff_max_ms) * 1000L;
+    if (max_backoff_us <= 0) {
+        return 0;
+    }
+    // Equal jitter: avoid retries from different RPC being synchronized
+    // while keeping them apart from the failed tries.
+    return max_backoff_us / 2 + butil::fast_rand_less_than(max_backoff_us / 2 + 1);
+}
+
+void Controller::HandleRetryBackoff(void* arg) {
+    // Don't issue RPC in the timer thread.
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, RunRetryAfterBackoff, arg) != 0) {
+        RunRetryAfterBackoff(arg);
+    }
+}
+
+void* Controller::RunRetryAfterBackoff(void* arg) {
+    const CallId cid = { (uint64_t)arg };
+    void* data = NULL;
+    if (bthread_id_lock(cid, &data) != 0) {
+        // The RPC already ended.
+        return NULL;
+    }
+    Controller* c = static_cast<Controller*>(data);
+    if (c->current_id() != cid) {
+        // Another try (say a backup request) was issued during the waiting.
+        CHECK_EQ(0, bthread_id_unlock(cid));
+        return NULL;
+    }
+    c->IssueRPC(butil::gettimeofday_us());
+    return NULL;
+}
+
 inline bool does_error_affect_main_socket(int error_code) {
     // Errors tested in this function are reported by pooled connections
     // and very likely to indicate that the server-side is down and the socket
@@ -734,6 +819,20 @@ void Controller::Call::OnComplete(
         }
     }
 
+    if (acquired_concurrency) {
+        acquired_concurrency = false;
+        // The RPC may fail before sending_sock is set, release the
+        // concurrency through the main socket.
+        SocketUniquePtr peer_sock;
+        if (sending_sock != NULL) {
+            sending_sock->FeedbackClientConcurrencyLimiter(
+                error_code, butil::gettimeofday_us() - begin_time_us);
+        } else if (Socket::AddressFailedAsWell(peer_id, &peer_sock) >= 0) {
+            peer_sock->FeedbackClientConcurrencyLimiter(
+                error_code, butil::gettimeofday_us() - begin_time_us);
+        }
+    }
+
     switch (c->connection_type()) {
     case CONNECTION_TYPE_UNKNOWN:
         break;
@@ -882,6 +981,7 @@ void Controller::EndRPC(const CompletionInfo& info) {
     }
     // RPC finished, now it's safe to release `LoadBalancerWithNaming'
     _lb.reset();
+    _retry_budget.reset();
     if (_span) {
         _span->set_ending_cid(info.id);
         _span->set_async(_done);
@@ -1003,6 +1103,7 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
     // Pick a target server for sending RPC
     _current_call.need_feedback = false;
     _current_call.enable_circuit_breaker = has_enabled_circuit_breaker();
+    _current_call.acquired_concurrency = false;
     SocketUniquePtr tmp_sock;
     if (SingleServer()) {
         // Don't use _current_call.peer_id which is set to -1 after construction
@@ -1015,13 +1116,62 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
             return HandleSendFailed();
         }
         _current_call.peer_id = _single_server_id;
+        if (has_enabled_client_concurrency_limiter() && !is_health_check_call()) {
+            if (!tmp_sock->AcquireClientConcurrency()) {
+                *g_client_concurrency_limited << 1;
+                SetFailed(ELIMIT, "Reached client-side max_concurrency of %s",
+                          endpoint2str(_remote_side).c_str());
+                tmp_sock.reset();
+                return HandleSendFailed();
+            }
+            _current_call.acquired_concurrency = true;
+        }
     } else {
         LoadBalancer::SelectIn sel_in =
             { start_realtime_us, true,
               has_request_code(), _request_code, _accessed };
         LoadBalancer::SelectOut sel_out(&tmp_sock);
-        const int rc = _lb->SelectServer(sel_in, &sel_out);
-        if (rc != 0) {
+        int rc = _lb->SelectServer(sel_in, &sel_out);
+        // Select other servers if the selected one reached its client-side
+        // max concurrency.
+        for (int ntry = 0; rc == 0 && has_enabled_client_concurrency_limiter();
+             ++ntry) {
+            if (tmp_sock->AcquireClientConcurrency()) {
+                _current_call.acquired_concurrency = true;
+                break;
+            }
+            *g_client_concurrency_limited << 1;
+            const SocketId limited_id = tmp_sock->id();
+            tmp_sock.reset();
+            if (sel_out.need_feedback) {
+                // The LB counted this selection, tell it the server is busy.
+                const LoadBalancer::CallInfo info =
+                    { start_realtime_us, limited_id, ELIMIT, this };
+                _lb->Feedback(info);
+                sel_out.need_feedback = false;
+            }
+            if (ntry >= FLAGS_client_cl_max_reselect) {
+                rc = ELIMIT;
+                break;
+            }
+            // Avoid the limited server in following selections and retries.
+            if (_accessed == NULL) {
+                _accessed = ExcludedServers::Create(
+                    std::max(1, std::min(_max_retry, RETRY_AVOIDANCE)));
+                if (NULL == _accessed) {
+                    rc = ELIMIT;
+                    break;
+                }
+            }
+            _accessed->Add(limited_id);
+            sel_in.excluded = _accessed;
+            rc = _lb->SelectServer(sel_in, &sel_out);
+        }
+        if (rc == ELIMIT) {
+            SetFailed(ELIMIT, "Reached client-side max_concurrency of all "
+                      "selected servers");
+            return HandleSendFailed();
+        } else if (rc != 0) {
             std::ostringstream os;
             DescribeOptions opt;
             opt.verbose = false;
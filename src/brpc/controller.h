@@ -62,8 +62,10 @@ struct x509_st;
 
 namespace brpc {
 class Span;
+struct RpcPhaseTimeline;
 class Server;
 class SharedLoadBalancer;
+class RetryBudget;
 class ExcludedServers;
 class RPCSender;
 class StreamSettings;
@@ -143,6 +145,7 @@ friend void policy::ProcessThriftRequest(InputMessageBase*);
     static const uint32_t FLAGS_ENABLED_CIRCUIT_BREAKER = (1 << 17);
     static const uint32_t FLAGS_ALWAYS_PRINT_PRIMITIVE_FIELDS = (1 << 18);
     static const uint32_t FLAGS_HEALTH_CHECK_CALL = (1 << 19);
+    static const uint32_t FLAGS_ENABLED_CLIENT_CONCURRENCY_LIMITER = (1 << 20);
 
 public:
     struct Inheritable {
@@ -574,6 +577,13 @@ private:
                                 bool new_bthread, int saved_error);
 
     static void* RunEndRPC(void* arg);
+
+    // Issue the retry after waiting for backoff.
+    static void HandleRetryBackoff(void* arg);
+    static void* RunRetryAfterBackoff(void* arg);
+    // Microseconds to wait before the current retry, 0 means no waiting.
+    int64_t RetryBackoffUs() const;
+
     void EndRPC(const CompletionInfo&);
 
     static int HandleSocketFailed(bthread_id_t, void* data, int error_code,
@@ -650,6 +660,7 @@ private:
         int nretry;                     // sent in nretry-th retry.
         bool need_feedback;             // The LB needs feedback.
         bool enable_circuit_breaker;    // The channel enabled circuit_breaker
+        bool acquired_concurrency;      // Counted by client-side limiter
         bool touched_by_stream_creator; 
         SocketId peer_id;               // main server id
         int64_t begin_time_us;          // sent real time.
@@ -694,6 +705,10 @@ private:
         return has_flag(FLAGS_ENABLED_CIRCUIT_BREAKER); 
     }
 
+    bool has_enabled_client_concurrency_limiter() const {
+        return has_flag(FLAGS_ENABLED_CLIENT_CONCURRENCY_LIMITER);
+    }
+
     std::string& protocol_param() { return _thrift_method_name; }
     const std::string& protocol_param() const { return _thrift_method_name; }
 
@@ -703,6 +718,8 @@ private:
     // NOTE: align and group fields to make Controller as compact as possible.
 
     Span* _span;
+    // Phases of the call at server-side, NULL when not recorded.
+    RpcPhaseTimeline* _phase_timeline;
     uint32_t _flags; // all boolean fields inside Controller
     int32_t _error_code;
     std::string _error_text;
@@ -721,6 +738,7 @@ private:
     // after CallMethod.
     int _max_retry;
     const RetryPolicy* _retry_policy;
+    butil::intrusive_ptr<RetryBudget> _retry_budget;
     // Synchronization object for one RPC call. It remains unchanged even 
     // when retry happens. Synchronous RPC will wait on this id.
     CallId _correlation_id;
@@ -736,6 +754,8 @@ private:
     int32_t _timeout_ms;
     int32_t _connect_timeout_ms;
     int32_t _backup_request_ms;
+    int32_t _retry_backoff_ms;
+    int32_t _retry_backoff_max_ms;
     // Deadline of this RPC (since the Epoch in microseconds).
     int64_t _deadline_us;
     // Timer registered to trigger RPC timeout event
@@ -0,0 +1,98 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_COROUTINE_H
+#define BRPC_COROUTINE_H
+
+// Asynchronous RPC in C++20 coroutines (see bthread/coroutine.h), e.g.
+//
+//   bthread::Awaitable<void> Foo(brpc::Channel* channel) {
+//       brpc::Controller cntl;
+//       EchoRequest request;
+//       EchoResponse response;
+//       co_await brpc::CallMethodAsync(channel, method, &cntl,
+//                                      &request, &response);
+//       // or with a stub:
+//       brpc::AwaitableDone done;
+//       stub.Echo(&cntl, &request, &response, &done);
+//       co_await done;
+//       ...
+//   }
+//
+// Unlike synchronous RPC which blocks a bthread along with its stack,
+// a coroutine waiting for the response only occupies its frame.
+
+#include <google/protobuf/service.h>            // Closure, RpcChannel
+#include "butil/atomicops.h"
+#include "bthread/coroutine.h"
+
+namespace brpc {
+
+// A Closure to be passed as `done' of asynchronous RPC and to be awaited by
+// a coroutine for the completion of the RPC. The coroutine is resumed in the
+// bthread running the done.
+// An AwaitableDone can only be used by one RPC.
+class AwaitableDone : public google::protobuf::Closure {
+public:
+    AwaitableDone() : _state(INITIAL), _tag(BTHREAD_TAG_INVALID) {}
+
+    void Run() override {
+        // DON'T touch *this after setting the state if it was not waited,
+        // the coroutine may go on and destroy this object.
+        if (_state.exchange(DONE, butil::memory_order_acq_rel) == WAITING) {
+            bthread::detail::resume_in_bthread(_h, _tag);
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return _state.load(butil::memory_order_acquire) == DONE;
+    }
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        _h = h;
+        _tag = bthread_self_tag();
+        int expected = INITIAL;
+        // Not suspended if Run() was called just now.
+        return _state.compare_exchange_strong(
+            expected, WAITING, butil::memory_order_acq_rel);
+    }
+    void await_resume() const noexcept {}
+
+private:
+    enum State { INITIAL, WAITING, DONE };
+
+    butil::atomic<int> _state;
+    bthread_tag_t _tag;
+    std::coroutine_handle<> _h;
+};
+
+// Call `method' of `channel' asynchronously and resume the calling coroutine
+// when the RPC finishes. Check `cntl' for the result.
+inline bthread::Awaitable<void> CallMethodAsync(
+    google::protobuf::RpcChannel* channel,
+    const google::protobuf::MethodDescriptor* method,
+    google::protobuf::RpcController* cntl,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response) {
+    AwaitableDone done;
+    channel->CallMethod(method, cntl, request, response, &done);
+    co_await done;
+}
+
+}  // namespace brpc
+
+#endif  // BRPC_COROUTINE_H
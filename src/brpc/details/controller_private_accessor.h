@@ -98,6 +98,14 @@ public:
     
     Span* span() const { return _cntl->_span; }
 
+    // Take the ownership of `timeline' got from butil::get_object().
+    ControllerPrivateAccessor &set_phase_timeline(RpcPhaseTimeline* timeline) {
+        _cntl->_phase_timeline = timeline;
+        return *this;
+    }
+
+    RpcPhaseTimeline* phase_timeline() const { return _cntl->_phase_timeline; }
+
     uint32_t pipelined_count() const { return _cntl->_pipelined_count; }
     void set_pipelined_count(uint32_t count) {  _cntl->_pipelined_count = count; }
 
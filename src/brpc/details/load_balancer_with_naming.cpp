@@ -16,6 +16,7 @@
 // under the License.
 
 
+#include "brpc/socket.h"
 #include "brpc/details/load_balancer_with_naming.h"
 
 
@@ -46,7 +47,23 @@ int LoadBalancerWithNaming::Init(const char* ns_url, const char* lb_name,
 
 void LoadBalancerWithNaming::OnAddedServers(
     const std::vector<ServerId>& servers) {
+    // Servers added into an empty balancer (the initial servers generally)
+    // are not slow-started, which just throttles all of them equally.
+    // Started before adding so that the servers are never selected without
+    // being throttled.
+    if (Weight() > 0) {
+        StartSlowStart(servers);
+    }
     AddServersInBatch(servers);
+    if (_preconnect_npooled < 0) {
+        return;
+    }
+    for (size_t i = 0; i < servers.size(); ++i) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(servers[i].id, &ptr) == 0) {
+            ptr->PreConnect(_preconnect_npooled);
+        }
+    }
 }
 
 void LoadBalancerWithNaming::OnRemovedServers(
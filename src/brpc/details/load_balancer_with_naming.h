@@ -29,9 +29,13 @@ namespace brpc {
 class LoadBalancerWithNaming : public SharedLoadBalancer,
                                public NamingServiceWatcher {
 public:
-    LoadBalancerWithNaming() {}
+    LoadBalancerWithNaming() : _preconnect_npooled(-1) {}
     ~LoadBalancerWithNaming();
 
+    // Call Socket::PreConnect(npooled) on added servers if `npooled' is
+    // non-negative. Must be called before Init().
+    void set_preconnect_npooled(int npooled) { _preconnect_npooled = npooled; }
+
     int Init(const char* ns_url, const char* lb_name,
              const NamingServiceFilter* filter,
              const GetNamingServiceThreadOptions* options);
@@ -43,6 +47,7 @@ public:
 
 private:
     butil::intrusive_ptr<NamingServiceThread> _nsthread_ptr;
+    int _preconnect_npooled;
 };
 
 } // namespace brpc
@@ -19,6 +19,7 @@
 #include <limits>
 #include "butil/macros.h"
 #include "brpc/controller.h"
+#include "brpc/details/controller_private_accessor.h"
 #include "brpc/details/server_private_accessor.h"
 #include "brpc/details/method_status.h"
 
@@ -60,6 +61,9 @@ int MethodStatus::Expose(const butil::StringPiece& prefix) {
     if (_latency_rec.expose(prefix) != 0) {
         return -1;
     }
+    if (_phase_rec && _phase_rec->Expose(prefix) != 0) {
+        return -1;
+    }
     if (_cl) {
         if (_max_concurrency_bvar.expose_as(prefix, "max_concurrency") != 0) {
             return -1;
@@ -136,6 +140,23 @@ void MethodStatus::Describe(
     OutputValue(os, "max_latency: ", _latency_rec.max_latency_name(),
                 _latency_rec.max_latency(), options, false);
 
+    // Latencies of phases
+    if (_phase_rec) {
+        for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+            const RpcPhase phase = (RpcPhase)i;
+            const bvar::LatencyRecorder& rec = _phase_rec->latency(phase);
+            std::string name = RpcPhaseToString(phase);
+            name.append("_latency: ");
+            OutputValue(os, name.c_str(), rec.latency_name(), rec.latency(),
+                        options, false);
+            if (!options.use_html) {
+                name.resize(name.size() - 2);
+                name.append("_99: ");
+                OutputTextValue(os, name.c_str(), rec.latency_percentile(0.99));
+            }
+        }
+    }
+
     // Concurrency
     OutputValue(os, "concurrency: ", _nconcurrency_bvar.name(),
                 _nconcurrency, options, false);
@@ -149,9 +170,23 @@ void MethodStatus::SetConcurrencyLimiter(ConcurrencyLimiter* cl) {
     _cl.reset(cl);
 }
 
+void MethodStatus::SetPhaseLatencyEnabled(bool enabled) {
+    if (!enabled) {
+        _phase_rec.reset(NULL);
+    } else if (!_phase_rec) {
+        _phase_rec.reset(new RpcPhaseRecorder);
+    }
+}
+
 ConcurrencyRemover::~ConcurrencyRemover() {
     if (_status) {
-        _status->OnResponded(_c->ErrorCode(), butil::cpuwide_time_us() - _received_us);
+        const int error_code = _c->ErrorCode();
+        _status->OnResponded(error_code, butil::cpuwide_time_us() - _received_us);
+        const RpcPhaseTimeline* timeline =
+            ControllerPrivateAccessor(_c).phase_timeline();
+        if (timeline && error_code == 0) {
+            _status->OnPhasesDone(*timeline);
+        }
         _status = NULL;
     }
     ServerPrivateAccessor(_c->server()).RemoveConcurrency(_c);
@@ -23,6 +23,7 @@
 #include "bvar/bvar.h"                    // vars
 #include "brpc/describable.h"
 #include "brpc/concurrency_limiter.h"
+#include "brpc/details/rpc_phase.h"
 
 
 namespace brpc {
@@ -48,6 +49,9 @@ public:
     // did the time keeping and the cost is better saved. 
     void OnResponded(int error_code, int64_t latency_us);
 
+    // Call this with the timeline of a successful call.
+    void OnPhasesDone(const RpcPhaseTimeline& timeline);
+
     // Expose internal vars.
     // Return 0 on success, -1 otherwise.
     int Expose(const butil::StringPiece& prefix);
@@ -66,6 +70,9 @@ friend class Server;
     // before the server is started. 
     void SetConcurrencyLimiter(ConcurrencyLimiter* cl);
 
+    // Record latencies of phases or not. Not thread safe either.
+    void SetPhaseLatencyEnabled(bool enabled);
+
     std::unique_ptr<ConcurrencyLimiter> _cl;
     butil::atomic<int> _nconcurrency;
     bvar::Adder<int64_t>  _nerror_bvar;
@@ -73,6 +80,8 @@ friend class Server;
     bvar::PassiveStatus<int>  _nconcurrency_bvar;
     bvar::PerSecond<bvar::Adder<int64_t>> _eps_bvar;
     bvar::PassiveStatus<int32_t> _max_concurrency_bvar;
+    // Created when -enable_rpc_phase_latency is on at starting the server.
+    std::unique_ptr<RpcPhaseRecorder> _phase_rec;
 };
 
 class ConcurrencyRemover {
@@ -112,6 +121,12 @@ inline void MethodStatus::OnResponded(int error_code, int64_t latency) {
     }
 }
 
+inline void MethodStatus::OnPhasesDone(const RpcPhaseTimeline& timeline) {
+    if (_phase_rec) {
+        _phase_rec->Record(timeline);
+    }
+}
+
 } // namespace brpc
 
 #endif  //BRPC_METHOD_STATUS_H
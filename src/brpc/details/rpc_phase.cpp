@@ -0,0 +1,106 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "brpc/details/rpc_phase.h"
+
+namespace brpc {
+
+DEFINE_bool(enable_rpc_phase_latency, false,
+            "Record latencies of phases(read, cut, queue, parse, user_code, "
+            "serialize, write) of calls to methods of servers in "
+            "<method>_<phase>_latency etc. Set before starting servers. "
+            "Only baidu_std supports all phases");
+
+static const char* const s_rpc_phase_names[] = {
+    "read", "cut", "queue", "parse", "user_code", "serialize", "write"
+};
+BAIDU_CASSERT(arraysize(s_rpc_phase_names) == RPC_PHASE_COUNT,
+              must_match_rpc_phases);
+
+const char* RpcPhaseToString(RpcPhase phase) {
+    return s_rpc_phase_names[phase];
+}
+
+static bool HasInvariantTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return butil::detail::read_invariant_cpu_frequency() > 0;
+#else
+    return false;
+#endif
+}
+
+// Decided before main() and never changed, otherwise a timeline may mix
+// TSC and nanoseconds.
+bool g_rpc_phase_use_tsc = HasInvariantTsc();
+
+// Frequency of TSC is calibrated against the monotonic clock since the
+// process started rather than read from "cpu MHz" in /proc/cpuinfo which is
+// the current frequency of the cpu.
+static const int64_t MIN_TSC_CALIBRATION_NS = 100000000L;
+static const int64_t s_calibration_start_ticks = RpcPhaseTicks();
+static const int64_t s_calibration_start_ns = butil::monotonic_time_ns();
+static butil::atomic<int64_t> s_ticks_per_ms(0);
+
+int64_t RpcPhaseTicksPerMs() {
+    if (!g_rpc_phase_use_tsc) {
+        return 1000000L;
+    }
+    const int64_t ticks_per_ms = s_ticks_per_ms.load(butil::memory_order_relaxed);
+    if (ticks_per_ms > 0) {
+        return ticks_per_ms;
+    }
+    const int64_t elapsed_ns = butil::monotonic_time_ns() - s_calibration_start_ns;
+    if (elapsed_ns < MIN_TSC_CALIBRATION_NS) {
+        return 0;
+    }
+    const int64_t elapsed_ticks = RpcPhaseTicks() - s_calibration_start_ticks;
+    // Racing threads store almost same values, no matter which one wins.
+    const int64_t v = (int64_t)(elapsed_ticks * 1000000.0 / elapsed_ns);
+    s_ticks_per_ms.store(v, butil::memory_order_relaxed);
+    return v;
+}
+
+int RpcPhaseRecorder::Expose(const butil::StringPiece& prefix) {
+    for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+        if (_latency[i].expose(prefix, s_rpc_phase_names[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void RpcPhaseRecorder::Record(const RpcPhaseTimeline& timeline) {
+    const int64_t ticks_per_ms = RpcPhaseTicksPerMs();
+    if (ticks_per_ms <= 0) {
+        return;
+    }
+    for (int i = 0; i < RPC_PHASE_COUNT; ++i) {
+        const int64_t begin = timeline.ticks[i];
+        const int64_t end = timeline.ticks[i + 1];
+        // Skip unmarked phases. Phases marked on different cpus may be
+        // slightly negative if TSC is not perfectly synchronized.
+        if (begin == 0 || end < begin) {
+            continue;
+        }
+        _latency[i] << (end - begin) * 1000 / ticks_per_ms;
+    }
+}
+
+} // namespace brpc
@@ -0,0 +1,102 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RPC_PHASE_H
+#define BRPC_RPC_PHASE_H
+
+#include <string.h>                         // memset
+#include "butil/macros.h"
+#include "butil/strings/string_piece.h"
+#include "butil/time.h"
+#include "bvar/latency_recorder.h"
+
+namespace brpc {
+
+// Phases of processing a request at server-side, in time order.
+enum RpcPhase {
+    RPC_PHASE_READ = 0,     // reading bytes from the socket
+    RPC_PHASE_CUT,          // cutting the request from read bytes
+    RPC_PHASE_QUEUE,        // waiting for the bthread to process the request
+    RPC_PHASE_PARSE,        // parsing meta and the request
+    RPC_PHASE_USER_CODE,    // running the method until done->Run()
+    RPC_PHASE_SERIALIZE,    // serializing the response
+    RPC_PHASE_WRITE,        // writing the response into the socket
+    RPC_PHASE_COUNT
+};
+
+// Name of the phase used in names of bvars, e.g. "user_code".
+const char* RpcPhaseToString(RpcPhase phase);
+
+extern bool g_rpc_phase_use_tsc;
+
+// Timestamp for marking phases. TSC is read when the cpu has invariant
+// TSC(constant_tsc and nonstop_tsc) which costs a few nanoseconds, while
+// butil::cpuwide_time_ns() calls clock_gettime(). Ticks are converted to
+// microseconds only when being recorded.
+inline int64_t RpcPhaseTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (g_rpc_phase_use_tsc) {
+        return (int64_t)butil::detail::clock_cycles();
+    }
+#endif
+    return butil::cpuwide_time_ns();
+}
+
+// Ticks per millisecond, 0 when TSC is not calibrated yet(in the first
+// 100ms of the process).
+int64_t RpcPhaseTicksPerMs();
+
+// Fixed-size timeline of a call at server-side, filled by protocols when
+// -enable_rpc_phase_latency is on. Got from butil::get_object() and returned
+// to the pool when the Controller is reset, call Reset() before reusing.
+struct RpcPhaseTimeline {
+    // ticks[i] is the beginning of phase i, ticks[RPC_PHASE_COUNT] is the
+    // end of the last phase. 0 means unmarked.
+    int64_t ticks[RPC_PHASE_COUNT + 1];
+
+    RpcPhaseTimeline() { Reset(); }
+    void Reset() { memset(ticks, 0, sizeof(ticks)); }
+
+    // Mark the beginning of `phase' and the end of the previous phase,
+    // RPC_PHASE_COUNT marks the end of the last phase.
+    void Mark(int phase) { ticks[phase] = RpcPhaseTicks(); }
+};
+
+// Latencies of phases of a method, exposed as <prefix>_<phase>_latency,
+// <prefix>_<phase>_latency_99 etc.
+class RpcPhaseRecorder {
+public:
+    RpcPhaseRecorder() {}
+
+    int Expose(const butil::StringPiece& prefix);
+
+    // Record phases with both ends marked.
+    void Record(const RpcPhaseTimeline& timeline);
+
+    const bvar::LatencyRecorder& latency(RpcPhase phase) const
+    { return _latency[phase]; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RpcPhaseRecorder);
+
+    bvar::LatencyRecorder _latency[RPC_PHASE_COUNT];
+};
+
+} // namespace brpc
+
+#endif  // BRPC_RPC_PHASE_H
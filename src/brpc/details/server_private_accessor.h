@@ -19,6 +19,7 @@
 #define BRPC_SERVER_PRIVATE_ACCESSOR_H
 
 #include <google/protobuf/descriptor.h>
+#include "bthread/unstable.h"                  // bthread_set_self_cpu_account/deadline_us
 #include "brpc/server.h"
 #include "brpc/acceptor.h"
 #include "brpc/details/method_status.h"
@@ -27,6 +28,47 @@
 
 namespace brpc {
 
+DECLARE_bool(server_drop_expired_requests);
+
+// Account cpu time of the calling bthread to `account' in the scope and
+// restore the previous account after the scope.
+class ScopedCpuAccount {
+public:
+    explicit ScopedCpuAccount(bthread_cpu_account_t* account)
+        : _account(account), _prev_account(NULL) {
+        if (_account) {
+            _prev_account = bthread_self_cpu_account();
+            bthread_set_self_cpu_account(_account);
+        }
+    }
+    ~ScopedCpuAccount() {
+        if (_account) {
+            bthread_set_self_cpu_account(_prev_account);
+        }
+    }
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedCpuAccount);
+    bthread_cpu_account_t* _account;
+    bthread_cpu_account_t* _prev_account;
+};
+
+// Set the deadline of the calling bthread in the scope and restore the
+// previous one after the scope. Messages may be processed in place, later
+// work in the bthread shouldn't inherit the deadline of a finished request.
+class ScopedBthreadDeadline {
+public:
+    explicit ScopedBthreadDeadline(int64_t deadline_us)
+        : _prev_deadline_us(bthread_self_deadline_us()) {
+        bthread_set_self_deadline_us(deadline_us);
+    }
+    ~ScopedBthreadDeadline() {
+        bthread_set_self_deadline_us(_prev_deadline_us);
+    }
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedBthreadDeadline);
+    int64_t _prev_deadline_us;
+};
+
 // A wrapper to access some private methods/fields of `Server'
 // This is supposed to be used by internal RPC protocols ONLY
 class ServerPrivateAccessor {
@@ -40,6 +82,21 @@ public:
         _server->_nerror_bvar << 1;
     }
 
+    // Returns true and fails `c' if the deadline of the request is passed
+    // before user code runs, which is pointless because the client has
+    // given up.
+    bool FailIfExpired(Controller* c) {
+        const int64_t deadline_us = c->deadline_us();
+        if (deadline_us < 0 || !FLAGS_server_drop_expired_requests ||
+            butil::gettimeofday_us() <= deadline_us) {
+            return false;
+        }
+        _server->_nexpired_bvar << 1;
+        c->SetFailed(ERPCTIMEDOUT, "Deadline of the request was passed "
+                     "before being processed");
+        return true;
+    }
+
     // Returns true if the `max_concurrency' limit is not reached.
     bool AddConcurrency(Controller* c) {
         if (_server->options().max_concurrency <= 0) {
@@ -47,8 +47,15 @@ public:
     // [Internal]
     int64_t received_us() const { return _received_us; }
     int64_t base_real_us() const { return _base_real_us; }
+    // [Internal] RpcPhaseTicks() when reading and cutting this message
+    // began and when cutting ended, 0 when -enable_rpc_phase_latency is off.
+    int64_t read_begin_ticks() const { return _read_begin_ticks; }
+    int64_t cut_begin_ticks() const { return _cut_begin_ticks; }
+    int64_t cut_end_ticks() const { return _cut_end_ticks; }
 
 protected:
+    InputMessageBase()
+        : _read_begin_ticks(0), _cut_begin_ticks(0), _cut_end_ticks(0) {}
     virtual ~InputMessageBase();
 
 private:
@@ -57,6 +64,9 @@ friend void* ProcessInputMessage(void*);
 friend class Stream;
     int64_t _received_us;
     int64_t _base_real_us;
+    int64_t _read_begin_ticks;
+    int64_t _cut_begin_ticks;
+    int64_t _cut_end_ticks;
     SocketUniquePtr _socket;
     void (*_process)(InputMessageBase* msg);
     const void* _arg;
@@ -28,6 +28,7 @@
 #include "brpc/reloadable_flags.h"         // BRPC_VALIDATE_GFLAG
 #include "brpc/protocol.h"                 // ListProtocols
 #include "brpc/input_messenger.h"
+#include "brpc/details/rpc_phase.h"          // RpcPhaseTicks
 
 
 namespace brpc {
@@ -53,6 +54,7 @@ DEFINE_bool(log_connection_close, false,
 BRPC_VALIDATE_GFLAG(log_connection_close, PassValidate);
 
 DECLARE_bool(usercode_in_pthread);
+DECLARE_bool(enable_rpc_phase_latency);
 DECLARE_uint64(max_body_size);
 
 const size_t MSG_SIZE_WINDOW = 10;  // Take last so many message into stat.
@@ -188,6 +190,8 @@ void InputMessenger::OnNewMessages(Socket* m) {
     while (!read_eof) {
         const int64_t received_us = butil::cpuwide_time_us();
         const int64_t base_realtime = butil::gettimeofday_us() - received_us;
+        const bool mark_phases = FLAGS_enable_rpc_phase_latency;
+        const int64_t read_begin_ticks = (mark_phases ? RpcPhaseTicks() : 0);
 
         // Calculate bytes to be read.
         size_t once_read = m->_avg_msg_size * 16;
@@ -229,9 +233,13 @@ void InputMessenger::OnNewMessages(Socket* m) {
         
         size_t last_size = m->_read_buf.length();
         int num_bthread_created = 0;
+        // Messages cut from the buffer share the reading phase, the cutting
+        // phase of each message begins after the previous one is cut.
+        int64_t cut_begin_ticks = (mark_phases ? RpcPhaseTicks() : 0);
         while (1) {
             size_t index = 8888;
             ParseResult pr = messenger->CutInputMessage(m, &index, read_eof);
+            const int64_t cut_end_ticks = (mark_phases ? RpcPhaseTicks() : 0);
             if (!pr.is_ok()) {
                 if (pr.error() == PARSE_ERROR_NOT_ENOUGH_DATA) {
                     // incomplete message, re-read.
@@ -276,10 +284,15 @@ void InputMessenger::OnNewMessages(Socket* m) {
             m->_last_msg_size = 0;
             
             if (pr.message() == NULL) { // the Process() step can be skipped.
+                cut_begin_ticks = cut_end_ticks;
                 continue;
             }
             pr.message()->_received_us = received_us;
             pr.message()->_base_real_us = base_realtime;
+            pr.message()->_read_begin_ticks = read_begin_ticks;
+            pr.message()->_cut_begin_ticks = cut_begin_ticks;
+            pr.message()->_cut_end_ticks = cut_end_ticks;
+            cut_begin_ticks = cut_end_ticks;
                         
             // This unique_ptr prevents msg to be lost before transfering
             // ownership to last_msg
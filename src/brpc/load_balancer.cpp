@@ -17,7 +17,10 @@
 
 
 #include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/time.h"
 #include "brpc/reloadable_flags.h"
+#include "brpc/socket.h"
 #include "brpc/load_balancer.h"
 
 
@@ -26,6 +29,64 @@ namespace brpc {
 DEFINE_bool(show_lb_in_vars, false, "Describe LoadBalancers in vars");
 BRPC_VALIDATE_GFLAG(show_lb_in_vars, PassValidate);
 
+DEFINE_int32(lb_slow_start_ms, 0,
+             "Traffic to a server revived by health checking or newly added "
+             "by the naming service ramps up linearly in so many "
+             "milliseconds. Non-positive value disables slow start");
+BRPC_VALIDATE_GFLAG(lb_slow_start_ms, PassValidate);
+
+void LoadBalancer::StartSlowStart(const std::vector<ServerId>& servers) {
+    const int64_t window_us = FLAGS_lb_slow_start_ms * 1000L;
+    if (window_us <= 0 || servers.empty()) {
+        return;
+    }
+    const int64_t now_us = butil::cpuwide_time_us();
+    BAIDU_SCOPED_LOCK(_slow_start_mutex);
+    // Drop servers out of the window to keep the map small.
+    for (std::map<SocketId, int64_t>::iterator
+             it = _slow_start_begin_us.begin();
+         it != _slow_start_begin_us.end();) {
+        if (now_us - it->second >= window_us) {
+            _slow_start_begin_us.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    for (size_t i = 0; i < servers.size(); ++i) {
+        _slow_start_begin_us[servers[i].id] = now_us;
+    }
+    _last_slow_start_us.store(now_us, butil::memory_order_release);
+}
+
+bool LoadBalancer::IsThrottledBySlowStart(const Socket* server) const {
+    const int64_t window_us = FLAGS_lb_slow_start_ms * 1000L;
+    if (window_us <= 0) {
+        return false;
+    }
+    const int64_t now_us = butil::cpuwide_time_us();
+    // Revival is a state of the server itself, which is shared by all
+    // balancers.
+    int64_t begin_us = server->revived_time_us();
+    if (now_us - _last_slow_start_us.load(butil::memory_order_acquire)
+        < window_us) {
+        BAIDU_SCOPED_LOCK(_slow_start_mutex);
+        std::map<SocketId, int64_t>::const_iterator it =
+            _slow_start_begin_us.find(server->id());
+        if (it != _slow_start_begin_us.end() && it->second > begin_us) {
+            begin_us = it->second;
+        }
+    }
+    if (begin_us == 0) {
+        return false;
+    }
+    const int64_t elapsed_us = now_us - begin_us;
+    if (elapsed_us >= window_us) {
+        return false;
+    }
+    // Let the server pass with probability of elapsed_us / window_us.
+    return (int64_t)butil::fast_rand_less_than(window_us) >= elapsed_us;
+}
+
 // For assigning unique names for lb.
 static butil::static_atomic<int> g_lb_counter = BUTIL_STATIC_ATOMIC_INIT(0);
 
@@ -19,6 +19,8 @@
 #ifndef BRPC_LOAD_BALANCER_H
 #define BRPC_LOAD_BALANCER_H
 
+#include <map>
+#include "butil/synchronization/lock.h"
 #include "bvar/passive_status.h"
 #include "brpc/describable.h"
 #include "brpc/destroyable.h"
@@ -64,7 +66,7 @@ public:
         const Controller* controller;
     };
 
-    LoadBalancer() { }
+    LoadBalancer() : _last_slow_start_us(0) { }
 
     // ====================================================================
     //  All methods must be thread-safe!
@@ -103,11 +105,36 @@ public:
     // Caller is responsible for Destroy() the instance after usage.
     virtual LoadBalancer* New(const butil::StringPiece& params) const = 0;
 
+    // Traffic of this balancer to `servers' ramps up from now on, which
+    // is called when servers are added into a non-empty balancer. The
+    // state is kept in the balancer rather than in the sockets which are
+    // shared by channels through SocketMap, so that warming up a server
+    // in one channel does not throttle it in others.
+    void StartSlowStart(const std::vector<ServerId>& servers);
+
 protected:
     virtual ~LoadBalancer() { }
+
+    // Returns true if `server' was revived or slow-started in this balancer
+    // recently and should not be chosen by this selection, so that traffic
+    // to the server ramps up linearly in -lb_slow_start_ms.
+    // Throttled servers are treated like excluded ones: they're still
+    // chosen when there's no other choice.
+    bool IsThrottledBySlowStart(const Socket* server) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LoadBalancer);
+
+    // cpuwide time of last StartSlowStart(), checked before locking
+    // _slow_start_mutex so that selections are not contended when no
+    // server is being warmed up, which is the common case.
+    butil::atomic<int64_t> _last_slow_start_us;
+    mutable butil::Mutex _slow_start_mutex;
+    std::map<SocketId, int64_t> _slow_start_begin_us;
 };
 
 DECLARE_bool(show_lb_in_vars);
+DECLARE_int32(lb_slow_start_ms);
 
 // A intrusively shareable load balancer created from name.
 class SharedLoadBalancer : public SharedObject, public NonConstDescribable {
@@ -158,6 +185,10 @@ public:
         return n;
     }
 
+    void StartSlowStart(const std::vector<ServerId>& servers) {
+        _lb->StartSlowStart(servers);
+    }
+
     virtual void Describe(std::ostream& os, const DescribeOptions&);
 
     virtual int Weight() {
@@ -24,6 +24,7 @@
 #include "butil/time.h"
 #include "butil/iobuf.h"                         // butil::IOBuf
 #include "butil/raw_pack.h"                      // RawPacker RawUnpacker
+#include "butil/object_pool.h"                   // butil::get_object
 #include "brpc/controller.h"                    // Controller
 #include "brpc/socket.h"                        // Socket
 #include "brpc/server.h"                        // Server
@@ -38,6 +39,8 @@
 #include "brpc/details/usercode_backup_pool.h"
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/details/server_private_accessor.h"
+#include "brpc/details/rpc_phase.h"
+#include "brpc/reloadable_flags.h"
 
 extern "C" {
 void bthread_assign_data(void* data);
@@ -51,6 +54,17 @@ DEFINE_bool(baidu_protocol_use_fullname, true,
             "If this flag is true, baidu_std puts service.full_name in requests"
             ", otherwise puts service.name (required by jprotobuf).");
 
+DEFINE_bool(baidu_protocol_deliver_timeout_ms, true,
+            "If this flag is true, baidu_std puts remaining time of the RPC "
+            "in requests so that servers are able to skip requests which are "
+            "already timed out at clients.");
+BRPC_VALIDATE_GFLAG(baidu_protocol_deliver_timeout_ms, PassValidate);
+
+DEFINE_bool(schedule_tagged_usercode_by_deadline, false,
+            "Bthreads running user code in workers with other tags are "
+            "scheduled in the order of deadlines of requests");
+BRPC_VALIDATE_GFLAG(schedule_tagged_usercode_by_deadline, PassValidate);
+
 // Notes:
 // 1. 12-byte header [PRPC][body_size][meta_size]
 // 2. body_size and meta_size are in network byte order
@@ -145,6 +159,10 @@ void SendRpcResponse(int64_t correlation_id,
     if (span) {
         span->set_start_send_us(butil::cpuwide_time_us());
     }
+    RpcPhaseTimeline* timeline = accessor.phase_timeline();
+    if (timeline) {
+        timeline->Mark(RPC_PHASE_SERIALIZE);
+    }
     Socket* sock = accessor.get_sending_socket();
     std::unique_ptr<Controller, LogErrorTextAndDelete> recycle_cntl(cntl);
     ConcurrencyRemover concurrency_remover(method_status, cntl, received_us);
@@ -228,6 +246,9 @@ void SendRpcResponse(int64_t correlation_id,
     if (span) {
         span->set_response_size(res_buf.size());
     }
+    if (timeline) {
+        timeline->Mark(RPC_PHASE_WRITE);
+    }
     if (stream_ptr) {
         CHECK(accessor.remote_stream_settings() != NULL);
         // Send the response over stream to notify that this stream connection
@@ -259,6 +280,11 @@ void SendRpcResponse(int64_t correlation_id,
         }
     }
 
+    if (timeline) {
+        // Written into the kernel or queued to KeepWrite when the socket
+        // is busy.
+        timeline->Mark(RPC_PHASE_COUNT);
+    }
     if (span) {
         // TODO: this is not sent
         span->set_sent_us(butil::cpuwide_time_us());
@@ -299,8 +325,61 @@ void EndRunningCallMethodInPool(
     return EndRunningUserCodeInPool(CallMethodInBackupThread, args);
 };
 
+static void* CallMethodInTaggedBthread(void* void_args) {
+    CallMethodInBackupThreadArgs* args =
+        static_cast<CallMethodInBackupThreadArgs*>(void_args);
+    Controller* cntl = static_cast<Controller*>(args->controller);
+    // The request may be expired when waiting for workers with the tag.
+    if (cntl->server() != NULL &&
+        ServerPrivateAccessor(cntl->server()).FailIfExpired(cntl)) {
+        args->done->Run();
+        delete args;
+        return NULL;
+    }
+    ScopedBthreadDeadline deadline(cntl->deadline_us());
+    CallMethodInBackupThread(void_args);
+    return NULL;
+}
+
+// Used by other protocols as well.
+// Call the method in a bthread running in workers with `tag', which is
+// different from the tag of current worker.
+void CallMethodInBthreadWithTag(
+    bthread_tag_t tag,
+    ::google::protobuf::Service* service,
+    const ::google::protobuf::MethodDescriptor* method,
+    ::google::protobuf::RpcController* controller,
+    const ::google::protobuf::Message* request,
+    ::google::protobuf::Message* response,
+    ::google::protobuf::Closure* done) {
+    CallMethodInBackupThreadArgs* args = new CallMethodInBackupThreadArgs;
+    args->service = service;
+    args->method = method;
+    args->controller = controller;
+    args->request = request;
+    args->response = response;
+    args->done = done;
+    // Inherit keytable_pool of the server.
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    bthread_getattr(bthread_self(), &attr);
+    attr.tag = tag;
+    int64_t deadline_us = -1;
+    if (FLAGS_schedule_tagged_usercode_by_deadline) {
+        deadline_us = static_cast<Controller*>(controller)->deadline_us();
+    }
+    bthread_t th;
+    if (bthread_start_background_with_deadline(
+            &th, &attr, CallMethodInTaggedBthread, args, deadline_us) != 0) {
+        LOG(ERROR) << "Fail to start bthread with tag=" << tag
+                   << ", call " << method->full_name() << " in place";
+        CallMethodInTaggedBthread(args);
+    }
+}
+
 void ProcessRpcRequest(InputMessageBase* msg_base) {
     const int64_t start_parse_us = butil::cpuwide_time_us();
+    const int64_t start_parse_ticks =
+        (msg_base->cut_end_ticks() ? RpcPhaseTicks() : 0);
     DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage*>(msg_base));
     SocketUniquePtr socket_guard(msg->ReleaseSocket());
     Socket* socket = socket_guard.get();
@@ -346,6 +425,10 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     if (request_meta.has_request_id()) {
         cntl->set_request_id(request_meta.request_id());
     }
+    if (request_meta.has_timeout_ms() && request_meta.timeout_ms() > 0) {
+        accessor.set_deadline_us(msg->base_real_us() + msg->received_us() +
+                                 request_meta.timeout_ms() * 1000L);
+    }
     cntl->set_request_compress_type((CompressType)meta.compress_type());
     accessor.set_server(server)
         .set_security_mode(security_mode)
@@ -357,6 +440,20 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         .set_begin_time_us(msg->received_us())
         .move_in_server_receiving_sock(socket_guard);
 
+    RpcPhaseTimeline* timeline = NULL;
+    if (start_parse_ticks) {
+        // Pooled rather than allocated for each call.
+        timeline = butil::get_object<RpcPhaseTimeline>();
+        if (timeline) {
+            timeline->Reset();
+            timeline->ticks[RPC_PHASE_READ] = msg->read_begin_ticks();
+            timeline->ticks[RPC_PHASE_CUT] = msg->cut_begin_ticks();
+            timeline->ticks[RPC_PHASE_QUEUE] = msg->cut_end_ticks();
+            timeline->ticks[RPC_PHASE_PARSE] = start_parse_ticks;
+            accessor.set_phase_timeline(timeline);
+        }
+    }
+
     if (meta.has_stream_settings()) {
         accessor.set_remote_stream_settings(meta.release_stream_settings());
     }
@@ -400,6 +497,10 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
             break;
         }
 
+        if (server_accessor.FailIfExpired(cntl.get())) {
+            break;
+        }
+
         if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
             cntl->SetFailed(ELIMIT, "Too many user code to run when"
                             " -usercode_in_pthread is on");
@@ -495,6 +596,18 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
             span->set_start_callback_us(butil::cpuwide_time_us());
             span->AsParent();
         }
+        if (timeline) {
+            timeline->Mark(RPC_PHASE_USER_CODE);
+        }
+        // Bthreads started for other tags inherit the account.
+        ScopedCpuAccount cpu_account(mp->cpu_account);
+        if (mp->bthread_tag != BTHREAD_TAG_INVALID &&
+            mp->bthread_tag != bthread_self_tag()) {
+            return CallMethodInBthreadWithTag(
+                mp->bthread_tag, svc, method, cntl.release(),
+                req.release(), res.release(), done);
+        }
+        ScopedBthreadDeadline deadline(cntl->deadline_us());
         if (!FLAGS_usercode_in_pthread) {
             return svc->CallMethod(method, cntl.release(), 
                                    req.release(), res.release(), done);
@@ -654,6 +767,16 @@ void PackRpcRequest(butil::IOBuf* req_buf,
     if (!cntl->request_id().empty()) {
         request_meta->set_request_id(cntl->request_id());
     }
+    if (FLAGS_baidu_protocol_deliver_timeout_ms && cntl->deadline_us() >= 0) {
+        // Deliver the remaining time rather than the deadline which is
+        // meaningless to servers with unsynchronized clocks.
+        // timeout_ms is int32, clamp long deadlines.
+        const int64_t left_ms =
+            (cntl->deadline_us() - butil::gettimeofday_us()) / 1000L;
+        request_meta->set_timeout_ms(
+            (int32_t)std::min(std::max(left_ms, (int64_t)1),
+                              (int64_t)INT32_MAX));
+    }
     meta.set_correlation_id(correlation_id);
     StreamId request_stream_id = accessor.request_stream();
     if (request_stream_id != INVALID_STREAM_ID) {
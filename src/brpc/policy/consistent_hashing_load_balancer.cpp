@@ -312,7 +312,9 @@ int ConsistentHashingLoadBalancer::SelectServer(
         if (((i + 1) == s->size() // always take last chance
              || !ExcludedServers::IsExcluded(in.excluded, choice->server_sock.id))
             && Socket::Address(choice->server_sock.id, out->ptr) == 0 
-            && (*out->ptr)->IsAvailable()) {
+            && (*out->ptr)->IsAvailable()
+            && ((i + 1) == s->size()
+                || !IsThrottledBySlowStart(out->ptr->get()))) {
             return 0;
         } else {
             if (++choice == s->end()) {
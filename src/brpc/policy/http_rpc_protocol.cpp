@@ -1210,6 +1210,16 @@ void EndRunningCallMethodInPool(
     ::google::protobuf::Message* response,
     ::google::protobuf::Closure* done);
 
+// Defined in baidu_rpc_protocol.cpp
+void CallMethodInBthreadWithTag(
+    bthread_tag_t tag,
+    ::google::protobuf::Service* service,
+    const ::google::protobuf::MethodDescriptor* method,
+    ::google::protobuf::RpcController* controller,
+    const ::google::protobuf::Message* request,
+    ::google::protobuf::Message* response,
+    ::google::protobuf::Closure* done);
+
 void ProcessHttpRequest(InputMessageBase *msg) {
     const int64_t start_parse_us = butil::cpuwide_time_us();
     DestroyingPtr<HttpContext> imsg_guard(static_cast<HttpContext*>(msg));
@@ -1495,6 +1505,17 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         span->set_start_callback_us(butil::cpuwide_time_us());
         span->AsParent();
     }
+    if (!sp->is_builtin_service && server_accessor.FailIfExpired(cntl)) {
+        return done->Run();
+    }
+    // Bthreads started for other tags inherit the account.
+    ScopedCpuAccount cpu_account(sp->cpu_account);
+    if (sp->bthread_tag != BTHREAD_TAG_INVALID &&
+        sp->bthread_tag != bthread_self_tag()) {
+        return CallMethodInBthreadWithTag(
+            sp->bthread_tag, svc, method, cntl, req, res, done);
+    }
+    ScopedBthreadDeadline deadline(cntl->deadline_us());
     if (!FLAGS_usercode_in_pthread) {
         return svc->CallMethod(method, cntl, req, res, done);
     }
@@ -306,7 +306,8 @@ int LocalityAwareLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out)
                    && (*out->ptr)->IsAvailable()) {
             if ((ntry + 1) == n  // Instead of fail with EHOSTDOWN, we prefer
                                  // choosing the server again.
-                || !ExcludedServers::IsExcluded(in.excluded, info.server_id)) {
+                || (!ExcludedServers::IsExcluded(in.excluded, info.server_id)
+                    && !IsThrottledBySlowStart(out->ptr->get()))) {
                 if (!in.changable_weights) {
                     return 0;
                 }
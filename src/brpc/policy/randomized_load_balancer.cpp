@@ -124,7 +124,8 @@ int RandomizedLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
         if (((i + 1) == n  // always take last chance
              || !ExcludedServers::IsExcluded(in.excluded, id))
             && Socket::Address(id, out->ptr) == 0
-            && (*out->ptr)->IsAvailable()) {
+            && (*out->ptr)->IsAvailable()
+            && ((i + 1) == n || !IsThrottledBySlowStart(out->ptr->get()))) {
             // We found an available server
             return 0;
         }
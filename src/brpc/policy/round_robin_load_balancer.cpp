@@ -129,7 +129,8 @@ int RoundRobinLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
         if (((i + 1) == n  // always take last chance
              || !ExcludedServers::IsExcluded(in.excluded, id))
             && Socket::Address(id, out->ptr) == 0
-            && (*out->ptr)->IsAvailable()) {
+            && (*out->ptr)->IsAvailable()
+            && ((i + 1) == n || !IsThrottledBySlowStart(out->ptr->get()))) {
             s.tls() = tls;
             return 0;
         }
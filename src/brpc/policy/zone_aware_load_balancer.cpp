@@ -0,0 +1,410 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/string_splitter.h"
+#include "butil/strings/string_number_conversions.h"
+#include "brpc/socket.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_string(lb_local_zone, "", "Zone of this process, servers in the "
+              "same zone are preferred by zone_aware load balancers");
+DEFINE_string(lb_local_region, "", "Region of this process, used by "
+              "zone_aware load balancers when the local zone is unavailable");
+
+ZoneAwareLoadBalancer::ZoneAwareLoadBalancer()
+    : _inner_lb(NULL)
+    , _headroom(4)
+    , _tolerance(0.2) {
+}
+
+ZoneAwareLoadBalancer::~ZoneAwareLoadBalancer() {
+    {
+        butil::DoublyBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) == 0) {
+            for (std::map<SocketId, ServerInfo*>::const_iterator
+                     it = s->server_map.begin(); it != s->server_map.end(); ++it) {
+                delete it->second;
+            }
+        }
+    }
+    for (std::map<std::string, Zone*>::iterator it = _zones.begin();
+         it != _zones.end(); ++it) {
+        it->second->lb->Destroy();
+        delete it->second;
+    }
+}
+
+void ZoneAwareLoadBalancer::ParseTag(const std::string& tag,
+                                     std::string* zone,
+                                     std::string* region,
+                                     std::string* inner_tag) {
+    zone->clear();
+    region->clear();
+    inner_tag->clear();
+    for (butil::StringSplitter sp(tag.c_str(), ' '); sp; ++sp) {
+        const butil::StringPiece item(sp.field(), sp.length());
+        if (item.starts_with("zone=")) {
+            item.substr(5).CopyToString(zone);
+        } else if (item.starts_with("region=")) {
+            item.substr(7).CopyToString(region);
+        } else {
+            if (!inner_tag->empty()) {
+                inner_tag->push_back(' ');
+            }
+            inner_tag->append(item.data(), item.size());
+        }
+    }
+}
+
+bool ZoneAwareLoadBalancer::AddZone(Servers& bg, Zone* zone) {
+    bg.zones.push_back(zone);
+    return true;
+}
+
+bool ZoneAwareLoadBalancer::Add(Servers& bg, SocketId id, ServerInfo* info) {
+    return bg.server_map.insert(std::make_pair(id, info)).second;
+}
+
+bool ZoneAwareLoadBalancer::Remove(Servers& bg, SocketId id) {
+    return bg.server_map.erase(id) != 0;
+}
+
+// Caller must hold _mutex.
+ZoneAwareLoadBalancer::Zone* ZoneAwareLoadBalancer::GetOrNewZone(
+    const std::string& name, const std::string& region) {
+    std::map<std::string, Zone*>::iterator it = _zones.find(name);
+    if (it != _zones.end()) {
+        return it->second;
+    }
+    LoadBalancer* lb = _inner_lb->New(butil::StringPiece());
+    if (lb == NULL) {
+        LOG(ERROR) << "Fail to new LoadBalancer for zone=" << name;
+        return NULL;
+    }
+    Zone* zone = new Zone;
+    zone->name = name;
+    zone->region = region;
+    zone->lb = lb;
+    zone->nserver.store(0, butil::memory_order_relaxed);
+    zone->inflight.store(0, butil::memory_order_relaxed);
+    _zones[name] = zone;
+    _db_servers.Modify(AddZone, zone);
+    return zone;
+}
+
+bool ZoneAwareLoadBalancer::AddServer(const ServerId& id) {
+    ServerId inner_id(id.id);
+    std::string zone_name;
+    std::string region;
+    ParseTag(id.tag, &zone_name, &region, &inner_id.tag);
+
+    BAIDU_SCOPED_LOCK(_mutex);
+    Zone* zone = GetOrNewZone(zone_name, region);
+    if (zone == NULL) {
+        return false;
+    }
+    ServerInfo* info = new ServerInfo;
+    info->zone = zone;
+    info->inflight.store(0, butil::memory_order_relaxed);
+    if (!_db_servers.Modify(Add, id.id, info)) {
+        delete info;
+        return false;
+    }
+    if (!zone->lb->AddServer(inner_id)) {
+        _db_servers.Modify(Remove, id.id);
+        delete info;
+        return false;
+    }
+    zone->nserver.fetch_add(1, butil::memory_order_relaxed);
+    return true;
+}
+
+bool ZoneAwareLoadBalancer::RemoveServer(const ServerId& id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    ServerInfo* info = NULL;
+    {
+        butil::DoublyBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return false;
+        }
+        std::map<SocketId, ServerInfo*>::const_iterator it =
+            s->server_map.find(id.id);
+        if (it == s->server_map.end()) {
+            return false;
+        }
+        info = it->second;
+    }
+    ServerId inner_id(id.id);
+    std::string zone_name;
+    std::string region;
+    ParseTag(id.tag, &zone_name, &region, &inner_id.tag);
+    Zone* zone = info->zone;
+    zone->lb->RemoveServer(inner_id);
+    _db_servers.Modify(Remove, id.id);
+    // Nobody references `info' after Modify(). Requests in flight to the
+    // server won't be fed back, remove them from the zone.
+    zone->nserver.fetch_sub(1, butil::memory_order_relaxed);
+    zone->inflight.fetch_sub(info->inflight.load(butil::memory_order_relaxed),
+                             butil::memory_order_relaxed);
+    delete info;
+    return true;
+}
+
+size_t ZoneAwareLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    size_t n = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        n += !!AddServer(servers[i]);
+    }
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t ZoneAwareLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    size_t n = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        n += !!RemoveServer(servers[i]);
+    }
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+ZoneAwareLoadBalancer::Zone* ZoneAwareLoadBalancer::ChooseZone(
+    const Servers& s) const {
+    Zone* local = NULL;
+    int64_t local_n = 0;
+    int64_t remote_n = 0;
+    int64_t remote_inflight = 0;
+    for (size_t i = 0; i < s.zones.size(); ++i) {
+        Zone* zone = s.zones[i];
+        const int64_t n = zone->nserver.load(butil::memory_order_relaxed);
+        if (n <= 0) {
+            continue;
+        }
+        if (!_local_zone.empty() && zone->name == _local_zone) {
+            local = zone;
+            local_n = n;
+        } else {
+            remote_n += n;
+            remote_inflight += zone->inflight.load(butil::memory_order_relaxed);
+        }
+    }
+    if (local != NULL) {
+        if (remote_n == 0) {
+            return local;
+        }
+        const double local_load =
+            local->inflight.load(butil::memory_order_relaxed) / (double)local_n;
+        const double threshold = std::max(
+            _headroom, remote_inflight / (double)remote_n * (1 + _tolerance));
+        // Keep traffic in the local zone until it exceeds the threshold.
+        if (local_load <= threshold) {
+            return local;
+        }
+    }
+    if (remote_n == 0) {
+        return NULL;
+    }
+    // Spill to other zones in proportion to their numbers of servers.
+    int64_t dice = butil::fast_rand_less_than(remote_n);
+    for (size_t i = 0; i < s.zones.size(); ++i) {
+        Zone* zone = s.zones[i];
+        if (zone == local) {
+            continue;
+        }
+        const int64_t n = zone->nserver.load(butil::memory_order_relaxed);
+        if (n <= 0) {
+            continue;
+        }
+        if (dice < n) {
+            return zone;
+        }
+        dice -= n;
+    }
+    return NULL;
+}
+
+int ZoneAwareLoadBalancer::SelectServerInZone(
+    const Servers& s, Zone* zone, const SelectIn& in, SelectOut* out) {
+    const int rc = zone->lb->SelectServer(in, out);
+    if (rc != 0 || !in.changable_weights) {
+        return rc;
+    }
+    std::map<SocketId, ServerInfo*>::const_iterator it =
+        s.server_map.find((*out->ptr)->id());
+    if (it != s.server_map.end() && it->second->zone == zone) {
+        it->second->inflight.fetch_add(1, butil::memory_order_relaxed);
+        zone->inflight.fetch_add(1, butil::memory_order_relaxed);
+        // Feedback() is always needed to count requests in flight, which
+        // is also passed to the inner balancer. Built-in balancers need or
+        // ignore the feedback when weights are changable.
+        out->need_feedback = true;
+    }
+    return 0;
+}
+
+int ZoneAwareLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    if (s->server_map.empty()) {
+        return ENODATA;
+    }
+    Zone* chosen = ChooseZone(*s);
+    int rc = EHOSTDOWN;
+    if (chosen != NULL) {
+        rc = SelectServerInZone(*s, chosen, in, out);
+        if (rc == 0) {
+            return 0;
+        }
+    }
+    // No server is available in the chosen zone, try the local zone, zones
+    // in the local region and other zones in turn.
+    for (int rank = 0; rank < 3; ++rank) {
+        for (size_t i = 0; i < s->zones.size(); ++i) {
+            Zone* zone = s->zones[i];
+            if (zone == chosen ||
+                zone->nserver.load(butil::memory_order_relaxed) <= 0) {
+                continue;
+            }
+            int zone_rank = 2;
+            if (!_local_zone.empty() && zone->name == _local_zone) {
+                zone_rank = 0;
+            } else if (!_local_region.empty() && zone->region == _local_region) {
+                zone_rank = 1;
+            }
+            if (zone_rank != rank) {
+                continue;
+            }
+            rc = SelectServerInZone(*s, zone, in, out);
+            if (rc == 0) {
+                return 0;
+            }
+        }
+    }
+    return rc;
+}
+
+void ZoneAwareLoadBalancer::Feedback(const CallInfo& info) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return;
+    }
+    std::map<SocketId, ServerInfo*>::const_iterator it =
+        s->server_map.find(info.server_id);
+    if (it == s->server_map.end()) {
+        return;
+    }
+    Zone* zone = it->second->zone;
+    it->second->inflight.fetch_sub(1, butil::memory_order_relaxed);
+    zone->inflight.fetch_sub(1, butil::memory_order_relaxed);
+    zone->lb->Feedback(info);
+}
+
+ZoneAwareLoadBalancer* ZoneAwareLoadBalancer::New(
+    const butil::StringPiece& params) const {
+    ZoneAwareLoadBalancer* lb = new (std::nothrow) ZoneAwareLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = NULL;
+    }
+    return lb;
+}
+
+void ZoneAwareLoadBalancer::Destroy() {
+    delete this;
+}
+
+void ZoneAwareLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "zone_aware";
+        return;
+    }
+    os << "ZoneAware{local_zone=" << _local_zone
+       << " local_region=" << _local_region;
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << " fail to read _db_servers";
+    } else {
+        for (size_t i = 0; i < s->zones.size(); ++i) {
+            const Zone* zone = s->zones[i];
+            os << ' ' << zone->name << "{region=" << zone->region
+               << " n=" << zone->nserver.load(butil::memory_order_relaxed)
+               << " inflight="
+               << zone->inflight.load(butil::memory_order_relaxed) << ' ';
+            zone->lb->Describe(os, options);
+            os << '}';
+        }
+    }
+    os << '}';
+}
+
+bool ZoneAwareLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    std::string lb_name = "rr";
+    _local_zone = FLAGS_lb_local_zone;
+    _local_region = FLAGS_lb_local_region;
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "lb") {
+            lb_name = sp.value().as_string();
+        } else if (sp.key() == "local_zone") {
+            _local_zone = sp.value().as_string();
+        } else if (sp.key() == "local_region") {
+            _local_region = sp.value().as_string();
+        } else if (sp.key() == "headroom") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_headroom)) {
+                return false;
+            }
+        } else if (sp.key() == "tolerance") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_tolerance)) {
+                return false;
+            }
+        } else {
+            LOG(ERROR) << "Failed to set this unknown parameters "
+                       << sp.key_and_value();
+            return false;
+        }
+    }
+    _inner_lb = LoadBalancerExtension()->Find(lb_name.c_str());
+    if (_inner_lb == NULL) {
+        LOG(ERROR) << "Fail to find LoadBalancer by `" << lb_name << "'";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,113 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+#define BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+
+#include <vector>                                      // std::vector
+#include <map>                                         // std::map
+#include <string>
+#include "butil/scoped_lock.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+// This LoadBalancer groups servers by zones and prefers servers in the same
+// zone with this process, servers in each zone are selected by a separate
+// instance of another LoadBalancer.
+//
+// Zone and region of a server are specified by "zone=<zone>" and
+// "region=<region>" in its tag, separated from other parts of the tag by
+// spaces. The remaining parts of the tag are passed to the inner balancer,
+// e.g. "zone=az1 region=bj 10" gives weight 10 to wrr.
+//
+// Servers in the local zone are always selected while their average number
+// of requests in flight is less than `headroom' or not more than
+// (1 + `tolerance') times the average of servers in other zones. Beyond
+// that, the exceeding part of the traffic spills to other zones in
+// proportion to their numbers of servers. Servers in the local region are
+// preferred when the selected zone has no available server.
+//
+// Parameters (all optional), e.g. "zone_aware:lb=la local_zone=az1":
+//   lb            Name of the inner balancer. Default: rr
+//   local_zone    Default: -lb_local_zone
+//   local_region  Default: -lb_local_region
+//   headroom      Default: 4
+//   tolerance     Default: 0.2
+class ZoneAwareLoadBalancer : public LoadBalancer {
+public:
+    ZoneAwareLoadBalancer();
+    ~ZoneAwareLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    ZoneAwareLoadBalancer* New(const butil::StringPiece& params) const;
+    void Destroy();
+    void Describe(std::ostream&, const DescribeOptions& options);
+
+    // Split `tag' into zone, region and the part for the inner balancer.
+    static void ParseTag(const std::string& tag, std::string* zone,
+                         std::string* region, std::string* inner_tag);
+
+private:
+    struct Zone {
+        std::string name;
+        std::string region;
+        LoadBalancer* lb;
+        butil::atomic<int64_t> nserver;
+        butil::atomic<int64_t> inflight;
+    };
+    struct ServerInfo {
+        Zone* zone;
+        butil::atomic<int64_t> inflight;
+    };
+    struct Servers {
+        std::map<SocketId, ServerInfo*> server_map;
+        // All zones that ever have servers, never shrinks.
+        std::vector<Zone*> zones;
+    };
+    bool SetParameters(const butil::StringPiece& params);
+    Zone* GetOrNewZone(const std::string& name, const std::string& region);
+    Zone* ChooseZone(const Servers& s) const;
+    int SelectServerInZone(const Servers& s, Zone* zone,
+                           const SelectIn& in, SelectOut* out);
+    static bool AddZone(Servers& bg, Zone* zone);
+    static bool Add(Servers& bg, SocketId id, ServerInfo* info);
+    static bool Remove(Servers& bg, SocketId id);
+
+    const LoadBalancer* _inner_lb;
+    std::string _local_zone;
+    std::string _local_region;
+    double _headroom;
+    double _tolerance;
+    // Protecting _zones.
+    butil::Mutex _mutex;
+    std::map<std::string, Zone*> _zones;
+    butil::DoublyBufferedData<Servers> _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
@@ -0,0 +1,110 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "butil/containers/bounded_queue.h"
+#include "bvar/detail/sampler.h"
+#include "brpc/retry_budget.h"
+
+
+namespace brpc {
+
+// Samples of the counters are kept for at most so many seconds.
+static const int MAX_RETRY_BUDGET_TTL_S = 60;
+
+DEFINE_int32(retry_budget_ttl_s, 10,
+             "Requests and retries in so many seconds are counted by "
+             "retry budgets, at most 60");
+
+static bvar::Adder<int64_t>* g_retry_budget_exhausted = NULL;
+static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
+
+static void CreateVars() {
+    g_retry_budget_exhausted =
+        new bvar::Adder<int64_t>("rpc_retry_budget_exhausted_count");
+}
+
+// Take samples of the cumulated counters every second.
+class RetryBudget::CounterSampler : public bvar::detail::Sampler {
+public:
+    struct Counters {
+        int64_t nrequest;
+        int64_t nretry;
+    };
+
+    explicit CounterSampler(RetryBudget* owner)
+        : _owner(owner)
+        , _q(_space, sizeof(_space), butil::NOT_OWN_STORAGE) {
+        take_sample();
+    }
+
+    void take_sample() override {
+        const Counters c = { _owner->_nrequest.get_value(),
+                             _owner->_nretry.get_value() };
+        _q.elim_push(c);
+    }
+
+    // Get counters sampled `ttl_s' seconds before, or the oldest one if
+    // the sampler is younger than that.
+    Counters get_base(int ttl_s) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        const Counters* c = _q.bottom(ttl_s);
+        if (c == NULL) {
+            c = _q.top();
+        }
+        return *c;
+    }
+
+private:
+    RetryBudget* _owner;
+    butil::BoundedQueue<Counters> _q;
+    Counters _space[MAX_RETRY_BUDGET_TTL_S + 1];
+};
+
+RetryBudget::RetryBudget(int percent, int min_retries_per_second)
+    : _percent(percent)
+    , _min_retries_per_second(min_retries_per_second)
+    , _sampler(NULL) {
+    pthread_once(&s_create_vars_once, CreateVars);
+    _sampler = new CounterSampler(this);
+    _sampler->schedule();
+}
+
+RetryBudget::~RetryBudget() {
+    _sampler->destroy();
+    _sampler = NULL;
+}
+
+bool RetryBudget::AcquireRetry() {
+    const int ttl_s = std::max(
+        1, std::min(FLAGS_retry_budget_ttl_s, MAX_RETRY_BUDGET_TTL_S));
+    const CounterSampler::Counters base = _sampler->get_base(ttl_s);
+    const int64_t nrequest = _nrequest.get_value() - base.nrequest;
+    const int64_t nretry = _nretry.get_value() - base.nretry;
+    const double budget = nrequest * _percent / 100.0 +
+        (double)_min_retries_per_second * ttl_s;
+    if (nretry >= budget) {
+        *g_retry_budget_exhausted << 1;
+        return false;
+    }
+    _nretry << 1;
+    return true;
+}
+
+} // namespace brpc
@@ -0,0 +1,66 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_RETRY_BUDGET_H
+#define BRPC_RETRY_BUDGET_H
+
+#include "bvar/reducer.h"
+#include "brpc/shared_object.h"
+
+
+namespace brpc {
+
+// Limit retries over a channel to a percentage of its requests (like the
+// retry budgets in Finagle and Envoy), so that retries do not multiply the
+// load of servers which are already struggling in a partial outage.
+// Requests and retries are counted with per-thread bvar::Adder, and the
+// counters are sampled every second to get values inside the window.
+// Shared by the channel and controllers in the middle of RPC.
+class RetryBudget : public SharedObject {
+public:
+    // Allow `percent'% of the requests in the last -retry_budget_ttl_s
+    // seconds to be retried, plus `min_retries_per_second' retries per
+    // second so that channels with low QPS can still retry.
+    RetryBudget(int percent, int min_retries_per_second);
+
+    // Called once for each RPC, retries are not included.
+    void OnRequest() { _nrequest << 1; }
+
+    // Returns true and counts the retry if the budget allows one more
+    // retry, false otherwise.
+    bool AcquireRetry();
+
+    int percent() const { return _percent; }
+    int min_retries_per_second() const { return _min_retries_per_second; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RetryBudget);
+    ~RetryBudget();
+
+    class CounterSampler;
+
+    const int _percent;
+    const int _min_retries_per_second;
+    bvar::Adder<int64_t> _nrequest;
+    bvar::Adder<int64_t> _nretry;
+    CounterSampler* _sampler;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_RETRY_BUDGET_H
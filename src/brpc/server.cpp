@@ -75,6 +75,7 @@
 #include "brpc/rtmp.h"
 #include "brpc/builtin/common.h"               // GetProgramName
 #include "brpc/details/tcmalloc_extension.h"
+#include "brpc/reloadable_flags.h"
 
 inline std::ostream& operator<<(std::ostream& os, const timeval& tm) {
     const char old_fill = os.fill();
@@ -87,6 +88,8 @@ extern "C" {
 void* bthread_get_assigned_data();
 }
 
+DECLARE_int32(task_group_ntags);
+
 namespace brpc {
 
 BAIDU_CASSERT(sizeof(int32_t) == sizeof(butil::subtle::Atomic32),
@@ -110,8 +113,20 @@ butil::static_atomic<int> g_running_server_count = BUTIL_STATIC_ATOMIC_INIT(0);
 DEFINE_bool(enable_dir_service, false, "Enable /dir");
 DEFINE_bool(enable_threads_service, false, "Enable /threads");
 
+DEFINE_bool(server_drop_expired_requests, true,
+            "Fail requests whose deadlines(set by clients) are passed before "
+            "running user code with ERPCTIMEDOUT");
+BRPC_VALIDATE_GFLAG(server_drop_expired_requests, PassValidate);
+
+DEFINE_bool(account_cpu_by_method, false,
+            "Account cpu time of bthreads running methods of user services "
+            "(baidu_std and http/h2 only), shown in "
+            "/vars/bthread_cpu_usage_<method>. Must be set before services "
+            "are added");
+
 DECLARE_int32(usercode_backup_threads);
 DECLARE_bool(usercode_in_pthread);
+DECLARE_bool(enable_rpc_phase_latency);
 
 const int INITIAL_SERVICE_CAP = 64;
 const int INITIAL_CERT_MAP = 64;
@@ -140,7 +155,8 @@ ServerOptions::ServerOptions()
     , http_master_service(NULL)
     , health_reporter(NULL)
     , rtmp_service(NULL)
-    , redis_service(NULL) {
+    , redis_service(NULL)
+    , bthread_tag(BTHREAD_TAG_INVALID) {
     if (s_ncore > 0) {
         num_threads = s_ncore + 1;
     }
@@ -166,7 +182,9 @@ Server::MethodProperty::MethodProperty()
     , http_url(NULL)
     , service(NULL)
     , method(NULL)
-    , status(NULL) {
+    , status(NULL)
+    , bthread_tag(BTHREAD_TAG_INVALID)
+    , cpu_account(NULL) {
 }
 
 static timeval GetUptime(void* arg/*start_time*/) {
@@ -282,6 +300,7 @@ void* Server::UpdateDerivedVars(void* arg) {
     std::vector<SocketId> internal_conns;
 
     server->_nerror_bvar.expose_as(prefix, "error");
+    server->_nexpired_bvar.expose_as(prefix, "expired_before_execution");
 
     bvar::PassiveStatus<timeval> uptime_st(
         prefix, "uptime", GetUptime, (void*)(intptr_t)start_us);
@@ -555,7 +574,8 @@ Acceptor* Server::BuildAcceptor() {
         whitelist.insert(protocol);
     }
     const bool has_whitelist = !whitelist.empty();
-    Acceptor* acceptor = new (std::nothrow) Acceptor(_keytable_pool);
+    Acceptor* acceptor = new (std::nothrow) Acceptor(
+        _keytable_pool, _options.bthread_tag);
     if (NULL == acceptor) {
         LOG(ERROR) << "Fail to new Acceptor";
         return NULL;
@@ -737,6 +757,12 @@ int Server::StartInternal(const butil::ip_t& ip,
         return -1;
     }
 
+    if (!IsValidBthreadTag(_options.bthread_tag)) {
+        LOG(ERROR) << "Invalid bthread_tag=" << _options.bthread_tag
+                   << ", -task_group_ntags=" << FLAGS_task_group_ntags;
+        return -1;
+    }
+
     if (_options.http_master_service) {
         // Check requirements for http_master_service:
         //  has "default_method" & request/response have no fields
@@ -821,6 +847,7 @@ int Server::StartInternal(const butil::ip_t& ip,
             init_args[i].stop = false;
             bthread_attr_t tmp = BTHREAD_ATTR_NORMAL;
             tmp.keytable_pool = _keytable_pool;
+            tmp.tag = _options.bthread_tag;
             if (bthread_start_background(
                     &init_args[i].th, &tmp, BthreadInitEntry, &init_args[i]) != 0) {
                 break;
@@ -910,10 +937,17 @@ int Server::StartInternal(const butil::ip_t& ip,
         if (FLAGS_usercode_in_pthread) {
             _options.num_threads += FLAGS_usercode_backup_threads;
         }
-        if (_options.num_threads < BTHREAD_MIN_CONCURRENCY) {
-            _options.num_threads = BTHREAD_MIN_CONCURRENCY;
+        if (_options.bthread_tag != BTHREAD_TAG_INVALID &&
+            _options.bthread_tag != BTHREAD_TAG_DEFAULT) {
+            // Size the isolated pool of this server.
+            bthread_setconcurrency_by_tag(_options.num_threads,
+                                          _options.bthread_tag);
+        } else {
+            if (_options.num_threads < BTHREAD_MIN_CONCURRENCY) {
+                _options.num_threads = BTHREAD_MIN_CONCURRENCY;
+            }
+            bthread_setconcurrency(_options.num_threads);
         }
-        bthread_setconcurrency(_options.num_threads);
     }
 
     for (MethodMap::iterator it = _method_map.begin();
@@ -931,6 +965,8 @@ int Server::StartInternal(const butil::ip_t& ip,
                 return -1;
             }
             it->second.status->SetConcurrencyLimiter(cl);
+            it->second.status->SetPhaseLatencyEnabled(
+                FLAGS_enable_rpc_phase_latency);
         }
     }
 
@@ -1214,6 +1250,9 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
         mp.service = service;
         mp.method = md;
         mp.status = new MethodStatus;
+        if (FLAGS_account_cpu_by_method && !is_builtin_service) {
+            mp.cpu_account = bthread_cpu_account_get(md->full_name().c_str());
+        }
         _method_map[md->full_name()] = mp;
         if (is_idl_support && sd->name() != sd->full_name()/*has ns*/) {
             MethodProperty mp2 = mp;
@@ -2060,6 +2099,31 @@ AdaptiveMaxConcurrency& Server::MaxConcurrencyOf(MethodProperty* mp) {
     return mp->max_concurrency;
 }
 
+bool Server::IsValidBthreadTag(bthread_tag_t tag) {
+    return tag == BTHREAD_TAG_INVALID ||
+        (tag >= 0 && tag < FLAGS_task_group_ntags);
+}
+
+int Server::SetBthreadTagOf(const butil::StringPiece& full_method_name,
+                            bthread_tag_t tag) {
+    if (IsRunning()) {
+        LOG(WARNING) << "SetBthreadTagOf is only allowed before Server started";
+        return -1;
+    }
+    if (!IsValidBthreadTag(tag)) {
+        LOG(ERROR) << "Invalid bthread_tag=" << tag
+                   << ", -task_group_ntags=" << FLAGS_task_group_ntags;
+        return -1;
+    }
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    mp->bthread_tag = tag;
+    return 0;
+}
+
 int Server::MaxConcurrencyOf(const MethodProperty* mp) const {
     if (IsRunning()) {
         LOG(WARNING) << "MaxConcurrencyOf is only allowd before Server started";
@@ -241,6 +241,14 @@ struct ServerOptions {
     // Default: NULL (disabled)
     RedisService* redis_service;
 
+    // Process connections and requests of this server in the isolated pool
+    // of bthread workers with this tag, which must be less than
+    // -task_group_ntags. If the tag is not BTHREAD_TAG_DEFAULT, `num_threads'
+    // is the number of workers in the pool rather than of all workers.
+    // Methods can be moved to other pools by Server::SetBthreadTagOf().
+    // Default: BTHREAD_TAG_INVALID (the default pool)
+    bthread_tag_t bthread_tag;
+
 private:
     // SSLOptions is large and not often used, allocate it on heap to
     // prevent ServerOptions from being bloated in most cases.
@@ -356,6 +364,12 @@ public:
         const google::protobuf::MethodDescriptor* method;
         MethodStatus* status;
         AdaptiveMaxConcurrency max_concurrency;
+        // Run the method in workers with this tag if it's not
+        // BTHREAD_TAG_INVALID.
+        bthread_tag_t bthread_tag;
+        // Cpu time of bthreads running the method is accounted to it if
+        // it's not NULL, see -account_cpu_by_method.
+        bthread_cpu_account_t* cpu_account;
 
         MethodProperty();
     };
@@ -532,6 +546,16 @@ public:
     int MaxConcurrencyOf(google::protobuf::Service* service,
                          const butil::StringPiece& method_name) const;
 
+    // Run the method in the isolated pool of bthread workers with `tag',
+    // e.g. to keep a CPU-heavy method from starving other methods.
+    // Example:
+    //    server.SetBthreadTagOf("example.EchoService.Echo", 1);
+    // Note: This interface can ONLY be called before the server is started,
+    // and only takes effect for methods called by baidu_std and http/h2.
+    // Returns 0 on success, -1 otherwise.
+    int SetBthreadTagOf(const butil::StringPiece& full_method_name,
+                        bthread_tag_t tag);
+
 private:
 friend class StatusService;
 friend class ProtobufsService;
@@ -623,6 +647,7 @@ friend class Controller;
 
     AdaptiveMaxConcurrency& MaxConcurrencyOf(MethodProperty*);
     int MaxConcurrencyOf(const MethodProperty*) const;
+    static bool IsValidBthreadTag(bthread_tag_t tag);
     
     DISALLOW_COPY_AND_ASSIGN(Server);
 
@@ -679,6 +704,7 @@ friend class Controller;
 
     // mutable is required for `ServerPrivateAccessor' to change this bvar
     mutable bvar::Adder<int64_t> _nerror_bvar;
+    mutable bvar::Adder<int64_t> _nexpired_bvar;
     mutable int32_t BAIDU_CACHELINE_ALIGNMENT _concurrency;
 
 };
@@ -41,6 +41,7 @@
 #include "brpc/socket.h"
 #include "brpc/describable.h"               // Describable
 #include "brpc/circuit_breaker.h"           // CircuitBreaker
+#include "brpc/client_concurrency_limiter.h"  // ClientConcurrencyLimiter
 #include "brpc/input_messenger.h"
 #include "brpc/details/sparse_minute_counter.h"
 #include "brpc/stream_impl.h"
@@ -87,6 +88,17 @@ DEFINE_int32(max_connection_pool_size, 100,
              "Max number of pooled connections to a single endpoint");
 BRPC_VALIDATE_GFLAG(max_connection_pool_size, PassValidate);
 
+DEFINE_bool(adaptive_connection_pool, false,
+            "Size pools of connections by the concurrency observed in the "
+            "last seconds: surplus free connections are closed and missing "
+            "ones are created and connected in background");
+BRPC_VALIDATE_GFLAG(adaptive_connection_pool, PassValidate);
+
+DEFINE_double(connection_pool_headroom, 0.5,
+              "Adaptive pools keep (1 + this value) times the observed "
+              "concurrency of connections for bursts");
+BRPC_VALIDATE_GFLAG(connection_pool_headroom, PassValidate);
+
 DEFINE_int32(connect_timeout_as_unreachable, 3,
              "If the socket failed to connect due to ETIMEDOUT for so many "
              "times *continuously*, the error is changed to ENETUNREACH which "
@@ -118,15 +130,39 @@ public:
     
     // Get all pooled sockets inside.
     void ListSockets(std::vector<SocketId>* list, size_t max_count);
-    
+
+    // Called every second to update the target size of the pool by the
+    // concurrency since last call, closes free sockets exceeding the
+    // target. Returns number of sockets that should be created.
+    int UpdateTargetSize(int64_t now_us);
+
+    // Create `n' sockets, connect them and put them into the pool.
+    void Grow(int n);
+
 private:
+    // Put a free socket into the pool, close it if the pool is full.
+    void AddFreeSocket(Socket* sock);
+
     // options used to create this instance
     SocketOptions _options;
     butil::Mutex _mutex;
+    // Sockets are got from and returned to the back, sockets at the front
+    // are least recently used and closed first when the pool shrinks.
     std::vector<SocketId> _pool;
     butil::EndPoint _remote_side;
     butil::atomic<int> _numfree; // #free sockets in all sub pools.
     butil::atomic<int> _numinflight; // #inflight sockets in all sub pools.
+    // Sum of (return time - get time) of sockets returned, minus get time
+    // of sockets in flight. Adding `now * _numinflight' gives the total
+    // time that sockets are in use, namely QPS * latency over time
+    // (Little's law).
+    butil::atomic<int64_t> _inuse_us;
+    butil::atomic<bool> _growing;
+    // Following fields are only accessed by UpdateTargetSize() which is
+    // serialized by stats_mutex of SharedPart.
+    int64_t _last_update_us;
+    int64_t _last_inuse_us;
+    double _target_size;
 };
 
 // NOTE: sizeof of this class is 1200 bytes. If we have 10K sockets, total
@@ -182,9 +218,14 @@ public:
 
     // For computing stats.
     ExtendedSocketStat* extended_stat;
+    // Serialize Socket::UpdateStatsEverySecond() which is not only called
+    // by the global updater, say tests call it to speed up.
+    butil::Mutex stats_mutex;
 
     CircuitBreaker circuit_breaker;
 
+    ClientConcurrencyLimiter client_concurrency_limiter;
+
     butil::atomic<uint64_t> recent_error_count;
 
     explicit SharedPart(SocketId creator_socket_id);
@@ -419,6 +460,7 @@ Socket::Socket(Forbidden)
     , _shared_part(NULL)
     , _nevent(0)
     , _keytable_pool(NULL)
+    , _bthread_tag(BTHREAD_TAG_INVALID)
     , _fd(-1)
     , _tos(0)
     , _reset_fd_real_us(-1)
@@ -454,6 +496,8 @@ Socket::Socket(Forbidden)
     , _write_head(NULL)
     , _stream_set(NULL)
     , _ninflight_app_health_check(0)
+    , _revived_time_us(0)
+    , _preconnect_npooled(-1)
 {
     CreateVarsOnce();
     pthread_mutex_init(&_id_wait_list_mutex, NULL);
@@ -593,6 +637,7 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     CHECK(NULL == m->_shared_part.load(butil::memory_order_relaxed));
     m->_nevent.store(0, butil::memory_order_relaxed);
     m->_keytable_pool = options.keytable_pool;
+    m->_bthread_tag = options.bthread_tag;
     m->_tos = 0;
     m->_remote_side = options.remote_side;
     m->_on_edge_triggered_events = options.on_edge_triggered_events;
@@ -637,6 +682,8 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     m->_error_text.clear();
     m->_agent_socket_id.store(INVALID_SOCKET_ID, butil::memory_order_relaxed);
     m->_ninflight_app_health_check.store(0, butil::memory_order_relaxed);
+    m->_revived_time_us.store(0, butil::memory_order_relaxed);
+    m->_preconnect_npooled.store(-1, butil::memory_order_relaxed);
     // NOTE: last two params are useless in bthread > r32787
     const int rc = bthread_id_list_init(&m->_id_wait_list, 512, 512);
     if (rc) {
@@ -758,6 +805,14 @@ void Socket::Revive() {
                 butil::memory_order_relaxed)) {
             // Set this flag to true since we add additional ref again
             _recycle_flag.store(false, butil::memory_order_relaxed);
+            // The server may be just restarted with cold caches.
+            _revived_time_us.store(butil::cpuwide_time_us(),
+                                   butil::memory_order_relaxed);
+            const int npooled =
+                _preconnect_npooled.load(butil::memory_order_relaxed);
+            if (npooled >= 0) {
+                PreConnect(npooled);
+            }
             if (_user) {
                 _user->AfterRevived(this);
             } else {
@@ -882,6 +937,89 @@ void Socket::FeedbackCircuitBreaker(int error_code, int64_t latency_us) {
     }
 }
 
+bool Socket::AcquireClientConcurrency() {
+    return GetOrNewSharedPart()->client_concurrency_limiter.OnRequested();
+}
+
+void Socket::FeedbackClientConcurrencyLimiter(int error_code,
+                                              int64_t latency_us) {
+    GetOrNewSharedPart()->client_concurrency_limiter.OnResponded(
+        error_code, latency_us);
+}
+
+bool Socket::GetClientConcurrencyStats(int* inflight,
+                                       int* max_concurrency) const {
+    SharedPart* sp = GetSharedPart();
+    if (sp == NULL || !sp->client_concurrency_limiter.used()) {
+        return false;
+    }
+    *inflight = sp->client_concurrency_limiter.inflight();
+    *max_concurrency = sp->client_concurrency_limiter.max_concurrency();
+    return true;
+}
+
+// Written into a socket to make the connection without sending anything.
+class EmptySocketMessage : public SocketMessage {
+public:
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf*, Socket*) {
+        delete this;
+        return butil::Status::OK();
+    }
+};
+
+static int ConnectByEmptyMessage(Socket* s) {
+    SocketMessagePtr<> msg(new EmptySocketMessage);
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    return s->Write(msg, &wopt);
+}
+
+struct PreConnectArgs {
+    SocketId id;
+    int npooled;
+};
+
+void Socket::PreConnect(int npooled) {
+    _preconnect_npooled.store(npooled, butil::memory_order_relaxed);
+    PreConnectArgs* args = new PreConnectArgs;
+    args->id = _this_id;
+    args->npooled = npooled;
+    bthread_t th;
+    if (bthread_start_background(&th, &BTHREAD_ATTR_NORMAL,
+                                 RunPreConnect, args) != 0) {
+        LOG(WARNING) << "Fail to start bthread to pre-connect " << *this;
+        delete args;
+    }
+}
+
+void* Socket::RunPreConnect(void* arg) {
+    std::unique_ptr<PreConnectArgs> args(static_cast<PreConnectArgs*>(arg));
+    SocketUniquePtr main_socket;
+    if (Socket::Address(args->id, &main_socket) != 0) {
+        return NULL;
+    }
+    if (args->npooled <= 0) {
+        ConnectByEmptyMessage(main_socket.get());
+        return NULL;
+    }
+    // Hold all pooled sockets before returning them, otherwise the same
+    // socket is got from the pool again and again.
+    const int npooled = std::min(args->npooled, FLAGS_max_connection_pool_size);
+    std::vector<SocketUniquePtr> pooled_sockets(npooled);
+    int ngot = 0;
+    for (; ngot < npooled; ++ngot) {
+        if (main_socket->GetPooledSocket(&pooled_sockets[ngot]) != 0) {
+            break;
+        }
+        ConnectByEmptyMessage(pooled_sockets[ngot].get());
+    }
+    for (int i = 0; i < ngot; ++i) {
+        pooled_sockets[i]->ReturnToPool();
+    }
+    return NULL;
+}
+
 int Socket::ReleaseReferenceIfIdle(int idle_seconds) {
     const int64_t last_active_us = last_active_time_us();
     if (butil::cpuwide_time_us() - last_active_us <= idle_seconds * 1000000L) {
@@ -1956,6 +2094,7 @@ int Socket::StartInputEvent(SocketId id, uint32_t events,
 
         bthread_attr_t attr = thread_attr;
         attr.keytable_pool = p->_keytable_pool;
+        attr.tag = p->_bthread_tag;
         if (bthread_start_urgent(&tid, &attr, ProcessEvent, p) != 0) {
             LOG(FATAL) << "Fail to start ProcessEvent";
             ProcessEvent(p);
@@ -1970,11 +2109,56 @@ void DereferenceSocket(Socket* s) {
     }
 }
 
+struct GrowPoolArgs {
+    SocketId id;
+    int n;
+};
+
 void Socket::UpdateStatsEverySecond(int64_t now_ms) {
     SharedPart* sp = GetSharedPart();
     if (sp) {
-        sp->UpdateStatsEverySecond(now_ms);
+        int n = 0;
+        {
+            BAIDU_SCOPED_LOCK(sp->stats_mutex);
+            sp->UpdateStatsEverySecond(now_ms);
+            SocketPool* pool =
+                sp->socket_pool.load(butil::memory_order_consume);
+            if (pool == NULL || Failed()) {
+                return;
+            }
+            n = pool->UpdateTargetSize(now_ms * 1000L);
+        }
+        if (n > 0) {
+            GrowPoolArgs* args = new GrowPoolArgs;
+            args->id = _this_id;
+            args->n = n;
+            bthread_t th;
+            if (bthread_start_background(&th, &BTHREAD_ATTR_NORMAL,
+                                         RunGrowPool, args) != 0) {
+                LOG(WARNING) << "Fail to start bthread to grow pool of "
+                             << *this;
+                delete args;
+            }
+        }
+    }
+}
+
+void* Socket::RunGrowPool(void* arg) {
+    std::unique_ptr<GrowPoolArgs> args(static_cast<GrowPoolArgs*>(arg));
+    // Hold the main socket so that the pool is not destroyed.
+    SocketUniquePtr main_socket;
+    if (Socket::Address(args->id, &main_socket) != 0) {
+        return NULL;
+    }
+    SharedPart* sp = main_socket->GetSharedPart();
+    if (sp == NULL) {
+        return NULL;
+    }
+    SocketPool* pool = sp->socket_pool.load(butil::memory_order_consume);
+    if (pool != NULL) {
+        pool->Grow(args->n);
     }
+    return NULL;
 }
 
 template <typename T>
@@ -2056,6 +2240,9 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
            << "\n  in_num_messages=" << sp->in_num_messages.load(butil::memory_order_relaxed)
            << "\n  out_size=" << sp->out_size.load(butil::memory_order_relaxed)
            << "\n  out_num_messages=" << sp->out_num_messages.load(butil::memory_order_relaxed)
+           << "\n  client_concurrency=" << sp->client_concurrency_limiter.inflight()
+           << "\n  client_max_concurrency="
+           << sp->client_concurrency_limiter.max_concurrency()
            << "\n}";
     }
     const int fd = ptr->_fd.load(butil::memory_order_relaxed);
@@ -2267,7 +2454,12 @@ inline SocketPool::SocketPool(const SocketOptions& opt)
     : _options(opt)
     , _remote_side(opt.remote_side)
     , _numfree(0)
-    , _numinflight(0) {
+    , _numinflight(0)
+    , _inuse_us(0)
+    , _growing(false)
+    , _last_update_us(butil::cpuwide_time_us())
+    , _last_inuse_us(0)
+    , _target_size(0) {
 }
 
 inline SocketPool::~SocketPool() {
@@ -2312,7 +2504,10 @@ inline int SocketPool::GetSocket(SocketUniquePtr* ptr) {
             // Not address inside the lock since at most time the pooled socket
             // is likely to be valid.
             if (Socket::Address(sid, ptr) == 0) {
+                _inuse_us.fetch_sub(butil::cpuwide_time_us(),
+                                    butil::memory_order_relaxed);
                 _numinflight.fetch_add(1, butil::memory_order_relaxed);
+                g_vars->npool_hit << 1;
                 return 0;
             }
         }
@@ -2322,13 +2517,17 @@ inline int SocketPool::GetSocket(SocketUniquePtr* ptr) {
     opt.health_check_interval_s = -1;
     if (get_client_side_messenger()->Create(opt, &sid) == 0 &&
         Socket::Address(sid, ptr) == 0) {
+        _inuse_us.fetch_sub(butil::cpuwide_time_us(),
+                            butil::memory_order_relaxed);
         _numinflight.fetch_add(1, butil::memory_order_relaxed);
+        g_vars->npool_miss << 1;
+        g_vars->npooled_create << 1;
         return 0;
     }
     return -1;
 }
 
-inline void SocketPool::ReturnSocket(Socket* sock) {
+inline void SocketPool::AddFreeSocket(Socket* sock) {
     // NOTE: save the gflag which may be reloaded at any time.
     const int connection_pool_size = FLAGS_max_connection_pool_size;
 
@@ -2343,9 +2542,88 @@ inline void SocketPool::ReturnSocket(Socket* sock) {
         _numfree.fetch_sub(1, butil::memory_order_relaxed);
         sock->SetFailed(EUNUSED, "Close unused pooled socket");
     }
+}
+
+inline void SocketPool::ReturnSocket(Socket* sock) {
+    AddFreeSocket(sock);
+    _inuse_us.fetch_add(butil::cpuwide_time_us(), butil::memory_order_relaxed);
     _numinflight.fetch_sub(1, butil::memory_order_relaxed);
 }
 
+int SocketPool::UpdateTargetSize(int64_t now_us) {
+    // Two fields are not changed atomically, the error is negligible.
+    const int numinflight = _numinflight.load(butil::memory_order_relaxed);
+    const int64_t inuse_us = _inuse_us.load(butil::memory_order_relaxed) +
+        now_us * numinflight;
+    const int64_t interval_us = now_us - _last_update_us;
+    if (interval_us <= 0) {
+        return 0;
+    }
+    const double concurrency =
+        (inuse_us - _last_inuse_us) / (double)interval_us;
+    _last_update_us = now_us;
+    _last_inuse_us = inuse_us;
+    if (!FLAGS_adaptive_connection_pool) {
+        _target_size = 0;
+        return 0;
+    }
+    // Grow immediately, shrink slowly so that the pool is not closed and
+    // recreated between bursts.
+    const double target = std::max(
+        std::max(concurrency, (double)numinflight) *
+        (1 + FLAGS_connection_pool_headroom), 1.0);
+    if (target >= _target_size) {
+        _target_size = target;
+    } else {
+        _target_size = _target_size * 0.9 + target * 0.1;
+    }
+    const int target_size = std::min(
+        (int)(_target_size + 0.5), FLAGS_max_connection_pool_size);
+    const int numfree = _numfree.load(butil::memory_order_relaxed);
+    int nclose = numfree + numinflight - target_size;
+    if (nclose <= 0) {
+        return -nclose;
+    }
+    std::vector<SocketId> closing;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        nclose = std::min(nclose, (int)_pool.size());
+        closing.assign(_pool.begin(), _pool.begin() + nclose);
+        _pool.erase(_pool.begin(), _pool.begin() + nclose);
+    }
+    _numfree.fetch_sub(closing.size(), butil::memory_order_relaxed);
+    for (size_t i = 0; i < closing.size(); ++i) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(closing[i], &ptr) == 0) {
+            ptr->ReleaseAdditionalReference();
+        }
+    }
+    return 0;
+}
+
+void SocketPool::Grow(int n) {
+    if (_growing.exchange(true, butil::memory_order_acquire)) {
+        return;
+    }
+    SocketOptions opt = _options;
+    opt.health_check_interval_s = -1;
+    for (int i = 0; i < n; ++i) {
+        SocketId sid;
+        SocketUniquePtr ptr;
+        if (get_client_side_messenger()->Create(opt, &sid) != 0 ||
+            Socket::Address(sid, &ptr) != 0) {
+            break;
+        }
+        g_vars->npooled_create << 1;
+        if (ConnectByEmptyMessage(ptr.get()) != 0) {
+            // The socket is failed already.
+            break;
+        }
+        AddFreeSocket(ptr.get());
+    }
+    _growing.store(false, butil::memory_order_release);
+}
+
 inline void SocketPool::ListSockets(std::vector<SocketId>* out, size_t max_count) {
     out->clear();
     // NOTE: size() of vector is thread-unsafe and may return a very 
@@ -2416,6 +2694,7 @@ int Socket::GetPooledSocket(SocketUniquePtr* pooled_socket) {
         opt.on_edge_triggered_events = _on_edge_triggered_events;
         opt.initial_ssl_ctx = _ssl_ctx;
         opt.keytable_pool = _keytable_pool;
+        opt.bthread_tag = _bthread_tag;
         opt.app_connect = _app_connect;
         socket_pool = new SocketPool(opt);
         SocketPool* expected = NULL;
@@ -2512,6 +2791,7 @@ int Socket::GetShortSocket(SocketUniquePtr* short_socket) {
     opt.on_edge_triggered_events = _on_edge_triggered_events;
     opt.initial_ssl_ctx = _ssl_ctx;
     opt.keytable_pool = _keytable_pool;
+    opt.bthread_tag = _bthread_tag;
     opt.app_connect = _app_connect;
     if (get_client_side_messenger()->Create(opt, &id) != 0 ||
         Socket::Address(id, short_socket) != 0) {
@@ -136,8 +136,22 @@ struct SocketVarsCollector {
         , nkeepwrite_second("rpc_keepwrite_second", &nkeepwrite)
         , nwaitepollout("rpc_waitepollout_count")
         , nwaitepollout_second("rpc_waitepollout_second", &nwaitepollout)
+        , npool_hit_second("rpc_socket_pool_hit_second", &npool_hit)
+        , npool_miss_second("rpc_socket_pool_miss_second", &npool_miss)
+        , npool_hit_window(&npool_hit, 10)
+        , npool_miss_window(&npool_miss, 10)
+        , pool_hit_ratio("rpc_socket_pool_hit_ratio", GetPoolHitRatio, this)
+        , npooled_create_second("rpc_pooled_socket_create_second",
+                                &npooled_create)
     {}
 
+    static double GetPoolHitRatio(void* arg) {
+        SocketVarsCollector* vars = static_cast<SocketVarsCollector*>(arg);
+        const int64_t nhit = vars->npool_hit_window.get_value();
+        const int64_t nget = nhit + vars->npool_miss_window.get_value();
+        return nget > 0 ? nhit / (double)nget : 0;
+    }
+
     bvar::Adder<int64_t> nsocket;
     bvar::Adder<int64_t> channel_conn;
     bvar::Adder<int> neventthread;
@@ -147,6 +161,17 @@ struct SocketVarsCollector {
     bvar::PerSecond<bvar::Adder<int64_t> > nkeepwrite_second;
     bvar::Adder<int64_t> nwaitepollout;
     bvar::PerSecond<bvar::Adder<int64_t> > nwaitepollout_second;
+    // Pooled sockets got from the pool or created on demand.
+    bvar::Adder<int64_t> npool_hit;
+    bvar::PerSecond<bvar::Adder<int64_t> > npool_hit_second;
+    bvar::Adder<int64_t> npool_miss;
+    bvar::PerSecond<bvar::Adder<int64_t> > npool_miss_second;
+    // Hit ratio of the pools in last 10 seconds.
+    bvar::Window<bvar::Adder<int64_t> > npool_hit_window;
+    bvar::Window<bvar::Adder<int64_t> > npool_miss_window;
+    bvar::PassiveStatus<double> pool_hit_ratio;
+    bvar::Adder<int64_t> npooled_create;
+    bvar::PerSecond<bvar::Adder<int64_t> > npooled_create_second;
 };
 
 struct PipelinedInfo {
@@ -189,6 +214,8 @@ struct SocketOptions {
     int health_check_interval_s;
     std::shared_ptr<SocketSSLContext> initial_ssl_ctx;
     bthread_keytable_pool_t* keytable_pool;
+    // bthreads processing events of the socket run in workers with this tag.
+    bthread_tag_t bthread_tag;
     SocketConnection* conn;
     std::shared_ptr<AppConnect> app_connect;
     // The created socket will set parsing_context with this value.
@@ -353,6 +380,28 @@ public:
 
     void FeedbackCircuitBreaker(int error_code, int64_t latency_us);
 
+    // Client-side concurrency limiting of the server. AcquireClientConcurrency
+    // returns false when requests in flight to the server reached the limit,
+    // otherwise FeedbackClientConcurrencyLimiter must be called when the
+    // request ends.
+    bool AcquireClientConcurrency();
+    void FeedbackClientConcurrencyLimiter(int error_code, int64_t latency_us);
+    // Returns false if client-side concurrency limiting was never applied.
+    bool GetClientConcurrencyStats(int* inflight, int* max_concurrency) const;
+
+    // cpuwide time when this socket was revived last time, 0 if it's never
+    // revived. Traffic to a revived socket ramps up, check out
+    // LoadBalancer::IsThrottledBySlowStart for details.
+    int64_t revived_time_us() const
+    { return _revived_time_us.load(butil::memory_order_relaxed); }
+
+    // Connect to the remote side in background so that the first requests
+    // don't pay for TCP (and SSL) handshakes. `npooled' connections are
+    // created in the SocketPool if it's positive, otherwise the main
+    // connection is made. The connections are made again when this socket
+    // is revived.
+    void PreConnect(int npooled);
+
     bool Failed() const;
 
     bool DidReleaseAdditionalRereference() const
@@ -422,7 +471,9 @@ public:
     
     void set_type_of_service(int tos) { _tos = tos; }
 
-    // Call this method every second (roughly)
+    // Call this method every second (roughly). The pool of pooled sockets
+    // is also resized when -adaptive_connection_pool is on.
+    // Calls from different threads are serialized.
     void UpdateStatsEverySecond(int64_t now_ms);
 
     // Copy stat into `out'. If UpdateStatsEverySecond was never called, all
@@ -528,6 +579,8 @@ public:
 
     bthread_keytable_pool_t* keytable_pool() const { return _keytable_pool; }
 
+    bthread_tag_t bthread_tag() const { return _bthread_tag; }
+
 private:
     DISALLOW_COPY_AND_ASSIGN(Socket);
 
@@ -596,6 +649,10 @@ friend void DereferenceSocket(Socket*);
 
     static void* KeepWrite(void*);
 
+    static void* RunPreConnect(void*);
+
+    static void* RunGrowPool(void*);
+
     bool IsWriteComplete(WriteRequest* old_head, bool singular_node,
                          WriteRequest** new_tail);
 
@@ -687,6 +744,10 @@ private:
     // May be set by Acceptor to share keytables between reading threads
     // on sockets created by the Acceptor.
     bthread_keytable_pool_t* _keytable_pool;
+
+    // May be set by Acceptor to process messages in an isolated pool of
+    // bthread workers.
+    bthread_tag_t _bthread_tag;
     
     // [ Set in ResetFileDescriptor ] 
     butil::atomic<int> _fd;  // -1 when not connected.
@@ -819,6 +880,12 @@ private:
     std::set<StreamId> *_stream_set;
 
     butil::atomic<int64_t> _ninflight_app_health_check;
+
+    // Set in Revive().
+    butil::atomic<int64_t> _revived_time_us;
+
+    // Argument of last PreConnect(), -1 means PreConnect() is never called.
+    butil::atomic<int> _preconnect_npooled;
 };
 
 } // namespace brpc
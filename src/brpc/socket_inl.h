@@ -58,6 +58,7 @@ inline SocketOptions::SocketOptions()
     , on_edge_triggered_events(NULL)
     , health_check_interval_s(-1)
     , keytable_pool(NULL)
+    , bthread_tag(BTHREAD_TAG_INVALID)
     , conn(NULL)
     , app_connect(NULL)
     , initial_parsing_context(NULL)
@@ -19,6 +19,7 @@
 
 // Date: Tue Jul 10 17:40:58 CST 2012
 
+#include <algorithm>                           // std::max
 #include <gflags/gflags.h>
 #include "butil/macros.h"                       // BAIDU_CASSERT
 #include "butil/logging.h"
@@ -26,8 +27,11 @@
 #include "bthread/task_control.h"              // TaskControl
 #include "bthread/timer_thread.h"
 #include "bthread/list_of_abafree_id.h"
+#include "bthread/cpu_account.h"              // get_cpu_account
 #include "bthread/bthread.h"
 
+DECLARE_int32(task_group_ntags);
+
 namespace bthread {
 
 DEFINE_int32(bthread_concurrency, 8 + BTHREAD_EPOLL_THREAD_NUM,
@@ -88,6 +92,8 @@ inline TaskControl* get_or_new_task_control() {
     int concurrency = FLAGS_bthread_min_concurrency > 0 ?
         FLAGS_bthread_min_concurrency :
         FLAGS_bthread_concurrency;
+    // Each pool of workers needs at least one worker.
+    concurrency = std::max(concurrency, FLAGS_task_group_ntags);
     if (c->init(concurrency) != 0) {
         LOG(ERROR) << "Fail to init g_task_control";
         delete c;
@@ -97,6 +103,15 @@ inline TaskControl* get_or_new_task_control() {
     return c;
 }
 
+void print_sched_stats(std::ostream& os) {
+    TaskControl* c = get_task_control();
+    if (c == NULL) {
+        os << "No bthread is created yet\n";
+        return;
+    }
+    c->print_sched_stats(os);
+}
+
 static bool validate_bthread_min_concurrency(const char*, int32_t val) {
     if (val <= 0) {
         return true;
@@ -120,29 +135,49 @@ static bool validate_bthread_min_concurrency(const char*, int32_t val) {
 
 __thread TaskGroup* tls_task_group_nosignal = NULL;
 
+// Returns true if the bthread to start with `attr' can be put into the
+// group of current worker, namely the tag of the worker matches.
+BUTIL_FORCE_INLINE bool can_start_in_group(const TaskGroup* g,
+                                           const bthread_attr_t* attr) {
+    return attr == NULL || attr->tag == BTHREAD_TAG_INVALID ||
+        attr->tag == g->tag();
+}
+
+// Called by non-workers, or workers starting bthreads with other tags.
 BUTIL_FORCE_INLINE int
 start_from_non_worker(bthread_t* __restrict tid,
                       const bthread_attr_t* __restrict attr,
                       void * (*fn)(void*),
-                      void* __restrict arg) {
+                      void* __restrict arg,
+                      int64_t deadline_us = -1) {
     TaskControl* c = get_or_new_task_control();
     if (NULL == c) {
         return ENOMEM;
     }
+    const bthread_tag_t tag = (attr ? attr->tag : BTHREAD_TAG_INVALID);
+    if (tag != BTHREAD_TAG_INVALID && (tag < 0 || tag >= c->ntags())) {
+        return EINVAL;
+    }
     if (attr != NULL && (attr->flags & BTHREAD_NOSIGNAL)) {
         // Remember the TaskGroup to insert NOSIGNAL tasks for 2 reasons:
         // 1. NOSIGNAL is often for creating many bthreads in batch,
         //    inserting into the same TaskGroup maximizes the batch.
         // 2. bthread_flush() needs to know which TaskGroup to flush.
         TaskGroup* g = tls_task_group_nosignal;
+        if (g != NULL && g->tag() != c->choose_one_group(tag)->tag()) {
+            // Tasks of another tag are batched, flush them.
+            tls_task_group_nosignal = NULL;
+            g->flush_nosignal_tasks_remote();
+            g = NULL;
+        }
         if (NULL == g) {
-            g = c->choose_one_group();
+            g = c->choose_one_group(tag);
             tls_task_group_nosignal = g;
         }
-        return g->start_background<true>(tid, attr, fn, arg);
+        return g->start_background<true>(tid, attr, fn, arg, deadline_us);
     }
-    return c->choose_one_group()->start_background<true>(
-        tid, attr, fn, arg);
+    return c->choose_one_group(tag)->start_background<true>(
+        tid, attr, fn, arg, deadline_us);
 }
 
 struct TidTraits {
@@ -174,7 +209,7 @@ int bthread_start_urgent(bthread_t* __restrict tid,
                          void * (*fn)(void*),
                          void* __restrict arg) {
     bthread::TaskGroup* g = bthread::tls_task_group;
-    if (g) {
+    if (g && bthread::can_start_in_group(g, attr)) {
         // start from worker
         return bthread::TaskGroup::start_foreground(&g, tid, attr, fn, arg);
     }
@@ -186,21 +221,34 @@ int bthread_start_background(bthread_t* __restrict tid,
                              void * (*fn)(void*),
                              void* __restrict arg) {
     bthread::TaskGroup* g = bthread::tls_task_group;
-    if (g) {
+    if (g && bthread::can_start_in_group(g, attr)) {
         // start from worker
         return g->start_background<false>(tid, attr, fn, arg);
     }
     return bthread::start_from_non_worker(tid, attr, fn, arg);
 }
 
+int bthread_start_background_with_deadline(bthread_t* __restrict tid,
+                                           const bthread_attr_t* __restrict attr,
+                                           void * (*fn)(void*),
+                                           void* __restrict arg,
+                                           int64_t deadline_us) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g && bthread::can_start_in_group(g, attr)) {
+        return g->start_background<false>(tid, attr, fn, arg, deadline_us);
+    }
+    return bthread::start_from_non_worker(tid, attr, fn, arg, deadline_us);
+}
+
 void bthread_flush() {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g) {
-        return g->flush_nosignal_tasks();
+        g->flush_nosignal_tasks();
     }
     g = bthread::tls_task_group_nosignal;
     if (g) {
-        // NOSIGNAL tasks were created in this non-worker.
+        // NOSIGNAL tasks were created in this non-worker, or in this worker
+        // but with another tag.
         bthread::tls_task_group_nosignal = NULL;
         return g->flush_nosignal_tasks_remote();
     }
@@ -261,7 +309,11 @@ int bthread_getattr(bthread_t tid, bthread_attr_t* attr) {
 }
 
 int bthread_getconcurrency(void) {
-    return bthread::FLAGS_bthread_concurrency;
+    // Workers may be added by -bthread_adaptive_concurrency without changing
+    // the flag.
+    bthread::TaskControl* c = bthread::get_task_control();
+    const int concurrency = bthread::FLAGS_bthread_concurrency;
+    return c ? std::max(concurrency, c->concurrency()) : concurrency;
 }
 
 int bthread_setconcurrency(int num) {
@@ -299,9 +351,12 @@ int bthread_setconcurrency(int num) {
         return 0;
     }
     if (bthread::FLAGS_bthread_concurrency != c->concurrency()) {
-        LOG(ERROR) << "CHECK failed: bthread_concurrency="
-                   << bthread::FLAGS_bthread_concurrency
-                   << " != tc_concurrency=" << c->concurrency();
+        // Fewer workers in the flag are expected when some were added by
+        // -bthread_adaptive_concurrency.
+        LOG_IF(ERROR, bthread::FLAGS_bthread_concurrency > c->concurrency())
+            << "CHECK failed: bthread_concurrency="
+            << bthread::FLAGS_bthread_concurrency
+            << " != tc_concurrency=" << c->concurrency();
         bthread::FLAGS_bthread_concurrency = c->concurrency();
     }
     if (num > bthread::FLAGS_bthread_concurrency) {
@@ -313,6 +368,87 @@ int bthread_setconcurrency(int num) {
     return (num == bthread::FLAGS_bthread_concurrency ? 0 : EPERM);
 }
 
+int bthread_getconcurrency_by_tag(bthread_tag_t tag) {
+    bthread::TaskControl* c = bthread::get_task_control();
+    if (c == NULL || tag < 0 || tag >= c->ntags()) {
+        return 0;
+    }
+    return c->concurrency(tag);
+}
+
+int bthread_setconcurrency_by_tag(int num, bthread_tag_t tag) {
+    if (tag < 0 || tag >= FLAGS_task_group_ntags) {
+        return EINVAL;
+    }
+    bthread::TaskControl* c = bthread::get_or_new_task_control();
+    if (c == NULL) {
+        return ENOMEM;
+    }
+    BAIDU_SCOPED_LOCK(bthread::g_task_control_mutex);
+    const int concurrency = c->concurrency(tag);
+    if (num < concurrency) {
+        return EPERM;
+    } else if (num == concurrency) {
+        return 0;
+    }
+    if (c->concurrency() + num - concurrency > BTHREAD_MAX_CONCURRENCY) {
+        LOG(ERROR) << "Invalid concurrency=" << num << " of tag=" << tag;
+        return EINVAL;
+    }
+    const int added = c->add_workers(num - concurrency, tag);
+    // Keep the flag as the total number of workers.
+    bthread::FLAGS_bthread_concurrency = c->concurrency();
+    return (added == num - concurrency ? 0 : EPERM);
+}
+
+bthread_tag_t bthread_self_tag(void) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    return (g != NULL ? g->tag() : BTHREAD_TAG_INVALID);
+}
+
+int64_t bthread_self_deadline_us(void) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g != NULL && !g->is_current_main_task()) {
+        return g->current_task()->deadline_us;
+    }
+    return -1;
+}
+
+int bthread_set_self_deadline_us(int64_t deadline_us) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL || g->is_current_main_task()) {
+        return EPERM;
+    }
+    g->current_task()->deadline_us = (deadline_us < 0 ? -1 : deadline_us);
+    return 0;
+}
+
+bthread_cpu_account_t* bthread_cpu_account_get(const char* name) {
+#ifndef BTHREAD_NO_SCHED_ACCOUNTING
+    return bthread::get_cpu_account(name);
+#else
+    (void)name;
+    return NULL;
+#endif
+}
+
+int bthread_set_self_cpu_account(bthread_cpu_account_t* account) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL || g->is_current_main_task()) {
+        return EPERM;
+    }
+    g->set_current_cpu_account(account);
+    return 0;
+}
+
+bthread_cpu_account_t* bthread_self_cpu_account(void) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL || g->is_current_main_task()) {
+        return NULL;
+    }
+    return g->current_task()->attr.cpu_account;
+}
+
 int bthread_about_to_quit() {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g != NULL) {
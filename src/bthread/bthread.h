@@ -146,6 +146,19 @@ extern int bthread_getconcurrency(void);
 // NOTE: currently concurrency cannot be reduced after any bthread created.
 extern int bthread_setconcurrency(int num);
 
+// Get number of worker pthreads in the pool of `tag', which is 0 before any
+// bthread is created or when `tag' is out of [0, -task_group_ntags).
+extern int bthread_getconcurrency_by_tag(bthread_tag_t tag);
+
+// Set number of worker pthreads in the pool of `tag' to `num'. Like
+// bthread_setconcurrency(), the concurrency cannot be reduced, and
+// -bthread_concurrency is updated to the total number of workers.
+extern int bthread_setconcurrency_by_tag(int num, bthread_tag_t tag);
+
+// Get tag of the pool that the calling worker belongs to, or
+// BTHREAD_TAG_INVALID if the caller is not a worker of bthread.
+extern bthread_tag_t bthread_self_tag(void);
+
 // Yield processor to another bthread. 
 // Notice that current implementation is not fair, which means that 
 // even if bthread_yield() is called, suspended threads may still starve.
@@ -19,6 +19,7 @@
 
 // Date: Tue Jul 22 17:30:12 CST 2014
 
+#include <gflags/gflags.h>
 #include "butil/atomicops.h"                // butil::atomic
 #include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
 #include "butil/macros.h"
@@ -56,6 +57,15 @@
 // of value to be reordered after it. Thus the value is visible to wait()
 // as well.
 
+DEFINE_bool(butex_batch_wake, true,
+            "Make bthreads woken up by butex_wake_all()/butex_wake_except() "
+            "runnable in a batch and signal workers once for all of them");
+DEFINE_int32(butex_wake_spread_size, 0,
+             "Spread bthreads woken up in a batch across groups in chunks of "
+             "so many (at most 64) bthreads, so that workers woken up take them "
+             "in parallel rather than contend on one runqueue. 0 means putting "
+             "all of them into one group");
+
 namespace bthread {
 
 #ifdef SHOW_BTHREAD_BUTEX_WAITER_COUNT_IN_VARS
@@ -100,6 +110,8 @@ struct ButexBthreadWaiter : public ButexWaiter {
     int expected_value;
     Butex* initial_butex;
     TaskControl* control;
+    // The waiter must be woken up in a group with this tag.
+    bthread_tag_t tag;
 };
 
 // pthread_task or main_task allocates this structure on stack and queue it
@@ -256,9 +268,11 @@ void butex_destroy(void* butex) {
     butil::return_object(b);
 }
 
-inline TaskGroup* get_task_group(TaskControl* c) {
+// Get a group to run bthreads with `tag', preferring the group of current
+// worker.
+inline TaskGroup* get_task_group(TaskControl* c, bthread_tag_t tag) {
     TaskGroup* g = tls_task_group;
-    return g ? g : c->choose_one_group();
+    return (g && g->tag() == tag) ? g : c->choose_one_group(tag);
 }
 
 int butex_wake(void* arg) {
@@ -280,14 +294,77 @@ int butex_wake(void* arg) {
     ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(front);
     unsleep_if_necessary(bbw, get_global_timer_thread());
     TaskGroup* g = tls_task_group;
-    if (g) {
+    if (g && g->tag() == bbw->tag) {
         TaskGroup::exchange(&g, bbw->tid);
     } else {
-        bbw->control->choose_one_group()->ready_to_run_remote(bbw->tid);
+        bbw->control->choose_one_group(bbw->tag)->ready_to_run_remote(bbw->tid);
     }
     return 1;
 }
 
+// Make all bthreads in `waiters' runnable, preferring group `g'.
+// Returns # of bthreads woken up.
+static int ready_to_run_waiters(ButexWaiterList* waiters, TaskGroup* g) {
+    int nwakeup = 0;
+    if (!FLAGS_butex_batch_wake) {
+        while (!waiters->empty()) {
+            // pop reversely
+            ButexBthreadWaiter* w = static_cast<ButexBthreadWaiter*>(
+                waiters->tail()->value());
+            w->RemoveFromList();
+            unsleep_if_necessary(w, get_global_timer_thread());
+            if (w->tag == g->tag()) {
+                g->ready_to_run_general(w->tid, true);
+            } else {
+                // Rare: waiters with different tags on the same butex.
+                get_task_group(w->control, w->tag)->ready_to_run_general(w->tid);
+            }
+            ++nwakeup;
+        }
+        if (nwakeup) {
+            g->flush_nosignal_tasks_general();
+        }
+        return nwakeup;
+    }
+    // Push waiters chunk by chunk so that the remote runqueue is locked once
+    // for each chunk, and workers are signalled once for the whole batch
+    // instead of once for each waiter.
+    const size_t MAX_CHUNK_SIZE = 64;
+    bthread_t tids[MAX_CHUNK_SIZE];
+    const int spread_size = FLAGS_butex_wake_spread_size;
+    const size_t chunk_size = (spread_size > 0 && (size_t)spread_size < MAX_CHUNK_SIZE)
+        ? spread_size : MAX_CHUNK_SIZE;
+    TaskGroup* target = g;
+    size_t ntid = 0;
+    size_t nunsignaled = 0;
+    while (!waiters->empty()) {
+        // pop reversely
+        ButexBthreadWaiter* w = static_cast<ButexBthreadWaiter*>(
+            waiters->tail()->value());
+        w->RemoveFromList();
+        unsleep_if_necessary(w, get_global_timer_thread());
+        ++nwakeup;
+        if (w->tag != g->tag()) {
+            // Rare: waiters with different tags on the same butex.
+            get_task_group(w->control, w->tag)->ready_to_run_general(w->tid);
+            continue;
+        }
+        tids[ntid++] = w->tid;
+        if (ntid == chunk_size) {
+            target->ready_to_run_batch(tids, ntid, &nunsignaled);
+            ntid = 0;
+            if (spread_size > 0) {
+                target = g->control()->choose_one_group(g->tag());
+            }
+        }
+    }
+    if (ntid) {
+        target->ready_to_run_batch(tids, ntid, &nunsignaled);
+    }
+    g->control()->signal_task_batch(nunsignaled, g->tag());
+    return nwakeup;
+}
+
 int butex_wake_all(void* arg) {
     Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
 
@@ -324,20 +401,8 @@ int butex_wake_all(void* arg) {
     next->RemoveFromList();
     unsleep_if_necessary(next, get_global_timer_thread());
     ++nwakeup;
-    TaskGroup* g = get_task_group(next->control);
-    const int saved_nwakeup = nwakeup;
-    while (!bthread_waiters.empty()) {
-        // pop reversely
-        ButexBthreadWaiter* w = static_cast<ButexBthreadWaiter*>(
-            bthread_waiters.tail()->value());
-        w->RemoveFromList();
-        unsleep_if_necessary(w, get_global_timer_thread());
-        g->ready_to_run_general(w->tid, true);
-        ++nwakeup;
-    }
-    if (saved_nwakeup != nwakeup) {
-        g->flush_nosignal_tasks_general();
-    }
+    TaskGroup* g = get_task_group(next->control, next->tag);
+    nwakeup += ready_to_run_waiters(&bthread_waiters, g);
     if (g == tls_task_group) {
         TaskGroup::exchange(&g, next->tid);
     } else {
@@ -391,20 +456,8 @@ int butex_wake_except(void* arg, bthread_t excluded_bthread) {
     ButexBthreadWaiter* front = static_cast<ButexBthreadWaiter*>(
                 bthread_waiters.head()->value());
 
-    TaskGroup* g = get_task_group(front->control);
-    const int saved_nwakeup = nwakeup;
-    do {
-        // pop reversely
-        ButexBthreadWaiter* w = static_cast<ButexBthreadWaiter*>(
-            bthread_waiters.tail()->value());
-        w->RemoveFromList();
-        unsleep_if_necessary(w, get_global_timer_thread());
-        g->ready_to_run_general(w->tid, true);
-        ++nwakeup;
-    } while (!bthread_waiters.empty());
-    if (saved_nwakeup != nwakeup) {
-        g->flush_nosignal_tasks_general();
-    }
+    TaskGroup* g = get_task_group(front->control, front->tag);
+    nwakeup += ready_to_run_waiters(&bthread_waiters, g);
     return nwakeup;
 }
 
@@ -440,10 +493,10 @@ int butex_requeue(void* arg, void* arg2) {
     ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(front);
     unsleep_if_necessary(bbw, get_global_timer_thread());
     TaskGroup* g = tls_task_group;
-    if (g) {
+    if (g && g->tag() == bbw->tag) {
         TaskGroup::exchange(&g, front->tid);
     } else {
-        bbw->control->choose_one_group()->ready_to_run_remote(front->tid);
+        bbw->control->choose_one_group(bbw->tag)->ready_to_run_remote(front->tid);
     }
     return 1;
 }
@@ -481,7 +534,7 @@ inline bool erase_from_butex(ButexWaiter* bw, bool wakeup, WaiterState state) {
     if (erased && wakeup) {
         if (bw->tid) {
             ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(bw);
-            get_task_group(bbw->control)->ready_to_run_general(bw->tid);
+            get_task_group(bbw->control, bbw->tag)->ready_to_run_general(bw->tid);
         } else {
             ButexPthreadWaiter* pw = static_cast<ButexPthreadWaiter*>(bw);
             wakeup_pthread(pw);
@@ -607,15 +660,8 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     return rc;
 }
 
-int butex_wait(void* arg, int expected_value, const timespec* abstime) {
-    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
-    if (b->value.load(butil::memory_order_relaxed) != expected_value) {
-        errno = EWOULDBLOCK;
-        // Sometimes we may take actions immediately after unmatched butex,
-        // this fence makes sure that we see changes before changing butex.
-        butil::atomic_thread_fence(butil::memory_order_acquire);
-        return -1;
-    }
+static int butex_wait_impl(Butex* b, int expected_value,
+                           const timespec* abstime) {
     TaskGroup* g = tls_task_group;
     if (NULL == g || g->is_current_pthread_task()) {
         return butex_wait_from_pthread(g, b, expected_value, abstime);
@@ -630,6 +676,7 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     bbw.expected_value = expected_value;
     bbw.initial_butex = b;
     bbw.control = g->control();
+    bbw.tag = g->tag();
 
     if (abstime != NULL) {
         // Schedule timer before queueing. If the timer is triggered before
@@ -692,6 +739,32 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     return 0;
 }
 
+int butex_wait(void* arg, int expected_value, const timespec* abstime,
+               ContentionKind kind) {
+    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
+    if (b->value.load(butil::memory_order_relaxed) != expected_value) {
+        errno = EWOULDBLOCK;
+        // Sometimes we may take actions immediately after unmatched butex,
+        // this fence makes sure that we see changes before changing butex.
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        return -1;
+    }
+    if (!is_contention_sampled()) {
+        return butex_wait_impl(b, expected_value, abstime);
+    }
+    ContentionSample sample;
+    start_contention_sample(kind, &sample);
+    const int rc = butex_wait_impl(b, expected_value, abstime);
+    const int saved_errno = errno;
+    end_contention_sample(&sample);
+    errno = saved_errno;
+    return rc;
+}
+
+int butex_wait(void* arg, int expected_value, const timespec* abstime) {
+    return butex_wait(arg, expected_value, abstime, CONTENTION_BUTEX);
+}
+
 }  // namespace bthread
 
 namespace butil {
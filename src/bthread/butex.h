@@ -26,6 +26,7 @@
 #include <time.h>                                // timespec
 #include "butil/macros.h"                         // BAIDU_CASSERT
 #include "bthread/types.h"                       // bthread_t
+#include "bthread/contention_sampler.h"          // ContentionKind
 
 namespace bthread {
 
@@ -70,6 +71,11 @@ int butex_requeue(void* butex1, void* butex2);
 // Returns 0 on success, -1 otherwise and errno is set.
 int butex_wait(void* butex, int expected_value, const timespec* abstime);
 
+// Same as above, but the waiting is sampled as contention of `kind' rather
+// than CONTENTION_BUTEX, see bthread/contention_sampler.h
+int butex_wait(void* butex, int expected_value, const timespec* abstime,
+               ContentionKind kind);
+
 }  // namespace bthread
 
 #endif  // BTHREAD_BUTEX_H
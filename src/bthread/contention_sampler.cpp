@@ -0,0 +1,262 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include <inttypes.h>                            // PRId64
+#include <pthread.h>
+#include <execinfo.h>                            // backtrace
+#include <algorithm>                             // std::sort
+#include <ostream>
+#include <vector>
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/file_util.h"                     // butil::ReadFileToString
+#include "butil/macros.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_printf.h"
+#include "butil/time.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "bvar/reducer.h"
+#include "bvar/passive_status.h"
+#include "bthread/contention_sampler.h"
+
+namespace bthread {
+
+DEFINE_int32(bthread_contention_sampling_interval, 1000,
+             "Sample one of so many contended lockings of bthread/pthread"
+             " mutexes and waitings on butexes on average, 0 to disable");
+
+// Max number of callsites kept, sites with less waiting time are replaced
+// when the table is full.
+const size_t MAX_CONTENTION_SITES = 256;
+// Number of sites shown in bvar `bthread_contention_top_sites'.
+const size_t TOP_CONTENTION_SITES_SHOWN = 10;
+// Skip start_contention_sample() which is always in the stack.
+const int SKIPPED_SAMPLE_FRAMES = 1;
+
+static const char* const s_contention_kind_names[] = {
+    "bthread_mutex", "pthread_mutex", "butex"
+};
+BAIDU_CASSERT(arraysize(s_contention_kind_names) == CONTENTION_KIND_COUNT,
+              must_match_contention_kinds);
+
+const char* contention_kind_name(ContentionKind kind) {
+    return s_contention_kind_names[kind];
+}
+
+// Contentions to skip before next sample in this thread. It's 0 before the
+// first contention of the thread, which makes the countdown negative and
+// the first contention not sampled.
+__thread int tls_contention_countdown = 0;
+// True when this thread is sampling, contentions inside sampling code
+// (backtrace, locking the table) are not sampled.
+static __thread bool tls_sampling_contention = false;
+
+struct ContentionSite {
+    uint64_t hash;
+    ContentionKind kind;
+    int nframes;
+    void* stack[CONTENTION_SAMPLE_MAX_FRAMES];
+    // Estimated from samples.
+    int64_t count;
+    int64_t wait_ns;
+};
+
+static bool greater_wait_ns(const ContentionSite& s1, const ContentionSite& s2) {
+    return s1.wait_ns > s2.wait_ns;
+}
+
+static void describe_top_contention_sites(std::ostream& os, void*);
+
+// Callsites of contentions with the most waiting time. When the table is
+// full, a new site replaces the one with the least waiting time and
+// inherits its counters(the Space-Saving algorithm), so that counters are
+// never under-estimated and frequent sites are hardly replaced by
+// infrequent ones.
+class ContentionSiteTable {
+public:
+    ContentionSiteTable()
+        : _nsite(0)
+        , _top_sites("bthread_contention_top_sites",
+                     describe_top_contention_sites, this) {
+        pthread_mutex_init(&_mutex, NULL);
+        for (int i = 0; i < CONTENTION_KIND_COUNT; ++i) {
+            const char* name = s_contention_kind_names[i];
+            _count[i].expose_as("bthread_contention",
+                                butil::string_printf("%s_count", name));
+            _wait_us[i].expose_as("bthread_contention",
+                                  butil::string_printf("%s_wait_us", name));
+        }
+    }
+
+    // `wait_ns' is the waiting time of the sampled contention, which
+    // represents `s.weight' contentions.
+    void add(const ContentionSample& s, int64_t wait_ns) {
+        wait_ns *= s.weight;
+        _count[s.kind] << s.weight;
+        _wait_us[s.kind] << wait_ns / 1000;
+
+        uint64_t hash[2];
+        butil::MurmurHash3_x64_128(s.stack, sizeof(void*) * s.nframes,
+                                   s.kind, hash);
+        BAIDU_SCOPED_LOCK(_mutex);
+        ContentionSite* min_site = NULL;
+        for (size_t i = 0; i < _nsite; ++i) {
+            ContentionSite& site = _sites[i];
+            if (site.hash == hash[0] && site.kind == s.kind) {
+                // Most contentions are caused by several hotspots, this
+                // should be the common branch.
+                site.count += s.weight;
+                site.wait_ns += wait_ns;
+                return;
+            }
+            if (min_site == NULL || site.wait_ns < min_site->wait_ns) {
+                min_site = &site;
+            }
+        }
+        ContentionSite* site = NULL;
+        if (_nsite < MAX_CONTENTION_SITES) {
+            site = &_sites[_nsite++];
+            site->count = 0;
+            site->wait_ns = 0;
+        } else {
+            site = min_site;
+        }
+        site->hash = hash[0];
+        site->kind = s.kind;
+        site->nframes = s.nframes;
+        memcpy(site->stack, s.stack, sizeof(void*) * s.nframes);
+        site->count += s.weight;
+        site->wait_ns += wait_ns;
+    }
+
+    // Copy sites sorted by waiting time in descending order.
+    void list(std::vector<ContentionSite>* sites) {
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            sites->assign(_sites, _sites + _nsite);
+        }
+        std::sort(sites->begin(), sites->end(), greater_wait_ns);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ContentionSiteTable);
+
+    pthread_mutex_t _mutex;
+    size_t _nsite;
+    ContentionSite _sites[MAX_CONTENTION_SITES];
+    bvar::Adder<int64_t> _count[CONTENTION_KIND_COUNT];
+    bvar::Adder<int64_t> _wait_us[CONTENTION_KIND_COUNT];
+    bvar::PassiveStatus<std::string> _top_sites;
+};
+
+static void describe_top_contention_sites(std::ostream& os, void* arg) {
+    std::vector<ContentionSite> sites;
+    static_cast<ContentionSiteTable*>(arg)->list(&sites);
+    for (size_t i = 0; i < sites.size() && i < TOP_CONTENTION_SITES_SHOWN; ++i) {
+        const ContentionSite& site = sites[i];
+        if (i) {
+            os << '\n';
+        }
+        os << s_contention_kind_names[site.kind]
+           << " wait_us=" << site.wait_ns / 1000
+           << " count=" << site.count << " @";
+        // Top frames are enough to tell the site in most cases, full
+        // stacks are in dump_sampled_contentions().
+        for (int j = SKIPPED_SAMPLE_FRAMES;
+             j < site.nframes && j < SKIPPED_SAMPLE_FRAMES + 4; ++j) {
+            os << ' ' << site.stack[j];
+        }
+    }
+}
+
+inline ContentionSiteTable* get_contention_site_table() {
+    return butil::get_leaky_singleton<ContentionSiteTable>();
+}
+
+// Create the table and expose the bvars before main(), not in the first
+// sampling which may be inside locks used by bvar.
+static ContentionSiteTable* ALLOW_UNUSED dummy_contention_site_table =
+    get_contention_site_table();
+
+bool reset_contention_countdown() {
+    const int interval = FLAGS_bthread_contention_sampling_interval;
+    if (interval <= 0) {
+        // Check the flag again later.
+        tls_contention_countdown = 1024;
+        return false;
+    }
+    if (tls_sampling_contention) {
+        tls_contention_countdown = 1;
+        return false;
+    }
+    // Don't sample the first contention of the thread.
+    const bool sampled = (tls_contention_countdown == 0);
+    // Randomize the countdown to avoid sampling contentions in a same
+    // pattern. The average is still `interval'.
+    tls_contention_countdown = 1 + butil::fast_rand_less_than(2 * interval - 1);
+    return sampled;
+}
+
+bool is_contention_sampled() {
+    if (--tls_contention_countdown > 0) {
+        return false;
+    }
+    return reset_contention_countdown();
+}
+
+void start_contention_sample(ContentionKind kind, ContentionSample* s) {
+    tls_sampling_contention = true;
+    s->kind = kind;
+    s->weight = std::max(FLAGS_bthread_contention_sampling_interval, 1);
+    s->nframes = backtrace(s->stack, arraysize(s->stack)); // may lock
+    tls_sampling_contention = false;
+    s->start_ns = butil::cpuwide_time_ns();
+}
+
+void end_contention_sample(ContentionSample* s) {
+    const int64_t wait_ns = butil::cpuwide_time_ns() - s->start_ns;
+    tls_sampling_contention = true;
+    get_contention_site_table()->add(*s, wait_ns);
+    tls_sampling_contention = false;
+}
+
+void dump_sampled_contentions(std::string* out) {
+    std::vector<ContentionSite> sites;
+    get_contention_site_table()->list(&sites);
+    // Already output nanoseconds, always set cycles/second to 1000000000.
+    out->assign("--- contention\ncycles/second=1000000000\n");
+    for (size_t i = 0; i < sites.size(); ++i) {
+        const ContentionSite& site = sites[i];
+        butil::string_appendf(out, "%" PRId64 " %" PRId64 " @",
+                              site.wait_ns, site.count);
+        for (int j = SKIPPED_SAMPLE_FRAMES; j < site.nframes; ++j) {
+            butil::string_appendf(out, " %p", site.stack[j]);
+        }
+        out->push_back('\n');
+    }
+    // Append /proc/self/maps to the end, required by pprof.pl, otherwise
+    // the functions in sys libs are not interpreted.
+    std::string maps;
+    if (butil::ReadFileToString(butil::FilePath("/proc/self/maps"), &maps)) {
+        out->append(maps);
+    }
+}
+
+}  // namespace bthread
@@ -0,0 +1,87 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_CONTENTION_SAMPLER_H
+#define BTHREAD_CONTENTION_SAMPLER_H
+
+#include <stdint.h>
+#include <string>
+
+// Always-on sampling of contentions, which is much cheaper than the
+// contention profiler (ContentionProfilerStart) and can be scraped at any
+// time: One of -bthread_contention_sampling_interval contended lockings of
+// bthread_mutex_t and pthread_mutex_t(including butil::Mutex) and waitings
+// on butexes is sampled on average. The callsites of samples are aggregated
+// by hash of their stacks into a bounded table which keeps sites with the
+// most waiting time, exposed as following bvars:
+//   bthread_contention_<kind>_count    estimated number of contentions
+//   bthread_contention_<kind>_wait_us  estimated waiting time
+//   bthread_contention_top_sites       sites with the most waiting time
+// and dumped in the format of pprof by dump_sampled_contentions().
+
+namespace bthread {
+
+enum ContentionKind {
+    CONTENTION_BTHREAD_MUTEX = 0,
+    CONTENTION_PTHREAD_MUTEX = 1,
+    CONTENTION_BUTEX = 2,
+    CONTENTION_KIND_COUNT
+};
+
+// Name of the kind used in names of bvars.
+const char* contention_kind_name(ContentionKind kind);
+
+const int CONTENTION_SAMPLE_MAX_FRAMES = 26;
+
+// A contention being sampled.
+struct ContentionSample {
+    ContentionKind kind;
+    int weight;         // number of contentions represented by this sample
+    int nframes;        // #elements in stack
+    int64_t start_ns;
+    void* stack[CONTENTION_SAMPLE_MAX_FRAMES];
+};
+
+// Returns true if the contention about to block should be sampled, one of
+// -bthread_contention_sampling_interval calls returns true on average.
+bool is_contention_sampled();
+
+// Contentions to skip before next sample in this thread, for inlining
+// is_contention_sampled() in hot paths like pthread_mutex_lock():
+//   if (--tls_contention_countdown > 0) return false;
+//   return reset_contention_countdown();
+extern __thread int tls_contention_countdown;
+
+// Reset the countdown and returns true if current contention is sampled.
+bool reset_contention_countdown();
+
+// Record the callsite and the start time of a sampled contention.
+// end_contention_sample() must be called after the blocking.
+void start_contention_sample(ContentionKind kind, ContentionSample* s);
+
+// Aggregate the sample into the table of callsites.
+void end_contention_sample(ContentionSample* s);
+
+// Write the aggregated samples into `out' in the format of pprof contention
+// profiles, which can be viewed by `pprof --contention <binary> <file>'.
+void dump_sampled_contentions(std::string* out);
+
+}  // namespace bthread
+
+#endif  // BTHREAD_CONTENTION_SAMPLER_H
@@ -0,0 +1,466 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+// C++20 coroutines running in bthread workers. A suspended coroutine only
+// occupies its frame rather than a bthread stack, so a program can wait for
+// a large number of timers or RPCs (see brpc/coroutine.h) concurrently with
+// little memory.
+//
+//   bthread::Awaitable<int> Foo() {
+//       co_await bthread::sleep_for(1000);
+//       co_return 1;
+//   }
+//   bthread::Awaitable<void> Bar() {
+//       int v = co_await Foo();
+//       ...
+//   }
+//   bthread::spawn(Bar());                   // run in background.
+//   int v = bthread::sync_wait(Foo());       // block until Foo() finishes.
+//
+// A coroutine is resumed in the bthread triggering the resumption when that
+// bthread has the same tag with the bthread suspending the coroutine,
+// otherwise in a new bthread (e.g. when being resumed by the timer thread).
+//
+// This header is only available to code compiled with -std=c++20 or above,
+// the library itself does not depend on it.
+
+#ifndef BTHREAD_COROUTINE_H
+#define BTHREAD_COROUTINE_H
+
+#if !defined(__cpp_impl_coroutine)
+#error "bthread/coroutine.h requires C++20 coroutines (e.g. -std=c++20)"
+#endif
+
+#include <coroutine>
+#include <exception>                            // std::exception_ptr
+#include <optional>
+#include <utility>                              // std::move
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"                   // bthread_timer_add
+#include "bthread/countdown_event.h"
+
+namespace bthread {
+
+template <typename T> class Awaitable;
+
+namespace detail {
+
+inline void* run_coroutine(void* arg) {
+    std::coroutine_handle<>::from_address(arg).resume();
+    return NULL;
+}
+
+// Resume `h' in a new bthread with `tag'.
+inline void resume_in_new_bthread(std::coroutine_handle<> h,
+                                  bthread_tag_t tag) {
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = tag;
+    bthread_t th;
+    if (bthread_start_background(&th, &attr, run_coroutine, h.address()) != 0) {
+        h.resume();
+    }
+}
+
+// Resume `h' in the calling bthread if it has `tag', otherwise in a new
+// bthread with `tag'.
+inline void resume_in_bthread(std::coroutine_handle<> h, bthread_tag_t tag) {
+    if (bthread_self() != INVALID_BTHREAD &&
+        (tag == BTHREAD_TAG_INVALID || tag == bthread_self_tag())) {
+        h.resume();
+    } else {
+        resume_in_new_bthread(h, tag);
+    }
+}
+
+class PromiseBase {
+public:
+    PromiseBase() : _detached(false) {}
+
+    // Coroutines are lazy, they start when being awaited or spawned.
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<P> h) const noexcept {
+            PromiseBase& p = h.promise();
+            const std::coroutine_handle<> next = p._continuation;
+            if (p._detached) {
+                h.destroy();
+            }
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+    // Resume the awaiting coroutine, if any.
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+
+    void unhandled_exception() {
+        if (_detached) {
+            // Nobody gets the exception, log it rather than terminating
+            // the program.
+            try {
+                throw;
+            } catch (const std::exception& e) {
+                LOG(ERROR) << "Exception escaped from a spawned coroutine: "
+                           << e.what();
+            } catch (...) {
+                LOG(ERROR) << "Unknown exception escaped from a spawned coroutine";
+            }
+            return;
+        }
+        _exception = std::current_exception();
+    }
+
+    void set_continuation(std::coroutine_handle<> h) { _continuation = h; }
+    void set_detached() { _detached = true; }
+
+protected:
+    void rethrow_if_failed() {
+        if (_exception) {
+            std::rethrow_exception(_exception);
+        }
+    }
+
+private:
+    std::coroutine_handle<> _continuation;
+    bool _detached;
+    std::exception_ptr _exception;
+};
+
+template <typename T>
+class Promise : public PromiseBase {
+public:
+    Awaitable<T> get_return_object();
+
+    template <typename U>
+    void return_value(U&& value) { _value.emplace(std::forward<U>(value)); }
+
+    T result() {
+        rethrow_if_failed();
+        return std::move(*_value);
+    }
+
+private:
+    std::optional<T> _value;
+};
+
+template <>
+class Promise<void> : public PromiseBase {
+public:
+    Awaitable<void> get_return_object();
+    void return_void() {}
+    void result() { rethrow_if_failed(); }
+};
+
+// Let the frame of `aw' destroy itself after finishing.
+inline std::coroutine_handle<> detach(Awaitable<void>&& aw);
+
+}  // namespace detail
+
+// Return type of coroutines returning T. Awaiting an Awaitable starts the
+// coroutine and resumes the awaiting one after it finishes. The coroutine
+// frame is destroyed along with the Awaitable.
+template <typename T>
+class Awaitable {
+public:
+    typedef detail::Promise<T> promise_type;
+
+    Awaitable(Awaitable&& rhs) noexcept : _h(rhs._h) { rhs._h = nullptr; }
+    Awaitable& operator=(Awaitable&& rhs) noexcept {
+        if (this != &rhs) {
+            if (_h) {
+                _h.destroy();
+            }
+            _h = rhs._h;
+            rhs._h = nullptr;
+        }
+        return *this;
+    }
+    ~Awaitable() {
+        if (_h) {
+            _h.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> caller) noexcept {
+        _h.promise().set_continuation(caller);
+        return _h;
+    }
+    T await_resume() { return _h.promise().result(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Awaitable);
+    friend class detail::Promise<T>;
+    friend std::coroutine_handle<> detail::detach(Awaitable<void>&&);
+
+    explicit Awaitable(std::coroutine_handle<promise_type> h) : _h(h) {}
+
+    std::coroutine_handle<promise_type> _h;
+};
+
+namespace detail {
+
+template <typename T>
+inline Awaitable<T> Promise<T>::get_return_object() {
+    return Awaitable<T>(
+        std::coroutine_handle<Promise<T> >::from_promise(*this));
+}
+
+inline Awaitable<void> Promise<void>::get_return_object() {
+    return Awaitable<void>(
+        std::coroutine_handle<Promise<void> >::from_promise(*this));
+}
+
+inline std::coroutine_handle<> detach(Awaitable<void>&& aw) {
+    std::coroutine_handle<Promise<void> > h = aw._h;
+    aw._h = nullptr;
+    h.promise().set_detached();
+    return h;
+}
+
+}  // namespace detail
+
+// Run the coroutine in a new bthread in background. The coroutine frame is
+// destroyed after it finishes. Exceptions thrown by the coroutine are logged.
+inline void spawn(Awaitable<void> aw) {
+    detail::resume_in_new_bthread(detail::detach(std::move(aw)),
+                                  bthread_self_tag());
+}
+
+namespace detail {
+
+template <typename T>
+Awaitable<void> signal_after(Awaitable<T> aw, std::optional<T>* value,
+                             std::exception_ptr* error,
+                             CountdownEvent* event) {
+    try {
+        value->emplace(co_await aw);
+    } catch (...) {
+        *error = std::current_exception();
+    }
+    event->signal();
+}
+
+inline Awaitable<void> signal_after(Awaitable<void> aw, std::optional<int>*,
+                                    std::exception_ptr* error,
+                                    CountdownEvent* event) {
+    try {
+        co_await aw;
+    } catch (...) {
+        *error = std::current_exception();
+    }
+    event->signal();
+}
+
+}  // namespace detail
+
+// Run the coroutine and block the calling bthread or pthread until it
+// finishes. Returns what the coroutine returns.
+template <typename T>
+T sync_wait(Awaitable<T> aw) {
+    typedef typename std::conditional<
+        std::is_void<T>::value, int, T>::type ValueType;
+    std::optional<ValueType> value;
+    std::exception_ptr error;
+    CountdownEvent event(1);
+    spawn(detail::signal_after(std::move(aw), &value, &error, &event));
+    event.wait();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if constexpr (!std::is_void<T>::value) {
+        return std::move(*value);
+    }
+}
+
+// co_await sleep_for(us) suspends the calling coroutine for `us'
+// microseconds without occupying a bthread. Destroying the suspended
+// coroutine cancels the sleep.
+class SleepAwaiter {
+public:
+    explicit SleepAwaiter(int64_t microseconds)
+        : _abstime(butil::microseconds_from_now(microseconds))
+        , _tag(BTHREAD_TAG_INVALID)
+        , _timer(0)
+        , _pending(false) {}
+
+    ~SleepAwaiter() {
+        // The coroutine is destroyed before being woken up, don't let the
+        // timer resume it.
+        if (_pending) {
+            bthread_timer_del(_timer);
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        _h = h;
+        _tag = bthread_self_tag();
+        // Set before adding the timer which may resume the coroutine at once.
+        _pending = true;
+        if (bthread_timer_add(&_timer, _abstime, on_timer, this) != 0) {
+            // Not suspended if the timer can't be added.
+            _pending = false;
+            return false;
+        }
+        return true;
+    }
+    void await_resume() noexcept { _pending = false; }
+
+private:
+    // Run in the timer thread.
+    static void on_timer(void* arg) {
+        SleepAwaiter* a = static_cast<SleepAwaiter*>(arg);
+        detail::resume_in_new_bthread(a->_h, a->_tag);
+    }
+
+    timespec _abstime;
+    bthread_tag_t _tag;
+    bthread_timer_t _timer;
+    bool _pending;
+    std::coroutine_handle<> _h;
+};
+
+inline SleepAwaiter sleep_for(int64_t microseconds) {
+    return SleepAwaiter(microseconds);
+}
+
+// co_await wait(&event) suspends the calling coroutine until the counter of
+// `event' reaches 0 and returns what CountdownEvent::wait() returns.
+// NOTE: The waiting is done by a bthread with a small stack, prefer when_all()
+// to wait for other coroutines.
+class EventAwaiter {
+public:
+    explicit EventAwaiter(CountdownEvent* event)
+        : _event(event), _tag(BTHREAD_TAG_INVALID), _rc(0) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        _h = h;
+        _tag = bthread_self_tag();
+        bthread_attr_t attr = BTHREAD_ATTR_SMALL;
+        attr.tag = _tag;
+        bthread_t th;
+        if (bthread_start_background(&th, &attr, wait_event, this) != 0) {
+            _rc = _event->wait();
+            return false;
+        }
+        return true;
+    }
+    int await_resume() const noexcept { return _rc; }
+
+private:
+    static void* wait_event(void* arg) {
+        EventAwaiter* a = static_cast<EventAwaiter*>(arg);
+        a->_rc = a->_event->wait();
+        // Don't run the coroutine on the small stack.
+        detail::resume_in_new_bthread(a->_h, a->_tag);
+        return NULL;
+    }
+
+    CountdownEvent* _event;
+    bthread_tag_t _tag;
+    int _rc;
+    std::coroutine_handle<> _h;
+};
+
+inline EventAwaiter wait(CountdownEvent* event) {
+    return EventAwaiter(event);
+}
+
+namespace detail {
+
+struct WhenAllState {
+    butil::atomic<size_t> nleft;
+    butil::atomic<bool> failed;
+    // The first exception thrown by the coroutines.
+    std::exception_ptr error;
+    std::coroutine_handle<> parent;
+    bthread_tag_t tag;
+};
+
+inline Awaitable<void> count_down_after(Awaitable<void> aw, WhenAllState* s) {
+    try {
+        co_await aw;
+    } catch (...) {
+        if (!s->failed.exchange(true, butil::memory_order_relaxed)) {
+            // Visible to the parent by the release of `nleft' below.
+            s->error = std::current_exception();
+        }
+    }
+    if (s->nleft.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+        // *s is probably destroyed by the parent since now.
+        resume_in_bthread(s->parent, s->tag);
+    }
+}
+
+}  // namespace detail
+
+// co_await when_all(std::move(coroutines)) runs all `coroutines'
+// concurrently and resumes the caller after all of them finish, e.g. to
+// issue a lot of RPCs in parallel. If any of the coroutines throws, the first
+// exception is rethrown to the caller after all coroutines finish.
+class WhenAllAwaiter {
+public:
+    explicit WhenAllAwaiter(std::vector<Awaitable<void> >&& coroutines)
+        : _coroutines(std::move(coroutines)) {}
+
+    bool await_ready() const noexcept { return _coroutines.empty(); }
+    bool await_suspend(std::coroutine_handle<> h) {
+        // One more count to prevent the parent from being resumed before
+        // all coroutines start.
+        _state.nleft.store(_coroutines.size() + 1, butil::memory_order_relaxed);
+        _state.failed.store(false, butil::memory_order_relaxed);
+        _state.parent = h;
+        _state.tag = bthread_self_tag();
+        for (size_t i = 0; i < _coroutines.size(); ++i) {
+            // Run until the first suspension in place.
+            detail::detach(detail::count_down_after(
+                               std::move(_coroutines[i]), &_state)).resume();
+        }
+        _coroutines.clear();
+        return _state.nleft.fetch_sub(1, butil::memory_order_acq_rel) != 1;
+    }
+    void await_resume() const {
+        if (_state.error) {
+            std::rethrow_exception(_state.error);
+        }
+    }
+
+private:
+    std::vector<Awaitable<void> > _coroutines;
+    detail::WhenAllState _state;
+};
+
+inline WhenAllAwaiter when_all(std::vector<Awaitable<void> > coroutines) {
+    return WhenAllAwaiter(std::move(coroutines));
+}
+
+}  // namespace bthread
+
+#endif  // BTHREAD_COROUTINE_H
@@ -0,0 +1,70 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include <map>
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/synchronization/lock.h"
+#include "bthread/cpu_account.h"
+
+static double get_cumulated_cputime(void* arg) {
+    return static_cast<bthread_cpu_account*>(arg)->cputime_ns.get_value()
+        / 1000000000.0;
+}
+
+bthread_cpu_account::bthread_cpu_account(const std::string& name2)
+    : name(name2)
+    , cumulated_cputime(get_cumulated_cputime, this)
+    , cpu_usage(&cumulated_cputime, 1) {
+    cpu_usage.expose_as("bthread_cpu_usage", name);
+}
+
+namespace bthread {
+
+struct CpuAccountMap {
+    butil::Mutex mutex;
+    std::map<std::string, bthread_cpu_account*> accounts;
+};
+
+static CpuAccountMap* get_cpu_account_map() {
+    return butil::get_leaky_singleton<CpuAccountMap>();
+}
+
+bthread_cpu_account_t* get_cpu_account(const std::string& name) {
+    CpuAccountMap* m = get_cpu_account_map();
+    BAIDU_SCOPED_LOCK(m->mutex);
+    bthread_cpu_account*& account = m->accounts[name];
+    if (account == NULL) {
+        account = new bthread_cpu_account(name);
+    }
+    return account;
+}
+
+void print_cpu_accounts(std::ostream& os) {
+    CpuAccountMap* m = get_cpu_account_map();
+    BAIDU_SCOPED_LOCK(m->mutex);
+    for (std::map<std::string, bthread_cpu_account*>::const_iterator
+             it = m->accounts.begin(); it != m->accounts.end(); ++it) {
+        const bthread_cpu_account* a = it->second;
+        os << a->name << " : cpu_usage=" << a->cpu_usage.get_value(1)
+           << " cputime_ms=" << a->cputime_ns.get_value() / 1000000
+           << " attaches=" << a->nattach.get_value() << '\n';
+    }
+}
+
+}  // namespace bthread
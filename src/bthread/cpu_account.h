@@ -0,0 +1,55 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_CPU_ACCOUNT_H
+#define BTHREAD_CPU_ACCOUNT_H
+
+#include <ostream>
+#include <string>
+#include "bvar/reducer.h"
+#include "bvar/passive_status.h"
+#include "bvar/window.h"
+#include "bthread/types.h"
+
+// Cpu time of bthreads accounted under the same name, e.g. bthreads running
+// the same method.
+struct bthread_cpu_account {
+    explicit bthread_cpu_account(const std::string& name);
+
+    const std::string name;
+    bvar::Adder<int64_t> cputime_ns;
+    // Times that bthreads are created with or switched to the account, a
+    // bthread switching to the account repeatedly is counted repeatedly.
+    bvar::Adder<int64_t> nattach;
+    bvar::PassiveStatus<double> cumulated_cputime;
+    // Exposed as bthread_cpu_usage_<name>
+    bvar::PerSecond<bvar::PassiveStatus<double> > cpu_usage;
+};
+
+namespace bthread {
+
+// Get or create the account named `name'. Accounts are never destroyed.
+bthread_cpu_account_t* get_cpu_account(const std::string& name);
+
+// Print cpu usages of all accounts.
+void print_cpu_accounts(std::ostream& os);
+
+}  // namespace bthread
+
+#endif  // BTHREAD_CPU_ACCOUNT_H
@@ -0,0 +1,486 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>                            // setitimer
+#include <ucontext.h>
+#include <unistd.h>
+#include <algorithm>                             // std::max
+#include <deque>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/build_config.h"                 // OS_LINUX
+#include "butil/containers/flat_map.h"
+#include "butil/file_util.h"                     // butil::ReadFileToString
+#include "butil/logging.h"
+#include "butil/macros.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/scoped_lock.h"
+#include "butil/time.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "bvar/passive_status.h"
+#include "bthread/cpu_account.h"
+#include "bthread/task_group.h"
+#include "bthread/cpu_sampler.h"
+
+namespace bthread {
+
+extern __thread TaskGroup* tls_task_group;
+
+DEFINE_int32(bthread_cpu_sampling_hz, 0,
+             "Sample running stacks so many times per cpu-second by SIGPROF, "
+             "0 to disable. Don't set to a high value, this is for always-on "
+             "sampling rather than precise profiling");
+DEFINE_int32(bthread_cpu_sampling_minutes, 60,
+             "Keep samples of so many latest minutes");
+
+const int CPU_SAMPLE_MAX_FRAMES = 32;
+// Power of 2. Samples are moved out every CPU_SAMPLE_COLLECT_INTERVAL_US,
+// enough for hundreds of busy cpus at ~20Hz.
+const uint64_t CPU_SAMPLE_BUFFER_SIZE = 1024;
+const int64_t CPU_SAMPLE_COLLECT_INTERVAL_US = 200000L;
+// Max number of distinct stacks in a minute, more are dropped.
+const size_t MAX_SAMPLED_STACKS_PER_MINUTE = 4096;
+// Frames larger than this are treated as broken links of frame pointers.
+const uintptr_t MAX_SAMPLED_FRAME_SIZE = 1024 * 1024;
+
+// Slot of the bounded MPSC queue written by the signal handler, `seq' tells
+// whether the slot is writable(seq == pos) or readable(seq == pos + 1).
+struct CpuSampleSlot {
+    butil::atomic<uint64_t> seq;
+    bthread_cpu_account_t* account;
+    int nframes;
+    void* stack[CPU_SAMPLE_MAX_FRAMES];
+};
+
+static CpuSampleSlot s_slots[CPU_SAMPLE_BUFFER_SIZE];
+static butil::atomic<uint64_t> s_enqueue_pos(0);
+static butil::atomic<int64_t> s_ndropped(0);
+// Only read by the collector.
+static uint64_t s_dequeue_pos = 0;
+
+// Stack of the pthread, set by register_cpu_sampled_thread() rather than in
+// the signal handler since pthread_getattr_np() is not async-signal-safe.
+static __thread uintptr_t tls_pthread_stack_low = 0;
+static __thread uintptr_t tls_pthread_stack_high = 0;
+
+// Walk frame pointers from the interrupted context, which requires code to be
+// compiled with -fno-omit-frame-pointer as brpc does, frames of code without
+// frame pointers are skipped or end the walk. Links are validated like
+// gperftools does: frames must be aligned, strictly increasing and not too
+// large, and must be inside the stack of the running bthread or the stack of
+// the pthread registered by register_cpu_sampled_thread(). Only the pc is
+// recorded when the stack is unknown.
+// Async-signal-safe.
+static int walk_frame_pointers(const void* context, void** stack, int max_depth) {
+#if defined(OS_LINUX) && defined(__x86_64__)
+    const mcontext_t& mc = static_cast<const ucontext_t*>(context)->uc_mcontext;
+    const uintptr_t pc = mc.gregs[REG_RIP];
+    uintptr_t fp = mc.gregs[REG_RBP];
+    const uintptr_t sp = mc.gregs[REG_RSP];
+#elif defined(OS_LINUX) && defined(__aarch64__)
+    const mcontext_t& mc = static_cast<const ucontext_t*>(context)->uc_mcontext;
+    const uintptr_t pc = mc.pc;
+    uintptr_t fp = mc.regs[29];
+    const uintptr_t sp = mc.sp;
+#else
+    const uintptr_t pc = 0;
+    uintptr_t fp = 0;
+    const uintptr_t sp = 0;
+#endif
+    if (pc == 0) {
+        return 0;
+    }
+    uintptr_t low = sp;
+    uintptr_t high = 0;
+    TaskGroup* g = tls_task_group;
+    if (g != NULL) {
+        const ContextualStack* cs = g->current_task()->stack;
+        if (cs != NULL && cs->storage.bottom != NULL) {
+            const uintptr_t bottom = (uintptr_t)cs->storage.bottom;
+            if (sp < bottom && sp >= bottom - cs->storage.stacksize) {
+                high = bottom;
+            }
+        }
+    }
+    if (high == 0 && sp >= tls_pthread_stack_low &&
+        sp < tls_pthread_stack_high) {
+        high = tls_pthread_stack_high;
+    }
+    stack[0] = (void*)pc;
+    int n = 1;
+    while (n < max_depth) {
+        if (fp < low || fp + 2 * sizeof(void*) > high ||
+            (fp & (sizeof(void*) - 1)) != 0) {
+            break;
+        }
+        // [caller's frame pointer, return address]
+        const uintptr_t* frame = reinterpret_cast<const uintptr_t*>(fp);
+        const uintptr_t next = frame[0];
+        if (frame[1] == 0) {
+            break;
+        }
+        stack[n++] = (void*)frame[1];
+        if (next <= fp || next - fp > MAX_SAMPLED_FRAME_SIZE) {
+            break;
+        }
+        low = fp;
+        fp = next;
+    }
+    return n;
+}
+
+static bthread_cpu_account_t* current_cpu_account() {
+    TaskGroup* g = tls_task_group;
+    if (g == NULL) {
+        return NULL;
+    }
+    return g->current_task()->attr.cpu_account;
+}
+
+static void handle_sigprof(int, siginfo_t*, void* context) {
+    const int saved_errno = errno;
+    uint64_t pos = s_enqueue_pos.load(butil::memory_order_relaxed);
+    CpuSampleSlot* slot = NULL;
+    while (true) {
+        slot = &s_slots[pos & (CPU_SAMPLE_BUFFER_SIZE - 1)];
+        const uint64_t seq = slot->seq.load(butil::memory_order_acquire);
+        const int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (s_enqueue_pos.compare_exchange_weak(
+                    pos, pos + 1, butil::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The collector falls behind.
+            s_ndropped.fetch_add(1, butil::memory_order_relaxed);
+            errno = saved_errno;
+            return;
+        } else {
+            pos = s_enqueue_pos.load(butil::memory_order_relaxed);
+        }
+    }
+    slot->account = current_cpu_account();
+    slot->nframes = walk_frame_pointers(context, slot->stack,
+                                        CPU_SAMPLE_MAX_FRAMES);
+    slot->seq.store(pos + 1, butil::memory_order_release);
+    errno = saved_errno;
+}
+
+struct SampledStack {
+    bthread_cpu_account_t* account;
+    int64_t count;
+    int nframes;
+    void* stack[CPU_SAMPLE_MAX_FRAMES];
+};
+
+struct MinuteSamples {
+    int64_t minute;  // since epoch
+    butil::FlatMap<uint64_t, SampledStack> stacks;
+};
+
+static int64_t get_sampled_count(void*) {
+    return (int64_t)s_enqueue_pos.load(butil::memory_order_relaxed);
+}
+
+static int64_t get_dropped_count(void*) {
+    return s_ndropped.load(butil::memory_order_relaxed);
+}
+
+static void* run_cpu_sample_collector(void* arg);
+
+// Collects samples from the queue into tables of minutes, and switches the
+// timer and the signal handler.
+class CpuSampleStore {
+public:
+    CpuSampleStore()
+        : _hz(0)
+        , _nsuspended(0)
+        , _timer_on(false)
+        , _collector_started(false)
+        , _period_us(0)
+        , _count("bthread_cpu_sample_count", get_sampled_count, NULL)
+        , _dropped("bthread_cpu_sample_dropped", get_dropped_count, NULL) {
+        pthread_mutex_init(&_mutex, NULL);
+        for (uint64_t i = 0; i < CPU_SAMPLE_BUFFER_SIZE; ++i) {
+            s_slots[i].seq.store(i, butil::memory_order_relaxed);
+        }
+    }
+
+    void set_hz(int hz) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _hz = hz;
+        update_timer();
+    }
+
+    void suspend() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        ++_nsuspended;
+        update_timer();
+    }
+
+    void resume() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_nsuspended > 0) {
+            --_nsuspended;
+        }
+        update_timer();
+    }
+
+    void collect() {
+        const int64_t minute = butil::gettimeofday_s() / 60;
+        BAIDU_SCOPED_LOCK(_mutex);
+        while (true) {
+            CpuSampleSlot* slot =
+                &s_slots[s_dequeue_pos & (CPU_SAMPLE_BUFFER_SIZE - 1)];
+            if (slot->seq.load(butil::memory_order_acquire) != s_dequeue_pos + 1) {
+                break;
+            }
+            add(minute, *slot);
+            slot->seq.store(s_dequeue_pos + CPU_SAMPLE_BUFFER_SIZE,
+                            butil::memory_order_release);
+            ++s_dequeue_pos;
+        }
+        const size_t max_minutes = std::max(FLAGS_bthread_cpu_sampling_minutes, 1);
+        while (_minutes.size() > max_minutes) {
+            delete _minutes.front();
+            _minutes.pop_front();
+        }
+    }
+
+    int64_t dump(int minutes, int ago, const char* account, std::string* out) {
+        collect();
+        const int64_t last = butil::gettimeofday_s() / 60 - std::max(ago, 0);
+        const int64_t first = last - std::max(minutes, 1) + 1;
+        // Header of cpu profiles of gperftools: 0, header words, version,
+        // sampling period in microseconds, padding.
+        out->clear();
+        int64_t nsample = 0;
+        BAIDU_SCOPED_LOCK(_mutex);
+        append_word(out, 0);
+        append_word(out, 3);
+        append_word(out, 0);
+        append_word(out, _period_us ? _period_us : 1000000 / 19);
+        append_word(out, 0);
+        for (size_t i = 0; i < _minutes.size(); ++i) {
+            const MinuteSamples* ms = _minutes[i];
+            if (ms->minute < first || ms->minute > last) {
+                continue;
+            }
+            for (butil::FlatMap<uint64_t, SampledStack>::const_iterator
+                     it = ms->stacks.begin(); it != ms->stacks.end(); ++it) {
+                const SampledStack& s = it->second;
+                if (account != NULL &&
+                    (s.account == NULL || s.account->name != account)) {
+                    continue;
+                }
+                // count, depth, pc...
+                append_word(out, s.count);
+                append_word(out, s.nframes);
+                for (int j = 0; j < s.nframes; ++j) {
+                    append_word(out, (uintptr_t)s.stack[j]);
+                }
+                nsample += s.count;
+            }
+        }
+        // Trailer.
+        append_word(out, 0);
+        append_word(out, 1);
+        append_word(out, 0);
+        // Append /proc/self/maps to the end, required by pprof.pl.
+        std::string maps;
+        if (butil::ReadFileToString(butil::FilePath("/proc/self/maps"), &maps)) {
+            out->append(maps);
+        }
+        return nsample;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CpuSampleStore);
+
+    static void append_word(std::string* out, uintptr_t word) {
+        out->append((const char*)&word, sizeof(word));
+    }
+
+    void add(int64_t minute, const CpuSampleSlot& slot) {
+        if (slot.nframes <= 0) {
+            return;
+        }
+        if (_minutes.empty() || _minutes.back()->minute < minute) {
+            MinuteSamples* ms = new MinuteSamples;
+            ms->minute = minute;
+            CHECK_EQ(0, ms->stacks.init(256));
+            _minutes.push_back(ms);
+        }
+        butil::FlatMap<uint64_t, SampledStack>& stacks = _minutes.back()->stacks;
+        uint64_t hash[2];
+        butil::MurmurHash3_x64_128(slot.stack, sizeof(void*) * slot.nframes,
+                                   0, hash);
+        const uint64_t key = hash[0] ^ (uint64_t)(uintptr_t)slot.account;
+        SampledStack* s = stacks.seek(key);
+        if (s == NULL) {
+            if (stacks.size() >= MAX_SAMPLED_STACKS_PER_MINUTE) {
+                s_ndropped.fetch_add(1, butil::memory_order_relaxed);
+                return;
+            }
+            s = &stacks[key];
+            s->account = slot.account;
+            s->count = 0;
+            s->nframes = slot.nframes;
+            memcpy(s->stack, slot.stack, sizeof(void*) * slot.nframes);
+        } else if (s->account != slot.account || s->nframes != slot.nframes ||
+                   memcmp(s->stack, slot.stack,
+                          sizeof(void*) * slot.nframes) != 0) {
+            // Hash collision, rare enough to be dropped.
+            s_ndropped.fetch_add(1, butil::memory_order_relaxed);
+            return;
+        }
+        ++s->count;
+    }
+
+    // Apply _hz and _nsuspended, called with _mutex held.
+    void update_timer() {
+        const int hz = (_nsuspended ? 0 : _hz);
+        if (hz <= 0) {
+            if (_timer_on) {
+                // Keep the handler installed, a pending SIGPROF would
+                // terminate the process otherwise.
+                struct itimerval timer;
+                memset(&timer, 0, sizeof(timer));
+                setitimer(ITIMER_PROF, &timer, NULL);
+                _timer_on = false;
+            }
+            return;
+        }
+        if (!_collector_started) {
+            pthread_t th;
+            const int rc = pthread_create(&th, NULL, run_cpu_sample_collector, this);
+            if (rc != 0) {
+                LOG(ERROR) << "Fail to create collector of cpu samples: "
+                           << berror(rc);
+                return;
+            }
+            pthread_detach(th);
+            _collector_started = true;
+        }
+        // Always reinstall the handler which may be replaced by other
+        // profilers.
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = handle_sigprof;
+        sa.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, NULL) != 0) {
+            PLOG(ERROR) << "Fail to install handler of SIGPROF";
+            return;
+        }
+        _period_us = 1000000 / hz;
+        struct itimerval timer;
+        timer.it_interval.tv_sec = _period_us / 1000000;
+        timer.it_interval.tv_usec = _period_us % 1000000;
+        timer.it_value = timer.it_interval;
+        if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+            PLOG(ERROR) << "Fail to set ITIMER_PROF";
+            return;
+        }
+        _timer_on = true;
+    }
+
+    pthread_mutex_t _mutex;
+    int _hz;
+    int _nsuspended;
+    bool _timer_on;
+    bool _collector_started;
+    int64_t _period_us;
+    std::deque<MinuteSamples*> _minutes;
+    bvar::PassiveStatus<int64_t> _count;
+    bvar::PassiveStatus<int64_t> _dropped;
+};
+
+inline CpuSampleStore* get_cpu_sample_store() {
+    return butil::get_leaky_singleton<CpuSampleStore>();
+}
+
+// Expose the bvars before main().
+static CpuSampleStore* ALLOW_UNUSED dummy_cpu_sample_store =
+    get_cpu_sample_store();
+
+static void* run_cpu_sample_collector(void* arg) {
+    CpuSampleStore* store = static_cast<CpuSampleStore*>(arg);
+    while (true) {
+        usleep(CPU_SAMPLE_COLLECT_INTERVAL_US);
+        store->collect();
+    }
+    return NULL;
+}
+
+static bool validate_bthread_cpu_sampling_hz(const char*, int32_t hz) {
+    if (hz < 0 || hz > 1000) {
+        LOG(ERROR) << "Invalid bthread_cpu_sampling_hz=" << hz;
+        return false;
+    }
+    get_cpu_sample_store()->set_hz(hz);
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bthread_cpu_sampling_hz =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_cpu_sampling_hz,
+                                       validate_bthread_cpu_sampling_hz);
+
+static bool validate_bthread_cpu_sampling_minutes(const char*, int32_t v) {
+    return v > 0;
+}
+const bool ALLOW_UNUSED dummy_bthread_cpu_sampling_minutes =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_cpu_sampling_minutes,
+                                       validate_bthread_cpu_sampling_minutes);
+
+int64_t dump_sampled_cpu(int minutes, int ago, const char* account,
+                         std::string* out) {
+    return get_cpu_sample_store()->dump(minutes, ago, account, out);
+}
+
+void register_cpu_sampled_thread() {
+#if defined(OS_LINUX)
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return;
+    }
+    void* addr = NULL;
+    size_t size = 0;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        tls_pthread_stack_low = (uintptr_t)addr;
+        // The signal handler must not see the new high with the old low.
+        butil::atomic_signal_fence(butil::memory_order_seq_cst);
+        tls_pthread_stack_high = (uintptr_t)addr + size;
+    }
+    pthread_attr_destroy(&attr);
+#endif
+}
+
+void suspend_cpu_sampling() {
+    get_cpu_sample_store()->suspend();
+}
+
+void resume_cpu_sampling() {
+    get_cpu_sample_store()->resume();
+}
+
+}  // namespace bthread
@@ -0,0 +1,66 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_CPU_SAMPLER_H
+#define BTHREAD_CPU_SAMPLER_H
+
+#include <stdint.h>
+#include <string>
+
+// Always-on sampling of running stacks at a low frequency, which does not
+// depend on gperftools and can be scraped at any time: SIGPROF is raised
+// -bthread_cpu_sampling_hz times per cpu-second of the process (0 by
+// default, namely disabled, 19 is a good choice for production), the
+// handler walks frame pointers of the interrupted thread and tags the stack
+// with the cpu account(see bthread_cpu_account_get in unstable.h, namely
+// the method name of servers with -account_cpu_by_method) of the running
+// bthread. Samples are aggregated by stack and account into one table per
+// minute, tables of latest -bthread_cpu_sampling_minutes minutes are kept.
+// Exposed bvars:
+//   bthread_cpu_sample_count    number of samples taken
+//   bthread_cpu_sample_dropped  samples dropped because the buffer or the
+//                               table of the minute is full
+
+namespace bthread {
+
+// Write samples of `minutes' minutes ending `ago' minutes before the current
+// minute(which is partially sampled) into `out' in the format of pprof cpu
+// profiles, which can be viewed by `pprof <binary> <file>'. If `account' is
+// not NULL, only samples tagged with the account of the name are included.
+// Returns number of samples written.
+int64_t dump_sampled_cpu(int minutes, int ago, const char* account,
+                         std::string* out);
+
+// Let the sampler walk stacks of the calling pthread, which is done by
+// worker pthreads of bthread automatically. Only the interrupted pc is
+// recorded for samples of other pthreads, since frame pointers can't be
+// validated without knowing the range of the stack.
+void register_cpu_sampled_thread();
+
+// Stop sampling temporarily, for running another SIGPROF based profiler
+// (e.g. ProfilerStart of gperftools) which replaces the signal handler.
+// Calls can be nested.
+void suspend_cpu_sampling();
+
+// Undo suspend_cpu_sampling(), the signal handler is reinstalled.
+void resume_cpu_sampling();
+
+}  // namespace bthread
+
+#endif  // BTHREAD_CPU_SAMPLER_H
@@ -0,0 +1,88 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_DEADLINE_TASK_QUEUE_H
+#define BTHREAD_DEADLINE_TASK_QUEUE_H
+
+#include <algorithm>                          // std::push_heap
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/synchronization/lock.h"
+#include "bthread/types.h"
+
+namespace bthread {
+
+// A queue for storing bthreads started with deadlines, which are run before
+// other bthreads of the group in the order of deadlines (earliest first).
+// Bthreads with deadlines are much less than others generally, this queue is
+// simply implemented as a heap protected with a lock.
+class DeadlineTaskQueue {
+public:
+    DeadlineTaskQueue() : _size(0) {}
+
+    void push(bthread_t task, int64_t deadline_us) {
+        const Entry e = { deadline_us, task };
+        _mutex.lock();
+        _heap.push_back(e);
+        std::push_heap(_heap.begin(), _heap.end(), later);
+        _size.store(_heap.size(), butil::memory_order_relaxed);
+        _mutex.unlock();
+    }
+
+    // Pop the bthread with the earliest deadline.
+    bool pop(bthread_t* task, int64_t* deadline_us) {
+        if (_size.load(butil::memory_order_relaxed) == 0) {
+            return false;
+        }
+        _mutex.lock();
+        if (_heap.empty()) {
+            _mutex.unlock();
+            return false;
+        }
+        std::pop_heap(_heap.begin(), _heap.end(), later);
+        *task = _heap.back().task;
+        *deadline_us = _heap.back().deadline_us;
+        _heap.pop_back();
+        _size.store(_heap.size(), butil::memory_order_relaxed);
+        _mutex.unlock();
+        return true;
+    }
+
+    size_t size() const { return _size.load(butil::memory_order_relaxed); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DeadlineTaskQueue);
+
+    struct Entry {
+        int64_t deadline_us;
+        bthread_t task;
+    };
+    static bool later(const Entry& a, const Entry& b) {
+        return a.deadline_us > b.deadline_us;
+    }
+
+    butil::atomic<size_t> _size;
+    butil::Mutex _mutex;
+    std::vector<Entry> _heap;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_DEADLINE_TASK_QUEUE_H
@@ -38,6 +38,7 @@
 #include "butil/logging.h"
 #include "butil/object_pool.h"
 #include "bthread/butex.h"                       // butex_*
+#include "bthread/contention_sampler.h"
 #include "bthread/processor.h"                   // cpu_relax, barrier
 #include "bthread/mutex.h"                       // bthread_mutex_t
 #include "bthread/sys_futex.h"
@@ -517,19 +518,11 @@ void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns) {
     tls_inside_lock = false;
 }
 
-BUTIL_FORCE_INLINE int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
-    // Don't change behavior of lock when profiler is off.
-    if (!g_cp ||
-        // collecting code including backtrace() and submit() may call
-        // pthread_mutex_lock and cause deadlock. Don't sample.
-        tls_inside_lock) {
+// Lock a mutex which failed to be locked by pthread_mutex_trylock().
+inline int pthread_mutex_lock_contended(pthread_mutex_t* mutex) {
+    if (!g_cp) {
         return sys_pthread_mutex_lock(mutex);
     }
-    // Don't slow down non-contended locks.
-    int rc = pthread_mutex_trylock(mutex);
-    if (rc != EBUSY) {
-        return rc;
-    }
     // Ask bvar::Collector if this (contended) locking should be sampled
     const size_t sampling_range = bvar::is_collectable(&g_cp_sl);
 
@@ -555,7 +548,7 @@ BUTIL_FORCE_INLINE int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
     }
     // Lock and monitor the waiting time.
     const int64_t start_ns = butil::cpuwide_time_ns();
-    rc = sys_pthread_mutex_lock(mutex);
+    const int rc = sys_pthread_mutex_lock(mutex);
     if (!rc) { // Inside lock
         if (!csite) {
             csite = add_pthread_contention_site(mutex);
@@ -569,6 +562,44 @@ BUTIL_FORCE_INLINE int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
     return rc;
 }
 
+// Same as is_contention_sampled() in contention_sampler.cpp, inlined since
+// it's called in every pthread_mutex_lock(). Trying the lock to know if the
+// locking is contended is more expensive than the countdown, so the locking
+// is chosen before trying, which samples contentions at the same ratio.
+BUTIL_FORCE_INLINE bool is_pthread_mutex_contention_sampled() {
+    if (--tls_contention_countdown > 0) {
+        return false;
+    }
+    return reset_contention_countdown();
+}
+
+BUTIL_FORCE_INLINE int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
+    // collecting code including backtrace() and submit() may call
+    // pthread_mutex_lock and cause deadlock. Don't sample.
+    if (tls_inside_lock) {
+        return sys_pthread_mutex_lock(mutex);
+    }
+    const bool sampled = is_pthread_mutex_contention_sampled();
+    // Don't change behavior of lock when profiler is off and the locking is
+    // not sampled.
+    if (!g_cp && !sampled) {
+        return sys_pthread_mutex_lock(mutex);
+    }
+    // Don't slow down non-contended locks.
+    int rc = pthread_mutex_trylock(mutex);
+    if (rc != EBUSY) {
+        return rc;
+    }
+    if (!sampled) {
+        return pthread_mutex_lock_contended(mutex);
+    }
+    ContentionSample sample;
+    start_contention_sample(CONTENTION_PTHREAD_MUTEX, &sample);
+    rc = pthread_mutex_lock_contended(mutex);
+    end_contention_sample(&sample);
+    return rc;
+}
+
 BUTIL_FORCE_INLINE int pthread_mutex_unlock_impl(pthread_mutex_t* mutex) {
     // Don't change behavior of unlock when profiler is off.
     if (!g_cp || tls_inside_lock) {
@@ -631,7 +662,8 @@ BAIDU_CASSERT(sizeof(unsigned) == sizeof(MutexInternal),
 inline int mutex_lock_contended(bthread_mutex_t* m) {
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
-        if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, NULL) < 0 &&
+        if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, NULL,
+                                CONTENTION_BTHREAD_MUTEX) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR/*note*/) {
             // a mutex lock should ignore interrruptions in general since
             // user code is unlikely to check the return value.
@@ -645,7 +677,8 @@ inline int mutex_timedlock_contended(
     bthread_mutex_t* m, const struct timespec* __restrict abstime) {
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
-        if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, abstime) < 0 &&
+        if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, abstime,
+                                CONTENTION_BTHREAD_MUTEX) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR/*note*/) {
             // a mutex lock should ignore interrruptions in general since
             // user code is unlikely to check the return value.
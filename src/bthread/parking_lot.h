@@ -22,6 +22,7 @@
 #ifndef BTHREAD_PARKING_LOT_H
 #define BTHREAD_PARKING_LOT_H
 
+#include <limits.h>                             // INT_MAX
 #include "butil/atomicops.h"
 #include "bthread/sys_futex.h"
 
@@ -56,8 +57,20 @@ public:
 
     // Wait for tasks.
     // If the `expected_state' does not match, wait() may finish directly.
-    void wait(const State& expected_state) {
-        futex_wait_private(&_pending_signal, expected_state.val, NULL);
+    // `waiter_bits' identifies the waiter for wake_waiters(), signal() wakes
+    // up waiters regardless of their bits.
+    void wait(const State& expected_state, int waiter_bits = -1) {
+        futex_wait_bitset_private(&_pending_signal, expected_state.val,
+                                  waiter_bits);
+    }
+
+    // Wake up all waiters whose bits intersect with `waiter_bits' without
+    // signalling tasks, e.g. to let a specific worker see that it's
+    // suspended. The state is changed so that waiters about to wait return
+    // as well.
+    void wake_waiters(int waiter_bits) {
+        _pending_signal.fetch_add(2, butil::memory_order_release);
+        futex_wake_bitset_private(&_pending_signal, INT_MAX, waiter_bits);
     }
 
     // Wakeup suspended wait() and make them unwaitable ever. 
@@ -70,6 +70,9 @@ public:
     }
 
     size_t capacity() const { return _tasks.capacity(); }
+
+    // Not accurate without holding the lock, for statistics only.
+    size_t volatile_size() const { return _tasks.size(); }
     
 private:
 friend class TaskGroup;
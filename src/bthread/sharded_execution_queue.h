@@ -0,0 +1,249 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef  BTHREAD_SHARDED_EXECUTION_QUEUE_H
+#define  BTHREAD_SHARDED_EXECUTION_QUEUE_H
+
+#include <vector>
+#include "butil/third_party/murmurhash3/murmurhash3.h"  // fmix64
+#include "bthread/execution_queue.h"
+
+namespace bthread {
+
+// ShardedExecutionQueue spreads tasks over a fixed number of ExecutionQueues
+// (shards) by keys: tasks with the same key are always executed in the
+// submitting order (as in one ExecutionQueue), while tasks with different keys
+// may be executed concurrently by consumers of different shards. Each shard
+// executes its pending tasks in batches, as ExecutionQueue does.
+//
+// This is a replacement of creating one ExecutionQueue for each key, which
+// costs a lot when there're thousands of keys, or one ExecutionQueue for all
+// keys, which can't use more than one core.
+//
+// Example:
+//   int update_state(void* meta, bthread::TaskIterator<Update>& iter) {
+//       if (iter.is_queue_stopped()) {
+//           // Called exactly once when all shards are stopped.
+//           return 0;
+//       }
+//       for (; iter; ++iter) {
+//           // apply *iter, tasks of the same key are in order.
+//       }
+//       return 0;
+//   }
+//   bthread::ShardedExecutionQueue<Update> q;
+//   q.start(NULL, update_state, meta);
+//   q.execute(update.user_id, update);
+//   ...
+//   q.stop();
+//   q.join();
+
+struct ShardedExecutionQueueOptions : public ExecutionQueueOptions {
+    ShardedExecutionQueueOptions();
+
+    // Number of shards, which is also the maximum number of tasks executed
+    // concurrently. Non-positive value means bthread_getconcurrency().
+    // default: 0
+    int num_shards;
+};
+
+template <typename T>
+class ShardedExecutionQueue {
+DISALLOW_COPY_AND_ASSIGN(ShardedExecutionQueue);
+public:
+    typedef int (*execute_func_t)(void* meta, TaskIterator<T>& iter);
+
+    ShardedExecutionQueue();
+    // Stop and join the queue if it's not joined yet.
+    ~ShardedExecutionQueue();
+
+    // Start shards which call |execute| with |meta| to run tasks. If
+    // |options| is NULL, the queue will be created with the default options.
+    // Unlike the per-shard executing, |execute| is called with
+    // TaskIterator::is_queue_stopped() being true exactly once, after all
+    // shards are stopped and all the pending tasks have been executed.
+    // Returns 0 on success, errno otherwise.
+    int start(const ShardedExecutionQueueOptions* options,
+              execute_func_t execute, void* meta);
+
+    // Thread-safe and Wait-free.
+    // Execute |task| after all the tasks with the same |key| submitted before.
+    // |options| and |handle| have the same meanings as in
+    // execution_queue_execute(), high-priority tasks are executed before
+    // pending normal-priority tasks in the same shard.
+    // Returns 0 on success, errno otherwise (e.g. the queue is stopped).
+    int execute(uint64_t key, typename butil::add_const_reference<T>::type task);
+    int execute(uint64_t key, typename butil::add_const_reference<T>::type task,
+                const TaskOptions* options);
+    int execute(uint64_t key, typename butil::add_const_reference<T>::type task,
+                const TaskOptions* options, TaskHandle* handle);
+
+    // Stop all shards, following execute() fail immediately.
+    // Returns 0 on success, errno otherwise.
+    int stop();
+
+    // Wait until the stop task of every shard has been executed.
+    // Returns 0 on success, errno otherwise.
+    int join();
+
+    int num_shards() const { return (int)_shards.size(); }
+
+    // The ExecutionQueue running tasks with |key|.
+    ExecutionQueueId<T> shard_of(uint64_t key) const {
+        return _shards[butil::fmix64(key) % _shards.size()];
+    }
+
+private:
+    static int execute_shard(void* meta, TaskIterator<T>& iter);
+
+    std::vector<ExecutionQueueId<T> > _shards;
+    execute_func_t _execute;
+    void* _meta;
+    // Shards whose stop tasks are not executed yet.
+    butil::atomic<int> _nrunning;
+    bool _joined;
+};
+
+// ---------------------- Implementations -----------------------
+
+inline ShardedExecutionQueueOptions::ShardedExecutionQueueOptions()
+    : num_shards(0)
+{}
+
+template <typename T>
+ShardedExecutionQueue<T>::ShardedExecutionQueue()
+    : _execute(NULL)
+    , _meta(NULL)
+    , _nrunning(0)
+    , _joined(false)
+{}
+
+template <typename T>
+ShardedExecutionQueue<T>::~ShardedExecutionQueue() {
+    if (!_shards.empty() && !_joined) {
+        stop();
+        join();
+    }
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::execute_shard(void* meta, TaskIterator<T>& iter) {
+    ShardedExecutionQueue* q = static_cast<ShardedExecutionQueue*>(meta);
+    if (iter.is_queue_stopped() &&
+        q->_nrunning.fetch_sub(1, butil::memory_order_acq_rel) != 1) {
+        return 0;
+    }
+    return q->_execute(q->_meta, iter);
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::start(const ShardedExecutionQueueOptions* options,
+                                    execute_func_t execute, void* meta) {
+    if (!_shards.empty() || execute == NULL) {
+        return EINVAL;
+    }
+    ShardedExecutionQueueOptions default_options;
+    if (options == NULL) {
+        options = &default_options;
+    }
+    int nshard = options->num_shards;
+    if (nshard <= 0) {
+        nshard = bthread_getconcurrency();
+    }
+    _execute = execute;
+    _meta = meta;
+    // One more than shards so that |execute| is never called with the stop
+    // task before all shards are started, see below.
+    _nrunning.store(nshard + 1, butil::memory_order_relaxed);
+    _shards.reserve(nshard);
+    for (int i = 0; i < nshard; ++i) {
+        ExecutionQueueId<T> id;
+        const int rc = execution_queue_start(&id, options, execute_shard, this);
+        if (rc != 0) {
+            // Started shards are stopped without calling |execute| with the
+            // stop task since _nrunning never reaches 0.
+            stop();
+            join();
+            _shards.clear();
+            _joined = false;
+            return rc;
+        }
+        _shards.push_back(id);
+    }
+    _nrunning.fetch_sub(1, butil::memory_order_relaxed);
+    return 0;
+}
+
+template <typename T>
+inline int ShardedExecutionQueue<T>::execute(
+        uint64_t key, typename butil::add_const_reference<T>::type task) {
+    return execute(key, task, NULL, NULL);
+}
+
+template <typename T>
+inline int ShardedExecutionQueue<T>::execute(
+        uint64_t key, typename butil::add_const_reference<T>::type task,
+        const TaskOptions* options) {
+    return execute(key, task, options, NULL);
+}
+
+template <typename T>
+inline int ShardedExecutionQueue<T>::execute(
+        uint64_t key, typename butil::add_const_reference<T>::type task,
+        const TaskOptions* options, TaskHandle* handle) {
+    if (_shards.empty()) {
+        return EINVAL;
+    }
+    return execution_queue_execute(shard_of(key), task, options, handle);
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::stop() {
+    if (_shards.empty()) {
+        return EINVAL;
+    }
+    int rc = 0;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        const int rc2 = execution_queue_stop(_shards[i]);
+        if (rc2 != 0 && rc == 0) {
+            rc = rc2;
+        }
+    }
+    return rc;
+}
+
+template <typename T>
+int ShardedExecutionQueue<T>::join() {
+    if (_shards.empty()) {
+        return EINVAL;
+    }
+    int rc = 0;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        const int rc2 = execution_queue_join(_shards[i]);
+        if (rc2 != 0 && rc == 0) {
+            rc = rc2;
+        }
+    }
+    _joined = true;
+    return rc;
+}
+
+}  // namespace bthread
+
+#endif  // BTHREAD_SHARDED_EXECUTION_QUEUE_H
@@ -23,8 +23,12 @@
 #include <sys/mman.h>                             // mmap, munmap, mprotect
 #include <algorithm>                              // std::max
 #include <stdlib.h>                               // posix_memalign
+#include <pthread.h>
+#include <map>
+#include <vector>
 #include "butil/macros.h"                          // BAIDU_CASSERT
 #include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/scoped_lock.h"                     // BAIDU_SCOPED_LOCK
 #include "butil/third_party/dynamic_annotations/dynamic_annotations.h" // RunningOnValgrind
 #include "butil/third_party/valgrind/valgrind.h"   // VALGRIND_STACK_REGISTER
 #include "bvar/passive_status.h"
@@ -37,6 +41,22 @@ DEFINE_int32(stack_size_large, 8388608, "size of large stacks");
 DEFINE_int32(guard_page_size, 4096, "size of guard page, allocate stacks by malloc if it's 0(not recommended)");
 DEFINE_int32(tc_stack_small, 32, "maximum small stacks cached by each thread");
 DEFINE_int32(tc_stack_normal, 8, "maximum normal stacks cached by each thread");
+DEFINE_int32(max_cached_stack_small, 0, "maximum small stacks cached in total, "
+             "storages of stacks returned beyond the limit are released. "
+             "non-positive value means no limit");
+DEFINE_int32(max_cached_stack_normal, 0, "maximum normal stacks cached in total, "
+             "non-positive value means no limit");
+DEFINE_int32(max_cached_stack_large, 0, "maximum large stacks cached in total, "
+             "non-positive value means no limit");
+DEFINE_int32(stack_trim_watermark, 0, "When a stack is returned, touched pages "
+             "deeper than so many bytes are given back to the OS by madvise. "
+             "Costs a mincore() for each returned stack, 0 to disable");
+DEFINE_bool(stack_trim_by_madv_free, false, "Trim stacks with MADV_FREE instead "
+            "of MADV_DONTNEED, pages are reclaimed lazily by the OS under "
+            "memory pressure");
+DEFINE_bool(stack_map_noreserve, false, "Map stacks with MAP_NORESERVE so that "
+            "pages of stacks are not counted as committed memory before "
+            "being touched");
 
 namespace bthread {
 
@@ -53,6 +73,77 @@ static int64_t get_stack_count(void*) {
 static bvar::PassiveStatus<int64_t> bvar_stack_count(
     "bthread_stack_count", get_stack_count, NULL);
 
+// Bytes of address space of stacks, including guard pages.
+static butil::static_atomic<int64_t> s_stack_reserved_bytes =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+static int64_t get_stack_reserved_bytes(void*) {
+    return s_stack_reserved_bytes.load(butil::memory_order_relaxed);
+}
+static bvar::PassiveStatus<int64_t> bvar_stack_reserved_bytes(
+    "bthread_stack_reserved_bytes", get_stack_reserved_bytes, NULL);
+
+// Mapped stacks, for counting resident pages.
+struct MappedStacks {
+    MappedStacks() { pthread_mutex_init(&mutex, NULL); }
+    pthread_mutex_t mutex;
+    // start address -> length
+    std::map<char*, size_t> stacks;
+};
+static MappedStacks* get_mapped_stacks() {
+    return butil::get_leaky_singleton<MappedStacks>();
+}
+
+// Bytes of stacks allocated by malloc, regarded as committed.
+static butil::static_atomic<int64_t> s_malloc_stack_bytes =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+
+// Slow, iterating all mapped stacks.
+static int64_t get_stack_committed_bytes() {
+    const static size_t PAGESIZE = getpagesize();
+    int64_t committed = s_malloc_stack_bytes.load(butil::memory_order_relaxed);
+    // Copy the stacks and call mincore() without the lock, which would
+    // otherwise block allocations of stacks. A stack unmapped meanwhile
+    // makes mincore() fail or count pages of another mapping, which is
+    // fine for an estimation.
+    std::vector<std::pair<char*, size_t> > stacks;
+    {
+        MappedStacks* ms = get_mapped_stacks();
+        BAIDU_SCOPED_LOCK(ms->mutex);
+        stacks.assign(ms->stacks.begin(), ms->stacks.end());
+    }
+    std::vector<unsigned char> vec;
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        const size_t npage = (stacks[i].second + PAGESIZE - 1) / PAGESIZE;
+        vec.resize(npage);
+        if (mincore(stacks[i].first, stacks[i].second, &vec[0]) != 0) {
+            continue;
+        }
+        for (size_t j = 0; j < npage; ++j) {
+            if (vec[j] & 1) {
+                committed += PAGESIZE;
+            }
+        }
+    }
+    return committed;
+}
+
+// Not a PassiveStatus which is sampled every second for series when
+// -save_series is on, this one is computed only when being read.
+class StackCommittedBytes : public bvar::Variable {
+public:
+    StackCommittedBytes() { expose("bthread_stack_committed_bytes"); }
+    ~StackCommittedBytes() { hide(); }
+
+    void describe(std::ostream& os, bool /*quote_string*/) const override {
+        os << get_stack_committed_bytes();
+    }
+
+    bool get_numeric_value(bvar::NumericValue* value) const override {
+        return bvar::to_numeric_value(get_stack_committed_bytes(), value);
+    }
+};
+static StackCommittedBytes bvar_stack_committed_bytes;
+
 int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in) {
     const static int PAGESIZE = getpagesize();
     const int PAGESIZE_M1 = PAGESIZE - 1;
@@ -72,6 +163,8 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
             return -1;
         }
         s_stack_count.fetch_add(1, butil::memory_order_relaxed);
+        s_stack_reserved_bytes.fetch_add(stacksize, butil::memory_order_relaxed);
+        s_malloc_stack_bytes.fetch_add(stacksize, butil::memory_order_relaxed);
         s->bottom = (char*)mem + stacksize;
         s->stacksize = stacksize;
         s->guardsize = 0;
@@ -89,8 +182,10 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
             ~PAGESIZE_M1;
 
         const int memsize = stacksize + guardsize;
+        const int flags = (MAP_PRIVATE | MAP_ANONYMOUS) |
+            (FLAGS_stack_map_noreserve ? MAP_NORESERVE : 0);
         void* const mem = mmap(NULL, memsize, (PROT_READ | PROT_WRITE),
-                               (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+                               flags, -1, 0);
 
         if (MAP_FAILED == mem) {
             PLOG_EVERY_SECOND(ERROR) 
@@ -117,6 +212,12 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
         }
 
         s_stack_count.fetch_add(1, butil::memory_order_relaxed);
+        s_stack_reserved_bytes.fetch_add(memsize, butil::memory_order_relaxed);
+        {
+            MappedStacks* ms = get_mapped_stacks();
+            BAIDU_SCOPED_LOCK(ms->mutex);
+            ms->stacks[(char*)mem] = memsize;
+        }
         s->bottom = (char*)mem + memsize;
         s->stacksize = stacksize;
         s->guardsize = guardsize;
@@ -139,15 +240,70 @@ void deallocate_stack_storage(StackStorage* s) {
         return;
     }
     s_stack_count.fetch_sub(1, butil::memory_order_relaxed);
+    s_stack_reserved_bytes.fetch_sub(memsize, butil::memory_order_relaxed);
     if (s->guardsize <= 0) {
+        s_malloc_stack_bytes.fetch_sub(memsize, butil::memory_order_relaxed);
         free((char*)s->bottom - memsize);
     } else {
-        munmap((char*)s->bottom - memsize, memsize);
+        char* const mem = (char*)s->bottom - memsize;
+        {
+            MappedStacks* ms = get_mapped_stacks();
+            BAIDU_SCOPED_LOCK(ms->mutex);
+            ms->stacks.erase(mem);
+        }
+        munmap(mem, memsize);
+    }
+}
+
+int trim_stack_storage(StackStorage* s, const void* sp) {
+    const int watermark = FLAGS_stack_trim_watermark;
+    // Stacks allocated by malloc are not trimmed.
+    if (watermark <= 0 || s->guardsize <= 0 || s->bottom == NULL) {
+        return 0;
+    }
+    const static uintptr_t PAGESIZE = getpagesize();
+    const uintptr_t PAGESIZE_M1 = PAGESIZE - 1;
+    const uintptr_t lowest = (uintptr_t)s->bottom - s->stacksize;
+    uintptr_t end = ((uintptr_t)s->bottom - watermark) & ~PAGESIZE_M1;
+    if (sp != NULL) {
+        // Leave one more page for the red zone below sp.
+        end = std::min(end, ((uintptr_t)sp & ~PAGESIZE_M1) - PAGESIZE);
+    }
+    if (end <= lowest || end > (uintptr_t)s->bottom) {
+        return 0;
+    }
+    // Stacks grow downwards, deeper pages are generally not touched if the
+    // page right below the watermark was not.
+    unsigned char vec = 0;
+    if (mincore((void*)(end - PAGESIZE), PAGESIZE, &vec) != 0 ||
+        !(vec & 1)) {
+        return 0;
+    }
+    int advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+    if (FLAGS_stack_trim_by_madv_free) {
+        advice = MADV_FREE;
+    }
+#endif
+    if (madvise((void*)lowest, end - lowest, advice) != 0) {
+        PLOG_EVERY_SECOND(ERROR) << "Fail to madvise " << (void*)lowest
+                                 << " length=" << end - lowest;
+        return 0;
     }
+    return end - lowest;
 }
 
 int* SmallStackClass::stack_size_flag = &FLAGS_stack_size_small;
 int* NormalStackClass::stack_size_flag = &FLAGS_stack_size_normal;
 int* LargeStackClass::stack_size_flag = &FLAGS_stack_size_large;
+int* SmallStackClass::max_cached_flag = &FLAGS_max_cached_stack_small;
+int* NormalStackClass::max_cached_flag = &FLAGS_max_cached_stack_normal;
+int* LargeStackClass::max_cached_flag = &FLAGS_max_cached_stack_large;
+butil::static_atomic<int64_t> SmallStackClass::ncached =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+butil::static_atomic<int64_t> NormalStackClass::ncached =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+butil::static_atomic<int64_t> LargeStackClass::ncached =
+    BUTIL_STATIC_ATOMIC_INIT(0);
 
 }  // namespace bthread
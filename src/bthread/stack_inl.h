@@ -32,23 +32,34 @@ struct MainStackClass {};
 
 struct SmallStackClass {
     static int* stack_size_flag;
+    static int* max_cached_flag;
+    static butil::static_atomic<int64_t> ncached;
     // Older gcc does not allow static const enum, use int instead.
     static const int stacktype = (int)STACK_TYPE_SMALL;
 };
 
 struct NormalStackClass {
     static int* stack_size_flag;
+    static int* max_cached_flag;
+    static butil::static_atomic<int64_t> ncached;
     static const int stacktype = (int)STACK_TYPE_NORMAL;
 };
 
 struct LargeStackClass {
     static int* stack_size_flag;
+    static int* max_cached_flag;
+    static butil::static_atomic<int64_t> ncached;
     static const int stacktype = (int)STACK_TYPE_LARGE;
 };
 
 template <typename StackClass> struct StackFactory {
     struct Wrapper : public ContextualStack {
-        explicit Wrapper(void (*entry)(intptr_t)) {
+        explicit Wrapper(void (*entry)(intptr_t)) : cached(false) {
+            allocate(entry);
+        }
+        ~Wrapper() { release(); }
+
+        void allocate(void (*entry)(intptr_t)) {
             if (allocate_stack_storage(&storage, *StackClass::stack_size_flag,
                                        FLAGS_guard_page_size) != 0) {
                 storage.zeroize();
@@ -58,21 +69,53 @@ template <typename StackClass> struct StackFactory {
             context = bthread_make_fcontext(storage.bottom, storage.stacksize, entry);
             stacktype = (StackType)StackClass::stacktype;
         }
-        ~Wrapper() {
+        void release() {
             if (context) {
                 context = NULL;
                 deallocate_stack_storage(&storage);
                 storage.zeroize();
             }
         }
+
+        // True if the stack is in the pool with its storage.
+        bool cached;
     };
     
     static ContextualStack* get_stack(void (*entry)(intptr_t)) {
-        return butil::get_object<Wrapper>(entry);
+        Wrapper* w = butil::get_object<Wrapper>(entry);
+        if (w == NULL) {
+            return NULL;
+        }
+        if (w->cached) {
+            w->cached = false;
+            StackClass::ncached.fetch_sub(1, butil::memory_order_relaxed);
+        } else if (w->context == NULL) {
+            // Storage was released when the stack was returned.
+            w->allocate(entry);
+            if (w->context == NULL) {
+                butil::return_object(w);
+                return NULL;
+            }
+        }
+        return w;
     }
     
+    // Called after jumping out of the stack.
     static void return_stack(ContextualStack* sc) {
-        butil::return_object(static_cast<Wrapper*>(sc));
+        Wrapper* w = static_cast<Wrapper*>(sc);
+        const int max_cached = *StackClass::max_cached_flag;
+        if (max_cached > 0 &&
+            StackClass::ncached.load(butil::memory_order_relaxed) >= max_cached) {
+            // Enough stacks are cached, only the wrapper is pooled.
+            w->release();
+        } else {
+            // Frames above the saved context are still needed when the
+            // stack is reused.
+            trim_stack_storage(&w->storage, w->context);
+            w->cached = true;
+            StackClass::ncached.fetch_add(1, butil::memory_order_relaxed);
+        }
+        butil::return_object(w);
     }
 };
 
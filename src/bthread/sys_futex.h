@@ -51,6 +51,18 @@ inline int futex_requeue_private(void* addr1, int nwake, void* addr2) {
                    nwake, NULL, addr2, 0);
 }
 
+// Waiters with `bitset' are only woken up by futex_wake_bitset_private()
+// with intersected bitsets, or by futex_wake_private().
+inline int futex_wait_bitset_private(void* addr1, int expected, int bitset) {
+    return syscall(SYS_futex, addr1, (FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG),
+                   expected, NULL, NULL, bitset);
+}
+
+inline int futex_wake_bitset_private(void* addr1, int nwake, int bitset) {
+    return syscall(SYS_futex, addr1, (FUTEX_WAKE_BITSET | FUTEX_PRIVATE_FLAG),
+                   nwake, NULL, NULL, bitset);
+}
+
 }  // namespace bthread
 
 #elif defined(OS_MACOSX)
@@ -63,6 +75,15 @@ int futex_wake_private(void* addr1, int nwake);
 
 int futex_requeue_private(void* addr1, int nwake, void* addr2);
 
+// Bitsets are not supported, all waiters match.
+inline int futex_wait_bitset_private(void* addr1, int expected, int) {
+    return futex_wait_private(addr1, expected, NULL);
+}
+
+inline int futex_wake_bitset_private(void* addr1, int nwake, int) {
+    return futex_wake_private(addr1, nwake);
+}
+
 }  // namespace bthread
 
 #else
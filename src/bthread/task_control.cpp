@@ -22,6 +22,8 @@
 #include "butil/scoped_lock.h"             // BAIDU_SCOPED_LOCK
 #include "butil/errno.h"                   // berror
 #include "butil/logging.h"
+#include "butil/string_printf.h"
+#include "butil/time.h"                    // gettimeofday_us
 #include "butil/third_party/murmurhash3/murmurhash3.h"
 #include "bthread/sys_futex.h"            // futex_wake_private
 #include "bthread/interrupt_pthread.h"
@@ -29,6 +31,8 @@
 #include "bthread/task_group.h"           // TaskGroup
 #include "bthread/task_control.h"
 #include "bthread/timer_thread.h"         // global_timer_thread
+#include "bthread/cpu_account.h"          // print_cpu_accounts
+#include "bthread/cpu_sampler.h"          // register_cpu_sampled_thread
 #include <gflags/gflags.h>
 #include "bthread/log.h"
 
@@ -38,6 +42,42 @@ DEFINE_int32(task_group_runqueue_capacity, 4096,
              "capacity of runqueue in each TaskGroup");
 DEFINE_int32(task_group_yield_before_idle, 0,
              "TaskGroup yields so many times before idle");
+DEFINE_int32(bthread_worker_spin_max_us, 0,
+             "Idle workers spin for at most so many microseconds to take new "
+             "tasks before waiting on futex. How long a worker actually spins is "
+             "adapted to recent intervals between it being idle and getting "
+             "tasks. 0 disables spinning");
+DEFINE_int32(bthread_max_spinning_workers, 2,
+             "Maximum number of idle workers spinning at the same time, see "
+             "-bthread_worker_spin_max_us");
+DEFINE_int32(task_group_ntags, 1,
+             "Number of isolated pools of workers. bthreads started with "
+             "bthread_attr_t.tag=N only run in workers of pool N, which "
+             "steal tasks from each other but not from other pools");
+DEFINE_int32(bthread_batch_signal_max_workers, 8,
+             "Wake up at most so many idle workers for a batch of bthreads "
+             "made runnable at once, e.g. by butex_wake_all()");
+DEFINE_bool(bthread_adaptive_concurrency, false,
+            "Adjust number of active workers periodically: add or resume "
+            "workers when workers are blocked (e.g. by synchronous IO) or busy "
+            "with pending tasks, suspend workers when they're idle. Must be set "
+            "before any bthread is created");
+DEFINE_int32(bthread_adaptive_min_concurrency, 0,
+             "Minimum number of active workers when -bthread_adaptive_concurrency"
+             " is on, non-positive value means one worker for each tag");
+DEFINE_int32(bthread_adaptive_max_concurrency, 0,
+             "Maximum number of active workers when -bthread_adaptive_concurrency"
+             " is on, non-positive value means twice of initial workers");
+DEFINE_int32(bthread_adaptive_interval_ms, 100,
+             "Interval of sampling workers to adjust concurrency");
+DEFINE_double(bthread_adaptive_busy_usage, 0.9,
+              "Add a worker when usage of active workers is higher than this "
+              "value and there're pending tasks");
+DEFINE_double(bthread_adaptive_idle_usage, 0.3,
+              "Suspend a worker when usage of active workers is lower than "
+              "this value for -bthread_adaptive_idle_rounds intervals");
+DEFINE_int32(bthread_adaptive_idle_rounds, 10,
+             "See -bthread_adaptive_idle_usage");
 
 namespace bthread {
 
@@ -55,24 +95,32 @@ void run_worker_startfn() {
     }
 }
 
+struct WorkerArgs {
+    TaskControl* control;
+    bthread_tag_t tag;
+};
+
 void* TaskControl::worker_thread(void* arg) {
     run_worker_startfn();    
 #ifdef BAIDU_INTERNAL
     logging::ComlogInitializer comlog_initializer;
 #endif
     
-    TaskControl* c = static_cast<TaskControl*>(arg);
-    TaskGroup* g = c->create_group();
+    const WorkerArgs args = *static_cast<WorkerArgs*>(arg);
+    delete static_cast<WorkerArgs*>(arg);
+    TaskControl* c = args.control;
+    TaskGroup* g = c->create_group(args.tag);
     TaskStatistics stat;
     if (NULL == g) {
         LOG(ERROR) << "Fail to create TaskGroup in pthread=" << pthread_self();
         return NULL;
     }
     BT_VLOG << "Created worker=" << pthread_self()
-            << " bthread=" << g->main_tid();
+            << " bthread=" << g->main_tid() << " tag=" << args.tag;
 
     tls_task_group = g;
     c->_nworkers << 1;
+    register_cpu_sampled_thread();
     g->run_main_task();
 
     stat = g->main_stat();
@@ -85,8 +133,8 @@ void* TaskControl::worker_thread(void* arg) {
     return NULL;
 }
 
-TaskGroup* TaskControl::create_group() {
-    TaskGroup* g = new (std::nothrow) TaskGroup(this);
+TaskGroup* TaskControl::create_group(bthread_tag_t tag) {
+    TaskGroup* g = new (std::nothrow) TaskGroup(this, tag);
     if (NULL == g) {
         LOG(FATAL) << "Fail to new TaskGroup";
         return NULL;
@@ -120,6 +168,18 @@ static int64_t get_cumulated_signal_count_from_this(void *arg) {
     return static_cast<TaskControl*>(arg)->get_cumulated_signal_count();
 }
 
+static int64_t get_cumulated_steal_count_from_this(void *arg) {
+    return static_cast<TaskControl*>(arg)->get_cumulated_steal_count();
+}
+
+static int get_spinning_workers_from_this(void* arg) {
+    return static_cast<TaskControl*>(arg)->spinning_workers();
+}
+
+static double get_spin_success_ratio_from_this(void* arg) {
+    return static_cast<TaskControl*>(arg)->get_spin_success_ratio();
+}
+
 TaskControl::TaskControl()
     // NOTE: all fileds must be initialized before the vars.
     : _ngroup(0)
@@ -128,6 +188,7 @@ TaskControl::TaskControl()
     , _concurrency(0)
     , _nworkers("bthread_worker_count")
     , _pending_time(NULL)
+    , _runqueue_wait(NULL)
       // Delay exposure of following two vars because they rely on TC which
       // is not initialized yet.
     , _cumulated_worker_time(get_cumulated_worker_time_from_this, this)
@@ -136,11 +197,65 @@ TaskControl::TaskControl()
     , _switch_per_second(&_cumulated_switch_count)
     , _cumulated_signal_count(get_cumulated_signal_count_from_this, this)
     , _signal_per_second(&_cumulated_signal_count)
+    , _cumulated_steal_count(get_cumulated_steal_count_from_this, this)
+    , _steal_per_second(&_cumulated_steal_count)
     , _status(print_rq_sizes_in_the_tc, this)
     , _nbthreads("bthread_count")
+    , _nexpired("bthread_expired_before_execution")
+    , _initial_concurrency(0)
+    , _has_adjuster(false)
+    , _nsuspended(0)
+    , _nblocked(0)
+    , _active_workers(get_active_concurrency, this)
+    , _blocked_workers(get_blocked_workers, this)
+    , _nspinning(0)
+    , _spinning_workers(get_spinning_workers_from_this, this)
+    , _spin_second(&_nspin)
+    , _spin_success_second(&_nspin_success)
+    , _spin_success_ratio(get_spin_success_ratio_from_this, this)
 {
     // calloc shall set memory to zero
     CHECK(_groups) << "Fail to create array of groups";
+    pthread_mutex_init(&_adjuster_mutex, NULL);
+    pthread_cond_init(&_adjuster_cond, NULL);
+}
+
+double TaskControl::TaggedGroups::get_cumulated_worker_time(void* arg) {
+    TaggedGroups* tg = static_cast<TaggedGroups*>(arg);
+    int64_t cputime_ns = 0;
+    BAIDU_SCOPED_LOCK(tg->control->_modify_group_mutex);
+    const size_t ngroup = tg->ngroup.load(butil::memory_order_relaxed);
+    for (size_t i = 0; i < ngroup; ++i) {
+        if (tg->groups[i]) {
+            cputime_ns += tg->groups[i]->_cumulated_cputime_ns;
+        }
+    }
+    return cputime_ns / 1000000000.0;
+}
+
+int TaskControl::TaggedGroups::get_concurrency(void* arg) {
+    TaggedGroups* tg = static_cast<TaggedGroups*>(arg);
+    return tg->concurrency.load(butil::memory_order_relaxed);
+}
+
+TaskControl::TaggedGroups::TaggedGroups(TaskControl* c, bthread_tag_t t)
+    : control(c)
+    , tag(t)
+    , ngroup(0)
+    , groups((TaskGroup**)calloc(BTHREAD_MAX_CONCURRENCY, sizeof(TaskGroup*)))
+    , concurrency(0)
+    , cumulated_worker_time(get_cumulated_worker_time, this)
+    , worker_usage_second(&cumulated_worker_time, 1)
+    , nworkers(get_concurrency, this)
+    , idle_rounds(0) {
+    CHECK(groups) << "Fail to create array of groups";
+}
+
+TaskControl::TaggedGroups::~TaggedGroups() {
+    worker_usage_second.hide();
+    nworkers.hide();
+    free(groups);
+    groups = NULL;
 }
 
 int TaskControl::init(int concurrency) {
@@ -148,11 +263,21 @@ int TaskControl::init(int concurrency) {
         LOG(ERROR) << "Already initialized";
         return -1;
     }
-    if (concurrency <= 0) {
-        LOG(ERROR) << "Invalid concurrency=" << concurrency;
+    const int ntags = FLAGS_task_group_ntags;
+    if (ntags <= 0 || ntags > BTHREAD_MAX_CONCURRENCY) {
+        LOG(ERROR) << "Invalid task_group_ntags=" << ntags;
         return -1;
     }
-    _concurrency = concurrency;
+    if (concurrency < ntags) {
+        LOG(ERROR) << "Invalid concurrency=" << concurrency
+                   << ", at least one worker for each of "
+                   << ntags << " tags";
+        return -1;
+    }
+    _tagged.resize(ntags);
+    for (int i = 0; i < ntags; ++i) {
+        _tagged[i] = new TaggedGroups(this, i);
+    }
 
     // Make sure TimerThread is ready.
     if (get_or_create_global_timer_thread() == NULL) {
@@ -160,62 +285,269 @@ int TaskControl::init(int concurrency) {
         return -1;
     }
     
-    _workers.resize(_concurrency);   
-    for (int i = 0; i < _concurrency; ++i) {
-        const int rc = pthread_create(&_workers[i], NULL, worker_thread, this);
-        if (rc) {
-            LOG(ERROR) << "Fail to create _workers[" << i << "], " << berror(rc);
+    // Workers are evenly distributed to the tags.
+    for (int i = 0; i < ntags; ++i) {
+        const int n = concurrency / ntags + (i < concurrency % ntags);
+        if (add_workers(n, i) != n) {
+            LOG(ERROR) << "Fail to create " << n << " workers of tag=" << i;
             return -1;
         }
     }
     _worker_usage_second.expose("bthread_worker_usage");
     _switch_per_second.expose("bthread_switch_second");
     _signal_per_second.expose("bthread_signal_second");
+    _steal_per_second.expose("bthread_steal_second");
+    _spinning_workers.expose("bthread_spinning_worker_count");
+    _nspin.expose("bthread_worker_spin_count");
+    _nspin_success.expose("bthread_worker_spin_success_count");
+    _spin_success_ratio.expose("bthread_worker_spin_success_ratio");
     _status.expose("bthread_group_status");
+    if (ntags > 1) {
+        for (int i = 0; i < ntags; ++i) {
+            _tagged[i]->worker_usage_second.expose_as(
+                "bthread_worker_usage_tag", butil::string_printf("%d", i));
+            _tagged[i]->nworkers.expose_as(
+                "bthread_worker_count_tag", butil::string_printf("%d", i));
+        }
+    }
 
-    // Wait for at least one group is added so that choose_one_group()
-    // never returns NULL.
+    // Wait for at least one group of each tag is added so that
+    // choose_one_group() never returns NULL.
     // TODO: Handle the case that worker quits before add_group
-    while (_ngroup == 0) {
-        usleep(100);  // TODO: Elaborate
+    for (int i = 0; i < ntags; ++i) {
+        while (_tagged[i]->ngroup == 0) {
+            usleep(100);  // TODO: Elaborate
+        }
+    }
+
+    _initial_concurrency = concurrency;
+    if (FLAGS_bthread_adaptive_concurrency) {
+        const int rc = pthread_create(&_adjuster, NULL, adjuster_thread, this);
+        if (rc) {
+            LOG(ERROR) << "Fail to create adjuster of concurrency, "
+                       << berror(rc);
+            return -1;
+        }
+        _has_adjuster = true;
+        _active_workers.expose("bthread_active_worker_count");
+        _blocked_workers.expose("bthread_blocked_worker_count");
+        _ngrow.expose("bthread_adaptive_grow_count");
+        _nshrink.expose("bthread_adaptive_shrink_count");
     }
     return 0;
 }
 
-int TaskControl::add_workers(int num) {
+int TaskControl::get_active_concurrency(void* arg) {
+    TaskControl* c = static_cast<TaskControl*>(arg);
+    return c->concurrency() -
+        c->_nsuspended.load(butil::memory_order_relaxed);
+}
+
+int TaskControl::get_blocked_workers(void* arg) {
+    return static_cast<TaskControl*>(arg)->_nblocked.load(
+        butil::memory_order_relaxed);
+}
+
+void* TaskControl::adjuster_thread(void* arg) {
+    TaskControl* c = static_cast<TaskControl*>(arg);
+    int64_t last_ns = butil::cpuwide_time_ns();
+    pthread_mutex_lock(&c->_adjuster_mutex);
+    while (!c->_stop) {
+        const int64_t interval_ms =
+            std::max(FLAGS_bthread_adaptive_interval_ms, 1);
+        timespec abstime = butil::milliseconds_from_now(interval_ms);
+        pthread_cond_timedwait(&c->_adjuster_cond, &c->_adjuster_mutex,
+                               &abstime);
+        if (c->_stop) {
+            break;
+        }
+        const int64_t now_ns = butil::cpuwide_time_ns();
+        int nblocked = 0;
+        for (size_t i = 0; i < c->_tagged.size(); ++i) {
+            nblocked += c->adjust_concurrency(
+                c->_tagged[i], now_ns, now_ns - last_ns);
+        }
+        c->_nblocked.store(nblocked, butil::memory_order_relaxed);
+        last_ns = now_ns;
+    }
+    pthread_mutex_unlock(&c->_adjuster_mutex);
+    return NULL;
+}
+
+int TaskControl::add_workers(int num, bthread_tag_t tag) {
     if (num <= 0) {
         return 0;
     }
+    if (tag < 0 || tag >= ntags()) {
+        LOG(ERROR) << "Invalid tag=" << tag;
+        return 0;
+    }
     try {
         _workers.resize(_concurrency + num);
     } catch (...) {
         return 0;
     }
     const int old_concurency = _concurrency.load(butil::memory_order_relaxed);
-    for (int i = 0; i < num; ++i) {
+    int nadded = 0;
+    for (; nadded < num; ++nadded) {
         // Worker will add itself to _idle_workers, so we have to add
         // _concurrency before create a worker.
         _concurrency.fetch_add(1);
+        _tagged[tag]->concurrency.fetch_add(1);
+        WorkerArgs* args = new WorkerArgs;
+        args->control = this;
+        args->tag = tag;
         const int rc = pthread_create(
-                &_workers[i + old_concurency], NULL, worker_thread, this);
+                &_workers[nadded + old_concurency], NULL, worker_thread, args);
         if (rc) {
-            LOG(WARNING) << "Fail to create _workers[" << i + old_concurency
+            LOG(WARNING) << "Fail to create _workers[" << nadded + old_concurency
                          << "], " << berror(rc);
+            delete args;
+            _tagged[tag]->concurrency.fetch_sub(1, butil::memory_order_release);
             _concurrency.fetch_sub(1, butil::memory_order_release);
             break;
         }
     }
     // Cannot fail
     _workers.resize(_concurrency.load(butil::memory_order_relaxed));
-    return _concurrency.load(butil::memory_order_relaxed) - old_concurency;
+    return nadded;
+}
+
+int TaskControl::adjust_concurrency(TaggedGroups* tg, int64_t now_ns,
+                                    int64_t interval_ns) {
+    std::vector<TaskGroup*> active;
+    std::vector<TaskGroup*> suspended;
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        const size_t ngroup = tg->ngroup.load(butil::memory_order_relaxed);
+        for (size_t i = 0; i < ngroup; ++i) {
+            TaskGroup* g = tg->groups[i];
+            if (g == NULL) {
+                continue;
+            }
+            if (g->is_suspended()) {
+                suspended.push_back(g);
+            } else {
+                active.push_back(g);
+            }
+        }
+    }
+    if (active.empty() || interval_ns <= 0) {
+        return 0;
+    }
+    // Fields of groups are read without synchronization, which is fine
+    // for estimations.
+    int nblocked = 0;
+    int64_t busy_ns = 0;
+    size_t npending = 0;
+    for (size_t i = 0; i < active.size(); ++i) {
+        TaskGroup* g = active[i];
+        const size_t nswitch = g->_nswitch;
+        const bool running = (g->_cur_meta->tid != g->_main_tid);
+        int64_t total_busy_ns = g->_cumulated_cputime_ns;
+        if (running) {
+            total_busy_ns += now_ns - g->_last_run_ns;
+            if (nswitch == g->_sampled_nswitch) {
+                // Running a bthread through the interval, probably blocked
+                // by a syscall or a pthread-level lock.
+                ++nblocked;
+            }
+        }
+        busy_ns += total_busy_ns - g->_sampled_busy_ns;
+        g->_sampled_nswitch = nswitch;
+        g->_sampled_busy_ns = total_busy_ns;
+        npending += g->_rq.volatile_size() + g->_remote_rq.volatile_size()
+            + g->_deadline_rq.size();
+    }
+    for (size_t i = 0; i < suspended.size(); ++i) {
+        // Tasks may be pushed into queues of suspended groups as well.
+        npending += suspended[i]->_remote_rq.volatile_size()
+            + suspended[i]->_deadline_rq.size();
+    }
+    const int nactive = (int)active.size();
+    const double usage = (double)busy_ns / interval_ns / nactive;
+    const int ntag = ntags();
+    const int min_concurrency = std::max(
+        FLAGS_bthread_adaptive_min_concurrency / ntag, 1);
+    const int max_concurrency = std::max(
+        (FLAGS_bthread_adaptive_max_concurrency > 0 ?
+         FLAGS_bthread_adaptive_max_concurrency :
+         _initial_concurrency * 2) / ntag, min_concurrency);
+
+    int ngrow = 0;
+    if (nactive < min_concurrency) {
+        ngrow = min_concurrency - nactive;
+    } else if (npending > 0) {
+        if (nblocked > 0) {
+            ngrow = std::min((size_t)nblocked, npending);
+        } else if (usage > FLAGS_bthread_adaptive_busy_usage) {
+            ngrow = 1;
+        }
+    }
+    ngrow = std::min(ngrow, max_concurrency - nactive);
+    if (ngrow > 0) {
+        tg->idle_rounds = 0;
+        const int ngrown = grow_workers(tg, ngrow, suspended);
+        LOG(INFO) << "Grow workers of tag=" << tg->tag << " from " << nactive
+                  << " to " << nactive + ngrown << ", blocked=" << nblocked
+                  << " pending=" << npending << " usage=" << usage;
+        return nblocked;
+    }
+    if (usage >= FLAGS_bthread_adaptive_idle_usage || nblocked > 0 ||
+        nactive <= min_concurrency) {
+        tg->idle_rounds = 0;
+        return nblocked;
+    }
+    if (++tg->idle_rounds < FLAGS_bthread_adaptive_idle_rounds) {
+        return nblocked;
+    }
+    tg->idle_rounds = 0;
+    // Suspend an idle worker, prefer the most recently added one.
+    for (int i = nactive - 1; i >= 0; --i) {
+        TaskGroup* g = active[i];
+        if (g->_cur_meta->tid == g->_main_tid) {
+            // The worker is woken up and suspended right away if it's
+            // parked, otherwise after finishing the current task.
+            g->suspend();
+            _nsuspended.fetch_add(1, butil::memory_order_relaxed);
+            _nshrink << 1;
+            LOG(INFO) << "Shrink workers of tag=" << tg->tag << " from "
+                      << nactive << " to " << nactive - 1
+                      << ", usage=" << usage;
+            break;
+        }
+    }
+    return nblocked;
 }
 
-TaskGroup* TaskControl::choose_one_group() {
-    const size_t ngroup = _ngroup.load(butil::memory_order_acquire);
+int TaskControl::grow_workers(TaggedGroups* tg, int num,
+                              const std::vector<TaskGroup*>& suspended) {
+    int ngrown = 0;
+    for (size_t i = 0; i < suspended.size() && ngrown < num; ++i, ++ngrown) {
+        _nsuspended.fetch_sub(1, butil::memory_order_relaxed);
+        suspended[i]->resume();
+    }
+    if (ngrown < num) {
+        BAIDU_SCOPED_LOCK(g_task_control_mutex);
+        // -bthread_concurrency is not changed here, which is not
+        // synchronized with readers of the flag, bthread_getconcurrency()
+        // counts the added workers instead.
+        ngrown += add_workers(num - ngrown, tg->tag);
+    }
+    _ngrow << ngrown;
+    return ngrown;
+}
+
+TaskGroup* TaskControl::choose_one_group(bthread_tag_t tag) {
+    if (tag == BTHREAD_TAG_INVALID) {
+        tag = BTHREAD_TAG_DEFAULT;
+    }
+    TaggedGroups* tg = _tagged[tag];
+    const size_t ngroup = tg->ngroup.load(butil::memory_order_acquire);
     if (ngroup != 0) {
-        return _groups[butil::fast_rand_less_than(ngroup)];
+        return tg->groups[butil::fast_rand_less_than(ngroup)];
     }
-    CHECK(false) << "Impossible: ngroup is 0";
+    CHECK(false) << "Impossible: ngroup of tag=" << tag << " is 0";
     return NULL;
 }
 
@@ -226,14 +558,35 @@ void TaskControl::stop_and_join() {
     // which cannot be woken up by signal_task below)
     CHECK_EQ(0, stop_and_join_epoll_threads());
 
+    if (_has_adjuster) {
+        pthread_mutex_lock(&_adjuster_mutex);
+        _stop = true;
+        pthread_cond_signal(&_adjuster_cond);
+        pthread_mutex_unlock(&_adjuster_mutex);
+        pthread_join(_adjuster, NULL);
+        _has_adjuster = false;
+    }
+
     // Stop workers
     {
         BAIDU_SCOPED_LOCK(_modify_group_mutex);
         _stop = true;
+        // Suspended workers need to quit as well.
+        const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
+        for (size_t i = 0; i < ngroup; ++i) {
+            if (_groups[i] && _groups[i]->is_suspended()) {
+                _groups[i]->resume();
+            }
+        }
         _ngroup.exchange(0, butil::memory_order_relaxed); 
+        for (size_t i = 0; i < _tagged.size(); ++i) {
+            _tagged[i]->ngroup.exchange(0, butil::memory_order_relaxed);
+        }
     }
-    for (int i = 0; i < PARKING_LOT_NUM; ++i) {
-        _pl[i].stop();
+    for (size_t i = 0; i < _tagged.size(); ++i) {
+        for (int j = 0; j < PARKING_LOT_NUM_PER_TAG; ++j) {
+            _tagged[i]->pl[j].stop();
+        }
     }
     // Interrupt blocking operations.
     for (size_t i = 0; i < _workers.size(); ++i) {
@@ -249,15 +602,27 @@ TaskControl::~TaskControl() {
     // NOTE: g_task_control is not destructed now because the situation
     //       is extremely racy.
     delete _pending_time.exchange(NULL, butil::memory_order_relaxed);
+    delete _runqueue_wait.exchange(NULL, butil::memory_order_relaxed);
     _worker_usage_second.hide();
     _switch_per_second.hide();
     _signal_per_second.hide();
+    _steal_per_second.hide();
+    _spinning_workers.hide();
+    _nspin.hide();
+    _nspin_success.hide();
+    _spin_success_ratio.hide();
     _status.hide();
+    _active_workers.hide();
+    _blocked_workers.hide();
     
     stop_and_join();
 
     free(_groups);
     _groups = NULL;
+    for (size_t i = 0; i < _tagged.size(); ++i) {
+        delete _tagged[i];
+    }
+    _tagged.clear();
 }
 
 int TaskControl::_add_group(TaskGroup* g) {
@@ -273,10 +638,16 @@ int TaskControl::_add_group(TaskGroup* g) {
         _groups[ngroup] = g;
         _ngroup.store(ngroup + 1, butil::memory_order_release);
     }
+    TaggedGroups* tg = _tagged[g->tag()];
+    ngroup = tg->ngroup.load(butil::memory_order_relaxed);
+    if (ngroup < (size_t)BTHREAD_MAX_CONCURRENCY) {
+        tg->groups[ngroup] = g;
+        tg->ngroup.store(ngroup + 1, butil::memory_order_release);
+    }
     mu.unlock();
     // See the comments in _destroy_group
     // TODO: Not needed anymore since non-worker pthread cannot have TaskGroup
-    signal_task(65536);
+    signal_task(65536, g->tag());
     return 0;
 }
 
@@ -317,6 +688,16 @@ int TaskControl::_destroy_group(TaskGroup* g) {
                 break;
             }
         }
+        // Same as above.
+        TaggedGroups* tg = _tagged[g->tag()];
+        const size_t ntagged = tg->ngroup.load(butil::memory_order_relaxed);
+        for (size_t i = 0; i < ntagged; ++i) {
+            if (tg->groups[i] == g) {
+                tg->groups[i] = tg->groups[ntagged - 1];
+                tg->ngroup.store(ntagged - 1, butil::memory_order_release);
+                break;
+            }
+        }
     }
 
     // Can't delete g immediately because for performance consideration,
@@ -332,10 +713,12 @@ int TaskControl::_destroy_group(TaskGroup* g) {
     return 0;
 }
 
-bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
+bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                             bthread_tag_t tag) {
+    TaggedGroups* tg = _tagged[tag];
     // 1: Acquiring fence is paired with releasing fence in _add_group to
-    // avoid accessing uninitialized slot of _groups.
-    const size_t ngroup = _ngroup.load(butil::memory_order_acquire/*1*/);
+    // avoid accessing uninitialized slot of groups.
+    const size_t ngroup = tg->ngroup.load(butil::memory_order_acquire/*1*/);
     if (0 == ngroup) {
         return false;
     }
@@ -344,9 +727,19 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     bool stolen = false;
     size_t s = *seed;
     for (size_t i = 0; i < ngroup; ++i, s += offset) {
-        TaskGroup* g = _groups[s % ngroup];
+        TaskGroup* g = tg->groups[s % ngroup];
         // g is possibly NULL because of concurrent _destroy_group
         if (g) {
+            // Expired tasks with deadlines are run directly rather than
+            // being deprioritized, since the thief is idle.
+            int64_t deadline_us = 0;
+            if (g->_deadline_rq.pop(tid, &deadline_us)) {
+                if (deadline_us < butil::gettimeofday_us()) {
+                    _nexpired << 1;
+                }
+                stolen = true;
+                break;
+            }
             if (g->_rq.steal(tid)) {
                 stolen = true;
                 break;
@@ -361,7 +754,7 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     return stolen;
 }
 
-void TaskControl::signal_task(int num_task) {
+void TaskControl::signal_task(int num_task, bthread_tag_t tag) {
     if (num_task <= 0) {
         return;
     }
@@ -372,23 +765,51 @@ void TaskControl::signal_task(int num_task) {
     if (num_task > 2) {
         num_task = 2;
     }
-    int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM;
-    num_task -= _pl[start_index].signal(1);
+    ParkingLot* pl = _tagged[tag]->pl;
+    int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM_PER_TAG;
+    num_task -= pl[start_index].signal(1);
     if (num_task > 0) {
-        for (int i = 1; i < PARKING_LOT_NUM && num_task > 0; ++i) {
-            if (++start_index >= PARKING_LOT_NUM) {
+        for (int i = 1; i < PARKING_LOT_NUM_PER_TAG && num_task > 0; ++i) {
+            if (++start_index >= PARKING_LOT_NUM_PER_TAG) {
                 start_index = 0;
             }
-            num_task -= _pl[start_index].signal(1);
+            num_task -= pl[start_index].signal(1);
+        }
+    }
+    add_worker_if_unsignalled(num_task, tag);
+}
+
+void TaskControl::signal_task_batch(int num_task, bthread_tag_t tag) {
+    if (num_task <= 0) {
+        return;
+    }
+    const int max_workers = FLAGS_bthread_batch_signal_max_workers;
+    if (num_task > max_workers) {
+        num_task = (max_workers > 0 ? max_workers : 1);
+    }
+    // Wake up all needed workers in one parking lot with one futex call,
+    // other parking lots are tried only when there're not enough workers
+    // waiting in it.
+    ParkingLot* pl = _tagged[tag]->pl;
+    int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM_PER_TAG;
+    num_task -= pl[start_index].signal(num_task);
+    for (int i = 1; i < PARKING_LOT_NUM_PER_TAG && num_task > 0; ++i) {
+        if (++start_index >= PARKING_LOT_NUM_PER_TAG) {
+            start_index = 0;
         }
+        num_task -= pl[start_index].signal(num_task);
     }
+    add_worker_if_unsignalled(num_task, tag);
+}
+
+void TaskControl::add_worker_if_unsignalled(int num_task, bthread_tag_t tag) {
     if (num_task > 0 &&
         FLAGS_bthread_min_concurrency > 0 &&    // test min_concurrency for performance
         _concurrency.load(butil::memory_order_relaxed) < FLAGS_bthread_concurrency) {
         // TODO: Reduce this lock
         BAIDU_SCOPED_LOCK(g_task_control_mutex);
         if (_concurrency.load(butil::memory_order_acquire) < FLAGS_bthread_concurrency) {
-            add_workers(1);
+            add_workers(1, tag);
         }
     }
 }
@@ -446,6 +867,81 @@ int64_t TaskControl::get_cumulated_signal_count() {
     return c;
 }
 
+int64_t TaskControl::get_cumulated_steal_count() {
+    int64_t c = 0;
+    BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
+    for (size_t i = 0; i < ngroup; ++i) {
+        if (_groups[i]) {
+            c += _groups[i]->_nsteal;
+        }
+    }
+    return c;
+}
+
+bool TaskControl::begin_spin() {
+    if (_nspinning.fetch_add(1, butil::memory_order_relaxed) >=
+        FLAGS_bthread_max_spinning_workers) {
+        _nspinning.fetch_sub(1, butil::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void TaskControl::end_spin(bool success) {
+    _nspinning.fetch_sub(1, butil::memory_order_relaxed);
+    _nspin << 1;
+    if (success) {
+        _nspin_success << 1;
+    }
+}
+
+double TaskControl::get_spin_success_ratio() {
+    const int64_t nspin = _spin_second.get_value(1);
+    if (nspin <= 0) {
+        return 0;
+    }
+    return (double)_spin_success_second.get_value(1) / nspin;
+}
+
+void TaskControl::print_sched_stats(std::ostream& os) {
+    os << "switch_second: " << _switch_per_second.get_value(1)
+       << "\nsignal_second: " << _signal_per_second.get_value(1)
+       << "\nsteal_second: " << _steal_per_second.get_value(1)
+       << "\ncumulated_steal_count: " << get_cumulated_steal_count()
+       << "\nspin_second: " << _spin_second.get_value(1)
+       << "\nspin_success_ratio: " << get_spin_success_ratio()
+       << "\n";
+    bvar::LatencyRecorder* rw = _runqueue_wait.load(butil::memory_order_consume);
+    if (rw) {
+        os << "runqueue_wait_us: avg=" << rw->latency()
+           << " p50=" << rw->latency_percentile(0.5)
+           << " p99=" << rw->latency_percentile(0.99)
+           << " p999=" << rw->latency_percentile(0.999)
+           << " max=" << rw->max_latency() << '\n';
+    } else {
+        os << "runqueue_wait_us: turn on -show_bthread_runqueue_wait_in_vars\n";
+    }
+    os << "\n[cpu usage by accounts]\n";
+    print_cpu_accounts(os);
+}
+
+bvar::LatencyRecorder* TaskControl::create_exposed_runqueue_wait() {
+    bool is_creator = false;
+    _pending_time_mutex.lock();
+    bvar::LatencyRecorder* rw = _runqueue_wait.load(butil::memory_order_consume);
+    if (!rw) {
+        rw = new bvar::LatencyRecorder;
+        _runqueue_wait.store(rw, butil::memory_order_release);
+        is_creator = true;
+    }
+    _pending_time_mutex.unlock();
+    if (is_creator) {
+        rw->expose("bthread_runqueue_wait");
+    }
+    return rw;
+}
+
 bvar::LatencyRecorder* TaskControl::create_exposed_pending_time() {
     bool is_creator = false;
     _pending_time_mutex.lock();
@@ -26,6 +26,7 @@
 #include <iostream>                             // std::ostream
 #endif
 #include <stddef.h>                             // size_t
+#include <vector>
 #include "butil/atomicops.h"                     // butil::atomic
 #include "bvar/bvar.h"                          // bvar::PassiveStatus
 #include "bthread/task_meta.h"                  // TaskMeta
@@ -37,6 +38,8 @@ namespace bthread {
 
 class TaskGroup;
 
+static const int PARKING_LOT_NUM_PER_TAG = 4;
+
 // Control all task groups
 class TaskControl {
     friend class TaskGroup;
@@ -45,17 +48,25 @@ public:
     TaskControl();
     ~TaskControl();
 
-    // Must be called before using. `nconcurrency' is # of worker pthreads.
+    // Must be called before using. `nconcurrency' is # of worker pthreads,
+    // which are evenly distributed to -task_group_ntags pools.
     int init(int nconcurrency);
     
-    // Create a TaskGroup in this control.
-    TaskGroup* create_group();
+    // Create a TaskGroup with `tag' in this control.
+    TaskGroup* create_group(bthread_tag_t tag);
+
+    // Steal a task from a "random" group with `tag'.
+    bool steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                    bthread_tag_t tag);
 
-    // Steal a task from a "random" group.
-    bool steal_task(bthread_t* tid, size_t* seed, size_t offset);
+    // Tell other groups with `tag' that `n' tasks was just added to
+    // caller's runqueue
+    void signal_task(int num_task, bthread_tag_t tag);
 
-    // Tell other groups that `n' tasks was just added to caller's runqueue
-    void signal_task(int num_task);
+    // Tell other groups with `tag' that a batch of `num_task' tasks was
+    // just added. Unlike signal_task() which wakes up at most 2 workers,
+    // up to -bthread_batch_signal_max_workers workers are woken up.
+    void signal_task_batch(int num_task, bthread_tag_t tag);
 
     // Stop and join worker threads in TaskControl.
     void stop_and_join();
@@ -64,21 +75,66 @@ public:
     int concurrency() const 
     { return _concurrency.load(butil::memory_order_acquire); }
 
+    // Get # of worker threads with `tag'.
+    int concurrency(bthread_tag_t tag) const
+    { return _tagged[tag]->concurrency.load(butil::memory_order_acquire); }
+
+    // Number of pools of workers.
+    int ntags() const { return (int)_tagged.size(); }
+
     void print_rq_sizes(std::ostream& os);
 
     double get_cumulated_worker_time();
     int64_t get_cumulated_switch_count();
     int64_t get_cumulated_signal_count();
-
-    // [Not thread safe] Add more worker threads.
+    int64_t get_cumulated_steal_count();
+
+    // Called by an idle worker before spinning for new tasks. Returns false
+    // when -bthread_max_spinning_workers workers are already spinning.
+    bool begin_spin();
+    // Called when the worker stops spinning, `success' is true if the worker
+    // got a task.
+    void end_spin(bool success);
+    int spinning_workers() const
+    { return _nspinning.load(butil::memory_order_relaxed); }
+    // Ratio of spinnings that got tasks in last second.
+    double get_spin_success_ratio();
+
+    // Print statistics of scheduling, shown in /bthreads.
+    void print_sched_stats(std::ostream& os);
+
+    // [Not thread safe] Add more worker threads with `tag'.
     // Return the number of workers actually added, which may be less than |num|
-    int add_workers(int num);
+    int add_workers(int num, bthread_tag_t tag = BTHREAD_TAG_DEFAULT);
 
-    // Choose one TaskGroup (randomly right now).
+    // Choose one TaskGroup with `tag' (randomly right now), BTHREAD_TAG_INVALID
+    // is treated as BTHREAD_TAG_DEFAULT.
     // If this method is called after init(), it never returns NULL.
-    TaskGroup* choose_one_group();
+    TaskGroup* choose_one_group(bthread_tag_t tag = BTHREAD_TAG_DEFAULT);
 
 private:
+    // Groups, parking lots and vars of workers with the same tag. Tasks are
+    // only stolen and signalled between groups with the same tag.
+    struct TaggedGroups {
+        TaggedGroups(TaskControl* c, bthread_tag_t tag);
+        ~TaggedGroups();
+        static double get_cumulated_worker_time(void* arg);
+        static int get_concurrency(void* arg);
+
+        TaskControl* control;
+        bthread_tag_t tag;
+        butil::atomic<size_t> ngroup;
+        TaskGroup** groups;
+        butil::atomic<int> concurrency;
+        ParkingLot pl[PARKING_LOT_NUM_PER_TAG];
+        bvar::PassiveStatus<double> cumulated_worker_time;
+        bvar::PerSecond<bvar::PassiveStatus<double> > worker_usage_second;
+        bvar::PassiveStatus<int> nworkers;
+        // Consecutive rounds that workers are idle enough, see
+        // adjust_concurrency().
+        int idle_rounds;
+    };
+
     // Add/Remove a TaskGroup.
     // Returns 0 on success, -1 otherwise.
     int _add_group(TaskGroup*);
@@ -86,10 +142,27 @@ private:
 
     static void delete_task_group(void* arg);
 
-    static void* worker_thread(void* task_control);
+    // Add a worker when `num_task' tasks were not signalled to any worker
+    // and concurrency is less than -bthread_concurrency.
+    void add_worker_if_unsignalled(int num_task, bthread_tag_t tag);
+
+    static void* worker_thread(void* arg);
+
+    // Periodically resume/add or suspend workers according to usage and
+    // blocking of workers when -bthread_adaptive_concurrency is on.
+    static void* adjuster_thread(void* arg);
+    // Returns number of blocked workers with the tag.
+    int adjust_concurrency(TaggedGroups* tg, int64_t now_ns,
+                           int64_t interval_ns);
+    int grow_workers(TaggedGroups* tg, int num,
+                     const std::vector<TaskGroup*>& suspended);
+    static int get_active_concurrency(void* arg);
+    static int get_blocked_workers(void* arg);
 
     bvar::LatencyRecorder& exposed_pending_time();
     bvar::LatencyRecorder* create_exposed_pending_time();
+    bvar::LatencyRecorder& exposed_runqueue_wait();
+    bvar::LatencyRecorder* create_exposed_runqueue_wait();
 
     butil::atomic<size_t> _ngroup;
     TaskGroup** _groups;
@@ -102,17 +175,40 @@ private:
     bvar::Adder<int64_t> _nworkers;
     butil::Mutex _pending_time_mutex;
     butil::atomic<bvar::LatencyRecorder*> _pending_time;
+    butil::atomic<bvar::LatencyRecorder*> _runqueue_wait;
     bvar::PassiveStatus<double> _cumulated_worker_time;
     bvar::PerSecond<bvar::PassiveStatus<double> > _worker_usage_second;
     bvar::PassiveStatus<int64_t> _cumulated_switch_count;
     bvar::PerSecond<bvar::PassiveStatus<int64_t> > _switch_per_second;
     bvar::PassiveStatus<int64_t> _cumulated_signal_count;
     bvar::PerSecond<bvar::PassiveStatus<int64_t> > _signal_per_second;
+    bvar::PassiveStatus<int64_t> _cumulated_steal_count;
+    bvar::PerSecond<bvar::PassiveStatus<int64_t> > _steal_per_second;
     bvar::PassiveStatus<std::string> _status;
     bvar::Adder<int64_t> _nbthreads;
-
-    static const int PARKING_LOT_NUM = 4;
-    ParkingLot _pl[PARKING_LOT_NUM];
+    bvar::Adder<int64_t> _nexpired;
+
+    std::vector<TaggedGroups*> _tagged;
+
+    int _initial_concurrency;
+    bool _has_adjuster;
+    pthread_t _adjuster;
+    pthread_mutex_t _adjuster_mutex;
+    pthread_cond_t _adjuster_cond;
+    butil::atomic<int> _nsuspended;
+    butil::atomic<int> _nblocked;
+    bvar::PassiveStatus<int> _active_workers;
+    bvar::PassiveStatus<int> _blocked_workers;
+    bvar::Adder<int64_t> _ngrow;
+    bvar::Adder<int64_t> _nshrink;
+
+    butil::atomic<int> _nspinning;
+    bvar::PassiveStatus<int> _spinning_workers;
+    bvar::Adder<int64_t> _nspin;
+    bvar::Adder<int64_t> _nspin_success;
+    bvar::PerSecond<bvar::Adder<int64_t> > _spin_second;
+    bvar::PerSecond<bvar::Adder<int64_t> > _spin_success_second;
+    bvar::PassiveStatus<double> _spin_success_ratio;
 };
 
 inline bvar::LatencyRecorder& TaskControl::exposed_pending_time() {
@@ -123,6 +219,14 @@ inline bvar::LatencyRecorder& TaskControl::exposed_pending_time() {
     return *pt;
 }
 
+inline bvar::LatencyRecorder& TaskControl::exposed_runqueue_wait() {
+    bvar::LatencyRecorder* rw = _runqueue_wait.load(butil::memory_order_consume);
+    if (!rw) {
+        rw = create_exposed_runqueue_wait();
+    }
+    return *rw;
+}
+
 }  // namespace bthread
 
 #endif  // BTHREAD_TASK_CONTROL_H
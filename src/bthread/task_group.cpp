@@ -21,6 +21,7 @@
 
 #include <sys/types.h>
 #include <stddef.h>                         // size_t
+#include <algorithm>                        // std::min
 #include <gflags/gflags.h>
 #include "butil/compat.h"                   // OS_MACOSX
 #include "butil/macros.h"                   // ARRAY_SIZE
@@ -36,11 +37,15 @@
 #include "bthread/task_group.h"
 #include "bthread/timer_thread.h"
 #include "bthread/errno.h"
+#include "bthread/cpu_account.h"
+
+DECLARE_int32(bthread_worker_spin_max_us);
+DECLARE_int32(task_group_yield_before_idle);
 
 namespace bthread {
 
 static const bthread_attr_t BTHREAD_ATTR_TASKGROUP = {
-    BTHREAD_STACKTYPE_UNKNOWN, 0, NULL };
+    BTHREAD_STACKTYPE_UNKNOWN, 0, NULL, BTHREAD_TAG_INVALID, NULL };
 
 static bool pass_bool(const char*, bool) { return true; }
 
@@ -51,6 +56,25 @@ const bool ALLOW_UNUSED dummy_show_bthread_creation_in_vars =
     ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_bthread_creation_in_vars,
                                     pass_bool);
 
+DEFINE_bool(show_bthread_runqueue_wait_in_vars, false, "When this flag is on, "
+            "the time from bthreads being put into runqueues to running is "
+            "recorded and shown in /vars/bthread_runqueue_wait*");
+const bool ALLOW_UNUSED dummy_show_bthread_runqueue_wait_in_vars =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_bthread_runqueue_wait_in_vars,
+                                    pass_bool);
+
+// Remember when the task is put into a runqueue. The time is not updated if
+// the task is moved between runqueues.
+inline void mark_ready(TaskMeta* m) {
+#ifndef BTHREAD_NO_SCHED_ACCOUNTING
+    if (FLAGS_show_bthread_runqueue_wait_in_vars && m->ready_ns == 0) {
+        m->ready_ns = butil::cpuwide_time_ns();
+    }
+#else
+    (void)m;
+#endif
+}
+
 DEFINE_bool(show_per_worker_usage_in_vars, false,
             "Show per-worker usage in /vars/bthread_per_worker_usage_<tid>");
 const bool ALLOW_UNUSED dummy_show_per_worker_usage_in_vars =
@@ -115,15 +139,62 @@ bool TaskGroup::is_stopped(bthread_t tid) {
     return true;
 }
 
+bool TaskGroup::spin_for_task(bthread_t* tid, int64_t idle_begin_ns) {
+    const int64_t max_spin_ns = FLAGS_bthread_worker_spin_max_us * 1000L;
+    // Spin only when tasks came soon after the worker became idle recently.
+    if (_avg_idle_ns > max_spin_ns) {
+        return false;
+    }
+    const int64_t spin_ns = std::min(_avg_idle_ns * 2, max_spin_ns);
+    if (spin_ns <= 0 || !_control->begin_spin()) {
+        return false;
+    }
+    const int64_t deadline_ns = idle_begin_ns + spin_ns;
+    bool found = false;
+    do {
+        if (steal_task(tid)) {
+            found = true;
+            break;
+        }
+        for (int i = 0; i < 32; ++i) {
+            cpu_relax();
+        }
+    } while (butil::cpuwide_time_ns() < deadline_ns &&
+             !_suspended.load(butil::memory_order_relaxed));
+    _control->end_spin(found);
+    return found;
+}
+
 bool TaskGroup::wait_task(bthread_t* tid) {
+    int64_t idle_begin_ns = 0;
+    if (FLAGS_bthread_worker_spin_max_us > 0) {
+        idle_begin_ns = butil::cpuwide_time_ns();
+    }
+    if (idle_begin_ns && spin_for_task(tid, idle_begin_ns)) {
+        // Taken by spinning, the average does not change much.
+        _avg_idle_ns += (butil::cpuwide_time_ns() - idle_begin_ns
+                         - _avg_idle_ns) / 8;
+        return true;
+    }
+    for (int i = 0; i < FLAGS_task_group_yield_before_idle; ++i) {
+        sched_yield();
+        if (steal_task(tid)) {
+            return true;
+        }
+    }
     do {
+        // Checked before waiting on the parking lot, so that a worker woken
+        // up for a task still runs the task before being suspended.
+        while (_suspended.load(butil::memory_order_acquire)) {
+            futex_wait_private(&_suspended, 1, NULL);
+        }
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         if (_last_pl_state.stopped()) {
             return false;
         }
-        _pl->wait(_last_pl_state);
+        _pl->wait(_last_pl_state, _pl_waiter_bits);
         if (steal_task(tid)) {
-            return true;
+            break;
         }
 #else
         const ParkingLot::State st = _pl->get_state();
@@ -131,17 +202,38 @@ bool TaskGroup::wait_task(bthread_t* tid) {
             return false;
         }
         if (steal_task(tid)) {
-            return true;
+            break;
         }
-        _pl->wait(st);
+        _pl->wait(st, _pl_waiter_bits);
 #endif
     } while (true);
+    if (idle_begin_ns) {
+        // Long intervals are capped so that the worker spins again soon
+        // after tasks come frequently.
+        const int64_t max_idle_ns = FLAGS_bthread_worker_spin_max_us * 2000L;
+        const int64_t idle_ns = std::min(
+            butil::cpuwide_time_ns() - idle_begin_ns, max_idle_ns);
+        _avg_idle_ns += (idle_ns - _avg_idle_ns) / 8;
+    }
+    return true;
 }
 
 static double get_cumulated_cputime_from_this(void* arg) {
     return static_cast<TaskGroup*>(arg)->cumulated_cputime_ns() / 1000000000.0;
 }
 
+void TaskGroup::suspend() {
+    _suspended.store(1, butil::memory_order_release);
+    // Parked workers are woken up by signals of tasks in any order, wake up
+    // this one specifically so that it's suspended at once.
+    _pl->wake_waiters(_pl_waiter_bits);
+}
+
+void TaskGroup::resume() {
+    _suspended.store(0, butil::memory_order_release);
+    futex_wake_private(&_suspended, 1);
+}
+
 void TaskGroup::run_main_task() {
     bvar::PassiveStatus<double> cumulated_cputime(
         get_cumulated_cputime_from_this, this);
@@ -173,18 +265,20 @@ void TaskGroup::run_main_task() {
     current_task()->stat.cputime_ns += butil::cpuwide_time_ns() - _last_run_ns;
 }
 
-TaskGroup::TaskGroup(TaskControl* c)
+TaskGroup::TaskGroup(TaskControl* c, bthread_tag_t tag)
     :
 #ifndef NDEBUG
     _sched_recursive_guard(0),
 #endif
     _cur_meta(NULL)
     , _control(c)
+    , _tag(tag)
     , _num_nosignal(0)
     , _nsignaled(0)
     , _last_run_ns(butil::cpuwide_time_ns())
     , _cumulated_cputime_ns(0)
     , _nswitch(0)
+    , _nsteal(0)
     , _last_context_remained(NULL)
     , _last_context_remained_arg(NULL)
     , _pl(NULL)
@@ -192,10 +286,18 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _main_tid(0)
     , _remote_num_nosignal(0)
     , _remote_nsignaled(0)
+    , _suspended(0)
+    , _avg_idle_ns(0)
+    , _sampled_nswitch(0)
+    , _sampled_busy_ns(0)
 {
     _steal_seed = butil::fast_rand();
     _steal_offset = OFFSET_TABLE[_steal_seed % ARRAY_SIZE(OFFSET_TABLE)];
-    _pl = &c->_pl[butil::fmix64(pthread_numeric_id()) % TaskControl::PARKING_LOT_NUM];
+    _pl = &c->_tagged[tag]->pl[
+        butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM_PER_TAG];
+    // Workers sharing a bit are woken up together by wake_waiters(), which
+    // is rare and harmless.
+    _pl_waiter_bits = 1 << butil::fast_rand_less_than(31);
     CHECK(c);
 }
 
@@ -235,8 +337,10 @@ int TaskGroup::init(size_t runqueue_capacity) {
     m->fn = NULL;
     m->arg = NULL;
     m->local_storage = LOCAL_STORAGE_INIT;
+    m->deadline_us = -1;
     m->cpuwide_start_ns = butil::cpuwide_time_ns();
     m->stat = EMPTY_STAT;
+    m->ready_ns = 0;
     m->attr = BTHREAD_ATTR_TASKGROUP;
     m->tid = make_tid(*m->version_butex, slot);
     m->set_stack(stk);
@@ -311,6 +415,11 @@ void TaskGroup::task_runner(intptr_t skip_remained) {
                       << m->stat.cputime_ns / 1000000.0 << "ms";
         }
 
+        // Account the last time slice before joiners are woken up.
+        if (m->attr.cpu_account) {
+            g->set_current_cpu_account(NULL);
+        }
+
         // Clean tls variables, must be done before changing version_butex
         // otherwise another thread just joined this thread may not see side
         // effects of destructing tls variables.
@@ -378,14 +487,21 @@ int TaskGroup::start_foreground(TaskGroup** pg,
     m->arg = arg;
     CHECK(m->stack == NULL);
     m->attr = using_attr;
+    // The caller has chosen a group with the tag in attr, if any.
+    m->attr.tag = (*pg)->_tag;
     m->local_storage = LOCAL_STORAGE_INIT;
+    m->deadline_us = -1;
     m->cpuwide_start_ns = start_ns;
     m->stat = EMPTY_STAT;
+    m->ready_ns = 0;
     m->tid = make_tid(*m->version_butex, slot);
     *th = m->tid;
     if (using_attr.flags & BTHREAD_LOG_START_AND_FINISH) {
         LOG(INFO) << "Started bthread " << m->tid;
     }
+    if (using_attr.cpu_account) {
+        using_attr.cpu_account->nattach << 1;
+    }
 
     TaskGroup* g = *pg;
     g->_control->_nbthreads << 1;
@@ -414,7 +530,8 @@ template <bool REMOTE>
 int TaskGroup::start_background(bthread_t* __restrict th,
                                 const bthread_attr_t* __restrict attr,
                                 void * (*fn)(void*),
-                                void* __restrict arg) {
+                                void* __restrict arg,
+                                int64_t deadline_us) {
     if (__builtin_expect(!fn, 0)) {
         return EINVAL;
     }
@@ -433,16 +550,27 @@ int TaskGroup::start_background(bthread_t* __restrict th,
     m->arg = arg;
     CHECK(m->stack == NULL);
     m->attr = using_attr;
+    m->attr.tag = _tag;
     m->local_storage = LOCAL_STORAGE_INIT;
+    m->deadline_us = (deadline_us < 0 ? -1 : deadline_us);
     m->cpuwide_start_ns = start_ns;
     m->stat = EMPTY_STAT;
+    m->ready_ns = 0;
     m->tid = make_tid(*m->version_butex, slot);
     *th = m->tid;
     if (using_attr.flags & BTHREAD_LOG_START_AND_FINISH) {
         LOG(INFO) << "Started bthread " << m->tid;
     }
+    if (using_attr.cpu_account) {
+        using_attr.cpu_account->nattach << 1;
+    }
     _control->_nbthreads << 1;
-    if (REMOTE) {
+    if (m->deadline_us >= 0) {
+        // Tasks with deadlines are rare and urgent, signal workers anyway.
+        mark_ready(m);
+        _deadline_rq.push(m->tid, m->deadline_us);
+        _control->signal_task(1, _tag);
+    } else if (REMOTE) {
         ready_to_run_remote(m->tid, (using_attr.flags & BTHREAD_NOSIGNAL));
     } else {
         ready_to_run(m->tid, (using_attr.flags & BTHREAD_NOSIGNAL));
@@ -455,12 +583,14 @@ template int
 TaskGroup::start_background<true>(bthread_t* __restrict th,
                                   const bthread_attr_t* __restrict attr,
                                   void * (*fn)(void*),
-                                  void* __restrict arg);
+                                  void* __restrict arg,
+                                  int64_t deadline_us);
 template int
 TaskGroup::start_background<false>(bthread_t* __restrict th,
                                    const bthread_attr_t* __restrict attr,
                                    void * (*fn)(void*),
-                                   void* __restrict arg);
+                                   void* __restrict arg,
+                                   int64_t deadline_us);
 
 int TaskGroup::join(bthread_t tid, void** return_value) {
     if (__builtin_expect(!tid, 0)) {  // tid of bthread is never 0.
@@ -504,6 +634,52 @@ TaskStatistics TaskGroup::main_stat() const {
     return m ? m->stat : EMPTY_STAT;
 }
 
+void TaskGroup::set_current_cpu_account(bthread_cpu_account_t* account) {
+    TaskMeta* const m = _cur_meta;
+    bthread_cpu_account_t* const old = m->attr.cpu_account;
+    if (account == old) {
+        return;
+    }
+#ifndef BTHREAD_NO_SCHED_ACCOUNTING
+    // The running time slice is accounted to the account set at the end of
+    // the slice in sched_to(), end the slice here so that the time before
+    // goes to `old' and nothing is charged to `account' in advance.
+    const int64_t now = butil::cpuwide_time_ns();
+    // cpuwide_time_ns() may go backwards slightly across cpus.
+    const int64_t elp_ns = std::max(now - _last_run_ns, (int64_t)0);
+    _last_run_ns = now;
+    m->stat.cputime_ns += elp_ns;
+    _cumulated_cputime_ns += elp_ns;
+    if (old) {
+        old->cputime_ns << elp_ns;
+    }
+#endif
+    if (account) {
+        account->nattach << 1;
+    }
+    m->attr.cpu_account = account;
+}
+
+bool TaskGroup::pop_deadline_task(bthread_t* tid) {
+    bthread_t t = 0;
+    int64_t deadline_us = 0;
+    int64_t now_us = 0;
+    while (_deadline_rq.pop(&t, &deadline_us)) {
+        if (now_us == 0) {
+            now_us = butil::gettimeofday_us();
+        }
+        if (deadline_us >= now_us) {
+            *tid = t;
+            return true;
+        }
+        // The task can't be done in time, run it after others to
+        // let tasks which still have chances to be done run first.
+        _control->_nexpired << 1;
+        ready_to_run_remote(t, true);
+    }
+    return false;
+}
+
 void TaskGroup::ending_sched(TaskGroup** pg) {
     TaskGroup* g = *pg;
     bthread_t next_tid = 0;
@@ -512,9 +688,11 @@ void TaskGroup::ending_sched(TaskGroup** pg) {
     // When BTHREAD_FAIR_WSQ is defined, profiling shows that cpu cost of
     // WSQ::steal() in example/multi_threaded_echo_c++ changes from 1.9%
     // to 2.9%
-    const bool popped = g->_rq.pop(&next_tid);
+    const bool popped = g->pop_deadline_task(&next_tid) ||
+        g->_rq.pop(&next_tid);
 #else
-    const bool popped = g->_rq.steal(&next_tid);
+    const bool popped = g->pop_deadline_task(&next_tid) ||
+        g->_rq.steal(&next_tid);
 #endif
     if (!popped && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
@@ -550,9 +728,11 @@ void TaskGroup::sched(TaskGroup** pg) {
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
 #ifndef BTHREAD_FAIR_WSQ
-    const bool popped = g->_rq.pop(&next_tid);
+    const bool popped = g->pop_deadline_task(&next_tid) ||
+        g->_rq.pop(&next_tid);
 #else
-    const bool popped = g->_rq.steal(&next_tid);
+    const bool popped = g->pop_deadline_task(&next_tid) ||
+        g->_rq.steal(&next_tid);
 #endif
     if (!popped && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
@@ -583,6 +763,18 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta) {
     }
     ++cur_meta->stat.nswitch;
     ++ g->_nswitch;
+#ifndef BTHREAD_NO_SCHED_ACCOUNTING
+    if (cur_meta->attr.cpu_account) {
+        cur_meta->attr.cpu_account->cputime_ns << elp_ns;
+    }
+    if (next_meta->ready_ns) {
+        if (FLAGS_show_bthread_runqueue_wait_in_vars) {
+            g->_control->exposed_runqueue_wait() <<
+                (now - next_meta->ready_ns) / 1000L;
+        }
+        next_meta->ready_ns = 0;
+    }
+#endif
     // Switch to the task
     if (__builtin_expect(next_meta != cur_meta, 1)) {
         g->_cur_meta = next_meta;
@@ -644,6 +836,7 @@ void TaskGroup::destroy_self() {
 }
 
 void TaskGroup::ready_to_run(bthread_t tid, bool nosignal) {
+    mark_ready(address_meta(tid));
     push_rq(tid);
     if (nosignal) {
         ++_num_nosignal;
@@ -651,7 +844,7 @@ void TaskGroup::ready_to_run(bthread_t tid, bool nosignal) {
         const int additional_signal = _num_nosignal;
         _num_nosignal = 0;
         _nsignaled += 1 + additional_signal;
-        _control->signal_task(1 + additional_signal);
+        _control->signal_task(1 + additional_signal, _tag);
     }
 }
 
@@ -660,11 +853,12 @@ void TaskGroup::flush_nosignal_tasks() {
     if (val) {
         _num_nosignal = 0;
         _nsignaled += val;
-        _control->signal_task(val);
+        _control->signal_task(val, _tag);
     }
 }
 
 void TaskGroup::ready_to_run_remote(bthread_t tid, bool nosignal) {
+    mark_ready(address_meta(tid));
     _remote_rq._mutex.lock();
     while (!_remote_rq.push_locked(tid)) {
         flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
@@ -681,7 +875,7 @@ void TaskGroup::ready_to_run_remote(bthread_t tid, bool nosignal) {
         _remote_num_nosignal = 0;
         _remote_nsignaled += 1 + additional_signal;
         _remote_rq._mutex.unlock();
-        _control->signal_task(1 + additional_signal);
+        _control->signal_task(1 + additional_signal, _tag);
     }
 }
 
@@ -694,7 +888,7 @@ void TaskGroup::flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex) {
     _remote_num_nosignal = 0;
     _remote_nsignaled += val;
     locked_mutex.unlock();
-    _control->signal_task(val);
+    _control->signal_task(val, _tag);
 }
 
 void TaskGroup::ready_to_run_general(bthread_t tid, bool nosignal) {
@@ -711,6 +905,47 @@ void TaskGroup::flush_nosignal_tasks_general() {
     return flush_nosignal_tasks_remote();
 }
 
+void TaskGroup::ready_to_run_batch(const bthread_t* tids, size_t n,
+                                   size_t* nunsignaled) {
+    if (tls_task_group == this) {
+        for (size_t i = 0; i < n; ++i) {
+            mark_ready(address_meta(tids[i]));
+            while (!_rq.push(tids[i])) {
+                // Other workers must know the tasks pushed before(including
+                // ones of previous calls in the batch) to steal them,
+                // otherwise _rq is never drained.
+                _control->signal_task_batch(*nunsignaled, _tag);
+                *nunsignaled = 0;
+                flush_nosignal_tasks();
+                LOG_EVERY_SECOND(ERROR) << "_rq is full, capacity="
+                                        << _rq.capacity();
+                ::usleep(1000);
+            }
+            ++*nunsignaled;
+        }
+        _nsignaled += n;
+        return;
+    }
+    _remote_rq._mutex.lock();
+    for (size_t i = 0; i < n; ++i) {
+        mark_ready(address_meta(tids[i]));
+        while (!_remote_rq.push_locked(tids[i])) {
+            // Workers must know the tasks pushed before sleeping.
+            const size_t nsignal = *nunsignaled;
+            *nunsignaled = 0;
+            _remote_rq._mutex.unlock();
+            _control->signal_task_batch(nsignal, _tag);
+            LOG_EVERY_SECOND(ERROR) << "_remote_rq is full, capacity="
+                                    << _remote_rq.capacity();
+            ::usleep(1000);
+            _remote_rq._mutex.lock();
+        }
+        ++*nunsignaled;
+    }
+    _remote_nsignaled += n;
+    _remote_rq._mutex.unlock();
+}
+
 void TaskGroup::ready_to_run_in_worker(void* args_in) {
     ReadyToRunArgs* args = static_cast<ReadyToRunArgs*>(args_in);
     return tls_task_group->ready_to_run(args->tid, args->nosignal);
@@ -718,6 +953,7 @@ void TaskGroup::ready_to_run_in_worker(void* args_in) {
 
 void TaskGroup::ready_to_run_in_worker_ignoresignal(void* args_in) {
     ReadyToRunArgs* args = static_cast<ReadyToRunArgs*>(args_in);
+    mark_ready(address_meta(args->tid));
     return tls_task_group->push_rq(args->tid);
 }
 
@@ -731,7 +967,8 @@ struct SleepArgs {
 static void ready_to_run_from_timer_thread(void* arg) {
     CHECK(tls_task_group == NULL);
     const SleepArgs* e = static_cast<const SleepArgs*>(arg);
-    e->group->control()->choose_one_group()->ready_to_run_remote(e->tid);
+    e->group->control()->choose_one_group(e->group->tag())
+        ->ready_to_run_remote(e->tid);
 }
 
 void TaskGroup::_add_sleep_event(void* void_args) {
@@ -867,14 +1104,16 @@ int TaskGroup::interrupt(bthread_t tid, TaskControl* c) {
         }
     } else if (sleep_id != 0) {
         if (get_global_timer_thread()->unschedule(sleep_id) == 0) {
+            // The sleeping bthread must be resumed in a group with its tag.
+            const bthread_tag_t tag = address_meta(tid)->attr.tag;
             bthread::TaskGroup* g = bthread::tls_task_group;
-            if (g) {
+            if (g && g->tag() == tag) {
                 g->ready_to_run(tid);
             } else {
                 if (!c) {
                     return EINVAL;
                 }
-                c->choose_one_group()->ready_to_run_remote(tid);
+                c->choose_one_group(tag)->ready_to_run_remote(tid);
             }
         }
     }
@@ -931,6 +1170,9 @@ void print_task(std::ostream& os, bthread_t tid) {
            << "\nattr={stack_type=" << attr.stack_type
            << " flags=" << attr.flags
            << " keytable_pool=" << attr.keytable_pool
+           << " tag=" << attr.tag
+           << " cpu_account="
+           << (attr.cpu_account ? attr.cpu_account->name : std::string("null"))
            << "}\nhas_tls=" << has_tls
            << "\nuptime_ns=" << butil::cpuwide_time_ns() - cpuwide_start_ns
            << "\ncputime_ns=" << stat.cputime_ns
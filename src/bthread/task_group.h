@@ -27,6 +27,7 @@
 #include "bthread/task_meta.h"                     // bthread_t, TaskMeta
 #include "bthread/work_stealing_queue.h"           // WorkStealingQueue
 #include "bthread/remote_task_queue.h"             // RemoteTaskQueue
+#include "bthread/deadline_task_queue.h"           // DeadlineTaskQueue
 #include "butil/resource_pool.h"                    // ResourceId
 #include "bthread/parking_lot.h"
 
@@ -67,12 +68,15 @@ public:
     // identifier into `tid'. Schedule the new thread to run.
     //   Called from worker: start_background<false>
     //   Called from non-worker: start_background<true>
+    // If `deadline_us' is not negative, the task is scheduled before tasks
+    // without deadlines in the order of deadlines.
     // Return 0 on success, errno otherwise.
     template <bool REMOTE>
     int start_background(bthread_t* __restrict tid,
                          const bthread_attr_t* __restrict attr,
                          void * (*fn)(void*),
-                         void* __restrict arg);
+                         void* __restrict arg,
+                         int64_t deadline_us = -1);
 
     // Suspend caller and run next bthread in TaskGroup *pg.
     static void sched(TaskGroup** pg);
@@ -127,6 +131,8 @@ public:
     // The bthread running run_main_task();
     bthread_t main_tid() const { return _main_tid; }
     TaskStatistics main_stat() const;
+    // Account cpu time of the current task to `account' from now on.
+    void set_current_cpu_account(bthread_cpu_account_t* account);
     // Routine of the main task which should be called from a dedicated pthread.
     void run_main_task();
 
@@ -165,9 +171,22 @@ public:
     void ready_to_run_general(bthread_t tid, bool nosignal = false);
     void flush_nosignal_tasks_general();
 
+    // Push `n' bthreads into the runqueue (or the remote one if the caller is
+    // not the worker of this group) without signalling. `*nunsignaled' is
+    // the number of tasks pushed by previous calls in the same batch and not
+    // signalled yet, which are signalled when the runqueue is full. It's
+    // increased by tasks pushed in this call, caller must call
+    // TaskControl::signal_task_batch() with it after the batch.
+    void ready_to_run_batch(const bthread_t* tids, size_t n,
+                            size_t* nunsignaled);
+
     // The TaskControl that this TaskGroup belongs to.
     TaskControl* control() const { return _control; }
 
+    // Tag of the pool of workers that this TaskGroup belongs to. Tasks in
+    // this group are only stolen by groups with the same tag.
+    bthread_tag_t tag() const { return _tag; }
+
     // Call this instead of delete.
     void destroy_self();
 
@@ -186,7 +205,7 @@ private:
 friend class TaskControl;
 
     // You shall use TaskControl::create_group to create new instance.
-    explicit TaskGroup(TaskControl*);
+    TaskGroup(TaskControl*, bthread_tag_t tag);
 
     int init(size_t runqueue_capacity);
 
@@ -210,15 +229,38 @@ friend class TaskControl;
     // Returns true on success, false is treated as permanent error and the
     // loop calling this function should end.
     bool wait_task(bthread_t* tid);
+    // Spin for a while to steal a task before waiting on the parking lot,
+    // see -bthread_worker_spin_max_us.
+    bool spin_for_task(bthread_t* tid, int64_t idle_begin_ns);
+
+    // Suspend/resume the worker of this group, called by TaskControl to
+    // adjust number of active workers. The worker is suspended when it
+    // waits for tasks next time, or right away if it's parked, and tasks in
+    // its queues are stolen by other workers meanwhile.
+    void suspend();
+    void resume();
+    bool is_suspended() const
+    { return _suspended.load(butil::memory_order_relaxed); }
+
+    // Pop the task with the earliest deadline which is not expired yet.
+    // Expired tasks are moved to _remote_rq to run after other tasks.
+    bool pop_deadline_task(bthread_t* tid);
 
     bool steal_task(bthread_t* tid) {
+        if (pop_deadline_task(tid)) {
+            return true;
+        }
         if (_remote_rq.pop(tid)) {
             return true;
         }
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         _last_pl_state = _pl->get_state();
 #endif
-        return _control->steal_task(tid, &_steal_seed, _steal_offset);
+        if (_control->steal_task(tid, &_steal_seed, _steal_offset, _tag)) {
+            ++_nsteal;
+            return true;
+        }
+        return false;
     }
 
 #ifndef NDEBUG
@@ -229,6 +271,7 @@ friend class TaskControl;
     
     // the control that this group belongs to
     TaskControl* _control;
+    bthread_tag_t _tag;
     int _num_nosignal;
     int _nsignaled;
     // last scheduling time
@@ -236,12 +279,16 @@ friend class TaskControl;
     int64_t _cumulated_cputime_ns;
 
     size_t _nswitch;
+    // Tasks stolen from other groups.
+    size_t _nsteal;
     RemainedFn _last_context_remained;
     void* _last_context_remained_arg;
 
     ParkingLot* _pl;
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
     ParkingLot::State _last_pl_state;
+    // Identify the worker in _pl to wake it up specifically.
+    int _pl_waiter_bits;
 #endif
     size_t _steal_seed;
     size_t _steal_offset;
@@ -249,8 +296,18 @@ friend class TaskControl;
     bthread_t _main_tid;
     WorkStealingQueue<bthread_t> _rq;
     RemoteTaskQueue _remote_rq;
+    DeadlineTaskQueue _deadline_rq;
     int _remote_num_nosignal;
     int _remote_nsignaled;
+
+    // 1 if the worker should be suspended, waited with futex.
+    butil::atomic<int> _suspended;
+    // Moving average of intervals from being idle to getting a task, which
+    // decides how long the worker spins before waiting on the parking lot.
+    int64_t _avg_idle_ns;
+    // Sampled by TaskControl for adjusting concurrency.
+    size_t _sampled_nswitch;
+    int64_t _sampled_busy_ns;
 };
 
 }  // namespace bthread
@@ -82,9 +82,16 @@ struct TaskMeta {
     // Attributes creating this task
     bthread_attr_t attr;
     
+    // Absolute time(in microseconds, see butil::gettimeofday_us) before which
+    // this task should be done, -1 means no deadline.
+    int64_t deadline_us;
+
     // Statistics
     int64_t cpuwide_start_ns;
     TaskStatistics stat;
+    // Time(in nanoseconds, see butil::cpuwide_time_ns) when the task was put
+    // into a runqueue, 0 if it's not recorded.
+    int64_t ready_ns;
 
     // bthread local storage, sync with tls_bls (defined in task_group.cpp)
     // when the bthread is created or destroyed.
@@ -18,7 +18,10 @@
 // bthread - A M:N threading library to make applications more concurrent.
 
 
+#include <string.h>                        // memset
+#include <algorithm>                       // std::min
 #include <queue>                           // heap functions
+#include <gflags/gflags.h>
 #include "butil/scoped_lock.h"
 #include "butil/logging.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
@@ -28,6 +31,9 @@
 #include "bthread/timer_thread.h"
 #include "bthread/log.h"
 
+DEFINE_int32(bthread_timer_num_threads, 1, "Number of pthreads running "
+             "timers of bthread, e.g. timeouts of RPC and bthread_usleep");
+
 namespace bthread {
 
 // Defined in task_control.cpp
@@ -36,7 +42,8 @@ void run_worker_startfn();
 const TimerThread::TaskId TimerThread::INVALID_TASK_ID = 0;
 
 TimerThreadOptions::TimerThreadOptions()
-    : num_buckets(13) {
+    : num_buckets(13)
+    , num_threads(1) {
 }
 
 // A task contains the necessary information for running fn(arg).
@@ -96,6 +103,112 @@ private:
     Task* _task_head;
 };
 
+// Hierarchical timing wheel holding pending tasks of a timer thread, only
+// accessed by the timer thread. Level i has NSLOT slots each spanning
+// NSLOT^i ticks, a task is put into the lowest level covering its distance
+// to the current tick and moved down (cascaded) when the current tick
+// reaches its slot. Tasks of passed ticks are moved into a small heap so
+// that they still run in the order of run_time in microseconds.
+// Unscheduled tasks are deleted whenever their slots are drained or
+// cascaded, they never enter the heap.
+class TimerThread::Wheel {
+public:
+    explicit Wheel(int64_t now_us);
+
+    // Put a consumed task into the wheel.
+    void add(Task* task);
+
+    // Move tasks in ticks before or at `now_us' into the heap.
+    void advance(int64_t now_us);
+
+    // The earliest task in the heap, NULL if the heap is empty.
+    Task* top() const { return _heap.empty() ? NULL : _heap[0]; }
+    void pop();
+
+    // The realtime that the wheel should be advanced again.
+    int64_t next_run_time() const;
+
+    // Number of tasks in the wheel and the heap, including unscheduled ones.
+    size_t size() const { return _heap.size() + _nwheel; }
+
+private:
+    static const int64_t TICK_US = 1000;
+    static const int SLOT_BITS = 8;
+    static const int NSLOT = 1 << SLOT_BITS;
+    static const int64_t SLOT_MASK = NSLOT - 1;
+    static const int NLEVEL = 4;
+
+    void insert(Task* task);
+    void cascade(int level);
+
+    int64_t _tick;                      // tasks before or at this tick are in _heap
+    size_t _nwheel;
+    size_t _nlevel[NLEVEL];
+    Task* _slots[NLEVEL][NSLOT];
+    uint64_t _nonempty[NSLOT / 64];     // bitmap of non-empty slots of level 0
+    Task* _overflow;                    // too far to be put into levels
+    std::vector<Task*> _heap;           // min heap of tasks ordered by run_time
+};
+
+// State of one timer thread. Tasks scheduled into buckets of a shard are run
+// by the thread of the shard.
+struct BAIDU_CACHELINE_ALIGNMENT TimerThread::Shard {
+    Shard()
+        : buckets(NULL)
+        , nearest_run_time(std::numeric_limits<int64_t>::max())
+        , nsignals(0)
+        , thread(0)
+        , timer_thread(NULL)
+        , nscheduled(0)
+        , ntriggered(0)
+        , busy_seconds(0) {
+    }
+
+    ~Shard() { delete [] buckets; }
+
+    Bucket* buckets;                    // list of tasks to be run
+    internal::FastPthreadMutex mutex;   // protect nearest_run_time
+    int64_t nearest_run_time;
+    // the futex for wake up timer thread. can't use nearest_run_time because
+    // it's 64-bit.
+    int nsignals;
+    pthread_t thread;        // tasks scheduled in this shard run on this thread
+    TimerThread* timer_thread;
+    // Only modified by the timer thread.
+    size_t nscheduled;
+    size_t ntriggered;
+    double busy_seconds;
+};
+
+// Stats summed from all shards.
+struct TimerThread::Vars {
+    explicit Vars(TimerThread* t)
+        : nscheduled(sum_of_shards<size_t, &Shard::nscheduled>, t)
+        , nscheduled_second(&nscheduled)
+        , ntriggered(sum_of_shards<size_t, &Shard::ntriggered>, t)
+        , ntriggered_second(&ntriggered)
+        , busy_seconds(sum_of_shards<double, &Shard::busy_seconds>, t)
+        , busy_seconds_second(&busy_seconds) {
+    }
+
+    template <typename T, T Shard::*field>
+    static T sum_of_shards(void* arg) {
+        TimerThread* t = static_cast<TimerThread*>(arg);
+        T sum = 0;
+        for (size_t i = 0; i < t->_options.num_threads; ++i) {
+            sum += t->_shards[i].*field;
+        }
+        return sum;
+    }
+
+    bvar::PassiveStatus<size_t> nscheduled;
+    bvar::PerSecond<bvar::PassiveStatus<size_t> > nscheduled_second;
+    bvar::PassiveStatus<size_t> ntriggered;
+    bvar::PerSecond<bvar::PassiveStatus<size_t> > ntriggered_second;
+    bvar::PassiveStatus<double> busy_seconds;
+    bvar::PerSecond<bvar::PassiveStatus<double> > busy_seconds_second;
+};
+
 // Utilies for making and extracting TaskId.
 inline TimerThread::TaskId make_task_id(
     butil::ResourceId<TimerThread::Task> slot, uint32_t version) {
@@ -116,24 +229,169 @@ inline bool task_greater(const TimerThread::Task* a, const TimerThread::Task* b)
     return a->run_time > b->run_time;
 }
 
+TimerThread::Wheel::Wheel(int64_t now_us)
+    : _tick(now_us / TICK_US)
+    , _nwheel(0)
+    , _overflow(NULL) {
+    memset(_nlevel, 0, sizeof(_nlevel));
+    memset(_slots, 0, sizeof(_slots));
+    memset(_nonempty, 0, sizeof(_nonempty));
+    _heap.reserve(4096);
+}
+
+void TimerThread::Wheel::add(Task* task) {
+    ++_nwheel;
+    insert(task);
+}
+
+void TimerThread::Wheel::insert(Task* task) {
+    const int64_t tick = task->run_time / TICK_US;
+    if (tick <= _tick) {
+        --_nwheel;
+        _heap.push_back(task);
+        std::push_heap(_heap.begin(), _heap.end(), task_greater);
+        return;
+    }
+    const int64_t distance = tick - _tick;
+    int level = 0;
+    while (level < NLEVEL && (distance >> (SLOT_BITS * (level + 1))) != 0) {
+        ++level;
+    }
+    if (level == NLEVEL) {
+        task->next = _overflow;
+        _overflow = task;
+        return;
+    }
+    const int index = (tick >> (SLOT_BITS * level)) & SLOT_MASK;
+    task->next = _slots[level][index];
+    _slots[level][index] = task;
+    ++_nlevel[level];
+    if (level == 0) {
+        _nonempty[index >> 6] |= ((uint64_t)1 << (index & 63));
+    }
+}
+
+void TimerThread::Wheel::cascade(int level) {
+    Task* p = NULL;
+    if (level == NLEVEL) {
+        p = _overflow;
+        _overflow = NULL;
+    } else {
+        const int index = (_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+        if (index == 0) {
+            // Higher level is cascaded first, its tasks may fall into the
+            // slot being cascaded.
+            cascade(level + 1);
+        }
+        p = _slots[level][index];
+        _slots[level][index] = NULL;
+    }
+    while (p != NULL) {
+        Task* next_task = p->next;
+        if (level != NLEVEL) {
+            --_nlevel[level];
+        }
+        if (p->try_delete()) {
+            --_nwheel;
+        } else {
+            insert(p);
+        }
+        p = next_task;
+    }
+}
+
+void TimerThread::Wheel::advance(int64_t now_us) {
+    const int64_t now_tick = now_us / TICK_US;
+    while (_tick < now_tick) {
+        if (_nlevel[0] == 0) {
+            if (_nwheel == 0) {
+                _tick = now_tick;
+                break;
+            }
+            // Nothing to do before the next cascading.
+            _tick = std::min(_tick | SLOT_MASK, now_tick);
+            if (_tick == now_tick) {
+                break;
+            }
+        }
+        ++_tick;
+        const int index = _tick & SLOT_MASK;
+        if (index == 0) {
+            cascade(1);
+        }
+        Task* p = _slots[0][index];
+        if (p == NULL) {
+            continue;
+        }
+        _slots[0][index] = NULL;
+        _nonempty[index >> 6] &= ~((uint64_t)1 << (index & 63));
+        while (p != NULL) {
+            Task* next_task = p->next;
+            --_nlevel[0];
+            --_nwheel;
+            if (!p->try_delete()) {
+                _heap.push_back(p);
+                std::push_heap(_heap.begin(), _heap.end(), task_greater);
+            }
+            p = next_task;
+        }
+    }
+}
+
+void TimerThread::Wheel::pop() {
+    std::pop_heap(_heap.begin(), _heap.end(), task_greater);
+    _heap.pop_back();
+}
+
+int64_t TimerThread::Wheel::next_run_time() const {
+    if (!_heap.empty()) {
+        return _heap[0]->run_time;
+    }
+    if (_nlevel[0] != 0) {
+        // Find the first non-empty slot after current tick.
+        const int start = (_tick + 1) & SLOT_MASK;
+        for (int n = 0; n < NSLOT;) {
+            const int index = (start + n) & SLOT_MASK;
+            const uint64_t bits = _nonempty[index >> 6] >> (index & 63);
+            if (bits) {
+                return (_tick + 1 + n + __builtin_ctzll(bits)) * TICK_US;
+            }
+            n += 64 - (index & 63);
+        }
+    }
+    // Wake up at the next cascading of the lowest non-empty level.
+    for (int level = 1; level <= NLEVEL; ++level) {
+        if (level == NLEVEL ? _overflow != NULL : _nlevel[level] != 0) {
+            const int shift = SLOT_BITS * level;
+            return (((_tick >> shift) + 1) << shift) * TICK_US;
+        }
+    }
+    return std::numeric_limits<int64_t>::max();
+}
+
 void* TimerThread::run_this(void* arg) {
-    static_cast<TimerThread*>(arg)->run();
+    Shard* s = static_cast<Shard*>(arg);
+    s->timer_thread->run(s);
     return NULL;
 }
 
 TimerThread::TimerThread()
     : _started(false)
     , _stop(false)
-    , _buckets(NULL)
-    , _nearest_run_time(std::numeric_limits<int64_t>::max())
-    , _nsignals(0)
-    , _thread(0) {
+    , _shards(NULL)
+    , _vars(NULL) {
 }
 
 TimerThread::~TimerThread() {
     stop_and_join();
-    delete [] _buckets;
-    _buckets = NULL;
+    delete _vars;
+    _vars = NULL;
+    delete [] _shards;
+    _shards = NULL;
+}
+
+pthread_t TimerThread::thread_id() const {
+    return _shards ? _shards[0].thread : 0;
 }
 
 int TimerThread::start(const TimerThreadOptions* options_in) {
@@ -151,14 +409,44 @@ int TimerThread::start(const TimerThreadOptions* options_in) {
         LOG(ERROR) << "num_buckets=" << _options.num_buckets << " is too big";
         return EINVAL;
     }
-    _buckets = new (std::nothrow) Bucket[_options.num_buckets];
-    if (NULL == _buckets) {
-        LOG(ERROR) << "Fail to new _buckets";
+    if (_options.num_threads == 0 || _options.num_threads > 64) {
+        LOG(ERROR) << "num_threads=" << _options.num_threads
+                   << " is out of range [1, 64]";
+        return EINVAL;
+    }
+    _shards = new (std::nothrow) Shard[_options.num_threads];
+    if (NULL == _shards) {
+        LOG(ERROR) << "Fail to new _shards";
+        return ENOMEM;
+    }
+    for (size_t i = 0; i < _options.num_threads; ++i) {
+        _shards[i].timer_thread = this;
+        _shards[i].buckets = new (std::nothrow) Bucket[_options.num_buckets];
+        if (NULL == _shards[i].buckets) {
+            LOG(ERROR) << "Fail to new buckets";
+            return ENOMEM;
+        }
+    }
+    _vars = new (std::nothrow) Vars(this);
+    if (NULL == _vars) {
+        LOG(ERROR) << "Fail to new _vars";
         return ENOMEM;
-    }        
-    const int ret = pthread_create(&_thread, NULL, TimerThread::run_this, this);
-    if (ret) {
-        return ret;
+    }
+    if (!_options.bvar_prefix.empty()) {
+        _vars->nscheduled_second.expose_as(_options.bvar_prefix, "scheduled_second");
+        _vars->ntriggered_second.expose_as(_options.bvar_prefix, "triggered_second");
+        _vars->busy_seconds_second.expose_as(_options.bvar_prefix, "usage");
+    }
+    for (size_t i = 0; i < _options.num_threads; ++i) {
+        const int ret = pthread_create(&_shards[i].thread, NULL,
+                                       TimerThread::run_this, &_shards[i]);
+        if (ret) {
+            // Stop threads already created, this TimerThread is unusable.
+            _options.num_threads = i;
+            _started = true;
+            stop_and_join();
+            return ret;
+        }
     }
     _started = true;
     return 0;
@@ -221,22 +509,24 @@ TimerThread::TaskId TimerThread::schedule(
         return INVALID_TASK_ID;
     }
     // Hashing by pthread id is better for cache locality.
+    const uint64_t hash = butil::fmix64(pthread_numeric_id());
+    Shard& s = _shards[hash % _options.num_threads];
     const Bucket::ScheduleResult result = 
-        _buckets[butil::fmix64(pthread_numeric_id()) % _options.num_buckets]
+        s.buckets[(hash / _options.num_threads) % _options.num_buckets]
         .schedule(fn, arg, abstime);
     if (result.earlier) {
         bool earlier = false;
         const int64_t run_time = butil::timespec_to_microseconds(abstime);
         {
-            BAIDU_SCOPED_LOCK(_mutex);
-            if (run_time < _nearest_run_time) {
-                _nearest_run_time = run_time;
-                ++_nsignals;
+            BAIDU_SCOPED_LOCK(s.mutex);
+            if (run_time < s.nearest_run_time) {
+                s.nearest_run_time = run_time;
+                ++s.nsignals;
                 earlier = true;
             }
         }
         if (earlier) {
-            futex_wake_private(&_nsignals, 1);
+            futex_wake_private(&s.nsignals, 1);
         }
     }
     return result.task_id;
@@ -305,12 +595,7 @@ bool TimerThread::Task::try_delete() {
     return false;
 }
 
-template <typename T>
-static T deref_value(void* arg) {
-    return *(T*)arg;
-}
-
-void TimerThread::run() {
+void TimerThread::run(Shard* s) {
     run_worker_startfn();
 #ifdef BAIDU_INTERNAL
     logging::ComlogInitializer comlog_initializer;
@@ -319,116 +604,100 @@ void TimerThread::run() {
     int64_t last_sleep_time = butil::gettimeofday_us();
     BT_VLOG << "Started TimerThread=" << pthread_self();
 
-    // min heap of tasks (ordered by run_time)
-    std::vector<Task*> tasks;
-    tasks.reserve(4096);
-
-    // vars
-    size_t nscheduled = 0;
-    bvar::PassiveStatus<size_t> nscheduled_var(deref_value<size_t>, &nscheduled);
-    bvar::PerSecond<bvar::PassiveStatus<size_t> > nscheduled_second(&nscheduled_var);
-    size_t ntriggered = 0;
-    bvar::PassiveStatus<size_t> ntriggered_var(deref_value<size_t>, &ntriggered);
-    bvar::PerSecond<bvar::PassiveStatus<size_t> > ntriggered_second(&ntriggered_var);
-    double busy_seconds = 0;
-    bvar::PassiveStatus<double> busy_seconds_var(deref_value<double>, &busy_seconds);
-    bvar::PerSecond<bvar::PassiveStatus<double> > busy_seconds_second(&busy_seconds_var);
-    if (!_options.bvar_prefix.empty()) {
-        nscheduled_second.expose_as(_options.bvar_prefix, "scheduled_second");
-        ntriggered_second.expose_as(_options.bvar_prefix, "triggered_second");
-        busy_seconds_second.expose_as(_options.bvar_prefix, "usage");
-    }
-    
+    // pending tasks
+    Wheel wheel(last_sleep_time);
+
     while (!_stop.load(butil::memory_order_relaxed)) {
-        // Clear _nearest_run_time before consuming tasks from buckets.
+        // Clear nearest_run_time before consuming tasks from buckets.
         // This helps us to be aware of earliest task of the new tasks before we
         // would run the consumed tasks.
         {
-            BAIDU_SCOPED_LOCK(_mutex);
-            _nearest_run_time = std::numeric_limits<int64_t>::max();
+            BAIDU_SCOPED_LOCK(s->mutex);
+            s->nearest_run_time = std::numeric_limits<int64_t>::max();
         }
         
         // Pull tasks from buckets.
         for (size_t i = 0; i < _options.num_buckets; ++i) {
-            Bucket& bucket = _buckets[i];
-            for (Task* p = bucket.consume_tasks(); p != nullptr; ++nscheduled) {
+            Bucket& bucket = s->buckets[i];
+            for (Task* p = bucket.consume_tasks(); p != nullptr; ++s->nscheduled) {
                 // p->next should be kept first
                 // in case of the deletion of Task p which is unscheduled
                 Task* next_task = p->next;
 
                 if (!p->try_delete()) { // remove the task if it's unscheduled
-                    tasks.push_back(p);
-                    std::push_heap(tasks.begin(), tasks.end(), task_greater);
+                    wheel.add(p);
                 }
                 p = next_task;
             }
         }
 
         bool pull_again = false;
-        while (!tasks.empty()) {
-            Task* task1 = tasks[0];  // the about-to-run task
-            if (butil::gettimeofday_us() < task1->run_time) {  // not ready yet.
+        while (true) {
+            const int64_t now = butil::gettimeofday_us();
+            wheel.advance(now);
+            Task* task1 = wheel.top();  // the about-to-run task
+            if (task1 == NULL || now < task1->run_time) {  // not ready yet.
                 break;
             }
             // Each time before we run the earliest task (that we think), 
-            // check the globally shared _nearest_run_time. If a task earlier
+            // check the globally shared nearest_run_time. If a task earlier
             // than task1 was scheduled during pulling from buckets, we'll
-            // know. In RPC scenarios, _nearest_run_time is not often changed by
+            // know. In RPC scenarios, nearest_run_time is not often changed by
             // threads because the task needs to be the earliest in its bucket,
             // since run_time of scheduled tasks are often in ascending order,
             // most tasks are unlikely to be "earliest". (If run_time of tasks
             // are in descending orders, all tasks are "earliest" after every
-            // insertion, and they'll grab _mutex and change _nearest_run_time
+            // insertion, and they'll grab mutex and change nearest_run_time
             // frequently, fortunately this is not true at most of time).
             {
-                BAIDU_SCOPED_LOCK(_mutex);
-                if (task1->run_time > _nearest_run_time) {
+                BAIDU_SCOPED_LOCK(s->mutex);
+                if (task1->run_time > s->nearest_run_time) {
                     // a task is earlier than task1. We need to check buckets.
                     pull_again = true;
                     break;
                 }
             }
-            std::pop_heap(tasks.begin(), tasks.end(), task_greater);
-            tasks.pop_back();
+            wheel.pop();
             if (task1->run_and_delete()) {
-                ++ntriggered;
+                ++s->ntriggered;
             }
         }
         if (pull_again) {
-            BT_VLOG << "pull again, tasks=" << tasks.size();
+            BT_VLOG << "pull again, tasks=" << wheel.size();
             continue;
         }
 
         // The realtime to wait for.
-        int64_t next_run_time = std::numeric_limits<int64_t>::max();
-        if (!tasks.empty()) {
-            next_run_time = tasks[0]->run_time;
-        }
+        const int64_t next_run_time = wheel.next_run_time();
         // Similarly with the situation before running tasks, we check
-        // _nearest_run_time to prevent us from waiting on a non-earliest
-        // task. We also use the _nsignal to make sure that if new task 
+        // nearest_run_time to prevent us from waiting on a non-earliest
+        // task. We also use the nsignals to make sure that if new task 
         // is earlier that the realtime that we wait for, we'll wake up.
         int expected_nsignals = 0;
         {
-            BAIDU_SCOPED_LOCK(_mutex);
-            if (next_run_time > _nearest_run_time) {
+            BAIDU_SCOPED_LOCK(s->mutex);
+            if (next_run_time > s->nearest_run_time) {
                 // a task is earlier that what we would wait for.
                 // We need to check buckets.
                 continue;
             } else {
-                _nearest_run_time = next_run_time;
-                expected_nsignals = _nsignals;
+                s->nearest_run_time = next_run_time;
+                expected_nsignals = s->nsignals;
             }
         }
         timespec* ptimeout = NULL;
         timespec next_timeout = { 0, 0 };
         const int64_t now = butil::gettimeofday_us();
         if (next_run_time != std::numeric_limits<int64_t>::max()) {
+            if (next_run_time <= now) {
+                // Time passed while running tasks.
+                continue;
+            }
             next_timeout = butil::microseconds_to_timespec(next_run_time - now);
             ptimeout = &next_timeout;
         }
-        busy_seconds += (now - last_sleep_time) / 1000000.0;
-        futex_wait_private(&_nsignals, expected_nsignals, ptimeout);
+        s->busy_seconds += (now - last_sleep_time) / 1000000.0;
+        futex_wait_private(&s->nsignals, expected_nsignals, ptimeout);
         last_sleep_time = butil::gettimeofday_us();
     }
     BT_VLOG << "Ended TimerThread=" << pthread_self();
@@ -437,17 +706,23 @@ void TimerThread::run() {
 void TimerThread::stop_and_join() {
     _stop.store(true, butil::memory_order_relaxed);
     if (_started) {
-        {
-            BAIDU_SCOPED_LOCK(_mutex);
-             // trigger pull_again and wakeup TimerThread
-            _nearest_run_time = 0;
-            ++_nsignals;
-        }
-        if (pthread_self() != _thread) {
-            // stop_and_join was not called from a running task.
+        for (size_t i = 0; i < _options.num_threads; ++i) {
+            Shard& s = _shards[i];
+            {
+                BAIDU_SCOPED_LOCK(s.mutex);
+                // trigger pull_again and wakeup TimerThread
+                s.nearest_run_time = 0;
+                ++s.nsignals;
+            }
             // wake up the timer thread in case it is sleeping.
-            futex_wake_private(&_nsignals, 1);
-            pthread_join(_thread, NULL);
+            futex_wake_private(&s.nsignals, 1);
+        }
+        for (size_t i = 0; i < _options.num_threads; ++i) {
+            if (pthread_self() != _shards[i].thread) {
+                // stop_and_join was not called from a task running in
+                // this thread.
+                pthread_join(_shards[i].thread, NULL);
+            }
         }
     }
 }
@@ -462,6 +737,7 @@ static void init_global_timer_thread() {
     }
     TimerThreadOptions options;
     options.bvar_prefix = "bthread_timer";
+    options.num_threads = std::max(FLAGS_bthread_timer_num_threads, 1);
     const int rc = g_timer_thread->start(&options);
     if (rc != 0) {
         LOG(FATAL) << "Fail to start timer_thread, " << berror(rc);
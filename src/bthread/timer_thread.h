@@ -38,6 +38,13 @@ struct TimerThreadOptions {
     // Default: 13
     size_t num_buckets;
 
+    // Number of pthreads to run scheduled tasks. Tasks are sharded to the
+    // pthreads by the pthreads calling schedule(), so that one busy timer
+    // thread does not delay all tasks. Tasks scheduled by one pthread still
+    // run in order of their time.
+    // Default: 1
+    size_t num_threads;
+
     // If this field is not empty, some bvar for reporting stats of TimerThread
     // will be exposed with this prefix.
     // Default: ""
@@ -47,13 +54,19 @@ struct TimerThreadOptions {
     TimerThreadOptions();
 };
 
-// TimerThread is a separate thread to run scheduled tasks at specific time.
-// At most one task runs at any time, don't put time-consuming code in the
-// callback otherwise the task may delay other tasks significantly.
+// TimerThread is one or more separate threads to run scheduled tasks at
+// specific time. At most one task runs in each thread at any time, don't put
+// time-consuming code in the callback otherwise the task may delay other
+// tasks significantly.
+// Pending tasks are kept in a hierarchical timing wheel, scheduling or
+// unscheduling a task is O(1) no matter how many tasks are pending, which is
+// the common case of RPC timeouts: most of them are unscheduled before
+// running.
 class TimerThread {
 public:
     struct Task;
     class Bucket;
+    class Wheel;
 
     typedef uint64_t TaskId;
     const static TaskId INVALID_TASK_ID;
@@ -81,26 +94,24 @@ public:
     //   1   -  The task is just running.
     int unschedule(TaskId task_id);
 
-    // Get identifier of internal pthread.
+    // Get identifier of internal pthread (the first one if there're more).
     // Returns (pthread_t)0 if start() is not called yet.
-    pthread_t thread_id() const { return _thread; }
+    pthread_t thread_id() const;
     
 private:
-    // the timer thread will run this method.
-    void run();
+    struct Shard;
+    struct Vars;
+
+    // the timer threads will run this method.
+    void run(Shard* shard);
     static void* run_this(void* arg);
 
     bool _started;            // whether the timer thread was started successfully.
     butil::atomic<bool> _stop;
 
     TimerThreadOptions _options;
-    Bucket* _buckets;        // list of tasks to be run
-    internal::FastPthreadMutex _mutex;    // protect _nearest_run_time
-    int64_t _nearest_run_time;
-    // the futex for wake up timer thread. can't use _nearest_run_time because
-    // it's 64-bit.
-    int _nsignals;
-    pthread_t _thread;       // all scheduled task will be run on this thread
+    Shard* _shards;           // one for each timer thread
+    Vars* _vars;
 };
 
 // Get the global TimerThread which never quits.
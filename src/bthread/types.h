@@ -87,16 +87,32 @@ typedef struct {
 } bthread_keytable_pool_stat_t;
 
 // Attributes for thread creation.
+// Tag of the pool of workers that a bthread runs in, see -task_group_ntags.
+typedef int bthread_tag_t;
+// Run in the pool of the creator, or the default pool if the creator is not
+// a bthread.
+static const bthread_tag_t BTHREAD_TAG_INVALID = -1;
+static const bthread_tag_t BTHREAD_TAG_DEFAULT = 0;
+
+// Account of cpu time of bthreads, see bthread_cpu_account_get() in
+// bthread/unstable.h
+typedef struct bthread_cpu_account bthread_cpu_account_t;
+
 typedef struct bthread_attr_t {
     bthread_stacktype_t stack_type;
     bthread_attrflags_t flags;
     bthread_keytable_pool_t* keytable_pool;
+    bthread_tag_t tag;
+    // Cpu time of the bthread is accounted to it if it's not NULL.
+    bthread_cpu_account_t* cpu_account;
 
 #if defined(__cplusplus)
     void operator=(unsigned stacktype_and_flags) {
         stack_type = (stacktype_and_flags & 7);
         flags = (stacktype_and_flags & ~(unsigned)7u);
         keytable_pool = NULL;
+        tag = BTHREAD_TAG_INVALID;
+        cpu_account = NULL;
     }
     bthread_attr_t operator|(unsigned other_flags) const {
         CHECK(!(other_flags & 7)) << "flags=" << other_flags;
@@ -114,22 +130,24 @@ typedef struct bthread_attr_t {
 // obvious drawback is that you need more worker pthreads when you have a lot
 // of such bthreads.
 static const bthread_attr_t BTHREAD_ATTR_PTHREAD =
-{ BTHREAD_STACKTYPE_PTHREAD, 0, NULL };
+{ BTHREAD_STACKTYPE_PTHREAD, 0, NULL, BTHREAD_TAG_INVALID, NULL };
 
 // bthreads created with following attributes will have different size of
 // stacks. Default is BTHREAD_ATTR_NORMAL.
 static const bthread_attr_t BTHREAD_ATTR_SMALL =
-{ BTHREAD_STACKTYPE_SMALL, 0, NULL };
+{ BTHREAD_STACKTYPE_SMALL, 0, NULL, BTHREAD_TAG_INVALID, NULL };
 static const bthread_attr_t BTHREAD_ATTR_NORMAL =
-{ BTHREAD_STACKTYPE_NORMAL, 0, NULL };
+{ BTHREAD_STACKTYPE_NORMAL, 0, NULL, BTHREAD_TAG_INVALID, NULL };
 static const bthread_attr_t BTHREAD_ATTR_LARGE =
-{ BTHREAD_STACKTYPE_LARGE, 0, NULL };
+{ BTHREAD_STACKTYPE_LARGE, 0, NULL, BTHREAD_TAG_INVALID, NULL };
 
 // bthreads created with this attribute will print log when it's started,
 // context-switched, finished.
 static const bthread_attr_t BTHREAD_ATTR_DEBUG = {
     BTHREAD_STACKTYPE_NORMAL,
     BTHREAD_LOG_START_AND_FINISH | BTHREAD_LOG_CONTEXT_SWITCH,
+    NULL,
+    BTHREAD_TAG_INVALID,
     NULL
 };
 
@@ -43,6 +43,45 @@ extern void bthread_flush();
 // worker pthreads are not notified.
 extern int bthread_about_to_quit();
 
+// Create bthread `fn(arg)' like bthread_start_background(), but the bthread
+// is scheduled before bthreads without deadlines of the same worker, and
+// bthreads with earlier `deadline_us' (absolute time in microseconds, see
+// butil::gettimeofday_us()) are scheduled first. If the deadline is passed
+// before the bthread is scheduled, the bthread is run after others instead,
+// and counted in bvar "bthread_expired_before_execution".
+// A negative `deadline_us' means no deadline.
+// Returns 0 on success, errno otherwise.
+extern int bthread_start_background_with_deadline(
+    bthread_t* __restrict tid, const bthread_attr_t* __restrict attr,
+    void * (*fn)(void*), void* __restrict arg, int64_t deadline_us);
+
+// Get the deadline of the calling bthread, -1 if the bthread does not have
+// a deadline or the caller is not a bthread.
+extern int64_t bthread_self_deadline_us(void);
+
+// Set the deadline of the calling bthread, which is for propagating deadlines
+// of requests to code running in the bthread. A negative `deadline_us'
+// clears the deadline. Scheduling of the bthread is not affected.
+// Returns 0 on success, EPERM if the caller is not a bthread.
+extern int bthread_set_self_deadline_us(int64_t deadline_us);
+
+// Get the account named `name' (usually a method name) for accounting cpu
+// time of bthreads, create it if it does not exist. Accounts are never
+// destroyed. Cpu usage of the account is shown in
+// /vars/bthread_cpu_usage_<name>.
+// Returns NULL if the accounting is compiled out (BTHREAD_NO_SCHED_ACCOUNTING).
+extern bthread_cpu_account_t* bthread_cpu_account_get(const char* name);
+
+// Account cpu time of the calling bthread to `account' from now on, NULL
+// stops the accounting. Bthreads can also be accounted since creation by
+// setting bthread_attr_t.cpu_account.
+// Returns 0 on success, EPERM if the caller is not a bthread.
+extern int bthread_set_self_cpu_account(bthread_cpu_account_t* account);
+
+// Get the account of the calling bthread, NULL if the caller is not a
+// bthread or is not accounted.
+extern bthread_cpu_account_t* bthread_self_cpu_account(void);
+
 // Run `on_timer(arg)' at or after real-time `abstime'. Put identifier of the
 // timer into *id.
 // Return 0 on success, errno otherwise.
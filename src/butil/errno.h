@@ -22,7 +22,13 @@
 #ifndef BUTIL_BAIDU_ERRNO_H
 #define BUTIL_BAIDU_ERRNO_H
 
-#define __const__
+// Stop GCC from caching errno(the result of __errno_location which is declared
+// as __const__) across context switches of bthreads. The build files pass the
+// same definition, this is for builds which don't. Not empty, which breaks
+// `[[__gnu__::__const__, ...]]' in C++20 headers.
+#ifndef __const__
+#define __const__ __unused__
+#endif
 #include <errno.h>                           // errno
 #include "butil/macros.h"                     // BAIDU_CONCAT
 
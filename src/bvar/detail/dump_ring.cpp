@@ -0,0 +1,334 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <fcntl.h>                           // open
+#include <unistd.h>                          // ftruncate
+#include <sys/mman.h>                        // mmap
+#include <sys/stat.h>                        // fstat
+#include <stdio.h>                           // rename
+#include <string.h>
+#include <errno.h>
+#include <algorithm>                         // std::min
+#include "butil/atomicops.h"                 // butil::atomic_thread_fence
+#include "butil/logging.h"
+#include "butil/file_util.h"                 // butil::CreateDirectoryAndGetError
+#include "butil/fd_guard.h"                  // butil::fd_guard
+#include "butil/time.h"                      // butil::gettimeofday_us
+#include "bvar/detail/dump_ring.h"
+
+namespace bvar {
+namespace detail {
+
+static const char DUMP_RING_MAGIC[8] = { 'B', 'V', 'A', 'R', 'R', 'I', 'N', 'G' };
+static const size_t DUMP_RING_PAGE_SIZE = 4096;
+
+BAIDU_CASSERT(sizeof(DumpRingHeader) <= DumpRingHeader::SIZE,
+              header_is_too_large);
+BAIDU_CASSERT(sizeof(DumpRingRecord) == 16, record_should_be_16_bytes);
+
+inline size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+DumpRingOptions::DumpRingOptions()
+    : max_frames(360)
+    , max_records(8192)
+    , names_capacity(1024 * 1024)
+    , interval_s(10) {}
+
+DumpRingWriter::DumpRingWriter()
+    : _base(NULL)
+    , _length(0)
+    , _header(NULL)
+    , _frame(NULL)
+    , _records(NULL) {}
+
+DumpRingWriter::~DumpRingWriter() {
+    close();
+}
+
+int DumpRingWriter::open(const std::string& path,
+                         const DumpRingOptions& options) {
+    close();
+    if (options.max_frames == 0 || options.max_records == 0) {
+        LOG(ERROR) << "Invalid max_frames=" << options.max_frames
+                   << " max_records=" << options.max_records;
+        return -1;
+    }
+    butil::File::Error error;
+    const butil::FilePath dir = butil::FilePath(path).DirName();
+    if (!butil::CreateDirectoryAndGetError(dir, &error)) {
+        LOG(ERROR) << "Fail to create directory=`" << dir.value()
+                   << "', " << error;
+        return -1;
+    }
+    const std::string prev_path = path + ".prev";
+    if (rename(path.c_str(), prev_path.c_str()) != 0 && errno != ENOENT) {
+        PLOG(WARNING) << "Fail to rename " << path << " to " << prev_path;
+    }
+    butil::fd_guard fd(::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << path;
+        return -1;
+    }
+    const size_t frame_size = sizeof(DumpRingFrameHeader) +
+        (size_t)options.max_records * sizeof(DumpRingRecord);
+    const size_t names_capacity = round_up(options.names_capacity, 8);
+    const size_t frames_offset =
+        round_up(DumpRingHeader::SIZE + names_capacity, DUMP_RING_PAGE_SIZE);
+    const size_t length = frames_offset + options.max_frames * frame_size;
+    // Sparse until written.
+    if (ftruncate(fd, length) != 0) {
+        PLOG(ERROR) << "Fail to truncate " << path << " to " << length;
+        return -1;
+    }
+    void* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to mmap " << path;
+        return -1;
+    }
+    _path = path;
+    _base = (char*)base;
+    _length = length;
+    _header = (DumpRingHeader*)base;
+    _header->version = DumpRingHeader::VERSION;
+    _header->max_frames = options.max_frames;
+    _header->max_records = options.max_records;
+    _header->frame_size = frame_size;
+    _header->names_offset = DumpRingHeader::SIZE;
+    _header->names_capacity = names_capacity;
+    _header->interval_s = options.interval_s;
+    _header->frames_offset = frames_offset;
+    _header->create_time_us = butil::gettimeofday_us();
+    _header->pid = getpid();
+    snprintf(_header->app, sizeof(_header->app), "%s", options.app.c_str());
+    if (!_name_ids.initialized() &&
+        _name_ids.init(std::max(options.max_records, 16u) * 2) != 0) {
+        LOG(ERROR) << "Fail to init _name_ids";
+        close();
+        return -1;
+    }
+    _header->names_size = 0;
+    _header->nnames = 0;
+    _header->nframes = 0;
+    butil::atomic_thread_fence(butil::memory_order_release);
+    memcpy(_header->magic, DUMP_RING_MAGIC, sizeof(DUMP_RING_MAGIC));
+    _name_ids.clear();
+    return 0;
+}
+
+void DumpRingWriter::close() {
+    if (_base) {
+        munmap(_base, _length);
+        _base = NULL;
+        _length = 0;
+        _header = NULL;
+        _frame = NULL;
+        _records = NULL;
+    }
+    _path.clear();
+    _name_ids.clear();
+}
+
+void DumpRingWriter::begin_frame(int64_t time_us) {
+    if (_header == NULL) {
+        return;
+    }
+    const uint64_t slot = _header->nframes % _header->max_frames;
+    char* p = _base + _header->frames_offset + slot * _header->frame_size;
+    _frame = (DumpRingFrameHeader*)p;
+    _records = (DumpRingRecord*)(p + sizeof(DumpRingFrameHeader));
+    _frame->seq = 0;
+    butil::atomic_thread_fence(butil::memory_order_release);
+    _frame->time_us = time_us;
+    _frame->nrecords = 0;
+    _frame->ndropped = 0;
+}
+
+int64_t DumpRingWriter::intern(const std::string& name) {
+    const uint32_t* pid = _name_ids.seek(name);
+    if (pid != NULL) {
+        return *pid;
+    }
+    const uint32_t size = _header->names_size;
+    if (name.size() > UINT16_MAX ||
+        size + 2 + name.size() > _header->names_capacity) {
+        return -1;
+    }
+    char* p = _base + _header->names_offset + size;
+    const uint16_t len = name.size();
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + sizeof(len), name.data(), name.size());
+    butil::atomic_thread_fence(butil::memory_order_release);
+    _header->names_size = size + sizeof(len) + name.size();
+    const uint32_t id = _header->nnames++;
+    _name_ids[name] = id;
+    return id;
+}
+
+bool DumpRingWriter::dump(const std::string& name, const NumericValue& value) {
+    if (_frame == NULL) {
+        return false;
+    }
+    if (_frame->nrecords >= _header->max_records) {
+        ++_frame->ndropped;
+        return true;
+    }
+    const int64_t id = intern(name);
+    if (id < 0) {
+        ++_frame->ndropped;
+        return true;
+    }
+    DumpRingRecord* r = _records + _frame->nrecords;
+    r->name_id = id;
+    r->type = value.type;
+    r->u64 = value.u64;
+    ++_frame->nrecords;
+    return true;
+}
+
+void DumpRingWriter::end_frame() {
+    if (_frame == NULL) {
+        return;
+    }
+    const uint64_t seq = _header->nframes + 1;
+    butil::atomic_thread_fence(butil::memory_order_release);
+    _frame->seq = seq;
+    butil::atomic_thread_fence(butil::memory_order_release);
+    _header->nframes = seq;
+    _frame = NULL;
+    _records = NULL;
+}
+
+DumpRingReader::DumpRingReader()
+    : _base(NULL), _length(0), _header(NULL) {}
+
+DumpRingReader::~DumpRingReader() {
+    close();
+}
+
+int DumpRingReader::open(const std::string& path) {
+    close();
+    butil::fd_guard fd(::open(path.c_str(), O_RDONLY));
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << path;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        PLOG(ERROR) << "Fail to fstat " << path;
+        return -1;
+    }
+    const size_t length = st.st_size;
+    if (length < DumpRingHeader::SIZE) {
+        LOG(ERROR) << path << " is too small to be a ring file";
+        return -1;
+    }
+    void* base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to mmap " << path;
+        return -1;
+    }
+    const DumpRingHeader* h = (const DumpRingHeader*)base;
+    if (memcmp(h->magic, DUMP_RING_MAGIC, sizeof(DUMP_RING_MAGIC)) != 0 ||
+        h->version != DumpRingHeader::VERSION ||
+        h->max_frames == 0 ||
+        h->frame_size != sizeof(DumpRingFrameHeader) +
+        (size_t)h->max_records * sizeof(DumpRingRecord) ||
+        h->names_offset + h->names_capacity > h->frames_offset ||
+        h->frames_offset + (uint64_t)h->max_frames * h->frame_size > length) {
+        LOG(ERROR) << path << " is not a valid ring file";
+        munmap(base, length);
+        return -1;
+    }
+    _base = (char*)base;
+    _length = length;
+    _header = h;
+    return 0;
+}
+
+void DumpRingReader::close() {
+    if (_base) {
+        munmap(_base, _length);
+        _base = NULL;
+        _length = 0;
+        _header = NULL;
+    }
+}
+
+void DumpRingReader::get_names(std::vector<std::string>* names) const {
+    names->clear();
+    const uint32_t nnames = *(const volatile uint32_t*)&_header->nnames;
+    butil::atomic_thread_fence(butil::memory_order_acquire);
+    const char* p = _base + _header->names_offset;
+    const char* const end = p + std::min(_header->names_size,
+                                         _header->names_capacity);
+    while (names->size() < nnames && p + sizeof(uint16_t) <= end) {
+        uint16_t len = 0;
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        if (p + len > end) {
+            break;
+        }
+        names->push_back(std::string(p, len));
+        p += len;
+    }
+}
+
+void DumpRingReader::get_frames(std::vector<Frame>* frames) const {
+    frames->clear();
+    const uint64_t nframes = *(const volatile uint64_t*)&_header->nframes;
+    butil::atomic_thread_fence(butil::memory_order_acquire);
+    const uint32_t max_frames = _header->max_frames;
+    // Frame at `nframes' may be completed without updating nframes, which
+    // overwrites the frame at `nframes - max_frames'.
+    const uint64_t first = (nframes > max_frames ? nframes - max_frames : 0);
+    for (uint64_t i = first; i <= nframes; ++i) {
+        const char* p = _base + _header->frames_offset +
+            (i % max_frames) * _header->frame_size;
+        const volatile DumpRingFrameHeader* fh =
+            (const volatile DumpRingFrameHeader*)p;
+        if (fh->seq != i + 1) {
+            continue;
+        }
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        Frame f;
+        f.seq = i + 1;
+        f.time_us = fh->time_us;
+        f.ndropped = fh->ndropped;
+        const uint32_t nrecords =
+            std::min((uint32_t)fh->nrecords, _header->max_records);
+        const DumpRingRecord* records =
+            (const DumpRingRecord*)(p + sizeof(DumpRingFrameHeader));
+        f.records.resize(nrecords);
+        for (uint32_t j = 0; j < nrecords; ++j) {
+            f.records[j].name_id = records[j].name_id;
+            f.records[j].value.type = (NumericValue::Type)records[j].type;
+            f.records[j].value.u64 = records[j].u64;
+        }
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        // Overwritten by the writer during copying.
+        if (fh->seq != i + 1) {
+            continue;
+        }
+        frames->push_back(f);
+    }
+}
+
+}  // namespace detail
+}  // namespace bvar
@@ -0,0 +1,185 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BVAR_DETAIL_DUMP_RING_H
+#define  BVAR_DETAIL_DUMP_RING_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "butil/macros.h"                    // DISALLOW_COPY_AND_ASSIGN
+#include "butil/containers/flat_map.h"       // butil::FlatMap
+#include "bvar/variable.h"                   // NumericValue
+
+namespace bvar {
+namespace detail {
+
+// A memory-mapped file keeping values of bvar in recent minutes, written
+// by the dumping thread when -bvar_dump_ring is on. Values are in binary
+// and appended into fixed-size frames, one frame for each dump, the oldest
+// frame is overwritten when all frames are used. Pages of the file are
+// written back by the kernel even if the process crashes, so history before
+// a crash is still readable (by tools/bvar_ring_view).
+//
+// Layout of the file:
+//   DumpRingHeader (padded to DumpRingHeader::SIZE)
+//   Names: [uint16 length][name] ...  (id of a name is its index)
+//   Frames: [DumpRingFrameHeader][DumpRingRecord * max_records] ...
+
+struct DumpRingHeader {
+    static const size_t SIZE = 4096;
+    static const uint32_t VERSION = 1;
+
+    // "BVARRING", written after other fields are initialized.
+    char magic[8];
+    uint32_t version;
+    uint32_t max_frames;
+    uint32_t max_records;
+    uint32_t frame_size;
+    uint64_t names_offset;
+    uint32_t names_capacity;
+    int32_t interval_s;
+    uint64_t frames_offset;
+    int64_t create_time_us;
+    int32_t pid;
+    char app[64];
+
+    // Changed by the writer.
+    uint32_t names_size;
+    uint32_t nnames;
+    // Number of frames ever written.
+    uint64_t nframes;
+};
+
+struct DumpRingFrameHeader {
+    // 1 + index of the frame in all frames ever written. 0 when the frame
+    // is being written.
+    uint64_t seq;
+    int64_t time_us;
+    uint32_t nrecords;
+    // Number of variables not written because the frame or names is full.
+    uint32_t ndropped;
+};
+
+struct DumpRingRecord {
+    uint32_t name_id;
+    // NumericValue::Type
+    uint32_t type;
+    union {
+        int64_t i64;
+        uint64_t u64;
+        double f64;
+    };
+};
+
+struct DumpRingOptions {
+    DumpRingOptions();
+
+    // Number of frames kept, namely minutes_to_keep * 60 / interval_s.
+    uint32_t max_frames;
+
+    // Max number of variables in a frame.
+    uint32_t max_records;
+
+    // Bytes reserved for names.
+    uint32_t names_capacity;
+
+    // Seconds between consecutive frames, informational.
+    int32_t interval_s;
+
+    // Name of the program, informational.
+    std::string app;
+};
+
+class DumpRingWriter : public NumericDumper {
+public:
+    DumpRingWriter();
+    ~DumpRingWriter();
+
+    // Create the ring file at `path'. An existing file is renamed to
+    // `path'.prev rather than overwritten because it may be written by a
+    // crashed process.
+    // Returns 0 on success, -1 otherwise.
+    int open(const std::string& path, const DumpRingOptions& options);
+    void close();
+    bool is_open() const { return _header != NULL; }
+    const std::string& path() const { return _path; }
+
+    // Write a frame: begin_frame(), dump() for each variable, end_frame().
+    void begin_frame(int64_t time_us);
+    // Returns true even if the variable is dropped because of no space.
+    bool dump(const std::string& name, const NumericValue& value) override;
+    void end_frame();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DumpRingWriter);
+
+    // Returns id of the name, -1 if names are full.
+    int64_t intern(const std::string& name);
+
+    std::string _path;
+    char* _base;
+    size_t _length;
+    DumpRingHeader* _header;
+    DumpRingFrameHeader* _frame;
+    DumpRingRecord* _records;
+    butil::FlatMap<std::string, uint32_t> _name_ids;
+};
+
+class DumpRingReader {
+public:
+    struct Record {
+        uint32_t name_id;
+        NumericValue value;
+    };
+    struct Frame {
+        uint64_t seq;
+        int64_t time_us;
+        uint32_t ndropped;
+        std::vector<Record> records;
+    };
+
+    DumpRingReader();
+    ~DumpRingReader();
+
+    // Map the ring file at `path'.
+    // Returns 0 on success, -1 otherwise.
+    int open(const std::string& path);
+    void close();
+
+    const DumpRingHeader& header() const { return *_header; }
+
+    // Names of variables indexed by Record::name_id
+    void get_names(std::vector<std::string>* names) const;
+
+    // Put complete frames into `frames' from the oldest to the newest.
+    // Frames being written (by a running process) are skipped.
+    void get_frames(std::vector<Frame>* frames) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DumpRingReader);
+
+    char* _base;
+    size_t _length;
+    const DumpRingHeader* _header;
+};
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  // BVAR_DETAIL_DUMP_RING_H
@@ -0,0 +1,151 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <vector>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/thread_local.h"
+#include "bvar/detail/percpu.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+// Exported by glibc 2.35+ which registers rseq for every thread.
+extern "C" {
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+}
+#endif
+
+namespace bvar {
+namespace detail {
+
+static uint32_t get_ncpu() {
+    const long n = sysconf(_SC_NPROCESSORS_CONF);
+    return n > 0 ? (uint32_t)n : 1;
+}
+
+uint32_t g_percpu_ncpu = get_ncpu();
+
+__thread RseqArea* tls_rseq_area = NULL;
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#ifndef __NR_rseq
+#define __NR_rseq 334
+#endif
+
+static const int RSEQ_FLAG_UNREGISTER = 1;
+static __thread RseqArea tls_own_rseq_area;
+
+static void unregister_rseq(void* arg) {
+    RseqArea* area = static_cast<RseqArea*>(arg);
+    tls_rseq_area = BVAR_RSEQ_UNAVAILABLE;
+    syscall(__NR_rseq, area, sizeof(RseqArea), RSEQ_FLAG_UNREGISTER,
+            BVAR_RSEQ_SIG);
+}
+
+RseqArea* init_rseq_area() {
+    if (tls_rseq_area != NULL) {
+        return tls_rseq_area;
+    }
+    tls_rseq_area = BVAR_RSEQ_UNAVAILABLE;
+    if (&__rseq_size != NULL && __rseq_size >= 20) {
+        // Registered by glibc, the area is at a fixed offset from the
+        // thread pointer.
+        char* tp = NULL;
+        __asm__ ("movq %%fs:0, %0" : "=r"(tp));
+        RseqArea* area = reinterpret_cast<RseqArea*>(tp + __rseq_offset);
+        if ((int32_t)area->cpu_id >= 0) {
+            tls_rseq_area = area;
+        }
+        return tls_rseq_area;
+    }
+    RseqArea* area = &tls_own_rseq_area;
+    memset(area, 0, sizeof(*area));
+    area->cpu_id = (uint32_t)-1;
+    if (syscall(__NR_rseq, area, sizeof(RseqArea), 0, BVAR_RSEQ_SIG) != 0) {
+        // ENOSYS: the kernel is older than 4.18.
+        // EBUSY: registered by someone else with unknown area.
+        return tls_rseq_area;
+    }
+    // Unregister before the TLS is released.
+    if (butil::thread_atexit(unregister_rseq, area) != 0) {
+        syscall(__NR_rseq, area, sizeof(RseqArea), RSEQ_FLAG_UNREGISTER,
+                BVAR_RSEQ_SIG);
+        return tls_rseq_area;
+    }
+    tls_rseq_area = area;
+    return tls_rseq_area;
+}
+
+#else
+
+RseqArea* init_rseq_area() {
+    tls_rseq_area = BVAR_RSEQ_UNAVAILABLE;
+    return tls_rseq_area;
+}
+
+#endif  // __x86_64__ && __linux__
+
+// Per-cpu variables are generally created at startup and rarely destroyed,
+// a global lock is enough.
+static pthread_mutex_t s_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<int64_t*>* s_free_slots = NULL;
+
+int64_t* PerCpuSlots::allocate() {
+    BAIDU_SCOPED_LOCK(s_slots_mutex);
+    if (s_free_slots == NULL) {
+        s_free_slots = new std::vector<int64_t*>;
+    }
+    if (s_free_slots->empty()) {
+        void* mem = NULL;
+        const size_t memsize =
+            sizeof(int64_t) * SLOTS_PER_CPU * g_percpu_ncpu;
+        if (posix_memalign(&mem, 64, memsize) != 0) {
+            LOG(ERROR) << "Fail to allocate " << memsize << " bytes";
+            return NULL;
+        }
+        memset(mem, 0, memsize);
+        int64_t* block = static_cast<int64_t*>(mem);
+        s_free_slots->reserve(s_free_slots->size() + SLOTS_PER_CPU);
+        for (size_t i = SLOTS_PER_CPU; i > 0; --i) {
+            s_free_slots->push_back(block + i - 1);
+        }
+    }
+    int64_t* slot = s_free_slots->back();
+    s_free_slots->pop_back();
+    return slot;
+}
+
+void PerCpuSlots::deallocate(int64_t* slot) {
+    if (slot == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < g_percpu_ncpu; ++i) {
+        slot[i * SLOTS_PER_CPU] = 0;
+    }
+    BAIDU_SCOPED_LOCK(s_slots_mutex);
+    s_free_slots->push_back(slot);
+}
+
+}  // namespace detail
+}  // namespace bvar
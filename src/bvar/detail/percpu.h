@@ -0,0 +1,165 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BVAR_DETAIL_PERCPU_H
+#define  BVAR_DETAIL_PERCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "butil/macros.h"                // BAIDU_SYMBOLSTR
+#include "butil/compiler_specific.h"     // BAIDU_UNLIKELY
+
+namespace bvar {
+namespace detail {
+
+// Layout of struct rseq in <linux/rseq.h>, which is registered to the
+// kernel per thread. The kernel updates cpu_id when the thread is scheduled
+// and restarts the critical section described by rseq_cs (jump to its abort
+// handler) if the thread is preempted, migrated or signaled in it.
+struct RseqArea {
+    uint32_t cpu_id_start;
+    uint32_t cpu_id;
+    uint64_t rseq_cs;
+    uint32_t flags;
+} __attribute__((aligned(32)));
+
+// Slots of per-cpu variables. Slots of the same CPU are continuous so that
+// variables updated on a CPU share cachelines with each other rather than
+// with other CPUs. Slot of a variable on CPU `c' is at
+// `slot + c * PerCpuSlots::SLOTS_PER_CPU' where `slot' is the one allocated.
+class PerCpuSlots {
+public:
+    static const size_t SLOTS_PER_CPU = 1024;
+
+    // Allocate zeroed slots for a variable.
+    // Returns NULL on error.
+    static int64_t* allocate();
+
+    // Zero the slots and return them for later allocations.
+    static void deallocate(int64_t* slot);
+};
+
+// Number of possible CPUs.
+extern uint32_t g_percpu_ncpu;
+
+// rseq area of current thread. NULL means rseq is not checked yet and
+// RSEQ_UNAVAILABLE means rseq is not available to the thread.
+extern __thread RseqArea* tls_rseq_area;
+#define BVAR_RSEQ_UNAVAILABLE ((::bvar::detail::RseqArea*)1)
+
+// Register rseq for current thread if it's not registered by glibc(2.35+).
+// Returns the rseq area, or BVAR_RSEQ_UNAVAILABLE if the kernel(4.18+) or
+// the platform does not support rseq.
+RseqArea* init_rseq_area();
+
+// True if rseq is available to current thread.
+inline bool rseq_available() {
+    RseqArea* area = tls_rseq_area;
+    if (area == NULL) {
+        area = init_rseq_area();
+    }
+    return area != BVAR_RSEQ_UNAVAILABLE;
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+// Signature before abort handlers, must be same with the one used in
+// registration. This is the value used by glibc as well.
+#define BVAR_RSEQ_SIG 0x53053053
+
+// Add `count' to `*v' in a restartable sequence if current thread is
+// running on `cpu'. Returns 0 on success, -1 if the thread is migrated,
+// preempted or signaled before the add which is not done.
+inline int rseq_addv(RseqArea* area, int64_t* v, int64_t count, uint32_t cpu) {
+    __asm__ __volatile__ goto (
+        // The critical section descriptor: version, flags, start_ip,
+        // post_commit_offset and abort_ip.
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, 8(%[area])\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], 4(%[area])\n\t"
+        "jnz 4f\n\t"
+        // Commit.
+        "addq %[count], %[v]\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        // ud1 <sig>(%rip),%edi, disassembler-friendly.
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " BAIDU_SYMBOLSTR(BVAR_RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        :
+        : [cpu] "r" (cpu), [area] "r" (area), [v] "m" (*v),
+          [count] "er" (count)
+        : "memory", "cc", "rax"
+        : abort);
+    return 0;
+abort:
+    return -1;
+}
+
+// Add `value' to the slot of current CPU.
+// Returns false if rseq is not available.
+inline bool percpu_add(int64_t* slot, int64_t value) {
+    RseqArea* area = tls_rseq_area;
+    if (BAIDU_UNLIKELY(area == NULL)) {
+        area = init_rseq_area();
+    }
+    if (BAIDU_UNLIKELY(area == BVAR_RSEQ_UNAVAILABLE)) {
+        return false;
+    }
+    while (true) {
+        const uint32_t cpu = *(volatile uint32_t*)&area->cpu_id;
+        if (BAIDU_UNLIKELY(cpu >= g_percpu_ncpu)) {
+            return false;
+        }
+        if (rseq_addv(area, slot + cpu * PerCpuSlots::SLOTS_PER_CPU,
+                      value, cpu) == 0) {
+            return true;
+        }
+    }
+}
+
+#else
+
+inline bool percpu_add(int64_t*, int64_t) {
+    return false;
+}
+
+#endif  // __x86_64__ && __linux__
+
+// Sum slots of all CPUs.
+inline int64_t percpu_sum(const int64_t* slot) {
+    int64_t sum = 0;
+    for (uint32_t i = 0; i < g_percpu_ncpu; ++i) {
+        sum += *(const volatile int64_t*)(slot + i * PerCpuSlots::SLOTS_PER_CPU);
+    }
+    return sum;
+}
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  // BVAR_DETAIL_PERCPU_H
@@ -17,6 +17,9 @@
 
 // Date: Tue Jul 28 18:14:40 CST 2015
 
+#include <pthread.h>
+#include <algorithm>
+#include <gflags/gflags.h>
 #include "butil/time.h"
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "bvar/reducer.h"
@@ -25,9 +28,19 @@
 #include "bvar/window.h"
 
 namespace bvar {
+
+DEFINE_int32(bvar_sampler_thread_num, 1,
+             "Number of threads calling take_sample() of Window/PerSecond/"
+             "LatencyRecorder..., can only be increased at runtime");
+DEFINE_int32(bvar_sampler_skew_tolerance_ms, 100,
+             "Samples in a round are taken at different time, rounds spending "
+             "more than so many milliseconds are counted in "
+             "bvar_sampler_collector_overrun_count");
+
 namespace detail {
 
 const int WARN_NOSLEEP_THRESHOLD = 2;
+const int MAX_SAMPLER_THREADS = 64;
 
 // Combine two circular linked list into one.
 struct CombineSampler {
@@ -47,6 +60,16 @@ struct CombineSampler {
 // of child as well, no need to register in the child again.
 static bool registered_atfork = false;
 
+// Samplers sampled by one thread. Samplers are stored in an array sorted by
+// addresses instead of the linked list, which is much more cache-friendly
+// to walk through when there're lots of samplers.
+struct SamplerShard {
+    SamplerShard() : thread_created(false) {}
+    std::vector<Sampler*> samplers;
+    bool thread_created;
+    pthread_t tid;
+};
+
 // Call take_sample() of all scheduled samplers.
 // This can be done with regular timer thread, but it's way too slow(global
 // contention + log(N) heap manipulations). We need it to be super fast so that
@@ -55,21 +78,37 @@ static bool registered_atfork = false;
 // doubly linked, thus we can reduce multiple Samplers into one cicurlarly
 // doubly linked list, and multiple lists into larger lists. We create a
 // dedicated thread to periodically get_value() which is just the combined
-// list of Samplers. Waking through the list and call take_sample().
+// list of Samplers. The samplers are distributed into shards, each of which
+// is sampled by a thread(the first one by the dedicated thread itself) in
+// parallel, see -bvar_sampler_thread_num.
 // If a Sampler needs to be deleted, we just mark it as unused and the
-// deletion is taken place in the thread as well.
+// deletion is taken place in the sampling threads as well.
 class SamplerCollector : public bvar::Reducer<Sampler*, CombineSampler> {
 public:
     SamplerCollector()
         : _created(false)
         , _stop(false)
-        , _cumulated_time_us(0) {
+        , _cumulated_time_us(0)
+        , _last_pass_us(0)
+        , _noverrun(0)
+        , _round(0)
+        , _nrunning(0) {
+        init_sync();
+        _shards.push_back(new SamplerShard);
         create_sampling_thread();
     }
     ~SamplerCollector() {
         if (_created) {
+            pthread_mutex_lock(&_mutex);
             _stop = true;
+            pthread_cond_broadcast(&_cond);
+            pthread_mutex_unlock(&_mutex);
             pthread_join(_tid, NULL);
+            for (size_t i = 1; i < _shards.size(); ++i) {
+                if (_shards[i]->thread_created) {
+                    pthread_join(_shards[i]->tid, NULL);
+                }
+            }
             _created = false;
         }
     }
@@ -86,6 +125,12 @@ private:
         butil::get_leaky_singleton<SamplerCollector>()->after_forked_as_child();
     }
 
+    void init_sync() {
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_cond_init(&_cond, NULL);
+        pthread_cond_init(&_done_cond, NULL);
+    }
+
     void create_sampling_thread() {
         const int rc = pthread_create(&_tid, NULL, sampling_thread, this);
         if (rc != 0) {
@@ -100,33 +145,188 @@ private:
     }
 
     void after_forked_as_child() {
+        // Only the forking thread survives, the mutex may be locked by
+        // threads which do not exist anymore.
+        init_sync();
+        _nrunning = 0;
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            _shards[i]->thread_created = false;
+        }
         _created = false;
         create_sampling_thread();
     }
 
     void run();
 
+    // Create threads for shards, add new shards if -bvar_sampler_thread_num
+    // is increased.
+    void prepare_shards();
+    // Distribute `samplers' into shards.
+    void distribute(std::vector<Sampler*>* samplers);
+    // Call take_sample() of samplers in the shard and delete unused ones.
+    static void sample_shard(SamplerShard* shard);
+    void run_shard(size_t index, int64_t last_round);
+
     static void* sampling_thread(void* arg) {
         static_cast<SamplerCollector*>(arg)->run();
         return NULL;
     }
 
+    struct ShardThreadArgs {
+        SamplerCollector* c;
+        size_t index;
+        // The thread runs since next round.
+        int64_t round;
+    };
+    static void* shard_thread(void* arg) {
+        ShardThreadArgs* args = static_cast<ShardThreadArgs*>(arg);
+        args->c->run_shard(args->index, args->round);
+        delete args;
+        return NULL;
+    }
+
     static double get_cumulated_time(void* arg) {
         return static_cast<SamplerCollector*>(arg)->_cumulated_time_us / 1000.0 / 1000.0;
     }
+    static int64_t get_last_pass_us(void* arg) {
+        return static_cast<SamplerCollector*>(arg)->_last_pass_us;
+    }
+    static int64_t get_overrun_count(void* arg) {
+        return static_cast<SamplerCollector*>(arg)->_noverrun;
+    }
 
 private:
     bool _created;
     bool _stop;
     int64_t _cumulated_time_us;
+    int64_t _last_pass_us;
+    int64_t _noverrun;
     pthread_t _tid;
+
+    // Sync the dedicated thread and threads of shards. Shards are only
+    // modified by the dedicated thread between rounds.
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    pthread_cond_t _done_cond;
+    int64_t _round;
+    size_t _nrunning;
+    std::vector<SamplerShard*> _shards;
 };
 
 #ifndef UNIT_TEST
 static PassiveStatus<double>* s_cumulated_time_bvar = NULL;
 static bvar::PerSecond<bvar::PassiveStatus<double> >* s_sampling_thread_usage_bvar = NULL;
+static PassiveStatus<int64_t>* s_pass_us_bvar = NULL;
+static PassiveStatus<int64_t>* s_overrun_count_bvar = NULL;
 #endif
 
+static bool less_address(const Sampler* s1, const Sampler* s2) {
+    return s1 < s2;
+}
+
+void SamplerCollector::distribute(std::vector<Sampler*>* samplers) {
+    if (samplers->empty()) {
+        return;
+    }
+    std::sort(samplers->begin(), samplers->end(), less_address);
+    size_t total = samplers->size();
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        total += _shards[i]->samplers.size();
+    }
+    const size_t avg = (total + _shards.size() - 1) / _shards.size();
+    // Fill shards up to the average with continuous ranges of samplers.
+    size_t pos = 0;
+    for (size_t i = 0; i < _shards.size() && pos < samplers->size(); ++i) {
+        std::vector<Sampler*>& v = _shards[i]->samplers;
+        if (v.size() >= avg) {
+            continue;
+        }
+        const size_t n = std::min(avg - v.size(), samplers->size() - pos);
+        const size_t old_size = v.size();
+        v.insert(v.end(), samplers->begin() + pos, samplers->begin() + pos + n);
+        std::inplace_merge(v.begin(), v.begin() + old_size, v.end(),
+                           less_address);
+        pos += n;
+    }
+    CHECK_EQ(pos, samplers->size());
+    samplers->clear();
+}
+
+void SamplerCollector::prepare_shards() {
+    const size_t nshard = std::max(
+        1, std::min(FLAGS_bvar_sampler_thread_num, MAX_SAMPLER_THREADS));
+    if (nshard > _shards.size()) {
+        // Rebalance all samplers into new shards.
+        std::vector<Sampler*> all;
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            all.insert(all.end(), _shards[i]->samplers.begin(),
+                       _shards[i]->samplers.end());
+            _shards[i]->samplers.clear();
+        }
+        while (_shards.size() < nshard) {
+            _shards.push_back(new SamplerShard);
+        }
+        distribute(&all);
+    }
+    for (size_t i = 1; i < _shards.size(); ++i) {
+        if (_shards[i]->thread_created) {
+            continue;
+        }
+        ShardThreadArgs* args = new ShardThreadArgs;
+        args->c = this;
+        args->index = i;
+        args->round = _round;
+        const int rc = pthread_create(&_shards[i]->tid, NULL,
+                                      shard_thread, args);
+        if (rc != 0) {
+            delete args;
+            LOG(ERROR) << "Fail to create thread for sampler shard "
+                       << i << ", " << berror(rc);
+            continue;
+        }
+        _shards[i]->thread_created = true;
+    }
+}
+
+void SamplerCollector::sample_shard(SamplerShard* shard) {
+    std::vector<Sampler*>& v = shard->samplers;
+    size_t nkept = 0;
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (i + 1 < v.size()) {
+            __builtin_prefetch(v[i + 1]);
+        }
+        Sampler* s = v[i];
+        s->_mutex.lock();
+        if (!s->_used) {
+            s->_mutex.unlock();
+            delete s;
+        } else {
+            s->take_sample();
+            s->_mutex.unlock();
+            v[nkept++] = s;
+        }
+    }
+    v.resize(nkept);
+}
+
+void SamplerCollector::run_shard(size_t index, int64_t last_round) {
+    pthread_mutex_lock(&_mutex);
+    while (!_stop) {
+        if (_round == last_round) {
+            pthread_cond_wait(&_cond, &_mutex);
+            continue;
+        }
+        last_round = _round;
+        pthread_mutex_unlock(&_mutex);
+        sample_shard(_shards[index]);
+        pthread_mutex_lock(&_mutex);
+        if (--_nrunning == 0) {
+            pthread_cond_signal(&_done_cond);
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
 void SamplerCollector::run() {
 #ifndef UNIT_TEST
     // NOTE:
@@ -143,38 +343,65 @@ void SamplerCollector::run() {
             new bvar::PerSecond<bvar::PassiveStatus<double> >(
                     "bvar_sampler_collector_usage", s_cumulated_time_bvar, 10);
     }
+    if (s_pass_us_bvar == NULL) {
+        s_pass_us_bvar = new PassiveStatus<int64_t>(
+            "bvar_sampler_collector_pass_us", get_last_pass_us, this);
+    }
+    if (s_overrun_count_bvar == NULL) {
+        s_overrun_count_bvar = new PassiveStatus<int64_t>(
+            "bvar_sampler_collector_overrun_count", get_overrun_count, this);
+    }
 #endif
 
-    butil::LinkNode<Sampler> root;
     int consecutive_nosleep = 0;
+    std::vector<Sampler*> fresh;
     while (!_stop) {
         int64_t abstime = butil::gettimeofday_us();
         Sampler* s = this->reset();
         if (s) {
-            s->InsertBeforeAsList(&root);
-        }
-        int nremoved = 0;
-        int nsampled = 0;
-        for (butil::LinkNode<Sampler>* p = root.next(); p != &root;) {
-            // We may remove p from the list, save next first.
-            butil::LinkNode<Sampler>* saved_next = p->next();
-            Sampler* s = p->value();
-            s->_mutex.lock();
-            if (!s->_used) {
-                s->_mutex.unlock();
-                p->RemoveFromList();
-                delete s;
-                ++nremoved;
-            } else {
-                s->take_sample();
-                s->_mutex.unlock();
-                ++nsampled;
+            butil::LinkNode<Sampler>* p = s;
+            do {
+                fresh.push_back(p->value());
+                p = p->next();
+            } while (p != s);
+            for (size_t i = 0; i < fresh.size(); ++i) {
+                fresh[i]->RemoveFromList();
             }
-            p = saved_next;
         }
+        prepare_shards();
+        distribute(&fresh);
+
+        pthread_mutex_lock(&_mutex);
+        ++_round;
+        _nrunning = 0;
+        for (size_t i = 1; i < _shards.size(); ++i) {
+            _nrunning += _shards[i]->thread_created;
+        }
+        pthread_cond_broadcast(&_cond);
+        pthread_mutex_unlock(&_mutex);
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            if (i == 0 || !_shards[i]->thread_created) {
+                sample_shard(_shards[i]);
+            }
+        }
+        pthread_mutex_lock(&_mutex);
+        while (_nrunning > 0) {
+            pthread_cond_wait(&_done_cond, &_mutex);
+        }
+        pthread_mutex_unlock(&_mutex);
+
         bool slept = false;
         int64_t now = butil::gettimeofday_us();
+        _last_pass_us = now - abstime;
         _cumulated_time_us += now - abstime;
+        if (_last_pass_us > FLAGS_bvar_sampler_skew_tolerance_ms * 1000L) {
+            ++_noverrun;
+            LOG_EVERY_SECOND(WARNING)
+                << "bvar spent " << _last_pass_us << "us at sampling, more "
+                "than -bvar_sampler_skew_tolerance_ms="
+                << FLAGS_bvar_sampler_skew_tolerance_ms
+                << ", consider increasing -bvar_sampler_thread_num";
+        }
         abstime += 1000000L;
         while (abstime > now) {
             ::usleep(abstime - now);
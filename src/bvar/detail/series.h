@@ -26,6 +26,7 @@
 #include "butil/type_traits.h"
 #include "bvar/vector.h"
 #include "bvar/detail/call_op_returning_void.h"
+#include "bvar/detail/series_codec.h"
 #include "butil/string_splitter.h"
 
 namespace bvar {
@@ -96,6 +97,192 @@ struct DivideOnAddition<Vector<T,N>, Op, typename butil::enable_if<
     }
 };
 
+enum SeriesLevel {
+    SERIES_SECOND = 0,
+    SERIES_MINUTE,
+    SERIES_HOUR,
+    SERIES_DAY,
+    SERIES_NLEVEL
+};
+
+// Number of values in a series: 30 days, 24 hours, 60 minutes, 60 seconds.
+const int SERIES_NVALUE = 30 + 24 + 60 + 60;
+
+inline int series_level_size(int level) {
+    static const int s_sizes[SERIES_NLEVEL] = { 60, 60, 24, 30 };
+    return s_sizes[level];
+}
+
+// Offset of values of the level in the output of SeriesData::get_values(),
+// which are ordered from days to seconds.
+inline int series_level_offset(int level) {
+    static const int s_offsets[SERIES_NLEVEL] = { 114, 54, 30, 0 };
+    return s_offsets[level];
+}
+
+// Values of integers and floating points are compressed, see series_codec.h
+template <typename T>
+struct IsCompressibleInSeries {
+    static const bool value = (butil::is_integral<T>::value ||
+                               butil::is_floating_point<T>::value) &&
+        sizeof(T) <= sizeof(int64_t);
+};
+
+template <typename T>
+struct SeriesCodecOf {
+    typedef typename butil::conditional<
+        butil::is_floating_point<T>::value,
+        FloatSeriesCodec, IntSeriesCodec>::type type;
+};
+
+// Storage of values in a series. Generally values are stored in arrays.
+template <typename T, typename Enabler = void>
+class SeriesData {
+public:
+    SeriesData() {
+        memset(_index, 0, sizeof(_index));
+        // is_pod does not work for gcc 3.4
+        if (butil::is_integral<T>::value ||
+            butil::is_floating_point<T>::value) {
+            memset(_array, 0, sizeof(_array));
+        }
+    }
+
+    void append(int level, const T& value) {
+        _array[series_level_offset(level) + _index[level]] = value;
+        if (++_index[level] >= series_level_size(level)) {
+            _index[level] = 0;
+        }
+    }
+
+    // Put all values into `out' in chronological order.
+    void get_values(T* out) const {
+        for (int level = 0; level < SERIES_NLEVEL; ++level) {
+            const int size = series_level_size(level);
+            const T* values = _array + series_level_offset(level);
+            T* level_out = out + series_level_offset(level);
+            for (int i = 0; i < size; ++i) {
+                level_out[i] = values[(i + _index[level]) % size];
+            }
+        }
+    }
+
+    size_t memory_usage() const { return sizeof(*this); }
+
+private:
+    char _index[SERIES_NLEVEL];
+    T _array[SERIES_NVALUE];
+};
+
+// Integers and floating points are encoded in CompressedRing, which takes
+// much less memory than arrays because values of most series change
+// slowly.
+template <typename T>
+class SeriesData<T, typename butil::enable_if<
+                        IsCompressibleInSeries<T>::value>::type> {
+    typedef typename SeriesCodecOf<T>::type Codec;
+    typedef typename Codec::value_type value_type;
+public:
+    // The value is dropped if memory can't be allocated, see
+    // CompressedRing::append().
+    void append(int level, const T& value) {
+        switch (level) {
+        case SERIES_SECOND:
+            _second.append((value_type)value);
+            break;
+        case SERIES_MINUTE:
+            _minute.append((value_type)value);
+            break;
+        case SERIES_HOUR:
+            _hour.append((value_type)value);
+            break;
+        case SERIES_DAY:
+            _day.append((value_type)value);
+            break;
+        }
+    }
+
+    void get_values(T* out) const {
+        _second.get(out + series_level_offset(SERIES_SECOND));
+        _minute.get(out + series_level_offset(SERIES_MINUTE));
+        _hour.get(out + series_level_offset(SERIES_HOUR));
+        _day.get(out + series_level_offset(SERIES_DAY));
+    }
+
+    size_t memory_usage() const {
+        return sizeof(*this) + _second.memory_usage() +
+            _minute.memory_usage() + _hour.memory_usage() +
+            _day.memory_usage();
+    }
+
+private:
+    CompressedRing<Codec, 60> _second;
+    CompressedRing<Codec, 60> _minute;
+    CompressedRing<Codec, 24> _hour;
+    CompressedRing<Codec, 30> _day;
+};
+
+// Each dimension of the Vector is encoded separately.
+template <typename T, size_t N>
+class SeriesData<Vector<T, N>, typename butil::enable_if<
+                                   IsCompressibleInSeries<T>::value>::type> {
+    typedef typename SeriesCodecOf<T>::type Codec;
+    typedef typename Codec::value_type value_type;
+public:
+    void append(int level, const Vector<T, N>& value) {
+        for (size_t j = 0; j < N; ++j) {
+            switch (level) {
+            case SERIES_SECOND:
+                _second[j].append((value_type)value[j]);
+                break;
+            case SERIES_MINUTE:
+                _minute[j].append((value_type)value[j]);
+                break;
+            case SERIES_HOUR:
+                _hour[j].append((value_type)value[j]);
+                break;
+            case SERIES_DAY:
+                _day[j].append((value_type)value[j]);
+                break;
+            }
+        }
+    }
+
+    void get_values(Vector<T, N>* out) const {
+        get_level(_second, out + series_level_offset(SERIES_SECOND));
+        get_level(_minute, out + series_level_offset(SERIES_MINUTE));
+        get_level(_hour, out + series_level_offset(SERIES_HOUR));
+        get_level(_day, out + series_level_offset(SERIES_DAY));
+    }
+
+    size_t memory_usage() const {
+        size_t n = sizeof(*this);
+        for (size_t j = 0; j < N; ++j) {
+            n += _second[j].memory_usage() + _minute[j].memory_usage() +
+                _hour[j].memory_usage() + _day[j].memory_usage();
+        }
+        return n;
+    }
+
+private:
+    template <int M>
+    static void get_level(const CompressedRing<Codec, M>* rings,
+                          Vector<T, N>* out) {
+        T values[M];
+        for (size_t j = 0; j < N; ++j) {
+            rings[j].get(values);
+            for (int i = 0; i < M; ++i) {
+                out[i][j] = values[i];
+            }
+        }
+    }
+
+    CompressedRing<Codec, 60> _second[N];
+    CompressedRing<Codec, 60> _minute[N];
+    CompressedRing<Codec, 24> _hour[N];
+    CompressedRing<Codec, 30> _day[N];
+};
+
 template <typename T, typename Op>
 class SeriesBase {
 public:
@@ -103,8 +290,7 @@ public:
         : _op(op)
         , _nsecond(0)
         , _nminute(0)
-        , _nhour(0)
-        , _nday(0) {
+        , _nhour(0) {
         pthread_mutex_init(&_mutex, NULL);
     }
     ~SeriesBase() {
@@ -116,57 +302,56 @@ public:
         return append_second(value, _op);
     }
 
+    // Bytes of memory used by this series.
+    size_t memory_usage() const {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return sizeof(*this) - sizeof(_data) + _data.memory_usage();
+    }
+
+protected:
+    // Copy all SERIES_NVALUE values into `out'.
+    void get_values(T* out) const {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _data.get_values(out);
+    }
+
 private:
     void append_second(const T& value, const Op& op);
     void append_minute(const T& value, const Op& op);
     void append_hour(const T& value, const Op& op);
     void append_day(const T& value);
 
-    struct Data {
-    public:
-        Data() {
-            // is_pod does not work for gcc 3.4
-            if (butil::is_integral<T>::value ||
-                butil::is_floating_point<T>::value) {
-                memset(_array, 0, sizeof(_array));
-            }
+    // Combine `value' into `acc', which is reset when `n' is 0.
+    static void accumulate(T& acc, const T& value, int n, const Op& op) {
+        if (n == 0) {
+            acc = value;
+        } else {
+            call_op_returning_void(op, acc, value);
         }
-        
-        T& second(int index) { return _array[index]; }
-        const T& second(int index) const { return _array[index]; }
-
-        T& minute(int index) { return _array[60 + index]; }
-        const T& minute(int index) const { return _array[60 + index]; }
-
-        T& hour(int index) { return _array[120 + index]; }
-        const T& hour(int index) const { return _array[120 + index]; }
-
-        T& day(int index) { return _array[144 + index]; }
-        const T& day(int index) const { return _array[144 + index]; }
-    private:
-        T _array[60 + 60 + 24 + 30];
-    };
+    }
 
 protected:
     Op _op;
     mutable pthread_mutex_t _mutex;
+    // Values of current minute/hour/day combined with _op so far, instead
+    // of combining stored values which are compressed.
+    T _second_acc;
+    T _minute_acc;
+    T _hour_acc;
     char _nsecond;
     char _nminute;
     char _nhour;
-    char _nday;
-    Data _data;
+    SeriesData<T> _data;
 };
 
 template <typename T, typename Op>
 void SeriesBase<T, Op>::append_second(const T& value, const Op& op) {
-    _data.second(_nsecond) = value;
+    _data.append(SERIES_SECOND, value);
+    accumulate(_second_acc, value, _nsecond, op);
     ++_nsecond;
     if (_nsecond >= 60) {
         _nsecond = 0;
-        T tmp = _data.second(0);
-        for (int i = 1; i < 60; ++i) {
-            call_op_returning_void(op, tmp, _data.second(i));
-        }
+        T tmp = _second_acc;
         DivideOnAddition<T, Op>::inplace_divide(tmp, op, 60);
         append_minute(tmp, op);
     }
@@ -174,14 +359,12 @@ void SeriesBase<T, Op>::append_second(const T& value, const Op& op) {
 
 template <typename T, typename Op>
 void SeriesBase<T, Op>::append_minute(const T& value, const Op& op) {
-    _data.minute(_nminute) = value;
+    _data.append(SERIES_MINUTE, value);
+    accumulate(_minute_acc, value, _nminute, op);
     ++_nminute;
     if (_nminute >= 60) {
         _nminute = 0;
-        T tmp = _data.minute(0);
-        for (int i = 1; i < 60; ++i) {
-            call_op_returning_void(op, tmp, _data.minute(i));
-        }
+        T tmp = _minute_acc;
         DivideOnAddition<T, Op>::inplace_divide(tmp, op, 60);
         append_hour(tmp, op);
     }
@@ -189,14 +372,12 @@ void SeriesBase<T, Op>::append_minute(const T& value, const Op& op) {
 
 template <typename T, typename Op>
 void SeriesBase<T, Op>::append_hour(const T& value, const Op& op) {
-    _data.hour(_nhour) = value;
+    _data.append(SERIES_HOUR, value);
+    accumulate(_hour_acc, value, _nhour, op);
     ++_nhour;
     if (_nhour >= 24) {
         _nhour = 0;
-        T tmp = _data.hour(0);
-        for (int i = 1; i < 24; ++i) {
-            call_op_returning_void(op, tmp, _data.hour(i));
-        }
+        T tmp = _hour_acc;
         DivideOnAddition<T, Op>::inplace_divide(tmp, op, 24);
         append_day(tmp);
     }
@@ -204,11 +385,7 @@ void SeriesBase<T, Op>::append_hour(const T& value, const Op& op) {
 
 template <typename T, typename Op>
 void SeriesBase<T, Op>::append_day(const T& value) {
-    _data.day(_nday) = value;
-    ++_nday;
-    if (_nday >= 30) {
-        _nday = 0;
-    }
+    _data.append(SERIES_DAY, value);
 }
 
 template <typename T, typename Op>
@@ -231,40 +408,14 @@ template <typename T, typename Op>
 void Series<T, Op>::describe(std::ostream& os,
                              const std::string* vector_names) const {
     CHECK(vector_names == NULL);
-    pthread_mutex_lock(&this->_mutex);
-    const int second_begin = this->_nsecond;
-    const int minute_begin = this->_nminute;
-    const int hour_begin = this->_nhour;
-    const int day_begin = this->_nday;
-    // NOTE: we don't save _data which may be inconsistent sometimes, but
-    // this output is generally for "peeking the trend" and does not need
-    // to exactly accurate.
-    pthread_mutex_unlock(&this->_mutex);
-    int c = 0;
+    T values[SERIES_NVALUE];
+    this->get_values(values);
     os << "{\"label\":\"trend\",\"data\":[";
-    for (int i = 0; i < 30; ++i, ++c) {
+    for (int c = 0; c < SERIES_NVALUE; ++c) {
         if (c) {
             os << ',';
         }
-        os << '[' << c << ',' << this->_data.day((i + day_begin) % 30) << ']';
-    }
-    for (int i = 0; i < 24; ++i, ++c) {
-        if (c) {
-            os << ',';
-        }
-        os << '[' << c << ',' << this->_data.hour((i + hour_begin) % 24) << ']';
-    }
-    for (int i = 0; i < 60; ++i, ++c) {
-        if (c) {
-            os << ',';
-        }
-        os << '[' << c << ',' << this->_data.minute((i + minute_begin) % 60) << ']';
-    }
-    for (int i = 0; i < 60; ++i, ++c) {
-        if (c) {
-            os << ',';
-        }
-        os << '[' << c << ',' << this->_data.second((i + second_begin) % 60) << ']';
+        os << '[' << c << ',' << values[c] << ']';
     }
     os << "]}";
 }
@@ -272,15 +423,8 @@ void Series<T, Op>::describe(std::ostream& os,
 template <typename T, size_t N, typename Op>
 void Series<Vector<T,N>, Op>::describe(std::ostream& os,
                                        const std::string* vector_names) const {
-    pthread_mutex_lock(&this->_mutex);
-    const int second_begin = this->_nsecond;
-    const int minute_begin = this->_nminute;
-    const int hour_begin = this->_nhour;
-    const int day_begin = this->_nday;
-    // NOTE: we don't save _data which may be inconsistent sometimes, but
-    // this output is generally for "peeking the trend" and does not need
-    // to exactly accurate.
-    pthread_mutex_unlock(&this->_mutex);
+    Vector<T,N> values[SERIES_NVALUE];
+    this->get_values(values);
 
     butil::StringSplitter sp(vector_names ? vector_names->c_str() : "", ',');
     os << '[';
@@ -288,7 +432,6 @@ void Series<Vector<T,N>, Op>::describe(std::ostream& os,
         if (j) {
             os << ',';
         }
-        int c = 0;
         os << "{\"label\":\"";
         if (sp) {
             os << butil::StringPiece(sp.field(), sp.length());
@@ -297,29 +440,11 @@ void Series<Vector<T,N>, Op>::describe(std::ostream& os,
             os << "Vector[" << j << ']';
         }
         os << "\",\"data\":[";
-        for (int i = 0; i < 30; ++i, ++c) {
-            if (c) {
-                os << ',';
-            }
-            os << '[' << c << ',' << this->_data.day((i + day_begin) % 30)[j] << ']';
-        }
-        for (int i = 0; i < 24; ++i, ++c) {
-            if (c) {
-                os << ',';
-            }
-            os << '[' << c << ',' << this->_data.hour((i + hour_begin) % 24)[j] << ']';
-        }
-        for (int i = 0; i < 60; ++i, ++c) {
-            if (c) {
-                os << ',';
-            }
-            os << '[' << c << ',' << this->_data.minute((i + minute_begin) % 60)[j] << ']';
-        }
-        for (int i = 0; i < 60; ++i, ++c) {
+        for (int c = 0; c < SERIES_NVALUE; ++c) {
             if (c) {
                 os << ',';
             }
-            os << '[' << c << ',' << this->_data.second((i + second_begin) % 60)[j] << ']';
+            os << '[' << c << ',' << values[c][j] << ']';
         }
         os << "]}";
     }
@@ -0,0 +1,406 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BVAR_DETAIL_SERIES_CODEC_H
+#define  BVAR_DETAIL_SERIES_CODEC_H
+
+#include <stdint.h>
+#include <stdlib.h>                     // realloc
+#include <string.h>                     // memset
+#include <algorithm>                    // std::min
+#include <utility>                      // std::swap
+#include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
+
+// Compression of values in bvar series, see "Gorilla: A Fast, Scalable,
+// In-Memory Time Series Database". Integers are encoded with delta of
+// delta and floating points are encoded by XOR with the previous value.
+// Values of a series often change slowly or not at all, which are encoded
+// in a few bits.
+
+namespace bvar {
+namespace detail {
+
+// Bits appended/read from the most significant bit of each word. Up to 128
+// bits are stored inline without allocating memory, which is enough for
+// series not changing.
+class SeriesBits {
+public:
+    static const uint32_t INLINE_WORDS = 2;
+
+    SeriesBits() : _nbits(0), _nwords(0) {
+        memset(_u.inline_words, 0, sizeof(_u.inline_words));
+    }
+    ~SeriesBits() { clear(); }
+
+    static const uint32_t MAX_WORDS = 255;
+
+    // Make sure that `nbits' more bits can be appended.
+    // Returns false if there's no memory or the bits would exceed
+    // MAX_WORDS, in which case the bits are not changed.
+    bool reserve_more(uint32_t nbits) {
+        const uint32_t need_words = (_nbits + nbits + 63) / 64;
+        if (need_words <= capacity()) {
+            return true;
+        }
+        if (need_words > MAX_WORDS) {
+            return false;
+        }
+        const uint32_t grown = need_words + _nwords / 4 + 1;
+        return reserve(grown < MAX_WORDS ? grown : MAX_WORDS);
+    }
+
+    // Append lowest `nbits'(1-64) bits of `value'.
+    // Returns false if the bits can't be reserved, see reserve_more().
+    bool append(uint64_t value, int nbits) {
+        if (!reserve_more(nbits)) {
+            return false;
+        }
+        value &= mask(nbits);
+        uint64_t* w = words() + (_nbits >> 6);
+        const int free_bits = 64 - (_nbits & 63);
+        if (nbits <= free_bits) {
+            w[0] |= value << (free_bits - nbits);
+        } else {
+            const int rest = nbits - free_bits;
+            w[0] |= value >> rest;
+            w[1] |= value << (64 - rest);
+        }
+        _nbits += nbits;
+        return true;
+    }
+
+    // Read `nbits'(1-64) bits at `*pos' and move forward `*pos'.
+    uint64_t read(uint32_t* pos, int nbits) const {
+        const uint64_t* w = words() + (*pos >> 6);
+        const int free_bits = 64 - (*pos & 63);
+        *pos += nbits;
+        if (nbits <= free_bits) {
+            return (w[0] >> (free_bits - nbits)) & mask(nbits);
+        }
+        const int rest = nbits - free_bits;
+        return ((w[0] & mask(free_bits)) << rest) | (w[1] >> (64 - rest));
+    }
+
+    // Remove all bits and release memory.
+    void clear() {
+        if (_nwords) {
+            free(_u.words);
+        }
+        memset(_u.inline_words, 0, sizeof(_u.inline_words));
+        _nbits = 0;
+        _nwords = 0;
+    }
+
+    void swap(SeriesBits& other) {
+        std::swap(_u, other._u);
+        std::swap(_nbits, other._nbits);
+        std::swap(_nwords, other._nwords);
+    }
+
+    uint32_t size() const { return _nbits; }
+    size_t memory_usage() const { return _nwords * sizeof(uint64_t); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SeriesBits);
+
+    static uint64_t mask(int nbits) {
+        return nbits >= 64 ? (uint64_t)-1 : (((uint64_t)1 << nbits) - 1);
+    }
+
+    uint32_t capacity() const { return _nwords ? _nwords : INLINE_WORDS; }
+    uint64_t* words() { return _nwords ? _u.words : _u.inline_words; }
+    const uint64_t* words() const {
+        return _nwords ? _u.words : _u.inline_words;
+    }
+
+    bool reserve(uint32_t nwords) {
+        uint64_t* new_words = (uint64_t*)malloc(nwords * sizeof(uint64_t));
+        if (new_words == NULL) {
+            return false;
+        }
+        const uint32_t old_nwords = capacity();
+        memcpy(new_words, words(), old_nwords * sizeof(uint64_t));
+        memset(new_words + old_nwords, 0,
+               (nwords - old_nwords) * sizeof(uint64_t));
+        if (_nwords) {
+            free(_u.words);
+        }
+        _u.words = new_words;
+        _nwords = nwords;
+        return true;
+    }
+
+    union {
+        uint64_t* words;
+        uint64_t inline_words[INLINE_WORDS];
+    } _u;
+    uint16_t _nbits;
+    // 0 means the inline words.
+    uint8_t _nwords;
+};
+
+// Encode integers with delta of delta:
+//   '0'                         : same delta
+//   '10'   + 7 bits             : zigzag(dod) < 128
+//   '110'  + 9 bits             : zigzag(dod) < 512
+//   '1110' + 12 bits            : zigzag(dod) < 4096
+//   '1111' + 64 bits            : otherwise
+struct IntSeriesCodec {
+    typedef int64_t value_type;
+    struct State {
+        uint64_t prev;
+        uint64_t prev_delta;
+    };
+    // Returns false if the bits can't be appended, in which case `bits'
+    // and `st' are not changed.
+    static bool encode(SeriesBits* bits, State* st, int index, int64_t value) {
+        const uint64_t u = (uint64_t)value;
+        // The first value is encoded as the delta to 0.
+        const uint64_t prev = (index == 0 ? 0 : st->prev);
+        const uint64_t prev_delta = (index == 0 ? 0 : st->prev_delta);
+        const uint64_t delta = u - prev;
+        const uint64_t dod = delta - prev_delta;
+        const uint64_t zz = (dod << 1) ^ (uint64_t)((int64_t)dod >> 63);
+        uint64_t header;
+        int header_bits;
+        int value_bits;
+        if (zz == 0) {
+            header = 0;
+            header_bits = 1;
+            value_bits = 0;
+        } else if (zz < 128) {
+            header = 0x2;
+            header_bits = 2;
+            value_bits = 7;
+        } else if (zz < 512) {
+            header = 0x6;
+            header_bits = 3;
+            value_bits = 9;
+        } else if (zz < 4096) {
+            header = 0xE;
+            header_bits = 4;
+            value_bits = 12;
+        } else {
+            header = 0xF;
+            header_bits = 4;
+            value_bits = 64;
+        }
+        if (!bits->reserve_more(header_bits + value_bits)) {
+            return false;
+        }
+        bits->append(header, header_bits);
+        if (value_bits) {
+            bits->append(zz, value_bits);
+        }
+        st->prev = u;
+        st->prev_delta = delta;
+        return true;
+    }
+
+    static int64_t decode(const SeriesBits& bits, uint32_t* pos,
+                          State* st, int index) {
+        if (index == 0) {
+            st->prev = 0;
+            st->prev_delta = 0;
+        }
+        int nones = 0;
+        while (nones < 4 && bits.read(pos, 1)) {
+            ++nones;
+        }
+        static const int s_nbits[] = { 0, 7, 9, 12, 64 };
+        uint64_t zz = 0;
+        if (nones) {
+            zz = bits.read(pos, s_nbits[nones]);
+        }
+        const uint64_t dod = (zz >> 1) ^ (uint64_t)(-(int64_t)(zz & 1));
+        st->prev_delta += dod;
+        st->prev += st->prev_delta;
+        return (int64_t)st->prev;
+    }
+};
+
+// Encode floating points by XOR with previous value:
+//   '0'                                         : same value
+//   '10' + meaningful bits                      : within previous window
+//   '11' + 5 bits leading zeros + 6 bits length
+//        + meaningful bits                      : new window
+struct FloatSeriesCodec {
+    typedef double value_type;
+    struct State {
+        uint64_t prev;
+        uint8_t leading;
+        uint8_t trailing;
+    };
+    static const uint8_t NO_WINDOW = 0xFF;
+
+    static uint64_t to_bits(double d) {
+        uint64_t u;
+        memcpy(&u, &d, sizeof(u));
+        return u;
+    }
+    static double from_bits(uint64_t u) {
+        double d;
+        memcpy(&d, &u, sizeof(d));
+        return d;
+    }
+
+    // Returns false if the bits can't be appended, in which case `bits'
+    // and `st' are not changed.
+    static bool encode(SeriesBits* bits, State* st, int index, double value) {
+        const uint64_t u = to_bits(value);
+        // The first value is XORed with 0.0
+        const uint64_t prev = (index == 0 ? 0 : st->prev);
+        const uint8_t prev_leading = (index == 0 ? NO_WINDOW : st->leading);
+        const uint8_t prev_trailing = (index == 0 ? 0 : st->trailing);
+        const uint64_t x = u ^ prev;
+        if (x == 0) {
+            if (!bits->reserve_more(1)) {
+                return false;
+            }
+            bits->append(0, 1);
+            st->prev = u;
+            st->leading = prev_leading;
+            st->trailing = prev_trailing;
+            return true;
+        }
+        int leading = __builtin_clzll(x);
+        const int trailing = __builtin_ctzll(x);
+        if (leading > 31) {
+            leading = 31;
+        }
+        if (prev_leading != NO_WINDOW &&
+            leading >= prev_leading && trailing >= prev_trailing) {
+            const int len = 64 - prev_leading - prev_trailing;
+            if (!bits->reserve_more(2 + len)) {
+                return false;
+            }
+            bits->append(0x2, 2);
+            bits->append(x >> prev_trailing, len);
+            st->prev = u;
+            st->leading = prev_leading;
+            st->trailing = prev_trailing;
+            return true;
+        }
+        const int len = 64 - leading - trailing;
+        if (!bits->reserve_more(2 + 5 + 6 + len)) {
+            return false;
+        }
+        bits->append(0x3, 2);
+        bits->append(leading, 5);
+        bits->append(len - 1, 6);
+        bits->append(x >> trailing, len);
+        st->prev = u;
+        st->leading = leading;
+        st->trailing = trailing;
+        return true;
+    }
+
+    static double decode(const SeriesBits& bits, uint32_t* pos,
+                         State* st, int index) {
+        if (index == 0) {
+            st->prev = 0;
+            st->leading = NO_WINDOW;
+            st->trailing = 0;
+        }
+        if (bits.read(pos, 1) == 0) {
+            return from_bits(st->prev);
+        }
+        if (bits.read(pos, 1) != 0) {
+            st->leading = bits.read(pos, 5);
+            st->trailing = 64 - st->leading - (bits.read(pos, 6) + 1);
+        }
+        const int len = 64 - st->leading - st->trailing;
+        st->prev ^= bits.read(pos, len) << st->trailing;
+        return from_bits(st->prev);
+    }
+};
+
+// Last N(<= 64) values encoded with Codec. Values are appended to the
+// encoded bits until there're N + N/2 values, then the last N values are
+// re-encoded. Namely appending is amortized O(1) while values of a series
+// not changing still fit in the inline words of SeriesBits.
+template <typename Codec, int N>
+class CompressedRing {
+public:
+    typedef typename Codec::value_type value_type;
+    static const int MAX_COUNT = N + N / 2;
+
+    CompressedRing() : _count(0) {}
+
+    // Returns false if memory can't be allocated, in which case `value'
+    // is dropped and values appended before are kept.
+    bool append(value_type value) {
+        if (_count >= MAX_COUNT) {
+            value_type values[MAX_COUNT];
+            decode_all(values);
+            SeriesBits bits;
+            typename Codec::State st;
+            for (int i = 0; i < N; ++i) {
+                if (!Codec::encode(&bits, &st, i, values[MAX_COUNT - N + i])) {
+                    return false;
+                }
+            }
+            _bits.swap(bits);
+            _state = st;
+            _count = N;
+        }
+        if (!Codec::encode(&_bits, &_state, _count, value)) {
+            return false;
+        }
+        ++_count;
+        return true;
+    }
+
+    // Put the last N values into `out' in chronological order. Values
+    // not appended yet are T().
+    template <typename T>
+    void get(T* out) const {
+        value_type values[MAX_COUNT];
+        decode_all(values);
+        const int n = std::min((int)_count, N);
+        for (int i = 0; i < N - n; ++i) {
+            out[i] = T();
+        }
+        for (int i = 0; i < n; ++i) {
+            out[N - n + i] = (T)values[_count - n + i];
+        }
+    }
+
+    size_t memory_usage() const { return _bits.memory_usage(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CompressedRing);
+    BAIDU_CASSERT(N <= 64, N_is_too_large);
+
+    void decode_all(value_type* values) const {
+        typename Codec::State st;
+        uint32_t pos = 0;
+        for (int i = 0; i < _count; ++i) {
+            values[i] = Codec::decode(_bits, &pos, &st, i);
+        }
+    }
+
+    SeriesBits _bits;
+    uint8_t _count;
+    typename Codec::State _state;
+};
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  // BVAR_DETAIL_SERIES_CODEC_H
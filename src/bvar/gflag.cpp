@@ -76,6 +76,24 @@ void GFlag::get_value(boost::any* value) const {
 }
 #endif
 
+bool GFlag::get_numeric_value(NumericValue* value) const {
+    GFLAGS_NS::CommandLineFlagInfo info;
+    if (!GFLAGS_NS::GetCommandLineFlagInfo(gflag_name().c_str(), &info)) {
+        return false;
+    }
+    const char* str = info.current_value.c_str();
+    if (info.type == "int32" || info.type == "int64") {
+        return to_numeric_value((int64_t)strtoll(str, NULL, 10), value);
+    } else if (info.type == "uint64") {
+        return to_numeric_value((uint64_t)strtoull(str, NULL, 10), value);
+    } else if (info.type == "bool") {
+        return to_numeric_value((int64_t)(info.current_value == "true"), value);
+    } else if (info.type == "double") {
+        return to_numeric_value(strtod(str, NULL), value);
+    }
+    return false;
+}
+
 std::string GFlag::get_value() const {
     std::string str;
     if (!GFLAGS_NS::GetCommandLineOption(gflag_name().c_str(), &str)) {
@@ -38,6 +38,9 @@ public:
 
     void describe(std::ostream& os, bool quote_string) const override;
 
+    // Numeric and bool(as 0 or 1) gflags have numeric values.
+    bool get_numeric_value(NumericValue* value) const override;
+
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const override;
 #endif
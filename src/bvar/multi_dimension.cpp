@@ -0,0 +1,119 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <inttypes.h>
+#include <gflags/gflags.h>
+#include "butil/string_printf.h"
+#include "bvar/multi_dimension.h"
+
+namespace bvar {
+
+DEFINE_int32(bvar_max_multi_dimension_stats_count, 20000,
+             "Max number of label sets of a multi-dimensional bvar, getting "
+             "bvars of more label sets fails");
+
+namespace detail {
+
+void append_escaped_label_value(std::string* out, const std::string& value) {
+    for (size_t i = 0; i < value.size(); ++i) {
+        switch (value[i]) {
+        case '\\':
+            out->append("\\\\");
+            break;
+        case '"':
+            out->append("\\\"");
+            break;
+        case '\n':
+            out->append("\\n");
+            break;
+        default:
+            out->push_back(value[i]);
+            break;
+        }
+    }
+}
+
+static void make_full_name(const std::string& name, const char* suffix,
+                           const std::string& labels, std::string* full_name) {
+    full_name->reserve(name.size() + 16 + labels.size());
+    full_name->append(name);
+    full_name->append(suffix);
+    full_name->append(labels);
+}
+
+static size_t dump_int(Dumper* dumper, const std::string& name,
+                       const char* suffix, const std::string& labels,
+                       int64_t value) {
+    std::string full_name;
+    make_full_name(name, suffix, labels, &full_name);
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), "%" PRId64, value);
+    return dumper->dump(full_name, butil::StringPiece(buf, len)) ? 1 : 0;
+}
+
+static size_t dump_int(NumericDumper* dumper, const std::string& name,
+                       const char* suffix, const std::string& labels,
+                       int64_t value) {
+    std::string full_name;
+    make_full_name(name, suffix, labels, &full_name);
+    NumericValue v;
+    v.type = NumericValue::TYPE_INT64;
+    v.i64 = value;
+    return dumper->dump(full_name, v) ? 1 : 0;
+}
+
+// Dump parts of `var' with suffixes same as an exposed LatencyRecorder.
+template <typename D>
+static size_t dump_latency_recorder(D* dumper, const std::string& name,
+                                    const std::string& labels,
+                                    const LatencyRecorder& var) {
+    size_t n = 0;
+    n += dump_int(dumper, name, "_count", labels, var.count());
+    n += dump_int(dumper, name, "_qps", labels, var.qps());
+    n += dump_int(dumper, name, "_latency", labels, var.latency());
+    const int ps[] = { FLAGS_bvar_latency_p1, FLAGS_bvar_latency_p2,
+                       FLAGS_bvar_latency_p3 };
+    for (size_t i = 0; i < arraysize(ps); ++i) {
+        const std::string suffix = butil::string_printf("_latency_%d", ps[i]);
+        n += dump_int(dumper, name, suffix.c_str(), labels,
+                      var.latency_percentile(ps[i] / 100.0));
+    }
+    n += dump_int(dumper, name, "_latency_999", labels,
+                  var.latency_percentile(0.999));
+    n += dump_int(dumper, name, "_latency_9999", labels,
+                  var.latency_percentile(0.9999));
+    // Same with exposed LatencyRecorder, _max_latency is the last one.
+    n += dump_int(dumper, name, "_max_latency", labels, var.max_latency());
+    return n;
+}
+
+size_t dump_labeled_stats(Dumper* dumper, const std::string& name,
+                          const std::string& labels,
+                          const LatencyRecorder& var,
+                          const DumpOptions&) {
+    return dump_latency_recorder(dumper, name, labels, var);
+}
+
+size_t dump_labeled_numerics(NumericDumper* dumper, const std::string& name,
+                             const std::string& labels,
+                             const LatencyRecorder& var) {
+    return dump_latency_recorder(dumper, name, labels, var);
+}
+
+}  // namespace detail
+}  // namespace bvar
@@ -0,0 +1,622 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BVAR_MULTI_DIMENSION_H
+#define  BVAR_MULTI_DIMENSION_H
+
+#include <gflags/gflags_declare.h>
+#include <pthread.h>
+#include <sstream>                                  // std::ostringstream
+#include "butil/logging.h"                          // LOG
+#include "butil/macros.h"                           // DISALLOW_COPY_AND_ASSIGN
+#include "butil/scoped_lock.h"                      // BAIDU_SCOPED_LOCK
+#include "butil/time.h"                             // butil::gettimeofday_s
+#include "butil/containers/flat_map.h"              // butil::FlatMap
+#include "butil/containers/doubly_buffered_data.h"  // butil::DoublyBufferedData
+#include "bvar/mvariable.h"
+#include "bvar/latency_recorder.h"
+#include "bvar/detail/sampler.h"                    // detail::Sampler
+
+namespace bvar {
+
+DECLARE_int32(bvar_max_multi_dimension_stats_count);
+DECLARE_int32(bvar_latency_p1);
+DECLARE_int32(bvar_latency_p2);
+DECLARE_int32(bvar_latency_p3);
+
+namespace detail {
+
+// Escape `value' to be a label value of prometheus, namely backslash,
+// double-quote and line feed are escaped.
+void append_escaped_label_value(std::string* out, const std::string& value);
+
+// Dump the bvar of a label set. `labels' is in the form of
+// {label1="value1",label2="value2"}
+inline size_t dump_labeled_stats(Dumper* dumper, const std::string& name,
+                                 const std::string& labels,
+                                 const Variable& var,
+                                 const DumpOptions& options) {
+    std::ostringstream os;
+    var.describe(os, options.quote_string);
+    return dumper->dump(name + labels, os.str()) ? 1 : 0;
+}
+
+// LatencyRecorder is dumped with the same suffixes as an exposed one so
+// that it can be output as a summary of prometheus.
+size_t dump_labeled_stats(Dumper* dumper, const std::string& name,
+                          const std::string& labels,
+                          const LatencyRecorder& var,
+                          const DumpOptions& options);
+
+// Dump the numeric value of the bvar of a label set, the bvar is described
+// and sent to dumper->non_numeric_dumper() if it does not have one.
+inline size_t dump_labeled_numerics(NumericDumper* dumper,
+                                    const std::string& name,
+                                    const std::string& labels,
+                                    const Variable& var) {
+    NumericValue value;
+    if (var.get_numeric_value(&value)) {
+        return dumper->dump(name + labels, value) ? 1 : 0;
+    }
+    Dumper* text_dumper = dumper->non_numeric_dumper();
+    if (text_dumper == NULL) {
+        return 0;
+    }
+    std::ostringstream os;
+    var.describe(os, true);
+    return text_dumper->dump(name + labels, os.str()) ? 1 : 0;
+}
+
+size_t dump_labeled_numerics(NumericDumper* dumper, const std::string& name,
+                             const std::string& labels,
+                             const LatencyRecorder& var);
+
+}  // namespace detail
+
+// A family of bvars of type T which are distinguished by values of labels.
+// T is generally a reducer(Adder/Maxer...), IntRecorder or LatencyRecorder.
+// Example:
+//   bvar::MultiDimension<bvar::LatencyRecorder> g_latency(
+//       "rpc_server", {"method", "peer"});
+//   ...
+//   std::vector<std::string> label_values = {"Echo", "127.0.0.1"};
+//   bvar::LatencyRecorder* lr = g_latency.get_stats(label_values);
+//   if (lr) {
+//       *lr << latency_us;
+//   }
+//
+// get_stats() of an existing label set reads a doubly-buffered map which is
+// almost lock-free, only creating a new label set takes a mutex. Callers
+// updating the same label set frequently may cache the pointer returned by
+// get_pinned_stats() which is as cheap to update as an unlabeled bvar.
+//
+// Number of label sets is bounded by -bvar_max_multi_dimension_stats_count
+// (or set_max_stats_count()), get_stats() of a new label set fails when the
+// limit is reached. Label sets not being got for idle seconds (disabled by
+// default, see set_idle_seconds()) are evicted, updating the bvar does not
+// count since it's not known to MultiDimension. An evicted bvar is deleted
+// idle seconds later, thus pointer returned by get_stats() must not be used
+// for longer than idle seconds when eviction is enabled, cache the pointer
+// returned by get_pinned_stats() instead. Pinned label sets are never
+// evicted.
+template <typename T>
+class MultiDimension : public MVariable {
+public:
+    typedef std::vector<std::string> key_type;
+    typedef T value_type;
+
+    explicit MultiDimension(const key_type& labels);
+    MultiDimension(const butil::StringPiece& name, const key_type& labels);
+    MultiDimension(const butil::StringPiece& prefix,
+                   const butil::StringPiece& name, const key_type& labels);
+    ~MultiDimension();
+
+    // Get bvar of `label_values' which must be as many as labels(), create
+    // the bvar if it does not exist.
+    // Returns NULL on invalid label values or too many label sets.
+    T* get_stats(const key_type& label_values);
+
+    // Same as get_stats() except that the label set is never evicted, the
+    // returned pointer can be cached until the label set is deleted by
+    // delete_stats() or clear_stats().
+    T* get_pinned_stats(const key_type& label_values);
+
+    // Remove the bvar of `label_values'.
+    // NOTE: the bvar is deleted at once, make sure no one is using it.
+    void delete_stats(const key_type& label_values);
+
+    // Remove all bvars. Same caution with delete_stats().
+    void clear_stats();
+
+    // Put all label sets into `label_values'.
+    void list_stats(std::vector<key_type>* label_values);
+
+    bool has_stats(const key_type& label_values);
+
+    // Implement MVariable.
+    size_t count_stats() override;
+    void describe(std::ostream& os) override;
+    size_t dump(Dumper* dumper, const DumpOptions* options) override;
+    size_t dump_numerics(NumericDumper* dumper,
+                         const DumpOptions* options) override;
+
+    // Limit number of label sets. 0 means -bvar_max_multi_dimension_stats_count
+    void set_max_stats_count(size_t max_count) { _max_count = max_count; }
+
+    // Evict label sets which are not got for `idle_s' seconds, except the
+    // pinned ones. Eviction is checked every second in the sampling thread
+    // of bvar. 0 disables eviction.
+    void set_idle_seconds(int idle_s);
+
+    // Evict idle label sets and delete bvars evicted idle seconds before.
+    // Returns number of label sets evicted.
+    size_t evict_idle_stats();
+
+    // Number of label sets rejected for exceeding the limit.
+    int64_t rejected_count() const {
+        return _nrejected.load(butil::memory_order_relaxed);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MultiDimension);
+
+    struct Stats {
+        Stats() : active_s(0), pinned(false) {}
+        T var;
+        butil::atomic<int64_t> active_s;
+        // Set with _mutex.
+        bool pinned;
+    };
+
+    struct RetiredStats {
+        Stats* stats;
+        // Deleted since this time, when no one should be using it.
+        int64_t expire_s;
+    };
+
+    // Call evict_idle_stats() every second.
+    class IdleStatsEvictor : public detail::Sampler {
+    public:
+        explicit IdleStatsEvictor(MultiDimension* owner) : _owner(owner) {}
+        void take_sample() override { _owner->evict_idle_stats(); }
+    private:
+        MultiDimension* _owner;
+    };
+
+    struct LabelsHasher {
+        size_t operator()(const key_type& key) const {
+            size_t h = key.size();
+            butil::DefaultHasher<std::string> hasher;
+            for (size_t i = 0; i < key.size(); ++i) {
+                h = h * 31 + hasher(key[i]);
+            }
+            return h;
+        }
+    };
+    typedef butil::FlatMap<key_type, Stats*, LabelsHasher> StatsMap;
+    typedef butil::DoublyBufferedData<StatsMap> DBStatsMap;
+
+    // Modifiers of both buffers of _db.
+    static size_t init_map(StatsMap& m) { return m.init(64) == 0 ? 1 : 0; }
+    static size_t insert_stats(StatsMap& m, const key_type& key,
+                               Stats* const& stats) {
+        return m.insert(key, stats) != NULL ? 1 : 0;
+    }
+    static size_t erase_stats(StatsMap& m, const std::vector<key_type>& keys) {
+        size_t n = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            n += m.erase(keys[i]);
+        }
+        return n;
+    }
+    static size_t clear_map(StatsMap& m) { m.clear(); return 1; }
+
+    void init();
+    void touch(Stats* stats) const;
+    size_t max_count() const;
+    // Remove label sets from _db, return removed bvars. Called with _mutex.
+    size_t remove_stats(const std::vector<key_type>& keys,
+                        std::vector<Stats*>* removed);
+    void list_all(std::vector<std::pair<key_type, Stats*> >* all);
+    void make_labels_string(const key_type& label_values,
+                            std::string* out) const;
+
+    DBStatsMap _db;
+    // Protect modifications of _db, _retired and _evictor.
+    pthread_mutex_t _mutex;
+    size_t _nstats;
+    std::vector<RetiredStats> _retired;
+    IdleStatsEvictor* _evictor;
+    size_t _max_count;
+    butil::atomic<int> _idle_s;
+    butil::atomic<int64_t> _nrejected;
+};
+
+template <typename T>
+MultiDimension<T>::MultiDimension(const key_type& labels)
+    : MVariable(labels) {
+    init();
+}
+
+template <typename T>
+MultiDimension<T>::MultiDimension(const butil::StringPiece& name,
+                                  const key_type& labels)
+    : MVariable(labels) {
+    init();
+    expose(name);
+}
+
+template <typename T>
+MultiDimension<T>::MultiDimension(const butil::StringPiece& prefix,
+                                  const butil::StringPiece& name,
+                                  const key_type& labels)
+    : MVariable(labels) {
+    init();
+    expose_as(prefix, name);
+}
+
+template <typename T>
+void MultiDimension<T>::init() {
+    pthread_mutex_init(&_mutex, NULL);
+    _nstats = 0;
+    _evictor = NULL;
+    _max_count = 0;
+    _idle_s.store(0, butil::memory_order_relaxed);
+    _nrejected.store(0, butil::memory_order_relaxed);
+    CHECK_EQ(1UL, _db.Modify(init_map));
+}
+
+template <typename T>
+MultiDimension<T>::~MultiDimension() {
+    hide();
+    if (_evictor) {
+        // take_sample() is not running and won't run after destroy().
+        _evictor->destroy();
+        _evictor = NULL;
+    }
+    clear_stats();
+    for (size_t i = 0; i < _retired.size(); ++i) {
+        delete _retired[i].stats;
+    }
+    _retired.clear();
+    pthread_mutex_destroy(&_mutex);
+}
+
+template <typename T>
+inline void MultiDimension<T>::touch(Stats* stats) const {
+    if (_idle_s.load(butil::memory_order_relaxed) > 0) {
+        // Written at most once per second to avoid bouncing the cacheline
+        // between threads updating the same label set.
+        const int64_t now_s = butil::gettimeofday_s();
+        if (stats->active_s.load(butil::memory_order_relaxed) != now_s) {
+            stats->active_s.store(now_s, butil::memory_order_relaxed);
+        }
+    }
+}
+
+template <typename T>
+inline size_t MultiDimension<T>::max_count() const {
+    return _max_count ? _max_count
+        : (size_t)FLAGS_bvar_max_multi_dimension_stats_count;
+}
+
+template <typename T>
+T* MultiDimension<T>::get_stats(const key_type& label_values) {
+    if (label_values.size() != labels().size()) {
+        LOG(ERROR) << "Expect " << labels().size() << " label values, actually "
+                   << label_values.size();
+        return NULL;
+    }
+    {
+        typename DBStatsMap::ScopedPtr ptr;
+        if (_db.Read(&ptr) != 0) {
+            return NULL;
+        }
+        Stats* const* stats = ptr->seek(label_values);
+        if (stats != NULL) {
+            touch(*stats);
+            return &(*stats)->var;
+        }
+    }
+    // Create the label set.
+    Stats* new_stats = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        {
+            typename DBStatsMap::ScopedPtr ptr;
+            if (_db.Read(&ptr) != 0) {
+                return NULL;
+            }
+            Stats* const* stats = ptr->seek(label_values);
+            if (stats != NULL) {
+                touch(*stats);
+                return &(*stats)->var;
+            }
+        }
+        if (_nstats >= max_count()) {
+            _nrejected.fetch_add(1, butil::memory_order_relaxed);
+            LOG_EVERY_SECOND(WARNING) << "Too many label sets of `" << name()
+                                      << "', max=" << max_count();
+            return NULL;
+        }
+        new_stats = new Stats;
+        touch(new_stats);
+        _db.Modify(insert_stats, label_values, new_stats);
+        ++_nstats;
+    }
+    return &new_stats->var;
+}
+
+template <typename T>
+T* MultiDimension<T>::get_pinned_stats(const key_type& label_values) {
+    while (true) {
+        T* var = get_stats(label_values);
+        if (var == NULL) {
+            return NULL;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        typename DBStatsMap::ScopedPtr ptr;
+        if (_db.Read(&ptr) != 0) {
+            return NULL;
+        }
+        // The label set may be evicted after get_stats(), which is not
+        // possible after being pinned with _mutex.
+        Stats* const* stats = ptr->seek(label_values);
+        if (stats != NULL && &(*stats)->var == var) {
+            (*stats)->pinned = true;
+            return var;
+        }
+    }
+}
+
+template <typename T>
+size_t MultiDimension<T>::remove_stats(const std::vector<key_type>& keys,
+                                       std::vector<Stats*>* removed) {
+    std::vector<key_type> found;
+    {
+        typename DBStatsMap::ScopedPtr ptr;
+        if (_db.Read(&ptr) != 0) {
+            return 0;
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            Stats* const* stats = ptr->seek(keys[i]);
+            if (stats != NULL) {
+                found.push_back(keys[i]);
+                removed->push_back(*stats);
+            }
+        }
+    }
+    if (found.empty()) {
+        return 0;
+    }
+    // Modify() returns after all Read() of the old foreground end, no one
+    // is able to get removed bvars from now on.
+    _db.Modify(erase_stats, found);
+    _nstats -= found.size();
+    return found.size();
+}
+
+template <typename T>
+void MultiDimension<T>::delete_stats(const key_type& label_values) {
+    std::vector<Stats*> removed;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        remove_stats(std::vector<key_type>(1, label_values), &removed);
+    }
+    for (size_t i = 0; i < removed.size(); ++i) {
+        delete removed[i];
+    }
+}
+
+template <typename T>
+void MultiDimension<T>::clear_stats() {
+    std::vector<std::pair<key_type, Stats*> > all;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        list_all(&all);
+        _db.Modify(clear_map);
+        _nstats = 0;
+    }
+    for (size_t i = 0; i < all.size(); ++i) {
+        delete all[i].second;
+    }
+}
+
+template <typename T>
+void MultiDimension<T>::set_idle_seconds(int idle_s) {
+    _idle_s.store(idle_s, butil::memory_order_relaxed);
+    if (idle_s > 0) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_evictor == NULL) {
+            _evictor = new IdleStatsEvictor(this);
+            _evictor->schedule();
+        }
+    }
+}
+
+template <typename T>
+size_t MultiDimension<T>::evict_idle_stats() {
+    const int idle_s = _idle_s.load(butil::memory_order_relaxed);
+    const int64_t now_s = butil::gettimeofday_s();
+    std::vector<Stats*> expired;
+    size_t nevicted = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        size_t nkept = 0;
+        for (size_t i = 0; i < _retired.size(); ++i) {
+            if (_retired[i].expire_s <= now_s) {
+                expired.push_back(_retired[i].stats);
+            } else {
+                _retired[nkept++] = _retired[i];
+            }
+        }
+        _retired.resize(nkept);
+        if (idle_s > 0) {
+            const int64_t deadline_s = now_s - idle_s;
+            std::vector<std::pair<key_type, Stats*> > all;
+            list_all(&all);
+            std::vector<key_type> idle;
+            for (size_t i = 0; i < all.size(); ++i) {
+                if (!all[i].second->pinned &&
+                    all[i].second->active_s.load(butil::memory_order_relaxed)
+                    < deadline_s) {
+                    idle.push_back(all[i].first);
+                }
+            }
+            std::vector<Stats*> removed;
+            nevicted = remove_stats(idle, &removed);
+            // A caller may get the bvar just before the eviction and keep
+            // using it for idle seconds, one more second covers truncation
+            // of gettimeofday_s().
+            for (size_t i = 0; i < removed.size(); ++i) {
+                RetiredStats r = { removed[i], now_s + idle_s + 1 };
+                _retired.push_back(r);
+            }
+        }
+    }
+    for (size_t i = 0; i < expired.size(); ++i) {
+        delete expired[i];
+    }
+    return nevicted;
+}
+
+template <typename T>
+void MultiDimension<T>::list_all(
+    std::vector<std::pair<key_type, Stats*> >* all) {
+    all->clear();
+    typename DBStatsMap::ScopedPtr ptr;
+    if (_db.Read(&ptr) != 0) {
+        return;
+    }
+    all->reserve(ptr->size());
+    for (typename StatsMap::const_iterator
+             it = ptr->begin(); it != ptr->end(); ++it) {
+        all->push_back(std::make_pair(it->first, it->second));
+    }
+}
+
+template <typename T>
+void MultiDimension<T>::list_stats(std::vector<key_type>* label_values) {
+    if (label_values == NULL) {
+        return;
+    }
+    label_values->clear();
+    typename DBStatsMap::ScopedPtr ptr;
+    if (_db.Read(&ptr) != 0) {
+        return;
+    }
+    label_values->reserve(ptr->size());
+    for (typename StatsMap::const_iterator
+             it = ptr->begin(); it != ptr->end(); ++it) {
+        label_values->push_back(it->first);
+    }
+}
+
+template <typename T>
+bool MultiDimension<T>::has_stats(const key_type& label_values) {
+    typename DBStatsMap::ScopedPtr ptr;
+    if (_db.Read(&ptr) != 0) {
+        return false;
+    }
+    return ptr->seek(label_values) != NULL;
+}
+
+template <typename T>
+size_t MultiDimension<T>::count_stats() {
+    typename DBStatsMap::ScopedPtr ptr;
+    if (_db.Read(&ptr) != 0) {
+        return 0;
+    }
+    return ptr->size();
+}
+
+template <typename T>
+void MultiDimension<T>::make_labels_string(const key_type& label_values,
+                                           std::string* out) const {
+    out->clear();
+    out->push_back('{');
+    for (size_t i = 0; i < label_values.size(); ++i) {
+        if (i != 0) {
+            out->push_back(',');
+        }
+        out->append(labels()[i]);
+        out->append("=\"");
+        detail::append_escaped_label_value(out, label_values[i]);
+        out->push_back('"');
+    }
+    out->push_back('}');
+}
+
+template <typename T>
+void MultiDimension<T>::describe(std::ostream& os) {
+    os << "{\"name\":\"" << name() << "\",\"labels\":[";
+    for (size_t i = 0; i < labels().size(); ++i) {
+        os << (i ? ",\"" : "\"") << labels()[i] << '"';
+    }
+    os << "],\"stats_count\":" << count_stats() << '}';
+}
+
+template <typename T>
+size_t MultiDimension<T>::dump(Dumper* dumper, const DumpOptions* options) {
+    DumpOptions opt;
+    if (options) {
+        opt = *options;
+    }
+    if (!detail::is_name_dumped(name(), opt)) {
+        return 0;
+    }
+    // Hold _mutex so that bvars being dumped are not deleted.
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::vector<std::pair<key_type, Stats*> > all;
+    list_all(&all);
+    size_t n = 0;
+    std::string labels_str;
+    for (size_t i = 0; i < all.size(); ++i) {
+        make_labels_string(all[i].first, &labels_str);
+        n += detail::dump_labeled_stats(dumper, name(), labels_str,
+                                        all[i].second->var, opt);
+    }
+    return n;
+}
+
+template <typename T>
+size_t MultiDimension<T>::dump_numerics(NumericDumper* dumper,
+                                        const DumpOptions* options) {
+    DumpOptions opt;
+    if (options) {
+        opt = *options;
+    }
+    if (!detail::is_name_dumped(name(), opt)) {
+        return 0;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::vector<std::pair<key_type, Stats*> > all;
+    list_all(&all);
+    size_t n = 0;
+    std::string labels_str;
+    for (size_t i = 0; i < all.size(); ++i) {
+        make_labels_string(all[i].first, &labels_str);
+        n += detail::dump_labeled_numerics(dumper, name(), labels_str,
+                                           all[i].second->var);
+    }
+    return n;
+}
+
+}  // namespace bvar
+
+#endif  // BVAR_MULTI_DIMENSION_H
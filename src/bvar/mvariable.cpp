@@ -0,0 +1,162 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <map>
+#include <pthread.h>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "bvar/mvariable.h"
+
+namespace bvar {
+
+// Multi-dimensional variables are much less than variables, a single map
+// is enough.
+struct MVarMapWithLock {
+    pthread_mutex_t mutex;
+    std::map<std::string, MVariable*> vars;
+
+    MVarMapWithLock() { pthread_mutex_init(&mutex, NULL); }
+};
+
+static pthread_once_t s_mvar_map_once = PTHREAD_ONCE_INIT;
+static MVarMapWithLock* s_mvar_map = NULL;
+
+static void init_mvar_map() {
+    // Never deleted, multi-dimensional variables may be hidden in
+    // destructors of global objects after exit().
+    s_mvar_map = new MVarMapWithLock;
+}
+
+inline MVarMapWithLock& get_mvar_map() {
+    pthread_once(&s_mvar_map_once, init_mvar_map);
+    return *s_mvar_map;
+}
+
+MVariable::MVariable(const std::vector<std::string>& labels)
+    : _labels(labels) {
+}
+
+MVariable::~MVariable() {
+    CHECK(!hide()) << "Subclass of MVariable MUST call hide() manually in their"
+        " dtors to avoid displaying a variable that is just destructing";
+}
+
+int MVariable::expose_impl(const butil::StringPiece& prefix,
+                           const butil::StringPiece& name) {
+    if (name.empty()) {
+        LOG(ERROR) << "Parameter[name] is empty";
+        return -1;
+    }
+    hide();
+    _name.clear();
+    if (!prefix.empty()) {
+        to_underscored_name(&_name, prefix);
+        if (!_name.empty() && butil::back_char(_name) != '_') {
+            _name.push_back('_');
+        }
+    }
+    to_underscored_name(&_name, name);
+
+    MVarMapWithLock& m = get_mvar_map();
+    {
+        BAIDU_SCOPED_LOCK(m.mutex);
+        if (m.vars.insert(std::make_pair(_name, this)).second) {
+            return 0;
+        }
+    }
+    LOG(ERROR) << "Already exposed multi-dimensional variable `" << _name << '\'';
+    _name.clear();
+    return -1;
+}
+
+bool MVariable::hide() {
+    if (_name.empty()) {
+        return false;
+    }
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    CHECK_EQ(1UL, m.vars.erase(_name)) << "`" << _name << "' must exist";
+    _name.clear();
+    return true;
+}
+
+void MVariable::list_exposed(std::vector<std::string>* names) {
+    if (names == NULL) {
+        return;
+    }
+    names->clear();
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    names->reserve(m.vars.size());
+    for (std::map<std::string, MVariable*>::const_iterator
+             it = m.vars.begin(); it != m.vars.end(); ++it) {
+        names->push_back(it->first);
+    }
+}
+
+size_t MVariable::count_exposed() {
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    return m.vars.size();
+}
+
+int MVariable::describe_exposed(const std::string& name, std::ostream& os) {
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    std::map<std::string, MVariable*>::const_iterator it = m.vars.find(name);
+    if (it == m.vars.end()) {
+        return -1;
+    }
+    it->second->describe(os);
+    return 0;
+}
+
+int MVariable::dump_exposed(Dumper* dumper, const DumpOptions* options) {
+    if (NULL == dumper) {
+        LOG(ERROR) << "Parameter[dumper] is NULL";
+        return -1;
+    }
+    // Hold the lock during dumping so that variables are not destructed,
+    // the lock is only contended with exposing/hiding.
+    int count = 0;
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    for (std::map<std::string, MVariable*>::const_iterator
+             it = m.vars.begin(); it != m.vars.end(); ++it) {
+        count += it->second->dump(dumper, options);
+    }
+    return count;
+}
+
+int MVariable::dump_exposed_numerics(NumericDumper* dumper,
+                                     const DumpOptions* options) {
+    if (NULL == dumper) {
+        LOG(ERROR) << "Parameter[dumper] is NULL";
+        return -1;
+    }
+    int count = 0;
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    for (std::map<std::string, MVariable*>::const_iterator
+             it = m.vars.begin(); it != m.vars.end(); ++it) {
+        count += it->second->dump_numerics(dumper, options);
+    }
+    return count;
+}
+
+}  // namespace bvar
@@ -0,0 +1,114 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BVAR_MVARIABLE_H
+#define  BVAR_MVARIABLE_H
+
+#include <ostream>                      // std::ostream
+#include <string>                       // std::string
+#include <vector>                       // std::vector
+#include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
+#include "butil/strings/string_piece.h" // butil::StringPiece
+#include "bvar/variable.h"              // Dumper, NumericDumper, DumpOptions
+
+namespace bvar {
+
+// Base class of multi-dimensional bvars, namely a family of bvars with the
+// same name which are distinguished by values of labels (dimensions), e.g.
+// latencies of RPC with labels {"method", "peer"}. Multi-dimensional bvars
+// are exposed separately from Variable, and dumped with labels attached to
+// the name in the format of prometheus: name{label1="value1",label2="value2"}
+class MVariable {
+public:
+    explicit MVariable(const std::vector<std::string>& labels);
+    virtual ~MVariable();
+
+    // Number of label values (bvars) in this variable.
+    virtual size_t count_stats() = 0;
+
+    // Print all label values and bvars into ostream.
+    virtual void describe(std::ostream& os) = 0;
+
+    // Dump bvars of all label values with `dumper' if the name is matched
+    // by wildcards in `options', default options are used when it's NULL.
+    // Returns number of dumped bvars.
+    virtual size_t dump(Dumper* dumper, const DumpOptions* options) = 0;
+
+    // Same as dump() except that numeric values of bvars are dumped without
+    // being described, see NumericDumper.
+    virtual size_t dump_numerics(NumericDumper* dumper,
+                                 const DumpOptions* options) = 0;
+
+    // Expose this variable globally so that it's counted in following
+    // *_exposed functions.
+    // Returns 0 on success, -1 otherwise.
+    int expose(const butil::StringPiece& name) {
+        return expose_impl(butil::StringPiece(), name);
+    }
+    int expose_as(const butil::StringPiece& prefix,
+                  const butil::StringPiece& name) {
+        return expose_impl(prefix, name);
+    }
+
+    // Hide this variable so that it's not counted in *_exposed functions.
+    // Returns false if this variable is already hidden.
+    // CAUTION!! Subclasses must call hide() manually to avoid dumping a
+    // variable that is just destructing.
+    bool hide();
+
+    // Get exposed name. If this variable is not exposed, the name is empty.
+    const std::string& name() const { return _name; }
+
+    // Names of labels.
+    const std::vector<std::string>& labels() const { return _labels; }
+
+    // ====================================================================
+
+    // Put names of all exposed multi-dimensional variables into `names'.
+    static void list_exposed(std::vector<std::string>* names);
+
+    // Get number of exposed multi-dimensional variables.
+    static size_t count_exposed();
+
+    // Find an exposed variable by `name' and describe it into `os'.
+    // Returns 0 on found, -1 otherwise.
+    static int describe_exposed(const std::string& name, std::ostream& os);
+
+    // Dump all exposed multi-dimensional variables with `dumper'.
+    // Returns number of dumped bvars, -1 on error.
+    static int dump_exposed(Dumper* dumper, const DumpOptions* options);
+
+    // Dump numeric values of all exposed multi-dimensional variables with
+    // `dumper'. Returns number of dumped bvars, -1 on error.
+    static int dump_exposed_numerics(NumericDumper* dumper,
+                                     const DumpOptions* options);
+
+protected:
+    int expose_impl(const butil::StringPiece& prefix,
+                    const butil::StringPiece& name);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MVariable);
+
+    std::string _name;
+    const std::vector<std::string> _labels;
+};
+
+}  // namespace bvar
+
+#endif  // BVAR_MVARIABLE_H
@@ -135,6 +135,10 @@ public:
         }
     }
 #endif
+
+    bool get_numeric_value(NumericValue* value) const override {
+        return to_numeric_value(get_value(), value);
+    }
     
     Tp get_value() const {
         return (_getfn ? _getfn(_arg) : Tp());
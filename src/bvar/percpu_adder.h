@@ -0,0 +1,179 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BVAR_PERCPU_ADDER_H
+#define  BVAR_PERCPU_ADDER_H
+
+#include "butil/type_traits.h"                    // butil::is_integral
+#include "bvar/reducer.h"                         // Adder
+#include "bvar/detail/percpu.h"                   // PerCpuSlots
+
+namespace bvar {
+
+// An Adder of integers storing values in per-cpu slots instead of per-thread
+// agents. Values are added to the slot of current CPU in a restartable
+// sequence(rseq) of linux, which is as cheap as adding to a thread-local
+// agent. Memory of each variable is 8 bytes * number of CPUs regardless of
+// number of threads, and get_value() sums slots of all CPUs without any
+// lock, which makes it suitable for processes with lots of variables and
+// threads.
+// When rseq is not available(kernel < 4.18 or not x86_64), values are added
+// into a regular Adder created at the first addition instead, namely
+// thread-local agents. get_value() adds the value of the Adder as well if it
+// exists, which takes the lock of the Adder and walks agents of threads that
+// ever added into it.
+// Example:
+//   bvar::PerCpuAdder<int64_t> nrequest("my_request_count");
+//   nrequest << 1;
+//   bvar::PerSecond<bvar::PerCpuAdder<int64_t> > qps("my_qps", &nrequest);
+template <typename T>
+class PerCpuAdder : public Variable {
+public:
+    typedef T value_type;
+    typedef detail::AddTo<T> op_type;
+    typedef detail::MinusFrom<T> inv_op_type;
+    typedef detail::ReducerSampler<PerCpuAdder, T, op_type, inv_op_type>
+    sampler_type;
+
+    PerCpuAdder() { init(); }
+    explicit PerCpuAdder(const butil::StringPiece& name) {
+        init();
+        this->expose(name);
+    }
+    PerCpuAdder(const butil::StringPiece& prefix,
+                const butil::StringPiece& name) {
+        init();
+        this->expose_as(prefix, name);
+    }
+    ~PerCpuAdder() {
+        hide();
+        if (_sampler) {
+            _sampler->destroy();
+            _sampler = NULL;
+        }
+        detail::PerCpuSlots::deallocate(_slot);
+        _slot = NULL;
+        delete _fallback.load(butil::memory_order_relaxed);
+    }
+
+    // Add a value.
+    // Returns self reference for chaining.
+    PerCpuAdder& operator<<(T value) {
+        if (__builtin_expect(_slot == NULL ||
+                             !detail::percpu_add(_slot, (int64_t)value), 0)) {
+            *get_fallback() << value;
+        }
+        return *this;
+    }
+
+    T get_value() const {
+        int64_t sum = 0;
+        if (_slot) {
+            sum = detail::percpu_sum(_slot);
+        }
+        T value = (T)(sum - _reset_base.load(butil::memory_order_relaxed));
+        Adder<T>* fallback = _fallback.load(butil::memory_order_acquire);
+        if (fallback) {
+            value += fallback->get_value();
+        }
+        return value;
+    }
+
+    // Reset the value to 0. Returns the value before reset.
+    // Slots of other CPUs can't be reset without contending with adding,
+    // the current sum is remembered and subtracted in later get_value().
+    T reset() {
+        int64_t sum = 0;
+        if (_slot) {
+            sum = detail::percpu_sum(_slot);
+        }
+        const int64_t base =
+            _reset_base.exchange(sum, butil::memory_order_relaxed);
+        T value = (T)(sum - base);
+        Adder<T>* fallback = _fallback.load(butil::memory_order_acquire);
+        if (fallback) {
+            value += fallback->reset();
+        }
+        return value;
+    }
+
+    void describe(std::ostream& os, bool /*quote_string*/) const override {
+        os << get_value();
+    }
+
+#ifdef BAIDU_INTERNAL
+    void get_value(boost::any* value) const override { *value = get_value(); }
+#endif
+
+    bool get_numeric_value(NumericValue* value) const override {
+        return to_numeric_value(get_value(), value);
+    }
+
+    // True if values are added into per-cpu slots in calling thread.
+    static bool percpu_enabled() { return detail::rseq_available(); }
+
+    const op_type& op() const { return _op; }
+    const inv_op_type& inv_op() const { return _inv_op; }
+
+    sampler_type* get_sampler() {
+        if (NULL == _sampler) {
+            _sampler = new sampler_type(this);
+            _sampler->schedule();
+        }
+        return _sampler;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PerCpuAdder);
+    BAIDU_CASSERT(butil::is_integral<T>::value && sizeof(T) <= sizeof(int64_t),
+                  PerCpuAdder_only_supports_integers);
+
+    void init() {
+        _slot = detail::PerCpuSlots::allocate();
+        _reset_base.store(0, butil::memory_order_relaxed);
+        _fallback.store(NULL, butil::memory_order_relaxed);
+        _sampler = NULL;
+    }
+
+    Adder<T>* get_fallback() {
+        Adder<T>* fallback = _fallback.load(butil::memory_order_acquire);
+        if (fallback == NULL) {
+            Adder<T>* created = new Adder<T>;
+            if (_fallback.compare_exchange_strong(
+                    fallback, created, butil::memory_order_acq_rel)) {
+                fallback = created;
+            } else {
+                // Created by another thread, which is in `fallback' now.
+                delete created;
+            }
+        }
+        return fallback;
+    }
+
+    int64_t* _slot;
+    butil::atomic<int64_t> _reset_base;
+    // Created only when values can't be added into per-cpu slots.
+    butil::atomic<Adder<T>*> _fallback;
+    sampler_type* _sampler;
+    op_type _op;
+    inv_op_type _inv_op;
+};
+
+}  // namespace bvar
+
+#endif  // BVAR_PERCPU_ADDER_H
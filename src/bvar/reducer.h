@@ -139,6 +139,10 @@ public:
     void get_value(boost::any* value) const override { *value = get_value(); }
 #endif
 
+    bool get_numeric_value(NumericValue* value) const override {
+        return to_numeric_value(get_value(), value);
+    }
+
     // True if this reducer is constructed successfully.
     bool valid() const { return _combiner.valid(); }
 
@@ -132,6 +132,10 @@ public:
         *value = get_value();
     }
 #endif
+
+    bool get_numeric_value(NumericValue* value) const override {
+        return to_numeric_value(get_value(), value);
+    }
     
     T get_value() const {
         return _value.load(butil::memory_order_relaxed);
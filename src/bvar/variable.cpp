@@ -18,12 +18,16 @@
 // Date: 2014/09/22 19:04:47
 
 #include <pthread.h>
+#include <sched.h>                              // sched_yield
+#include <unistd.h>                             // usleep
+#include <algorithm>                            // std::binary_search
 #include <set>                                  // std::set
 #include <fstream>                              // std::ifstream
 #include <sstream>                              // std::ostringstream
 #include <gflags/gflags.h>
 #include "butil/macros.h"                        // BAIDU_CASSERT
 #include "butil/containers/flat_map.h"           // butil::FlatMap
+#include "butil/containers/doubly_buffered_data.h"  // butil::DoublyBufferedData
 #include "butil/scoped_lock.h"                   // BAIDU_SCOPE_LOCK
 #include "butil/string_splitter.h"               // butil::StringSplitter
 #include "butil/errno.h"                         // berror
@@ -31,6 +35,7 @@
 #include "butil/file_util.h"                     // butil::FilePath
 #include "bvar/gflag.h"
 #include "bvar/variable.h"
+#include "bvar/detail/dump_ring.h"
 
 namespace bvar {
 
@@ -67,36 +72,48 @@ BAIDU_CASSERT(!(SUB_MAP_COUNT & (SUB_MAP_COUNT - 1)), must_be_power_of_2);
 
 class VarEntry {
 public:
-    VarEntry() : var(NULL), display_filter(DISPLAY_ON_ALL) {}
+    VarEntry(Variable* var2, DisplayFilter display_filter2)
+        : var(var2), display_filter(display_filter2), nref(0) {}
 
     Variable* var;
     DisplayFilter display_filter;
+    // Number of readers using `var' outside the registry. hide() waits
+    // until it's zero so that the variable can be destroyed safely.
+    butil::atomic<int> nref;
 };
 
-typedef butil::FlatMap<std::string, VarEntry> VarMap;
+typedef butil::FlatMap<std::string, VarEntry*> VarMap;
 
-struct VarMapWithLock : public VarMap {
-    pthread_mutex_t mutex;
-
-    VarMapWithLock() {
-        CHECK_EQ(0, init(1024, 80));
-        pthread_mutexattr_t attr;
-        pthread_mutexattr_init(&attr);
-        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-        pthread_mutex_init(&mutex, &attr);
-        pthread_mutexattr_destroy(&attr);
-    }
+struct VarMaps {
+    VarMap maps[SUB_MAP_COUNT];
 };
 
+// Registry of exposed variables. Lookups and iterations read the foreground
+// maps almost lock-free, expose() and hide() modify both maps and never
+// wait for other writers or long-running readers:
+//  - Readers only seek or copy entries inside Read(). Methods of variables
+//    are called after Read() with references to the entries held.
+//  - After an entry is erased in Modify(), no reader can find it, hide()
+//    then waits for existing references before the entry is deleted.
+typedef butil::DoublyBufferedData<VarMaps> VarRegistry;
+
 // We have to initialize global map on need because bvar is possibly used
 // before main().
-static pthread_once_t s_var_maps_once = PTHREAD_ONCE_INIT;
-static VarMapWithLock* s_var_maps = NULL;
+static pthread_once_t s_var_registry_once = PTHREAD_ONCE_INIT;
+static VarRegistry* s_var_registry = NULL;
 
-static void init_var_maps() {
+static size_t init_var_maps(VarMaps& m) {
+    for (size_t i = 0; i < SUB_MAP_COUNT; ++i) {
+        CHECK_EQ(0, m.maps[i].init(1024, 80));
+    }
+    return 1;
+}
+
+static void init_var_registry() {
     // It's probably slow to initialize all sub maps, but rpc often expose 
     // variables before user. So this should not be an issue to users.
-    s_var_maps = new VarMapWithLock[SUB_MAP_COUNT];
+    s_var_registry = new VarRegistry;
+    s_var_registry->Modify(init_var_maps);
 }
 
 inline size_t sub_map_index(const std::string& str) {
@@ -111,16 +128,139 @@ inline size_t sub_map_index(const std::string& str) {
     return h & (SUB_MAP_COUNT - 1);
 }
 
-inline VarMapWithLock* get_var_maps() {
-    pthread_once(&s_var_maps_once, init_var_maps);
-    return s_var_maps;
+inline VarRegistry* get_var_registry() {
+    pthread_once(&s_var_registry_once, init_var_registry);
+    return s_var_registry;
 }
 
-inline VarMapWithLock& get_var_map(const std::string& name) {
-    VarMapWithLock& m = get_var_maps()[sub_map_index(name)];
-    return m;
+// Find the entry of `name' and reference it. Returns NULL if not found.
+static VarEntry* acquire_var_entry(const std::string& name) {
+    VarRegistry::ScopedPtr ptr;
+    if (get_var_registry()->Read(&ptr) != 0) {
+        return NULL;
+    }
+    VarEntry* const* p = ptr->maps[sub_map_index(name)].seek(name);
+    if (p == NULL) {
+        return NULL;
+    }
+    (*p)->nref.fetch_add(1, butil::memory_order_relaxed);
+    return *p;
 }
 
+inline void release_var_entry(VarEntry* entry) {
+    entry->nref.fetch_sub(1, butil::memory_order_release);
+}
+
+// Release the referenced entry at scope exit.
+class VarEntryGuard {
+public:
+    explicit VarEntryGuard(VarEntry* entry) : _entry(entry) {}
+    ~VarEntryGuard() {
+        if (_entry) {
+            release_var_entry(_entry);
+        }
+    }
+private:
+    DISALLOW_COPY_AND_ASSIGN(VarEntryGuard);
+    VarEntry* _entry;
+};
+
+// Wait for readers of an erased entry and delete it.
+static void destroy_var_entry(VarEntry* entry) {
+    for (int i = 0; entry->nref.load(butil::memory_order_acquire) != 0; ++i) {
+        if (i < 100) {
+            sched_yield();
+        } else {
+            usleep(100);
+        }
+    }
+    delete entry;
+}
+
+// Iterate the sub map at `index' and call fn(name, entry) on entries inside
+// Read(). The iteration is split into short reads so that writers are not
+// blocked long. If the sub map is resized between reads, fn.restart() is
+// called and the iteration begins again.
+template <typename Fn>
+static void iterate_sub_map(size_t index, Fn& fn) {
+    VarMap::PositionHint hint;
+    bool restored = false;
+    while (true) {
+        VarRegistry::ScopedPtr ptr;
+        if (get_var_registry()->Read(&ptr) != 0) {
+            return;
+        }
+        const VarMap& m = ptr->maps[index];
+        VarMap::const_iterator it = m.begin();
+        if (restored) {
+            it = m.restore_iterator(hint);
+            if (it == m.begin()) { // resized
+                fn.restart();
+            }
+        }
+        for (size_t n = 0; it != m.end(); ++it) {
+            if (++n > 256/*max iterated one pass*/) {
+                break;
+            }
+            fn(it->first, it->second);
+        }
+        if (it == m.end()) {
+            return;
+        }
+        m.save_iterator(it, &hint);
+        restored = true;
+    }
+}
+
+static size_t insert_var_entry(VarMaps& m, const std::string& name,
+                               VarEntry* const& entry) {
+    VarMap& sub_map = m.maps[sub_map_index(name)];
+    if (sub_map.seek(name) != NULL) {
+        return 0;
+    }
+    sub_map[name] = entry;
+    return 1;
+}
+
+static size_t erase_var_entry(VarMaps& m, const std::string& name,
+                              VarEntry** const& erased) {
+    VarMap& sub_map = m.maps[sub_map_index(name)];
+    VarEntry* const* p = sub_map.seek(name);
+    if (p == NULL) {
+        return 0;
+    }
+    *erased = *p;
+    return sub_map.erase(name);
+}
+
+// Changes to the registry made by a VariableBatch.
+struct VarRegistryChanges {
+    std::vector<std::string> erased_names;
+    std::vector<std::pair<std::string, VarEntry*> > inserts;
+    // Names of `inserts' and entries in `inserts' can't be inserted.
+    std::set<std::string> inserted_names;
+    // Filled in Modify()
+    std::vector<VarEntry*> erased;
+    std::vector<char> inserted;
+};
+
+static size_t apply_var_registry_changes(VarMaps& m,
+                                         VarRegistryChanges* const& c) {
+    for (size_t i = 0; i < c->erased_names.size(); ++i) {
+        VarEntry* erased = NULL;
+        erase_var_entry(m, c->erased_names[i], &erased);
+        c->erased[i] = erased;
+    }
+    for (size_t i = 0; i < c->inserts.size(); ++i) {
+        c->inserted[i] = insert_var_entry(m, c->inserts[i].first,
+                                          c->inserts[i].second);
+    }
+    return 1;
+}
+
+// Changes of the VariableBatch being committed in this thread.
+static __thread VarRegistryChanges* tls_var_batch_changes = NULL;
+
 Variable::~Variable() {
     CHECK(!hide()) << "Subclass of Variable MUST call hide() manually in their"
         " dtors to avoid displaying a variable that is just destructing";
@@ -133,12 +273,11 @@ int Variable::expose_impl(const butil::StringPiece& prefix,
         LOG(ERROR) << "Parameter[name] is empty";
         return -1;
     }
-    // NOTE: It's impossible to atomically erase from a submap and insert into
-    // another submap without a global lock. When the to-be-exposed name
-    // already exists, there's a chance that we can't insert back previous
-    // name. But it should be fine generally because users are unlikely to
-    // expose a variable more than once and calls to expose() are unlikely
-    // to contend heavily.
+    // NOTE: It's impossible to atomically erase the previous name and insert
+    // the new one without batching. When the to-be-exposed name already
+    // exists, there's a chance that we can't insert back previous name. But
+    // it should be fine generally because users are unlikely to expose a
+    // variable more than once.
 
     // remove previous pointer from the map if needed.
     hide();
@@ -154,16 +293,33 @@ int Variable::expose_impl(const butil::StringPiece& prefix,
     }
     to_underscored_name(&_name, name);
     
-    VarMapWithLock& m = get_var_map(_name);
-    {
-        BAIDU_SCOPED_LOCK(m.mutex);
-        VarEntry* entry = m.seek(_name);
-        if (entry == NULL) {
-            entry = &m[_name];
-            entry->var = this;
-            entry->display_filter = display_filter;
+    VarRegistryChanges* batch = tls_var_batch_changes;
+    if (batch != NULL) {
+        // Inserted in VariableBatch::commit(), check conflicts with exposed
+        // variables which are not hidden in the batch and variables exposed
+        // earlier in the batch.
+        if (!batch->inserted_names.insert(_name).second) {
+            // fall through
+        } else if (std::binary_search(batch->erased_names.begin(),
+                                      batch->erased_names.end(), _name)) {
+            batch->inserts.push_back(std::make_pair(
+                    _name, new VarEntry(this, display_filter)));
+            return 0;
+        } else {
+            VarEntry* entry = acquire_var_entry(_name);
+            if (entry == NULL) {
+                batch->inserts.push_back(std::make_pair(
+                        _name, new VarEntry(this, display_filter)));
+                return 0;
+            }
+            release_var_entry(entry);
+        }
+    } else {
+        VarEntry* entry = new VarEntry(this, display_filter);
+        if (get_var_registry()->Modify(insert_var_entry, _name, entry)) {
             return 0;
         }
+        delete entry;
     }
     if (FLAGS_bvar_abort_on_same_name) {
         LOG(FATAL) << "Abort due to name conflict";
@@ -181,15 +337,41 @@ int Variable::expose_impl(const butil::StringPiece& prefix,
     return -1;
 }
 
+// Remove the insert of `var' from the batch being committed, if any.
+// Returns true on removed.
+static bool erase_pending_insert(VarRegistryChanges* batch,
+                                 const Variable* var,
+                                 const std::string& name) {
+    if (batch->inserted_names.find(name) == batch->inserted_names.end()) {
+        return false;
+    }
+    for (size_t i = batch->inserts.size(); i > 0; --i) {
+        VarEntry* entry = batch->inserts[i - 1].second;
+        if (entry->var == var) {
+            delete entry;
+            batch->inserts.erase(batch->inserts.begin() + (i - 1));
+            batch->inserted_names.erase(name);
+            return true;
+        }
+    }
+    return false;
+}
+
 bool Variable::hide() {
     if (_name.empty()) {
         return false;
     }
-    VarMapWithLock& m = get_var_map(_name);
-    BAIDU_SCOPED_LOCK(m.mutex);
-    VarEntry* entry = m.seek(_name);
-    if (entry) {
-        CHECK_EQ(1UL, m.erase(_name));
+    // Exposed earlier in the batch being committed, say the variable is
+    // exposed more than once in the batch, the name is not in the registry
+    // yet.
+    VarRegistryChanges* batch = tls_var_batch_changes;
+    if (batch != NULL && erase_pending_insert(batch, this, _name)) {
+        _name.clear();
+        return true;
+    }
+    VarEntry* erased = NULL;
+    if (get_var_registry()->Modify(erase_var_entry, _name, &erased)) {
+        destroy_var_entry(erased);
     } else {
         CHECK(false) << "`" << _name << "' must exist";
     }
@@ -197,6 +379,88 @@ bool Variable::hide() {
     return true;
 }
 
+void VariableBatch::expose_as(Variable* var,
+                              const butil::StringPiece& prefix,
+                              const butil::StringPiece& name,
+                              DisplayFilter display_filter) {
+    _exposes.push_back(Expose());
+    Expose& e = _exposes.back();
+    e.var = var;
+    prefix.CopyToString(&e.prefix);
+    name.CopyToString(&e.name);
+    e.display_filter = display_filter;
+}
+
+int VariableBatch::commit() {
+    if (_exposes.empty() && _hides.empty()) {
+        return 0;
+    }
+    VarRegistryChanges changes;
+    std::vector<Variable*> hidden;
+    for (size_t i = 0; i < _hides.size(); ++i) {
+        if (!_hides[i]->_name.empty()) {
+            changes.erased_names.push_back(_hides[i]->_name);
+            hidden.push_back(_hides[i]);
+        }
+    }
+    std::sort(changes.erased_names.begin(), changes.erased_names.end());
+    // Variables whose previous names are erased in this batch.
+    for (size_t i = 0; i < hidden.size(); ++i) {
+        hidden[i]->_name.clear();
+    }
+    // Exposes are still done by expose_impl() which may be overridden by
+    // subclasses, Variable::expose_impl() puts the entries into `changes'.
+    VarRegistryChanges* saved_changes = tls_var_batch_changes;
+    tls_var_batch_changes = &changes;
+    int nfail = 0;
+    for (size_t i = 0; i < _exposes.size(); ++i) {
+        const Expose& e = _exposes[i];
+        if (e.var->expose_impl(e.prefix, e.name, e.display_filter) != 0) {
+            ++nfail;
+        }
+    }
+    tls_var_batch_changes = saved_changes;
+    _exposes.clear();
+    _hides.clear();
+
+    changes.erased.resize(changes.erased_names.size(), NULL);
+    changes.inserted.resize(changes.inserts.size(), 0);
+    get_var_registry()->Modify(apply_var_registry_changes, &changes);
+    for (size_t i = 0; i < changes.erased.size(); ++i) {
+        if (changes.erased[i] != NULL) {
+            destroy_var_entry(changes.erased[i]);
+        }
+    }
+    for (size_t i = 0; i < changes.inserts.size(); ++i) {
+        if (changes.inserted[i]) {
+            continue;
+        }
+        // Exposed by another thread after the check in expose_impl().
+        VarEntry* entry = changes.inserts[i].second;
+        LOG(ERROR) << "Already exposed `" << entry->var->_name << '\'';
+        entry->var->_name.clear();
+        delete entry;
+        ++nfail;
+    }
+    return nfail;
+}
+
+class ListExposedFn {
+public:
+    ListExposedFn(std::vector<std::string>* names, DisplayFilter filter)
+        : _names(names), _filter(filter), _restart_size(names->size()) {}
+    void operator()(const std::string& name, const VarEntry* entry) {
+        if (entry->display_filter & _filter) {
+            _names->push_back(name);
+        }
+    }
+    void restart() { _names->resize(_restart_size); }
+private:
+    std::vector<std::string>* _names;
+    DisplayFilter _filter;
+    size_t _restart_size;
+};
+
 void Variable::list_exposed(std::vector<std::string>* names,
                             DisplayFilter display_filter) {
     if (names == NULL) {
@@ -206,38 +470,20 @@ void Variable::list_exposed(std::vector<std::string>* names,
     if (names->capacity() < 32) {
         names->reserve(count_exposed());
     }
-    VarMapWithLock* var_maps = get_var_maps();
     for (size_t i = 0; i < SUB_MAP_COUNT; ++i) {
-        VarMapWithLock& m = var_maps[i];
-        std::unique_lock<pthread_mutex_t> mu(m.mutex);
-        size_t n = 0;
-        for (VarMap::const_iterator it = m.begin(); it != m.end(); ++it) {
-            if (++n >= 256/*max iterated one pass*/) {
-                VarMap::PositionHint hint;
-                m.save_iterator(it, &hint);
-                n = 0;
-                mu.unlock();  // yield
-                mu.lock();
-                it = m.restore_iterator(hint);
-                if (it == m.begin()) { // resized
-                    names->clear();
-                }
-                if (it == m.end()) {
-                    break;
-                }
-            }
-            if (it->second.display_filter & display_filter) {
-                names->push_back(it->first);
-            }
-        }
+        ListExposedFn fn(names, display_filter);
+        iterate_sub_map(i, fn);
     }
 }
 
 size_t Variable::count_exposed() {
+    VarRegistry::ScopedPtr ptr;
+    if (get_var_registry()->Read(&ptr) != 0) {
+        return 0;
+    }
     size_t n = 0;
-    VarMapWithLock* var_maps = get_var_maps();
     for (size_t i = 0; i < SUB_MAP_COUNT; ++i) {
-        n += var_maps[i].size();
+        n += ptr->maps[i].size();
     }
     return n;
 }
@@ -245,12 +491,11 @@ size_t Variable::count_exposed() {
 int Variable::describe_exposed(const std::string& name, std::ostream& os,
                                bool quote_string,
                                DisplayFilter display_filter) {
-    VarMapWithLock& m = get_var_map(name);
-    BAIDU_SCOPED_LOCK(m.mutex);
-    VarEntry* p = m.seek(name);
+    VarEntry* p = acquire_var_entry(name);
     if (p == NULL) {
         return -1;
     }
+    VarEntryGuard guard(p);
     if (!(display_filter & p->display_filter)) {
         return -1;
     }
@@ -285,23 +530,21 @@ void Variable::get_value(boost::any* value) const {
 int Variable::describe_series_exposed(const std::string& name,
                                       std::ostream& os,
                                       const SeriesOptions& options) {
-    VarMapWithLock& m = get_var_map(name);
-    BAIDU_SCOPED_LOCK(m.mutex);
-    VarEntry* p = m.seek(name);
+    VarEntry* p = acquire_var_entry(name);
     if (p == NULL) {
         return -1;
     }
+    VarEntryGuard guard(p);
     return p->var->describe_series(os, options);
 }
 
 #ifdef BAIDU_INTERNAL
 int Variable::get_exposed(const std::string& name, boost::any* value) {
-    VarMapWithLock& m = get_var_map(name);
-    BAIDU_SCOPED_LOCK(m.mutex);
-    VarEntry* p = m.seek(name);
+    VarEntry* p = acquire_var_entry(name);
     if (p == NULL) {
         return -1;
     }
+    VarEntryGuard guard(p);
     p->var->get_value(value);
     return 0;
 }
@@ -458,6 +701,18 @@ DumpOptions::DumpOptions()
     , display_filter(DISPLAY_ON_PLAIN_TEXT)
 {}
 
+namespace detail {
+bool is_name_dumped(const std::string& name, const DumpOptions& options) {
+    WildcardMatcher black_matcher(options.black_wildcards,
+                                  options.question_mark,
+                                  false);
+    WildcardMatcher white_matcher(options.white_wildcards,
+                                  options.question_mark,
+                                  true);
+    return white_matcher.match(name) && !black_matcher.match(name);
+}
+}  // namespace detail
+
 int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
     if (NULL == dumper) {
         LOG(ERROR) << "Parameter[dumper] is NULL";
@@ -532,6 +787,137 @@ int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
     return count;
 }
 
+// Reference entries of variables matching the filters.
+class CollectEntriesFn {
+public:
+    CollectEntriesFn(std::vector<std::pair<std::string, VarEntry*> >* entries,
+                     DisplayFilter filter,
+                     const WildcardMatcher& white_matcher,
+                     const WildcardMatcher& black_matcher)
+        : _entries(entries), _filter(filter)
+        , _white_matcher(white_matcher), _black_matcher(black_matcher) {}
+    void operator()(const std::string& name, VarEntry* entry) {
+        if (!(entry->display_filter & _filter) ||
+            !_white_matcher.match(name) ||
+            _black_matcher.match(name)) {
+            return;
+        }
+        entry->nref.fetch_add(1, butil::memory_order_relaxed);
+        _entries->push_back(std::make_pair(name, entry));
+    }
+    void restart() {
+        for (size_t i = 0; i < _entries->size(); ++i) {
+            release_var_entry((*_entries)[i].second);
+        }
+        _entries->clear();
+    }
+private:
+    std::vector<std::pair<std::string, VarEntry*> >* _entries;
+    DisplayFilter _filter;
+    const WildcardMatcher& _white_matcher;
+    const WildcardMatcher& _black_matcher;
+};
+
+int Variable::get_numeric_exposed(const std::string& name,
+                                  NumericValue* value,
+                                  DisplayFilter display_filter) {
+    VarEntry* p = acquire_var_entry(name);
+    if (p == NULL) {
+        return -1;
+    }
+    VarEntryGuard guard(p);
+    if (!(display_filter & p->display_filter)) {
+        return -1;
+    }
+    return p->var->get_numeric_value(value) ? 0 : -1;
+}
+
+int Variable::dump_exposed_numerics(NumericDumper* dumper,
+                                    const DumpOptions* poptions) {
+    if (NULL == dumper) {
+        LOG(ERROR) << "Parameter[dumper] is NULL";
+        return -1;
+    }
+    DumpOptions opt;
+    if (poptions) {
+        opt = *poptions;
+    }
+    WildcardMatcher black_matcher(opt.black_wildcards,
+                                  opt.question_mark,
+                                  false);
+    WildcardMatcher white_matcher(opt.white_wildcards,
+                                  opt.question_mark,
+                                  true);
+    Dumper* const text_dumper = dumper->non_numeric_dumper();
+    int count = 0;
+    NumericValue value;
+    if (white_matcher.wildcards().empty() &&
+        !white_matcher.exact_names().empty()) {
+        std::ostringstream os;
+        for (std::set<std::string>::const_iterator
+                 it = white_matcher.exact_names().begin();
+             it != white_matcher.exact_names().end(); ++it) {
+            const std::string& name = *it;
+            if (black_matcher.match(name)) {
+                continue;
+            }
+            if (get_numeric_exposed(name, &value, opt.display_filter) == 0) {
+                if (!dumper->dump(name, value)) {
+                    return -1;
+                }
+            } else if (text_dumper != NULL &&
+                       describe_exposed(name, os, true, opt.display_filter) == 0) {
+                if (!text_dumper->dump(name, os.str())) {
+                    return -1;
+                }
+                os.str("");
+            } else {
+                continue;
+            }
+            ++count;
+        }
+        return count;
+    }
+    // Get values while iterating the maps rather than seeking each name
+    // again, which is much faster when there're many variables.
+    std::vector<std::pair<std::string, NumericValue> > values;
+    std::vector<std::pair<std::string, std::string> > descs;
+    std::ostringstream os;
+    std::vector<std::pair<std::string, VarEntry*> > entries;
+    for (size_t i = 0; i < SUB_MAP_COUNT; ++i) {
+        values.clear();
+        descs.clear();
+        entries.clear();
+        CollectEntriesFn fn(&entries, opt.display_filter,
+                            white_matcher, black_matcher);
+        iterate_sub_map(i, fn);
+        // Variables are not called inside Read() of the registry.
+        for (size_t j = 0; j < entries.size(); ++j) {
+            Variable* var = entries[j].second->var;
+            if (var->get_numeric_value(&value)) {
+                values.push_back(std::make_pair(entries[j].first, value));
+            } else if (text_dumper != NULL) {
+                var->describe(os, true);
+                descs.push_back(std::make_pair(entries[j].first, os.str()));
+                os.str("");
+            }
+            release_var_entry(entries[j].second);
+        }
+        for (size_t j = 0; j < values.size(); ++j) {
+            if (!dumper->dump(values[j].first, values[j].second)) {
+                return -1;
+            }
+        }
+        for (size_t j = 0; j < descs.size(); ++j) {
+            if (!text_dumper->dump(descs[j].first, descs[j].second)) {
+                return -1;
+            }
+        }
+        count += values.size() + descs.size();
+    }
+    return count;
+}
+
 
 // ============= export to files ==============
 
@@ -683,6 +1069,17 @@ DEFINE_string(bvar_dump_tabs, "latency=*_latency*"
                               "; system=*process_*,*malloc_*,*kernel_*",
               "Dump bvar into different tabs according to the filters (seperated by semicolon), "
               "format: *(tab_name=wildcards;)");
+DEFINE_bool(bvar_dump_ring, false, "Append numeric bvar into a memory-mapped "
+            "ring file in binary instead of writing text files. The file "
+            "keeps history of recent -bvar_dump_ring_minutes minutes even if "
+            "the process crashes, read it with tools/bvar_ring_view");
+DEFINE_string(bvar_dump_ring_file, "monitor/bvar.<app>.ring",
+              "Dump bvar into this ring file when -bvar_dump_ring is on, "
+              "existing file is renamed with suffix .prev");
+DEFINE_int32(bvar_dump_ring_minutes, 60, "Minutes of history kept in the "
+             "ring file, effective when the file is created");
+DEFINE_int32(bvar_dump_ring_max_vars, 8192, "Max number of bvar dumped into "
+             "the ring file each time, effective when the file is created");
 
 #if !defined(BVAR_NOT_LINK_DEFAULT_VARIABLES)
 // Expose bvar-releated gflags so that they're collected by noah.
@@ -696,6 +1093,7 @@ static void* dumping_thread(void*) {
     // destructed when program exits and caused coredumps.
     const std::string command_name = read_command_name();
     std::string last_filename;
+    detail::DumpRingWriter ring;
     while (1) {
         // We can't access string flags directly because it's thread-unsafe.
         std::string filename;
@@ -725,7 +1123,42 @@ static void* dumping_thread(void*) {
             return NULL;
         }
 
-        if (FLAGS_bvar_dump && !filename.empty()) {
+        if (FLAGS_bvar_dump && FLAGS_bvar_dump_ring) {
+            std::string ring_filename;
+            if (!GFLAGS_NS::GetCommandLineOption("bvar_dump_ring_file",
+                                                 &ring_filename)) {
+                LOG(ERROR) << "Fail to get gflag bvar_dump_ring_file";
+                return NULL;
+            }
+            const size_t pos = ring_filename.find("<app>");
+            if (pos != std::string::npos) {
+                ring_filename.replace(pos, 5/*<app>*/, command_name);
+            }
+            if (ring.path() != ring_filename) {
+                detail::DumpRingOptions ring_options;
+                ring_options.max_frames = std::max(
+                    FLAGS_bvar_dump_ring_minutes * 60 /
+                    FLAGS_bvar_dump_interval, 1);
+                ring_options.max_records =
+                    std::max(FLAGS_bvar_dump_ring_max_vars, 1);
+                // 128 bytes for each name should be enough.
+                ring_options.names_capacity = ring_options.max_records * 128;
+                ring_options.interval_s = FLAGS_bvar_dump_interval;
+                ring_options.app = command_name;
+                if (ring.open(ring_filename, ring_options) == 0) {
+                    LOG(INFO) << "Write numeric bvar to " << ring_filename
+                              << " every " << FLAGS_bvar_dump_interval
+                              << " seconds.";
+                }
+            }
+            if (ring.is_open()) {
+                ring.begin_frame(butil::gettimeofday_us());
+                if (Variable::dump_exposed_numerics(&ring, &options) < 0) {
+                    LOG(ERROR) << "Fail to dump vars into " << ring_filename;
+                }
+                ring.end_frame();
+            }
+        } else if (FLAGS_bvar_dump && !filename.empty()) {
             // Replace first <app> in filename with program name. We can't use
             // pid because a same binary should write the data to the same 
             // place, otherwise restarting of app may confuse noah with a lot 
@@ -832,6 +1265,8 @@ const bool ALLOW_UNUSED dummy_bvar_dump_prefix = ::GFLAGS_NS::RegisterFlagValida
     &FLAGS_bvar_dump_prefix, wakeup_dumping_thread);
 const bool ALLOW_UNUSED dummy_bvar_dump_tabs = ::GFLAGS_NS::RegisterFlagValidator(
     &FLAGS_bvar_dump_tabs, wakeup_dumping_thread);
+const bool ALLOW_UNUSED dummy_bvar_dump_ring_file = ::GFLAGS_NS::RegisterFlagValidator(
+    &FLAGS_bvar_dump_ring_file, wakeup_dumping_thread);
 
 void to_underscored_name(std::string* name, const butil::StringPiece& src) {
     name->reserve(name->size() + src.size() + 8/*just guess*/);
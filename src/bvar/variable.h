@@ -20,12 +20,15 @@
 #ifndef  BVAR_VARIABLE_H
 #define  BVAR_VARIABLE_H
 
+#include <stdint.h>                    // int64_t
+#include <limits>                      // std::numeric_limits
 #include <ostream>                     // std::ostream
 #include <string>                      // std::string
 #include <vector>                      // std::vector
 #include <gflags/gflags_declare.h>
 #include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
 #include "butil/strings/string_piece.h" // butil::StringPiece
+#include "butil/type_traits.h"          // butil::is_integral
 
 #ifdef BAIDU_INTERNAL
 #include <boost/any.hpp>
@@ -55,6 +58,78 @@ public:
                       const butil::StringPiece& description) = 0;
 };
 
+// A number got from Variable::get_numeric_value() without formatting.
+struct NumericValue {
+    enum Type {
+        TYPE_NONE = 0,
+        TYPE_INT64 = 1,
+        TYPE_UINT64 = 2,
+        TYPE_DOUBLE = 3,
+    };
+
+    NumericValue() : type(TYPE_NONE), u64(0) {}
+
+    Type type;
+    union {
+        int64_t i64;
+        uint64_t u64;
+        double f64;
+    };
+};
+
+// Implement this class to write numeric values of variables, which is
+// cheaper than Dumper that needs variables to be formatted.
+// If dump() returns false, Variable::dump_exposed_numerics() stops and
+// returns -1.
+class NumericDumper {
+public:
+    virtual ~NumericDumper() { }
+    virtual bool dump(const std::string& name, const NumericValue& value) = 0;
+
+    // Variables without numeric values are skipped by default. If this
+    // method returns non-NULL, they're described(with quoted strings) and
+    // sent to the returned dumper instead.
+    virtual Dumper* non_numeric_dumper() { return NULL; }
+};
+
+namespace detail {
+// Set `out' with `value' if T is integral or floating point.
+template <typename T, typename Enabler = void>
+struct NumericValueSetter {
+    static bool set(NumericValue*, const T&) { return false; }
+};
+
+template <typename T>
+struct NumericValueSetter<T, typename butil::enable_if<
+                                 butil::is_integral<T>::value>::type> {
+    static bool set(NumericValue* out, const T& value) {
+        if (std::numeric_limits<T>::is_signed) {
+            out->type = NumericValue::TYPE_INT64;
+            out->i64 = (int64_t)value;
+        } else {
+            out->type = NumericValue::TYPE_UINT64;
+            out->u64 = (uint64_t)value;
+        }
+        return true;
+    }
+};
+
+template <typename T>
+struct NumericValueSetter<T, typename butil::enable_if<
+                                 butil::is_floating_point<T>::value>::type> {
+    static bool set(NumericValue* out, const T& value) {
+        out->type = NumericValue::TYPE_DOUBLE;
+        out->f64 = (double)value;
+        return true;
+    }
+};
+}  // namespace detail
+
+template <typename T>
+inline bool to_numeric_value(const T& value, NumericValue* out) {
+    return detail::NumericValueSetter<T>::set(out, value);
+}
+
 // Options for Variable::dump_exposed().
 struct DumpOptions {
     // Constructed with default options.
@@ -77,6 +152,12 @@ struct DumpOptions {
     std::string black_wildcards;
 };
 
+namespace detail {
+// Returns true if `name' is matched by white_wildcards and not matched by
+// black_wildcards of `options'.
+bool is_name_dumped(const std::string& name, const DumpOptions& options);
+}  // namespace detail
+
 struct SeriesOptions {
     SeriesOptions() : fixed_length(true), test_only(false) {}
     
@@ -114,6 +195,11 @@ public:
     virtual void get_value(boost::any* value) const;
 #endif
 
+    // Put the value into `value' if it's a number.
+    // Returns true on success, false otherwise(not a number).
+    virtual bool get_numeric_value(NumericValue* /*value*/) const
+    { return false; }
+
     // Describe saved series as a json-string into the stream.
     // The output will be ploted by flot.js
     // Returns 0 on success, 1 otherwise(this variable does not save series).
@@ -167,7 +253,7 @@ public:
     // Put names of all exposed variables into `names'.
     // If you want to print all variables, you have to go through `names'
     // and call `describe_exposed' on each name. This prevents an iteration
-    // from taking the lock too long.
+    // from blocking expose() and hide() too long.
     static void list_exposed(std::vector<std::string>* names,
                              DisplayFilter = DISPLAY_ON_ALL);
 
@@ -205,12 +291,27 @@ public:
     // Return number of dumped variables, -1 on error.
     static int dump_exposed(Dumper* dumper, const DumpOptions* options);
 
+    // Find an exposed variable by `name' and put its numeric value into
+    // `value'. Returns 0 on success, -1 otherwise(not found, filtered by
+    // `display_filter' or not a number).
+    static int get_numeric_exposed(const std::string& name,
+                                   NumericValue* value,
+                                   DisplayFilter = DISPLAY_ON_ALL);
+
+    // Same as dump_exposed() except that only variables with numeric values
+    // are sent to `dumper', without formatting. `quote_string' in options
+    // is not used.
+    // Return number of dumped variables, -1 on error.
+    static int dump_exposed_numerics(NumericDumper* dumper,
+                                     const DumpOptions* options);
+
 protected:
     virtual int expose_impl(const butil::StringPiece& prefix,
                             const butil::StringPiece& name,
                             DisplayFilter display_filter);
 
 private:
+    friend class VariableBatch;
     std::string _name;
 
     // bvar uses TLS, thus copying/assignment need to copy TLS stuff as well,
@@ -218,6 +319,54 @@ private:
     DISALLOW_COPY_AND_ASSIGN(Variable);
 };
 
+// Expose and hide variables together. The registry of variables is modified
+// once in commit() rather than once per variable, which is much faster when
+// many variables are created or destroyed at a time, say variables of
+// connections or streams.
+// Example:
+//   bvar::VariableBatch batch;
+//   for (size_t i = 0; i < conns.size(); ++i) {
+//       batch.expose_as(&conns[i]->nread, conns[i]->name, "nread");
+//   }
+//   batch.commit();
+class VariableBatch {
+public:
+    VariableBatch() {}
+    // Uncommitted changes are committed.
+    ~VariableBatch() { commit(); }
+
+    // Expose `var' in commit() as var->expose_as(prefix, name) does.
+    // If `var' is exposed more than once in the batch, the last name wins.
+    void expose_as(Variable* var,
+                   const butil::StringPiece& prefix,
+                   const butil::StringPiece& name,
+                   DisplayFilter display_filter = DISPLAY_ON_ALL);
+    void expose(Variable* var,
+                const butil::StringPiece& name,
+                DisplayFilter display_filter = DISPLAY_ON_ALL) {
+        expose_as(var, butil::StringPiece(), name, display_filter);
+    }
+
+    // Hide `var' in commit(). `var' must not be destroyed before commit().
+    void hide(Variable* var) { _hides.push_back(var); }
+
+    // Apply all changes. Hides are applied before exposes.
+    // Returns number of variables failed to be exposed due to name conflicts.
+    int commit();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(VariableBatch);
+
+    struct Expose {
+        Variable* var;
+        std::string prefix;
+        std::string name;
+        DisplayFilter display_filter;
+    };
+    std::vector<Expose> _exposes;
+    std::vector<Variable*> _hides;
+};
+
 // Make name only use lowercased alphabets / digits / underscores, and append
 // the result to `out'.
 // Examples:
@@ -122,6 +122,10 @@ public:
     void get_value(boost::any* value) const override { *value = get_value(); }
 #endif
 
+    bool get_numeric_value(NumericValue* value) const override {
+        return to_numeric_value(get_value(), value);
+    }
+
     time_t window_size() const { return _window_size; }
 
     int describe_series(std::ostream& os, const SeriesOptions& options) const override {
@@ -0,0 +1,298 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// brpc - A framework to host and access services throughout Baidu.
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <google/protobuf/descriptor.h>
+#include "butil/time.h"
+#include "butil/macros.h"
+#include "bthread/unstable.h"
+#include "brpc/socket.h"
+#include "brpc/acceptor.h"
+#include "brpc/server.h"
+#include "brpc/policy/baidu_rpc_meta.pb.h"
+#include "brpc/policy/baidu_rpc_protocol.h"
+#include "brpc/policy/most_common_message.h"
+#include "brpc/controller.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_bool(server_drop_expired_requests);
+namespace policy {
+DECLARE_bool(baidu_protocol_deliver_timeout_ms);
+}
+}
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
+
+namespace {
+
+static const std::string EXP_REQUEST = "hello";
+static const std::string EXP_RESPONSE = "world";
+
+class MyEchoService : public ::test::EchoService {
+public:
+    MyEchoService() : ncalled(0), deadline_us(0), self_deadline_us(0) {}
+
+    void Echo(::google::protobuf::RpcController* cntl_base,
+              const ::test::EchoRequest* req,
+              ::test::EchoResponse* res,
+              ::google::protobuf::Closure* done) {
+        brpc::Controller* cntl =
+            static_cast<brpc::Controller*>(cntl_base);
+        brpc::ClosureGuard done_guard(done);
+        ++ncalled;
+        deadline_us = cntl->deadline_us();
+        self_deadline_us = bthread_self_deadline_us();
+        EXPECT_EQ(EXP_REQUEST, req->message());
+        res->set_message(EXP_RESPONSE);
+    }
+
+    int ncalled;
+    int64_t deadline_us;
+    int64_t self_deadline_us;
+};
+
+class BaiduTest : public ::testing::Test{
+protected:
+    BaiduTest() {
+        EXPECT_EQ(0, _server.AddService(
+            &_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+        // Hack: Regard `_server' as running
+        _server._status = brpc::Server::RUNNING;
+
+        EXPECT_EQ(0, pipe(_pipe_fds));
+
+        brpc::SocketId id;
+        brpc::SocketOptions options;
+        options.fd = _pipe_fds[1];
+        EXPECT_EQ(0, brpc::Socket::Create(options, &id));
+        EXPECT_EQ(0, brpc::Socket::Address(id, &_socket));
+    };
+
+    virtual ~BaiduTest() {};
+    virtual void SetUp() {};
+    virtual void TearDown() {};
+
+    void ProcessMessage(void (*process)(brpc::InputMessageBase*),
+                        brpc::InputMessageBase* msg, bool set_eof) {
+        if (msg->_socket == NULL) {
+            _socket.get()->ReAddress(&msg->_socket);
+        }
+        msg->_arg = &_server;
+        _socket->PostponeEOF();
+        if (set_eof) {
+            _socket->SetEOF();
+        }
+        (*process)(msg);
+    }
+
+    // Make a request message which was received `received_ago_us'
+    // microseconds ago.
+    brpc::policy::MostCommonMessage* MakeRequestMessage(
+        const brpc::policy::RpcMeta& meta, int64_t received_ago_us) {
+        brpc::policy::MostCommonMessage* msg =
+                brpc::policy::MostCommonMessage::Get();
+        butil::IOBufAsZeroCopyOutputStream meta_stream(&msg->meta);
+        EXPECT_TRUE(meta.SerializeToZeroCopyStream(&meta_stream));
+
+        test::EchoRequest req;
+        req.set_message(EXP_REQUEST);
+        butil::IOBufAsZeroCopyOutputStream req_stream(&msg->payload);
+        EXPECT_TRUE(req.SerializeToZeroCopyStream(&req_stream));
+        msg->_received_us = butil::cpuwide_time_us() - received_ago_us;
+        msg->_base_real_us = butil::gettimeofday_us() - butil::cpuwide_time_us();
+        return msg;
+    }
+
+    brpc::policy::RpcMeta MakeRequestMeta(int32_t timeout_ms) {
+        brpc::policy::RpcMeta meta;
+        brpc::policy::RpcRequestMeta* req_meta = meta.mutable_request();
+        req_meta->set_service_name("EchoService");
+        req_meta->set_method_name("Echo");
+        if (timeout_ms > 0) {
+            req_meta->set_timeout_ms(timeout_ms);
+        }
+        meta.set_correlation_id(1);
+        return meta;
+    }
+
+    void CheckResponseCode(int expect_code) {
+        int bytes_in_pipe = 0;
+        ioctl(_pipe_fds[0], FIONREAD, &bytes_in_pipe);
+        EXPECT_GT(bytes_in_pipe, 0);
+        butil::IOPortal buf;
+        EXPECT_EQ((ssize_t)bytes_in_pipe,
+                  buf.append_from_file_descriptor(_pipe_fds[0], 1024));
+        brpc::ParseResult pr =
+                brpc::policy::ParseRpcMessage(&buf, NULL, false, NULL);
+        EXPECT_EQ(brpc::PARSE_OK, pr.error());
+        brpc::policy::MostCommonMessage* msg =
+            static_cast<brpc::policy::MostCommonMessage*>(pr.message());
+
+        brpc::policy::RpcMeta meta;
+        butil::IOBufAsZeroCopyInputStream meta_stream(msg->meta);
+        EXPECT_TRUE(meta.ParseFromZeroCopyStream(&meta_stream));
+        EXPECT_EQ(expect_code, meta.response().error_code());
+        msg->Destroy();
+    }
+
+    int _pipe_fds[2];
+    brpc::SocketUniquePtr _socket;
+    brpc::Server _server;
+
+    MyEchoService _svc;
+};
+
+TEST_F(BaiduTest, pack_request_with_timeout) {
+    butil::IOBuf request_buf;
+    butil::IOBuf total_buf;
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    req.set_message(EXP_REQUEST);
+    brpc::SerializeRequestDefault(&request_buf, &cntl, &req);
+    ASSERT_FALSE(cntl.Failed());
+    cntl._deadline_us = butil::gettimeofday_us() + 500000;
+    brpc::policy::PackRpcRequest(
+        &total_buf, NULL, cntl.call_id().value,
+        test::EchoService::descriptor()->method(0), &cntl, request_buf, NULL);
+    ASSERT_FALSE(cntl.Failed());
+
+    brpc::ParseResult pr =
+            brpc::policy::ParseRpcMessage(&total_buf, NULL, false, NULL);
+    ASSERT_EQ(brpc::PARSE_OK, pr.error());
+    brpc::policy::MostCommonMessage* msg =
+        static_cast<brpc::policy::MostCommonMessage*>(pr.message());
+    brpc::policy::RpcMeta meta;
+    butil::IOBufAsZeroCopyInputStream meta_stream(msg->meta);
+    ASSERT_TRUE(meta.ParseFromZeroCopyStream(&meta_stream));
+    msg->Destroy();
+    ASSERT_TRUE(meta.request().has_timeout_ms());
+    ASSERT_LE(meta.request().timeout_ms(), 500);
+    ASSERT_GT(meta.request().timeout_ms(), 400);
+
+    // Not delivered when the flag is off.
+    brpc::policy::FLAGS_baidu_protocol_deliver_timeout_ms = false;
+    total_buf.clear();
+    brpc::policy::PackRpcRequest(
+        &total_buf, NULL, cntl.call_id().value,
+        test::EchoService::descriptor()->method(0), &cntl, request_buf, NULL);
+    brpc::policy::FLAGS_baidu_protocol_deliver_timeout_ms = true;
+    pr = brpc::policy::ParseRpcMessage(&total_buf, NULL, false, NULL);
+    ASSERT_EQ(brpc::PARSE_OK, pr.error());
+    msg = static_cast<brpc::policy::MostCommonMessage*>(pr.message());
+    butil::IOBufAsZeroCopyInputStream meta_stream2(msg->meta);
+    ASSERT_TRUE(meta.ParseFromZeroCopyStream(&meta_stream2));
+    msg->Destroy();
+    ASSERT_FALSE(meta.request().has_timeout_ms());
+
+    // Clamped when the remaining time overflows int32 milliseconds.
+    cntl._deadline_us = butil::gettimeofday_us() + 30 * 24 * 3600 * 1000000L;
+    total_buf.clear();
+    brpc::policy::PackRpcRequest(
+        &total_buf, NULL, cntl.call_id().value,
+        test::EchoService::descriptor()->method(0), &cntl, request_buf, NULL);
+    pr = brpc::policy::ParseRpcMessage(&total_buf, NULL, false, NULL);
+    ASSERT_EQ(brpc::PARSE_OK, pr.error());
+    msg = static_cast<brpc::policy::MostCommonMessage*>(pr.message());
+    butil::IOBufAsZeroCopyInputStream meta_stream3(msg->meta);
+    ASSERT_TRUE(meta.ParseFromZeroCopyStream(&meta_stream3));
+    msg->Destroy();
+    ASSERT_EQ(INT32_MAX, meta.request().timeout_ms());
+}
+
+TEST_F(BaiduTest, process_request_with_timeout) {
+    const int64_t start_us = butil::gettimeofday_us();
+    brpc::policy::MostCommonMessage* msg =
+        MakeRequestMessage(MakeRequestMeta(1000), 0);
+    ProcessMessage(brpc::policy::ProcessRpcRequest, msg, false);
+    CheckResponseCode(0);
+    ASSERT_EQ(1, _svc.ncalled);
+    ASSERT_GE(_svc.deadline_us, start_us + 1000000L);
+    ASSERT_LE(_svc.deadline_us, butil::gettimeofday_us() + 1000000L);
+    // ProcessRpcRequest is not called in a bthread.
+    ASSERT_EQ(-1, _svc.self_deadline_us);
+    ASSERT_EQ(0ll, _server._nexpired_bvar.get_value());
+
+    msg = MakeRequestMessage(MakeRequestMeta(0), 0);
+    ProcessMessage(brpc::policy::ProcessRpcRequest, msg, false);
+    CheckResponseCode(0);
+    ASSERT_EQ(2, _svc.ncalled);
+    ASSERT_EQ(-1, _svc.deadline_us);
+}
+
+TEST_F(BaiduTest, drop_expired_request) {
+    // Received 200ms ago with a timeout of 100ms.
+    brpc::policy::MostCommonMessage* msg =
+        MakeRequestMessage(MakeRequestMeta(100), 200000);
+    ProcessMessage(brpc::policy::ProcessRpcRequest, msg, false);
+    CheckResponseCode(brpc::ERPCTIMEDOUT);
+    ASSERT_EQ(0, _svc.ncalled);
+    ASSERT_EQ(1ll, _server._nexpired_bvar.get_value());
+    ASSERT_EQ(1ll, _server._nerror_bvar.get_value());
+
+    // Not dropped when the flag is off.
+    brpc::FLAGS_server_drop_expired_requests = false;
+    msg = MakeRequestMessage(MakeRequestMeta(100), 200000);
+    ProcessMessage(brpc::policy::ProcessRpcRequest, msg, false);
+    brpc::FLAGS_server_drop_expired_requests = true;
+    CheckResponseCode(0);
+    ASSERT_EQ(1, _svc.ncalled);
+    ASSERT_EQ(1ll, _server._nexpired_bvar.get_value());
+}
+
+struct ProcessInBthreadArgs {
+    brpc::InputMessageBase* msg;
+    int64_t deadline_us_after;
+};
+
+void* ProcessRpcRequestInBthread(void* void_args) {
+    ProcessInBthreadArgs* args = static_cast<ProcessInBthreadArgs*>(void_args);
+    brpc::policy::ProcessRpcRequest(args->msg);
+    args->deadline_us_after = bthread_self_deadline_us();
+    return NULL;
+}
+
+TEST_F(BaiduTest, propagate_deadline_to_bthread) {
+    brpc::policy::MostCommonMessage* msg =
+        MakeRequestMessage(MakeRequestMeta(1000), 0);
+    _socket.get()->ReAddress(&msg->_socket);
+    msg->_arg = &_server;
+    ProcessInBthreadArgs args = { msg, 0 };
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(
+                  &th, NULL, ProcessRpcRequestInBthread, &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    CheckResponseCode(0);
+    ASSERT_EQ(1, _svc.ncalled);
+    ASSERT_GT(_svc.deadline_us, 0);
+    ASSERT_EQ(_svc.deadline_us, _svc.self_deadline_us);
+    // Cleared after the request, later messages processed in the bthread
+    // don't inherit the deadline.
+    ASSERT_EQ(-1, args.deadline_us_after);
+}
+
+} // namespace
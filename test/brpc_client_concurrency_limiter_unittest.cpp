@@ -0,0 +1,121 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "brpc/errno.pb.h"
+#include "brpc/client_concurrency_limiter.h"
+
+namespace brpc {
+DECLARE_int32(client_cl_initial_max_concurrency);
+DECLARE_int32(client_cl_min_concurrency);
+DECLARE_int32(client_cl_max_concurrency);
+DECLARE_int32(client_cl_sample_window_size_ms);
+DECLARE_int32(client_cl_min_sample_count);
+} // namespace brpc
+
+namespace {
+
+const int kInitialMaxConcurrency = 20;
+
+class ClientConcurrencyLimiterTest : public ::testing::Test {
+protected:
+    void SetUp() {
+        brpc::FLAGS_client_cl_initial_max_concurrency = kInitialMaxConcurrency;
+        brpc::FLAGS_client_cl_min_concurrency = 2;
+        brpc::FLAGS_client_cl_max_concurrency = 1000;
+        brpc::FLAGS_client_cl_sample_window_size_ms = 1;
+        brpc::FLAGS_client_cl_min_sample_count = 5;
+    }
+
+    // Run `n' sampling windows in which every request is answered with
+    // `error_code' after `latency_us'.
+    void RunWindows(brpc::ClientConcurrencyLimiter* cl, int n,
+                    int error_code, int64_t latency_us) {
+        for (int i = 0; i < n; ++i) {
+            // Saturate the limiter so that it's allowed to grow.
+            int nreq = 0;
+            while (cl->OnRequested()) {
+                ++nreq;
+            }
+            usleep(1500);
+            for (int j = 0; j < nreq; ++j) {
+                cl->OnResponded(error_code, latency_us);
+            }
+        }
+    }
+};
+
+TEST_F(ClientConcurrencyLimiterTest, reject_over_limit) {
+    brpc::ClientConcurrencyLimiter cl;
+    ASSERT_FALSE(cl.used());
+    for (int i = 0; i < kInitialMaxConcurrency; ++i) {
+        ASSERT_TRUE(cl.OnRequested());
+    }
+    ASSERT_TRUE(cl.used());
+    ASSERT_EQ(kInitialMaxConcurrency, cl.inflight());
+    ASSERT_FALSE(cl.OnRequested());
+    ASSERT_EQ(kInitialMaxConcurrency, cl.inflight());
+    cl.OnResponded(0, 1000);
+    ASSERT_TRUE(cl.OnRequested());
+    for (int i = 0; i < kInitialMaxConcurrency; ++i) {
+        cl.OnResponded(ECANCELED, 1000);
+    }
+    ASSERT_EQ(0, cl.inflight());
+}
+
+TEST_F(ClientConcurrencyLimiterTest, back_off_on_overload) {
+    brpc::ClientConcurrencyLimiter cl;
+    RunWindows(&cl, 10, brpc::ELIMIT, 100);
+    ASSERT_LT(cl.max_concurrency(), kInitialMaxConcurrency);
+    RunWindows(&cl, 200, brpc::ERPCTIMEDOUT, 100);
+    ASSERT_EQ(brpc::FLAGS_client_cl_min_concurrency, cl.max_concurrency());
+    ASSERT_EQ(0, cl.inflight());
+}
+
+TEST_F(ClientConcurrencyLimiterTest, grow_on_stable_latency) {
+    brpc::ClientConcurrencyLimiter cl;
+    RunWindows(&cl, 30, 0, 1000);
+    const int grown = cl.max_concurrency();
+    ASSERT_GT(grown, kInitialMaxConcurrency);
+
+    // Latency rising far beyond the long-term latency shrinks the limit.
+    RunWindows(&cl, 10, 0, 10000);
+    ASSERT_LT(cl.max_concurrency(), grown);
+
+    cl.Reset();
+    ASSERT_EQ(kInitialMaxConcurrency, cl.max_concurrency());
+    ASSERT_EQ(0, cl.inflight());
+}
+
+TEST_F(ClientConcurrencyLimiterTest, no_growth_when_not_saturated) {
+    brpc::ClientConcurrencyLimiter cl;
+    for (int i = 0; i < 20; ++i) {
+        for (int j = 0; j < 5; ++j) {
+            ASSERT_TRUE(cl.OnRequested());
+        }
+        usleep(1500);
+        for (int j = 0; j < 5; ++j) {
+            cl.OnResponded(0, 1000);
+        }
+    }
+    ASSERT_EQ(kInitialMaxConcurrency, cl.max_concurrency());
+}
+
+} // namespace
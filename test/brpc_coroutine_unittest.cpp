@@ -0,0 +1,317 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// Coroutines are only available in C++20, the build files compile this file
+// with -std=c++20 when the compiler supports it. It's empty otherwise.
+#if defined(__cpp_impl_coroutine)
+
+#include <stdexcept>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "bthread/coroutine.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/coroutine.h"
+#include "echo.pb.h"
+
+namespace {
+
+bthread::Awaitable<int> sleep_and_return(int64_t sleep_us, int value) {
+    co_await bthread::sleep_for(sleep_us);
+    co_return value;
+}
+
+bthread::Awaitable<int> add_after_sleep(int64_t sleep_us) {
+    const int a = co_await sleep_and_return(sleep_us, 1);
+    const int b = co_await sleep_and_return(sleep_us, 2);
+    co_return a + b;
+}
+
+TEST(CoroutineTest, sleep_and_return) {
+    butil::Timer tm;
+    tm.start();
+    ASSERT_EQ(3, bthread::sync_wait(add_after_sleep(10000)));
+    tm.stop();
+    ASSERT_GE(tm.u_elapsed(), 20000);
+}
+
+bthread::Awaitable<void> throw_after_sleep() {
+    co_await bthread::sleep_for(1000);
+    throw std::runtime_error("from coroutine");
+}
+
+bthread::Awaitable<int> catch_exception() {
+    try {
+        co_await throw_after_sleep();
+    } catch (const std::runtime_error&) {
+        co_return 1;
+    }
+    co_return 0;
+}
+
+TEST(CoroutineTest, exception) {
+    ASSERT_EQ(1, bthread::sync_wait(catch_exception()));
+    ASSERT_THROW(bthread::sync_wait(throw_after_sleep()), std::runtime_error);
+}
+
+bthread::Awaitable<void> signal_and_throw(bthread::CountdownEvent* event) {
+    co_await bthread::sleep_for(1000);
+    event->signal();
+    throw std::runtime_error("from spawned coroutine");
+}
+
+TEST(CoroutineTest, spawned_exception) {
+    // The exception is logged rather than terminating the program.
+    bthread::CountdownEvent event(1);
+    bthread::spawn(signal_and_throw(&event));
+    event.wait();
+    bthread_usleep(10000);
+}
+
+bthread::Awaitable<void> sleep_and_set(butil::atomic<int>* flag) {
+    co_await bthread::sleep_for(10000);
+    flag->store(1);
+}
+
+TEST(CoroutineTest, cancel_sleep) {
+    butil::atomic<int> flag(0);
+    {
+        bthread::Awaitable<void> aw = sleep_and_set(&flag);
+        // Run until the coroutine suspends in sleep_for, then destroy it.
+        aw._h.resume();
+    }
+    bthread_usleep(30000);
+    ASSERT_EQ(0, flag.load());
+}
+
+bthread::Awaitable<void> sleep_and_count(butil::atomic<int>* counter) {
+    co_await bthread::sleep_for(100000);
+    counter->fetch_add(1);
+}
+
+bthread::Awaitable<void> sleep_concurrently(int n, butil::atomic<int>* counter) {
+    std::vector<bthread::Awaitable<void> > coroutines;
+    for (int i = 0; i < n; ++i) {
+        coroutines.push_back(sleep_and_count(counter));
+    }
+    co_await bthread::when_all(std::move(coroutines));
+}
+
+TEST(CoroutineTest, when_all) {
+    // Much more than bthreads that can be created with normal stacks
+    // comfortably.
+    const int N = 100000;
+    butil::atomic<int> counter(0);
+    butil::Timer tm;
+    tm.start();
+    bthread::sync_wait(sleep_concurrently(N, &counter));
+    tm.stop();
+    ASSERT_EQ(N, counter.load());
+    LOG(INFO) << N << " coroutines slept 100ms in " << tm.m_elapsed() << "ms";
+
+    bthread::sync_wait(sleep_concurrently(0, &counter));
+    ASSERT_EQ(N, counter.load());
+}
+
+bthread::Awaitable<void> count_or_throw(int i, butil::atomic<int>* counter) {
+    co_await bthread::sleep_for(1000);
+    if (i % 2 == 0) {
+        throw std::runtime_error("from when_all");
+    }
+    counter->fetch_add(1);
+}
+
+bthread::Awaitable<void> throw_concurrently(int n, butil::atomic<int>* counter) {
+    std::vector<bthread::Awaitable<void> > coroutines;
+    for (int i = 0; i < n; ++i) {
+        coroutines.push_back(count_or_throw(i, counter));
+    }
+    co_await bthread::when_all(std::move(coroutines));
+}
+
+TEST(CoroutineTest, when_all_exception) {
+    butil::atomic<int> counter(0);
+    ASSERT_THROW(bthread::sync_wait(throw_concurrently(10, &counter)),
+                 std::runtime_error);
+    // Thrown after all coroutines finish.
+    ASSERT_EQ(5, counter.load());
+}
+
+void* signal_later(void* arg) {
+    bthread_usleep(10000);
+    static_cast<bthread::CountdownEvent*>(arg)->signal();
+    return NULL;
+}
+
+bthread::Awaitable<int> wait_event(bthread::CountdownEvent* event) {
+    bthread_t th;
+    EXPECT_EQ(0, bthread_start_background(&th, NULL, signal_later, event));
+    co_return co_await bthread::wait(event);
+}
+
+TEST(CoroutineTest, wait_countdown_event) {
+    bthread::CountdownEvent event(1);
+    ASSERT_EQ(0, bthread::sync_wait(wait_event(&event)));
+}
+
+bthread::Awaitable<void> set_flag(butil::atomic<int>* flag,
+                                  bthread::CountdownEvent* event) {
+    co_await bthread::sleep_for(1000);
+    flag->store(1);
+    event->signal();
+}
+
+TEST(CoroutineTest, spawn) {
+    butil::atomic<int> flag(0);
+    bthread::CountdownEvent event(1);
+    bthread::spawn(set_flag(&flag, &event));
+    event.wait();
+    ASSERT_EQ(1, flag.load());
+}
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        // Respond in a coroutine.
+        bthread::spawn(DelayedEcho(request, response, done));
+    }
+
+private:
+    static bthread::Awaitable<void> DelayedEcho(
+        const test::EchoRequest* request, test::EchoResponse* response,
+        google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        co_await bthread::sleep_for(1000);
+        response->set_message(request->message());
+    }
+};
+
+class CoroutineRpcTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_EQ(0, _server.AddService(&_echo_service,
+                                        brpc::SERVER_DOESNT_OWN_SERVICE));
+        ASSERT_EQ(0, _server.Start(0, NULL));
+        brpc::ChannelOptions options;
+        options.timeout_ms = 5000;
+        ASSERT_EQ(0, _channel.Init(butil::EndPoint(butil::my_ip(),
+                                                    _server.listen_address().port),
+                                   &options));
+    }
+
+    void TearDown() override {
+        _server.Stop(0);
+        _server.Join();
+    }
+
+    EchoServiceImpl _echo_service;
+    brpc::Server _server;
+    brpc::Channel _channel;
+};
+
+bthread::Awaitable<std::string> echo(brpc::Channel* channel,
+                                     std::string message) {
+    test::EchoRequest request;
+    test::EchoResponse response;
+    brpc::Controller cntl;
+    request.set_message(message);
+    co_await brpc::CallMethodAsync(
+        channel, test::EchoService::descriptor()->FindMethodByName("Echo"),
+        &cntl, &request, &response);
+    EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    co_return response.message();
+}
+
+bthread::Awaitable<std::string> echo_by_stub(brpc::Channel* channel,
+                                             std::string message) {
+    test::EchoService_Stub stub(channel);
+    test::EchoRequest request;
+    test::EchoResponse response;
+    brpc::Controller cntl;
+    request.set_message(message);
+    brpc::AwaitableDone done;
+    stub.Echo(&cntl, &request, &response, &done);
+    co_await done;
+    EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    co_return response.message();
+}
+
+TEST_F(CoroutineRpcTest, call_method_async) {
+    ASSERT_EQ("hello", bthread::sync_wait(echo(&_channel, "hello")));
+    ASSERT_EQ("world", bthread::sync_wait(echo_by_stub(&_channel, "world")));
+}
+
+bthread::Awaitable<void> echo_and_count(brpc::Channel* channel,
+                                        butil::atomic<int>* nsucc) {
+    const std::string response = co_await echo(channel, "fanout");
+    if (response == "fanout") {
+        nsucc->fetch_add(1);
+    }
+}
+
+bthread::Awaitable<void> fanout(brpc::Channel* channel, int n,
+                                butil::atomic<int>* nsucc) {
+    std::vector<bthread::Awaitable<void> > calls;
+    for (int i = 0; i < n; ++i) {
+        calls.push_back(echo_and_count(channel, nsucc));
+    }
+    co_await bthread::when_all(std::move(calls));
+}
+
+TEST_F(CoroutineRpcTest, fanout) {
+    const int N = 1000;
+    butil::atomic<int> nsucc(0);
+    bthread::sync_wait(fanout(&_channel, N, &nsucc));
+    ASSERT_EQ(N, nsucc.load());
+}
+
+// Fails all RPC before returning from CallMethod.
+class FailingChannel : public google::protobuf::RpcChannel {
+public:
+    void CallMethod(const google::protobuf::MethodDescriptor*,
+                    google::protobuf::RpcController* cntl,
+                    const google::protobuf::Message*,
+                    google::protobuf::Message*,
+                    google::protobuf::Closure* done) override {
+        cntl->SetFailed("always fail");
+        done->Run();
+    }
+};
+
+bthread::Awaitable<bool> call_failed(google::protobuf::RpcChannel* channel) {
+    test::EchoService_Stub stub(channel);
+    test::EchoRequest request;
+    test::EchoResponse response;
+    brpc::Controller cntl;
+    request.set_message("fail");
+    brpc::AwaitableDone done;
+    stub.Echo(&cntl, &request, &response, &done);
+    co_await done;
+    co_return cntl.Failed();
+}
+
+TEST(CoroutineTest, done_before_await) {
+    FailingChannel channel;
+    ASSERT_TRUE(bthread::sync_wait(call_failed(&channel)));
+}
+
+} // namespace
+
+#endif  // __cpp_impl_coroutine
@@ -47,6 +47,7 @@
 namespace brpc {
 DECLARE_int32(health_check_interval);
 DECLARE_int64(detect_available_server_interval_ms);
+DECLARE_int32(lb_slow_start_ms);
 namespace policy {
 extern uint32_t CRCHash32(const char *key, size_t len);
 extern const char* GetHashName(uint32_t (*hasher)(const void* key, size_t len));
@@ -1003,4 +1004,90 @@ TEST_F(LoadBalancerTest, revived_from_all_failed_intergrated) {
     ASSERT_EQ(0, num_failed.load(butil::memory_order_relaxed));
 }
 
+TEST_F(LoadBalancerTest, slow_start) {
+    const int saved_slow_start_ms = brpc::FLAGS_lb_slow_start_ms;
+    for (size_t round = 0; round < 5; ++round) {
+        brpc::LoadBalancer* lb = NULL;
+        if (round == 0) {
+            lb = new brpc::policy::RoundRobinLoadBalancer;
+        } else if (round == 1) {
+            lb = new brpc::policy::RandomizedLoadBalancer;
+        } else if (round == 2) {
+            lb = new LALB;
+        } else if (round == 3) {
+            lb = new brpc::policy::WeightedRoundRobinLoadBalancer;
+        } else {
+            lb = new brpc::policy::ConsistentHashingLoadBalancer(
+                brpc::policy::CONS_HASH_LB_MURMUR3);
+        }
+        brpc::FLAGS_lb_slow_start_ms = 100000;
+        const size_t N = 4;
+        std::vector<brpc::ServerId> ids;
+        for (size_t i = 0; i < N; ++i) {
+            brpc::ServerId id(0, "1");
+            brpc::SocketOptions options;
+            ASSERT_EQ(0, str2endpoint("127.0.0.1", 7000 + i,
+                                      &options.remote_side));
+            options.user = new SaveRecycle;
+            ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+            ids.push_back(id);
+        }
+        lb->StartSlowStart(std::vector<brpc::ServerId>(1, ids[0]));
+        // Sockets are shared, but slow start of `lb' does not affect
+        // other balancers.
+        brpc::LoadBalancer* other = lb->New(butil::StringPiece());
+        ASSERT_TRUE(other != NULL);
+
+        // The warming server is still selected when it's the only choice.
+        ASSERT_TRUE(lb->AddServer(ids[0]));
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, true, 0, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        for (int i = 0; i < 10; ++i) {
+            in.request_code = (uint32_t)butil::fast_rand();
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            ASSERT_EQ(ids[0].id, ptr->id());
+        }
+
+        // The warming server gets almost no traffic at the beginning of
+        // the window.
+        for (size_t i = 1; i < N; ++i) {
+            ASSERT_TRUE(lb->AddServer(ids[i]));
+        }
+        ASSERT_EQ(N, other->AddServersInBatch(ids));
+        const int nselect = 4000;
+        int nwarming = 0;
+        int nother = 0;
+        for (int i = 0; i < nselect; ++i) {
+            in.request_code = (uint32_t)butil::fast_rand();
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            nwarming += (ptr->id() == ids[0].id);
+            ASSERT_EQ(0, other->SelectServer(in, &out));
+            nother += (ptr->id() == ids[0].id);
+        }
+        ASSERT_LT(nwarming, nselect / (int)N / 10) << "round=" << round;
+        ASSERT_GT(nother, nselect / (int)N / 2) << "round=" << round;
+
+        // Traffic is evenly distributed after the window.
+        brpc::FLAGS_lb_slow_start_ms = 1;
+        usleep(2000);
+        nwarming = 0;
+        for (int i = 0; i < nselect; ++i) {
+            in.request_code = (uint32_t)butil::fast_rand();
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            nwarming += (ptr->id() == ids[0].id);
+        }
+        ASSERT_GT(nwarming, nselect / (int)N / 2) << "round=" << round;
+
+        lb->Destroy();
+        other->Destroy();
+        for (size_t i = 0; i < N; ++i) {
+            brpc::SocketUniquePtr p;
+            ASSERT_EQ(0, brpc::Socket::Address(ids[i].id, &p));
+            p->SetFailed();
+        }
+    }
+    brpc::FLAGS_lb_slow_start_ms = saved_slow_start_ms;
+}
+
 } //namespace
@@ -18,10 +18,16 @@
 // brpc - A framework to host and access services throughout Baidu.
 
 #include <gtest/gtest.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/unknown_field_set.h>
+#include "butil/time.h"
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
 #include "butil/strings/string_piece.h"
+#include "bvar/bvar.h"
+#include "bvar/multi_dimension.h"
+#include "brpc/builtin/prometheus_metrics_service.h"
 #include "echo.pb.h"
 
 int main(int argc, char* argv[]) {
@@ -142,3 +148,374 @@ TEST(PrometheusMetrics, sanity) {
     ASSERT_EQ(0, server.Stop(0));
     ASSERT_EQ(0, server.Join());
 }
+
+TEST(PrometheusMetrics, multi_dimension) {
+    std::vector<std::string> labels;
+    labels.push_back("method");
+    labels.push_back("peer");
+    bvar::MultiDimension<bvar::Adder<int> > md("md_adder", labels);
+    bvar::MultiDimension<bvar::LatencyRecorder> lmd("md_request", labels);
+    std::vector<std::string> values;
+    values.push_back("Echo");
+    values.push_back("127.0.0.1:8614");
+    *md.get_stats(values) << 1;
+    *lmd.get_stats(values) << 10;
+    values[1] = "127.0.0.1:8615";
+    *md.get_stats(values) << 2;
+    *lmd.get_stats(values) << 20;
+
+    butil::IOBuf buf;
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+    const std::string res = buf.to_string();
+    // Label sets of a family are grouped under one TYPE.
+    ASSERT_NE(std::string::npos, res.find(
+        "# TYPE md_adder gauge\n"
+        "md_adder{method=\"Echo\",peer=\"127.0.0.1:8614\"} 1\n"
+        "md_adder{method=\"Echo\",peer=\"127.0.0.1:8615\"} 2\n"));
+    ASSERT_NE(std::string::npos, res.find("# TYPE md_request summary\n"));
+    ASSERT_NE(std::string::npos, res.find(
+        "md_request{method=\"Echo\",peer=\"127.0.0.1:8614\",quantile=\"0.999\"} "));
+    ASSERT_NE(std::string::npos, res.find(
+        "md_request_count{method=\"Echo\",peer=\"127.0.0.1:8615\"} 1\n"));
+    ASSERT_NE(std::string::npos, res.find(
+        "md_request_sum{method=\"Echo\",peer=\"127.0.0.1:8615\"} "));
+    ASSERT_NE(std::string::npos, res.find("# TYPE md_request_qps gauge\n"));
+}
+
+// Find the MetricFamily named `name' in the protobuf output and put its
+// type and serialized metrics into `type' and `metrics'.
+static bool FindMetricFamily(const std::string& data, const std::string& name,
+                             int* type,
+                             std::vector<std::string>* metrics) {
+    google::protobuf::io::CodedInputStream input(
+        (const uint8_t*)data.data(), data.size());
+    uint32_t len = 0;
+    while (input.ReadVarint32(&len)) {
+        const google::protobuf::io::CodedInputStream::Limit limit =
+            input.PushLimit(len);
+        google::protobuf::UnknownFieldSet family;
+        EXPECT_TRUE(family.ParseFromCodedStream(&input));
+        input.PopLimit(limit);
+        if (family.field(0).length_delimited() != name) {
+            continue;
+        }
+        metrics->clear();
+        for (int i = 0; i < family.field_count(); ++i) {
+            const google::protobuf::UnknownField& f = family.field(i);
+            if (f.number() == 3) {
+                *type = (int)f.varint();
+            } else if (f.number() == 4) {
+                metrics->push_back(f.length_delimited());
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+static double GetFixed64AsDouble(const google::protobuf::UnknownField& f) {
+    const uint64_t bits = f.fixed64();
+    double d = 0;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+TEST(PrometheusMetrics, formats) {
+    bvar::Adder<int> adder("prom_test_adder");
+    adder << 7;
+    bvar::Status<double> status("prom_test_status", 0.25);
+    // Variables under the server prefix with suffixes of LatencyRecorder
+    // are parts of summaries.
+    bvar::LatencyRecorder rec("rpc_server_prom_test_method");
+    rec << 10 << 30;
+    bvar::Adder<int> conn_count("rpc_server_prom_test_conn_count");
+    conn_count << 3;
+    bvar::Status<std::string> str("prom_test_str", "x");
+
+    butil::IOBuf buf;
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(
+                  &buf, brpc::PROMETHEUS_FORMAT_TEXT));
+    std::string res = buf.to_string();
+    ASSERT_NE(std::string::npos, res.find(
+        "# HELP prom_test_adder\n# TYPE prom_test_adder gauge\n"
+        "prom_test_adder 7\n"));
+    ASSERT_NE(std::string::npos, res.find("\nprom_test_status 0.25\n"));
+    ASSERT_EQ(std::string::npos, res.find("prom_test_str"));
+    ASSERT_NE(std::string::npos, res.find(
+        "# TYPE rpc_server_prom_test_method summary\n"
+        "rpc_server_prom_test_method{quantile=\"0.8\"} "));
+    ASSERT_NE(std::string::npos, res.find(
+        "\nrpc_server_prom_test_method_count 2\n"));
+    ASSERT_NE(std::string::npos, res.find(
+        "\nrpc_server_prom_test_method_sum "));
+    // Not a LatencyRecorder, output as a gauge.
+    ASSERT_NE(std::string::npos, res.find(
+        "# TYPE rpc_server_prom_test_conn_count gauge\n"
+        "rpc_server_prom_test_conn_count 3\n"));
+
+    // Values are updated while names are cached.
+    adder << 1;
+    buf.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(
+                  &buf, brpc::PROMETHEUS_FORMAT_OPENMETRICS));
+    res = buf.to_string();
+    ASSERT_EQ(std::string::npos, res.find("# HELP"));
+    ASSERT_NE(std::string::npos, res.find(
+        "# TYPE prom_test_adder gauge\nprom_test_adder 8\n"));
+    ASSERT_EQ(res.size() - 6, res.rfind("# EOF\n"));
+
+    buf.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(
+                  &buf, brpc::PROMETHEUS_FORMAT_PROTOBUF));
+    res = buf.to_string();
+    int type = -1;
+    std::vector<std::string> metrics;
+    ASSERT_TRUE(FindMetricFamily(res, "prom_test_adder", &type, &metrics));
+    ASSERT_EQ(1/*GAUGE*/, type);
+    ASSERT_EQ(1u, metrics.size());
+    google::protobuf::UnknownFieldSet metric;
+    ASSERT_TRUE(metric.ParseFromString(metrics[0]));
+    google::protobuf::UnknownFieldSet gauge;
+    ASSERT_TRUE(gauge.ParseFromString(metric.field(0).length_delimited()));
+    ASSERT_EQ(8, GetFixed64AsDouble(gauge.field(0)));
+
+    ASSERT_TRUE(FindMetricFamily(res, "rpc_server_prom_test_method",
+                                 &type, &metrics));
+    ASSERT_EQ(2/*SUMMARY*/, type);
+    ASSERT_EQ(1u, metrics.size());
+    metric.Clear();
+    ASSERT_TRUE(metric.ParseFromString(metrics[0]));
+    google::protobuf::UnknownFieldSet summary;
+    ASSERT_TRUE(summary.ParseFromString(metric.field(0).length_delimited()));
+    ASSERT_EQ(2u, summary.field(0).varint());
+    // 6 quantiles
+    ASSERT_EQ(8, summary.field_count());
+
+    // Labels of multi-dimensional bvars.
+    std::vector<std::string> labels;
+    labels.push_back("method");
+    bvar::MultiDimension<bvar::Adder<int> > md("prom_test_md", labels);
+    std::vector<std::string> values;
+    values.push_back("Ec\"ho");
+    *md.get_stats(values) << 5;
+    buf.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(
+                  &buf, brpc::PROMETHEUS_FORMAT_PROTOBUF));
+    ASSERT_TRUE(FindMetricFamily(buf.to_string(), "prom_test_md",
+                                 &type, &metrics));
+    ASSERT_EQ(1u, metrics.size());
+    metric.Clear();
+    ASSERT_TRUE(metric.ParseFromString(metrics[0]));
+    ASSERT_EQ(2, metric.field_count());
+    google::protobuf::UnknownFieldSet label;
+    ASSERT_TRUE(label.ParseFromString(metric.field(0).length_delimited()));
+    ASSERT_EQ("method", label.field(0).length_delimited());
+    ASSERT_EQ("Ec\"ho", label.field(1).length_delimited());
+
+    // Hidden variables are not output any more.
+    adder.hide();
+    buf.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf));
+    ASSERT_EQ(std::string::npos, buf.to_string().find("prom_test_adder"));
+}
+
+TEST(PrometheusMetrics, negotiate_format) {
+    brpc::Server server;
+    DummyEchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(&echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start("127.0.0.1:8616", NULL));
+    brpc::Channel channel;
+    brpc::ChannelOptions channel_opts;
+    channel_opts.protocol = "http";
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8616", &channel_opts));
+
+    const char* const accepts[] = {
+        NULL,
+        // Sent by prometheus by default.
+        "application/openmetrics-text;version=1.0.0,"
+        "application/openmetrics-text;version=0.0.1;q=0.75,"
+        "text/plain;version=0.0.4;q=0.5,*/*;q=0.1",
+        "text/plain;version=0.0.4;q=0.5,"
+        "application/vnd.google.protobuf;"
+        "proto=io.prometheus.client.MetricFamily;encoding=delimited;q=0.7",
+    };
+    const char* const content_types[] = {
+        "text/plain",
+        "application/openmetrics-text; version=1.0.0; charset=utf-8",
+        "application/vnd.google.protobuf; "
+        "proto=io.prometheus.client.MetricFamily; encoding=delimited",
+    };
+    for (size_t i = 0; i < arraysize(accepts); ++i) {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = "/brpc_metrics";
+        if (accepts[i]) {
+            cntl.http_request().SetHeader("Accept", accepts[i]);
+        }
+        cntl.http_request().SetHeader("Accept-Encoding", "gzip");
+        channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(content_types[i], cntl.http_response().content_type());
+        // Metrics of the server are large enough to be compressed.
+        const std::string* encoding =
+            cntl.http_response().GetHeader("Content-Encoding");
+        ASSERT_TRUE(encoding != NULL);
+        ASSERT_EQ("gzip", *encoding);
+    }
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+class CountingDumper : public bvar::Dumper, public bvar::NumericDumper {
+public:
+    CountingDumper() : count(0) {}
+    bool dump(const std::string&, const butil::StringPiece&) override {
+        ++count;
+        return true;
+    }
+    bool dump(const std::string&, const bvar::NumericValue&) override {
+        ++count;
+        return true;
+    }
+    size_t count;
+};
+
+TEST(PrometheusMetrics, scrape_performance) {
+    const int N = 20000;
+    std::vector<bvar::Adder<int>*> adders;
+    for (int i = 0; i < N; ++i) {
+        adders.push_back(new bvar::Adder<int>(
+            butil::string_printf("prom_perf_adder_%d", i)));
+        *adders.back() << i;
+    }
+    std::vector<bvar::LatencyRecorder*> recs;
+    for (int i = 0; i < 100; ++i) {
+        recs.push_back(new bvar::LatencyRecorder(
+            butil::string_printf("rpc_server_prom_perf_%d", i)));
+        *recs.back() << i;
+    }
+    // Multi-dimensional bvars of high cardinality.
+    std::vector<std::string> labels;
+    labels.push_back("peer");
+    bvar::MultiDimension<bvar::Adder<int> > md("prom_perf_md", labels);
+    bvar::MultiDimension<bvar::LatencyRecorder> lmd("prom_perf_lmd", labels);
+    const int NLABEL = 1000;
+    for (int i = 0; i < NLABEL; ++i) {
+        std::vector<std::string> values;
+        values.push_back(butil::string_printf("peer_%d", i));
+        *md.get_stats(values) << i;
+        *lmd.get_stats(values) << i;
+    }
+    butil::Timer tm;
+    // Describing all variables, which is the cost of parsing descriptions.
+    CountingDumper counting_dumper;
+    tm.start();
+    ASSERT_LT(0, bvar::Variable::dump_exposed(&counting_dumper, NULL));
+    ASSERT_LT(0, bvar::MVariable::dump_exposed(&counting_dumper, NULL));
+    tm.stop();
+    const int64_t describe_us = tm.u_elapsed();
+    // Reading numeric values only, which is the lower bound of scrapes.
+    tm.start();
+    ASSERT_LT(0, bvar::Variable::dump_exposed_numerics(&counting_dumper, NULL));
+    ASSERT_LT(0, bvar::MVariable::dump_exposed_numerics(&counting_dumper, NULL));
+    tm.stop();
+    const int64_t numerics_us = tm.u_elapsed();
+
+    const brpc::PrometheusFormat formats[] = {
+        brpc::PROMETHEUS_FORMAT_TEXT, brpc::PROMETHEUS_FORMAT_PROTOBUF };
+    for (size_t i = 0; i < arraysize(formats); ++i) {
+        butil::IOBuf buf;
+        tm.start();
+        ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf, formats[i]));
+        tm.stop();
+        const int64_t first_us = tm.u_elapsed();
+        int64_t total_us = 0;
+        const int ROUND = 5;
+        for (int j = 0; j < ROUND; ++j) {
+            buf.clear();
+            tm.start();
+            ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf, formats[i]));
+            tm.stop();
+            total_us += tm.u_elapsed();
+        }
+        LOG(INFO) << "Scrape " << adders.size() + recs.size() * 12 +
+                     NLABEL * 11
+                  << " vars in format=" << formats[i] << ": first="
+                  << first_us << "us cached=" << total_us / ROUND
+                  << "us describe_all=" << describe_us << "us numerics_all="
+                  << numerics_us << "us size="
+                  << buf.size();
+    }
+    for (size_t i = 0; i < adders.size(); ++i) {
+        delete adders[i];
+    }
+    for (size_t i = 0; i < recs.size(); ++i) {
+        delete recs[i];
+    }
+}
+
+struct ScrapeArg {
+    butil::atomic<bool>* stop;
+    int nscrape;
+    bool ok;
+};
+
+static void* ScrapeRepeatedly(void* arg) {
+    ScrapeArg* sa = (ScrapeArg*)arg;
+    const brpc::PrometheusFormat formats[] = {
+        brpc::PROMETHEUS_FORMAT_TEXT, brpc::PROMETHEUS_FORMAT_OPENMETRICS,
+        brpc::PROMETHEUS_FORMAT_PROTOBUF };
+    while (!sa->stop->load(butil::memory_order_relaxed)) {
+        butil::IOBuf buf;
+        const brpc::PrometheusFormat format =
+            formats[sa->nscrape % arraysize(formats)];
+        if (brpc::DumpPrometheusMetricsToIOBuf(&buf, format) != 0) {
+            sa->ok = false;
+            return NULL;
+        }
+        if (format == brpc::PROMETHEUS_FORMAT_TEXT &&
+            buf.to_string().find("\nprom_concurrent_stable 1\n") ==
+            std::string::npos) {
+            sa->ok = false;
+            return NULL;
+        }
+        ++sa->nscrape;
+    }
+    return NULL;
+}
+
+TEST(PrometheusMetrics, concurrent_scrapes) {
+    bvar::Adder<int> stable("prom_concurrent_stable");
+    stable << 1;
+    std::vector<std::string> labels;
+    labels.push_back("id");
+    bvar::MultiDimension<bvar::LatencyRecorder> lmd("prom_concurrent_lmd",
+                                                    labels);
+    butil::atomic<bool> stop(false);
+    const int NTHREAD = 4;
+    ScrapeArg args[NTHREAD];
+    pthread_t th[NTHREAD];
+    for (int i = 0; i < NTHREAD; ++i) {
+        args[i].stop = &stop;
+        args[i].nscrape = 0;
+        args[i].ok = true;
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, ScrapeRepeatedly, &args[i]));
+    }
+    // Entries of variables are created and removed while being scraped.
+    for (int i = 0; i < 200; ++i) {
+        bvar::Adder<int> adder(butil::string_printf("prom_concurrent_%d", i));
+        adder << i;
+        std::vector<std::string> values;
+        values.push_back(butil::string_printf("%d", i % 10));
+        *lmd.get_stats(values) << i;
+        if (i % 10 == 9) {
+            lmd.clear_stats();
+        }
+        usleep(1000);
+    }
+    stop.store(true);
+    for (int i = 0; i < NTHREAD; ++i) {
+        ASSERT_EQ(0, pthread_join(th[i], NULL));
+        ASSERT_TRUE(args[i].ok);
+        ASSERT_LT(0, args[i].nscrape);
+    }
+}
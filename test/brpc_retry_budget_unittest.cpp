@@ -0,0 +1,190 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <vector>
+#include "butil/time.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/channel.h"
+#include "brpc/server.h"
+#include "brpc/controller.h"
+#include "brpc/retry_budget.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_int32(retry_budget_ttl_s);
+} // namespace brpc
+
+namespace {
+
+TEST(RetryBudgetTest, percent_of_requests) {
+    butil::intrusive_ptr<brpc::RetryBudget> budget(
+        new brpc::RetryBudget(10, 0));
+    ASSERT_FALSE(budget->AcquireRetry());
+    for (int i = 0; i < 100; ++i) {
+        budget->OnRequest();
+    }
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_TRUE(budget->AcquireRetry()) << i;
+    }
+    ASSERT_FALSE(budget->AcquireRetry());
+    for (int i = 0; i < 10; ++i) {
+        budget->OnRequest();
+    }
+    ASSERT_TRUE(budget->AcquireRetry());
+    ASSERT_FALSE(budget->AcquireRetry());
+}
+
+TEST(RetryBudgetTest, min_retries_per_second) {
+    const int saved_ttl_s = brpc::FLAGS_retry_budget_ttl_s;
+    brpc::FLAGS_retry_budget_ttl_s = 3;
+    butil::intrusive_ptr<brpc::RetryBudget> budget(
+        new brpc::RetryBudget(0, 2));
+    for (int i = 0; i < 6; ++i) {
+        ASSERT_TRUE(budget->AcquireRetry()) << i;
+    }
+    ASSERT_FALSE(budget->AcquireRetry());
+    brpc::FLAGS_retry_budget_ttl_s = saved_ttl_s;
+}
+
+// Fails all requests with a retriable error and records when they arrive.
+class FailingEchoService : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest*,
+              test::EchoResponse*,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            _arrival_us.push_back(butil::gettimeofday_us());
+        }
+        static_cast<brpc::Controller*>(cntl_base)->SetFailed(
+            ENODATA, "Always fail");
+    }
+
+    std::vector<int64_t> arrival_us() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _arrival_us;
+    }
+
+    void clear() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _arrival_us.clear();
+    }
+
+private:
+    butil::Mutex _mutex;
+    std::vector<int64_t> _arrival_us;
+};
+
+class RetryBackoffTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_EQ(0, _server.AddService(&_svc,
+                                        brpc::SERVER_DOESNT_OWN_SERVICE));
+        ASSERT_EQ(0, _server.Start("127.0.0.1:8927", NULL));
+    }
+
+    void TearDown() override {
+        _server.Stop(0);
+        _server.Join();
+    }
+
+    void InitChannel(brpc::Channel* channel, int backoff_ms,
+                     int timeout_ms, int max_retry) {
+        brpc::ChannelOptions options;
+        options.retry_backoff_ms = backoff_ms;
+        options.retry_backoff_max_ms = 1000;
+        options.timeout_ms = timeout_ms;
+        options.max_retry = max_retry;
+        ASSERT_EQ(0, channel->Init("127.0.0.1:8927", &options));
+    }
+
+    FailingEchoService _svc;
+    brpc::Server _server;
+};
+
+TEST_F(RetryBackoffTest, delay_between_tries) {
+    brpc::Channel channel;
+    InitChannel(&channel, 50, 2000, 2);
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    req.set_message("hello");
+    test::EchoResponse res;
+    brpc::Controller cntl;
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_EQ(ENODATA, cntl.ErrorCode());
+    ASSERT_EQ(2, cntl.retried_count());
+    const std::vector<int64_t> arrival_us = _svc.arrival_us();
+    ASSERT_EQ(3u, arrival_us.size());
+    // The n-th retry is delayed by [T/2, T] where T = 50ms * 2^(n-1).
+    const int64_t gap1 = arrival_us[1] - arrival_us[0];
+    const int64_t gap2 = arrival_us[2] - arrival_us[1];
+    ASSERT_GE(gap1, 25000);
+    ASSERT_LT(gap1, 50000 + 200000);
+    ASSERT_GE(gap2, 50000);
+    ASSERT_LT(gap2, 100000 + 200000);
+}
+
+TEST_F(RetryBackoffTest, no_retry_after_deadline) {
+    brpc::Channel channel;
+    // The backoff is at least 250ms which is beyond the deadline.
+    InitChannel(&channel, 500, 200, 3);
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    req.set_message("hello");
+    test::EchoResponse res;
+    brpc::Controller cntl;
+    butil::Timer tm;
+    tm.start();
+    stub.Echo(&cntl, &req, &res, NULL);
+    tm.stop();
+    // Ends with the error of the try at once instead of waiting for the
+    // timeout.
+    ASSERT_EQ(ENODATA, cntl.ErrorCode());
+    ASSERT_EQ(0, cntl.retried_count());
+    ASSERT_LT(tm.m_elapsed(), 150);
+    ASSERT_EQ(1u, _svc.arrival_us().size());
+}
+
+TEST_F(RetryBackoffTest, rpc_ends_during_backoff) {
+    brpc::Channel channel;
+    InitChannel(&channel, 400, 2000, 3);
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    req.set_message("hello");
+    test::EchoResponse res;
+    brpc::Controller cntl;
+    const brpc::CallId cid = cntl.call_id();
+    stub.Echo(&cntl, &req, &res, brpc::DoNothing());
+    // Wait for the first try which is followed by a backoff of 200ms~400ms.
+    for (int i = 0; i < 100 && _svc.arrival_us().empty(); ++i) {
+        bthread_usleep(1000);
+    }
+    ASSERT_EQ(1u, _svc.arrival_us().size());
+    brpc::StartCancel(cid);
+    brpc::Join(cid);
+    ASSERT_EQ(ECANCELED, cntl.ErrorCode());
+    // The backoff timer fires after the RPC ended, which is ignored.
+    bthread_usleep(500000);
+    ASSERT_EQ(1u, _svc.arrival_us().size());
+}
+
+} // namespace
+
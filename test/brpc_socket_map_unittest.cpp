@@ -24,11 +24,14 @@
 #include "brpc/socket.h"
 #include "brpc/socket_map.h"
 #include "brpc/reloadable_flags.h"
+#include "butil/endpoint.h"
+#include "butil/time.h"
 
 namespace brpc {
 DECLARE_int32(idle_timeout_second);
 DECLARE_int32(defer_close_second);
 DECLARE_int32(max_connection_pool_size);
+DECLARE_bool(adaptive_connection_pool);
 } // namespace brpc
 
 namespace {
@@ -140,6 +143,71 @@ TEST_F(SocketMapTest, max_pool_size) {
         EXPECT_TRUE(ptrs[i]->Failed());
     }
 }
+
+TEST_F(SocketMapTest, adaptive_pool_size) {
+    // Connections are accepted by the kernel without calling accept().
+    const int listening_fd = butil::tcp_listen(g_key.peer.addr);
+    ASSERT_GE(listening_fd, 0);
+    brpc::FLAGS_max_connection_pool_size = 100;
+    brpc::FLAGS_adaptive_connection_pool = true;
+
+    brpc::SocketId main_id;
+    ASSERT_EQ(0, brpc::SocketMapInsert(g_key, &main_id));
+    brpc::SocketUniquePtr main_ptr;
+    ASSERT_EQ(0, brpc::Socket::Address(main_id, &main_ptr));
+    const int N = 8;
+    brpc::SocketUniquePtr ptrs[N];
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, main_ptr->GetPooledSocket(&ptrs[i]));
+    }
+    usleep(100000);
+    // Concurrency is 8, 4 more connections are created for bursts.
+    // UpdateStatsEverySecond() is serialized with the global updater which
+    // may be running.
+    main_ptr->UpdateStatsEverySecond(butil::cpuwide_time_ms());
+    int numfree = 0;
+    int numinflight = 0;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(main_ptr->GetPooledSocketStats(&numfree, &numinflight));
+        if (numfree == N / 2) {
+            break;
+        }
+        usleep(10000);
+    }
+    ASSERT_EQ(N / 2, numfree);
+    ASSERT_EQ(N, numinflight);
+    std::vector<brpc::SocketId> ids;
+    main_ptr->ListPooledSockets(&ids);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::SocketUniquePtr ptr;
+        ASSERT_EQ(0, brpc::Socket::Address(ids[i], &ptr));
+    }
+
+    // The most recently returned socket is reused first.
+    const brpc::SocketId last_id = ptrs[N - 1]->id();
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, ptrs[i]->ReturnToPool());
+        ptrs[i].reset();
+    }
+    ASSERT_EQ(0, main_ptr->GetPooledSocket(&ptrs[0]));
+    ASSERT_EQ(last_id, ptrs[0]->id());
+    ASSERT_EQ(0, ptrs[0]->ReturnToPool());
+    ptrs[0].reset();
+
+    // Free connections are closed gradually without traffic.
+    for (int i = 0; i < 50; ++i) {
+        usleep(1000);
+        main_ptr->UpdateStatsEverySecond(butil::cpuwide_time_ms());
+    }
+    ASSERT_TRUE(main_ptr->GetPooledSocketStats(&numfree, &numinflight));
+    ASSERT_EQ(1, numfree);
+    ASSERT_EQ(0, numinflight);
+
+    brpc::FLAGS_adaptive_connection_pool = false;
+    main_ptr.reset();
+    brpc::SocketMapRemove(g_key);
+    close(listening_fd);
+}
 } //namespace
 
 int main(int argc, char* argv[]) {
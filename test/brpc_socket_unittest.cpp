@@ -40,6 +40,7 @@
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
+#include "brpc/socket_map.h"
 #include "health_check.pb.h"
 #if defined(OS_MACOSX)
 #include <sys/event.h>
@@ -631,6 +632,66 @@ TEST_F(SocketTest, app_level_health_check) {
     GFLAGS_NS::SetCommandLineOption("health_check_interval", hc_buf);
 }
 
+static bool WaitForConnectionCount(brpc::Server* server, size_t expected) {
+    for (int i = 0; i < 100; ++i) {
+        if (server->_am->ConnectionCount() == expected) {
+            return true;
+        }
+        bthread_usleep(10000);
+    }
+    return server->_am->ConnectionCount() == expected;
+}
+
+TEST_F(SocketTest, preconnect) {
+    butil::EndPoint point(butil::IP_ANY, 7779);
+    brpc::Server server;
+    ASSERT_EQ(0, server.Start(point, NULL));
+    ASSERT_EQ(0u, server._am->ConnectionCount());
+
+    // Pooled connections are made before any RPC.
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    options.connection_type = brpc::CONNECTION_TYPE_POOLED;
+    options.preconnect_connections = 3;
+    brpc::Channel pooled_channel;
+    ASSERT_EQ(0, pooled_channel.Init(point, &options));
+    ASSERT_TRUE(WaitForConnectionCount(&server, 3));
+    brpc::SocketId main_id;
+    ASSERT_EQ(0, brpc::SocketMapFind(brpc::SocketMapKey(point), &main_id));
+    brpc::SocketUniquePtr main_socket;
+    ASSERT_EQ(0, brpc::Socket::Address(main_id, &main_socket));
+    int numfree = 0;
+    int numinflight = 0;
+    ASSERT_TRUE(main_socket->GetPooledSocketStats(&numfree, &numinflight));
+    ASSERT_EQ(3, numfree);
+    ASSERT_EQ(0, numinflight);
+    ASSERT_LT(main_socket->fd(), 0);
+
+    // The single connection is the main socket shared through SocketMap.
+    options.protocol = "baidu_std";
+    options.connection_type = brpc::CONNECTION_TYPE_SINGLE;
+    options.preconnect_connections = 1;
+    brpc::Channel single_channel;
+    ASSERT_EQ(0, single_channel.Init(point, &options));
+    ASSERT_TRUE(WaitForConnectionCount(&server, 4));
+    // The server may accept the connection before fd of the socket is set.
+    for (int i = 0; i < 100 && main_socket->fd() < 0; ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_GE(main_socket->fd(), 0);
+
+    // Short connections are never pre-connected.
+    options.connection_type = brpc::CONNECTION_TYPE_SHORT;
+    brpc::Channel short_channel;
+    ASSERT_EQ(0, short_channel.Init(point, &options));
+    bthread_usleep(100000);
+    ASSERT_EQ(4u, server._am->ConnectionCount());
+
+    main_socket.reset();
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
 TEST_F(SocketTest, health_check) {
     // FIXME(gejun): Messenger has to be new otherwise quitting may crash.
     brpc::Acceptor* messenger = new brpc::Acceptor;
@@ -0,0 +1,169 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <deque>
+#include <map>
+#include <gtest/gtest.h>
+#include "butil/string_printf.h"
+#include "brpc/socket.h"
+#include "brpc/global.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+
+namespace {
+
+class ZoneAwareLoadBalancerTest : public ::testing::Test {
+protected:
+    void SetUp() {
+        brpc::GlobalInitializeOrDie();
+        _lb = NULL;
+    }
+
+    void TearDown() {
+        if (_lb) {
+            _lb->Destroy();
+        }
+        for (size_t i = 0; i < _servers.size(); ++i) {
+            brpc::SocketUniquePtr ptr;
+            if (brpc::Socket::Address(_servers[i].id, &ptr) == 0) {
+                ptr->SetFailed();
+            }
+        }
+    }
+
+    void AddServers(const char* tag, int n) {
+        for (int i = 0; i < n; ++i) {
+            brpc::SocketOptions options;
+            ASSERT_EQ(0, butil::str2endpoint(
+                          "127.0.0.1", 9000 + (int)_servers.size(),
+                          &options.remote_side));
+            brpc::ServerId id(0, tag);
+            ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+            ASSERT_TRUE(_lb->AddServer(id));
+            _servers.push_back(id);
+            _zone_of[id.id] = tag;
+        }
+    }
+
+    // Simulate `nrequest' requests with `concurrency' requests in flight,
+    // returns number of requests sent to each zone.
+    std::map<std::string, int> Simulate(int nrequest, size_t concurrency) {
+        std::map<std::string, int> nsent;
+        std::deque<brpc::LoadBalancer::CallInfo> inflight;
+        for (int i = 0; i < nrequest; ++i) {
+            brpc::SocketUniquePtr ptr;
+            brpc::LoadBalancer::SelectIn in = { 0, true, false, 0u, NULL };
+            brpc::LoadBalancer::SelectOut out(&ptr);
+            EXPECT_EQ(0, _lb->SelectServer(in, &out));
+            if (ptr == NULL) {
+                break;
+            }
+            ++nsent[_zone_of[ptr->id()]];
+            if (out.need_feedback) {
+                const brpc::LoadBalancer::CallInfo info =
+                    { 0, ptr->id(), 0, NULL };
+                inflight.push_back(info);
+            }
+            while (inflight.size() > concurrency) {
+                _lb->Feedback(inflight.front());
+                inflight.pop_front();
+            }
+        }
+        for (; !inflight.empty(); inflight.pop_front()) {
+            _lb->Feedback(inflight.front());
+        }
+        return nsent;
+    }
+
+    brpc::LoadBalancer* _lb;
+    std::vector<brpc::ServerId> _servers;
+    std::map<brpc::SocketId, std::string> _zone_of;
+};
+
+TEST_F(ZoneAwareLoadBalancerTest, parse_tag) {
+    std::string zone;
+    std::string region;
+    std::string inner_tag;
+    brpc::policy::ZoneAwareLoadBalancer::ParseTag(
+        "zone=az1 10  region=bj", &zone, &region, &inner_tag);
+    ASSERT_EQ("az1", zone);
+    ASSERT_EQ("bj", region);
+    ASSERT_EQ("10", inner_tag);
+    brpc::policy::ZoneAwareLoadBalancer::ParseTag(
+        "a b", &zone, &region, &inner_tag);
+    ASSERT_EQ("", zone);
+    ASSERT_EQ("", region);
+    ASSERT_EQ("a b", inner_tag);
+}
+
+TEST_F(ZoneAwareLoadBalancerTest, invalid_params) {
+    brpc::policy::ZoneAwareLoadBalancer proto;
+    ASSERT_EQ(NULL, proto.New("lb=not_exist"));
+    ASSERT_EQ(NULL, proto.New("headroom=abc"));
+    ASSERT_EQ(NULL, proto.New("unknown=1"));
+    brpc::LoadBalancer* lb = proto.New("lb=wrr local_zone=az1");
+    ASSERT_TRUE(lb != NULL);
+    lb->Destroy();
+}
+
+TEST_F(ZoneAwareLoadBalancerTest, simulation) {
+    brpc::policy::ZoneAwareLoadBalancer proto;
+    _lb = proto.New("lb=rr local_zone=az1 local_region=bj "
+                    "headroom=2 tolerance=1");
+    ASSERT_TRUE(_lb != NULL);
+    AddServers("zone=az1 region=bj", 4);
+    AddServers("zone=az2 region=bj", 4);
+    AddServers("zone=az3 region=sh", 2);
+
+    // Local servers have enough headroom for light traffic.
+    std::map<std::string, int> nsent = Simulate(10000, 4);
+    ASSERT_EQ(10000, nsent["zone=az1 region=bj"]);
+
+    // Under heavy traffic, local servers take twice the load of other
+    // servers (tolerance=1), which is 8/14 of all requests. The rest spills
+    // to other zones in proportion to their numbers of servers.
+    nsent = Simulate(100000, 100);
+    const double local_ratio = nsent["zone=az1 region=bj"] / 100000.0;
+    LOG(INFO) << "local=" << nsent["zone=az1 region=bj"]
+              << " az2=" << nsent["zone=az2 region=bj"]
+              << " az3=" << nsent["zone=az3 region=sh"];
+    ASSERT_GT(local_ratio, 0.5);
+    ASSERT_LT(local_ratio, 0.65);
+    const double remote_ratio = nsent["zone=az2 region=bj"] /
+        (double)nsent["zone=az3 region=sh"];
+    ASSERT_GT(remote_ratio, 1.6);
+    ASSERT_LT(remote_ratio, 2.5);
+
+    // Servers in the local region take over the traffic when all local
+    // servers are down.
+    for (size_t i = 0; i < 4; ++i) {
+        brpc::SocketUniquePtr ptr;
+        ASSERT_EQ(0, brpc::Socket::Address(_servers[i].id, &ptr));
+        ptr->SetFailed();
+    }
+    nsent = Simulate(10000, 4);
+    ASSERT_EQ(10000, nsent["zone=az2 region=bj"]);
+
+    // Removing servers drops their requests in flight.
+    for (size_t i = 4; i < 8; ++i) {
+        ASSERT_TRUE(_lb->RemoveServer(_servers[i]));
+    }
+    ASSERT_FALSE(_lb->RemoveServer(_servers[4]));
+    nsent = Simulate(10000, 4);
+    ASSERT_EQ(10000, nsent["zone=az3 region=sh"]);
+}
+
+} // namespace
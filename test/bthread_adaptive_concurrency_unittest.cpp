@@ -0,0 +1,144 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "bvar/variable.h"
+#include "bthread/bthread.h"
+
+namespace bthread {
+DECLARE_int32(bthread_concurrency);
+}
+DECLARE_bool(bthread_adaptive_concurrency);
+DECLARE_int32(bthread_adaptive_max_concurrency);
+DECLARE_int32(bthread_adaptive_interval_ms);
+DECLARE_int32(bthread_adaptive_idle_rounds);
+
+namespace {
+
+const int INITIAL_CONCURRENCY = 4;
+
+class AdaptiveConcurrencyTest : public ::testing::Test {
+protected:
+    AdaptiveConcurrencyTest() {
+        // Must be set before any bthread is created.
+        bthread::FLAGS_bthread_concurrency = INITIAL_CONCURRENCY;
+        FLAGS_bthread_adaptive_concurrency = true;
+        FLAGS_bthread_adaptive_max_concurrency = 16;
+        FLAGS_bthread_adaptive_interval_ms = 10;
+        FLAGS_bthread_adaptive_idle_rounds = 3;
+    }
+};
+
+int64_t get_var(const char* name) {
+    return atoll(bvar::Variable::describe_exposed(name).c_str());
+}
+
+struct Blocker {
+    butil::atomic<int> nstarted;
+    butil::atomic<bool> released;
+};
+
+void* block_worker(void* arg) {
+    Blocker* b = static_cast<Blocker*>(arg);
+    b->nstarted.fetch_add(1);
+    // Blocks the worker pthread rather than the bthread.
+    while (!b->released.load()) {
+        usleep(1000);
+    }
+    return NULL;
+}
+
+void* count_run(void* arg) {
+    static_cast<butil::atomic<int>*>(arg)->fetch_add(1);
+    return NULL;
+}
+
+// Wait until *counter reaches `expected' or 10 seconds elapse. Intervals of
+// the adjuster may be much longer than -bthread_adaptive_interval_ms on
+// loaded machines, don't depend on timings.
+bool wait_count(const butil::atomic<int>* counter, int expected) {
+    const int64_t deadline_us = butil::gettimeofday_us() + 10000000L;
+    while (counter->load() < expected) {
+        if (butil::gettimeofday_us() > deadline_us) {
+            return false;
+        }
+        usleep(1000);
+    }
+    return true;
+}
+
+TEST_F(AdaptiveConcurrencyTest, grow_when_blocked_and_shrink_when_idle) {
+    Blocker blocker;
+    blocker.nstarted.store(0);
+    blocker.released.store(false);
+    bthread_t blockers[INITIAL_CONCURRENCY];
+    for (int i = 0; i < INITIAL_CONCURRENCY; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&blockers[i], NULL,
+                                              block_worker, &blocker));
+    }
+    ASSERT_TRUE(wait_count(&blocker.nstarted, INITIAL_CONCURRENCY));
+    // At least INITIAL_CONCURRENCY workers are blocked, new bthreads can
+    // only be run by workers added by the adjuster.
+    const int N = 8;
+    butil::atomic<int> nrun(0);
+    bthread_t th[N];
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, count_run, &nrun));
+    }
+    ASSERT_TRUE(wait_count(&nrun, N));
+    ASSERT_GT(bthread_getconcurrency(), INITIAL_CONCURRENCY);
+    ASSERT_LE(bthread_getconcurrency(), 16);
+    ASSERT_GT(get_var("bthread_adaptive_grow_count"), 0);
+    blocker.released.store(true);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    for (int i = 0; i < INITIAL_CONCURRENCY; ++i) {
+        ASSERT_EQ(0, bthread_join(blockers[i], NULL));
+    }
+
+    // Workers are suspended one by one when they're idle.
+    const int64_t nworkers = get_var("bthread_active_worker_count");
+    const int64_t deadline_us = butil::gettimeofday_us() + 10000000L;
+    while (get_var("bthread_active_worker_count") > 1 &&
+           butil::gettimeofday_us() < deadline_us) {
+        usleep(1000);
+    }
+    ASSERT_EQ(1, get_var("bthread_active_worker_count"));
+    ASSERT_GE(get_var("bthread_adaptive_shrink_count"), nworkers - 1);
+
+    // Suspended workers are resumed when the active one is blocked.
+    blocker.nstarted.store(0);
+    blocker.released.store(false);
+    ASSERT_EQ(0, bthread_start_background(&blockers[0], NULL,
+                                          block_worker, &blocker));
+    ASSERT_TRUE(wait_count(&blocker.nstarted, 1));
+    nrun.store(0);
+    ASSERT_EQ(0, bthread_start_background(&th[0], NULL, count_run, &nrun));
+    ASSERT_TRUE(wait_count(&nrun, 1));
+    ASSERT_GT(get_var("bthread_active_worker_count"), 1);
+    blocker.released.store(true);
+    ASSERT_EQ(0, bthread_join(th[0], NULL));
+    ASSERT_EQ(0, bthread_join(blockers[0], NULL));
+}
+
+} // namespace
@@ -15,7 +15,9 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <vector>
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/atomicops.h"
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -26,6 +28,10 @@
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
 
+DECLARE_bool(butex_batch_wake);
+DECLARE_int32(butex_wake_spread_size);
+DECLARE_int32(task_group_runqueue_capacity);
+
 namespace bthread {
 extern butil::atomic<TaskControl*> g_task_control;
 inline TaskControl* get_task_control() {
@@ -394,4 +400,99 @@ TEST(ButexTest, stop_before_sleeping) {
         ASSERT_EQ(EINVAL, bthread_stop(th));
     }
 }
+
+struct WakeAllArgs {
+    butil::atomic<int>* butex;
+    butil::atomic<int> nwaiting;
+    butil::atomic<int> nwoken;
+    int nwakeup;
+};
+
+void* wait_until_woken(void* void_args) {
+    WakeAllArgs* args = static_cast<WakeAllArgs*>(void_args);
+    args->nwaiting.fetch_add(1);
+    while (args->butex->load(butil::memory_order_acquire) == 0) {
+        bthread::butex_wait(args->butex, 0, NULL);
+    }
+    args->nwoken.fetch_add(1);
+    return NULL;
+}
+
+void* wake_all_in_bthread(void* arg) {
+    WakeAllArgs* args = static_cast<WakeAllArgs*>(arg);
+    args->butex->store(1, butil::memory_order_release);
+    args->nwakeup = bthread::butex_wake_all(args->butex);
+    return NULL;
+}
+
+// Returns microseconds from butex_wake_all() to all of `n' waiters running.
+int64_t wake_all_waiters(int n, bool from_bthread) {
+    WakeAllArgs args;
+    args.butex = bthread::butex_create_checked<butil::atomic<int> >();
+    args.butex->store(0);
+    args.nwaiting = 0;
+    args.nwoken = 0;
+    args.nwakeup = 0;
+    std::vector<bthread_t> th(n);
+    for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(0, bthread_start_background(&th[i], NULL,
+                                              wait_until_woken, &args));
+    }
+    while (args.nwaiting.load() != n) {
+        usleep(1000);
+    }
+    // Make sure that all of them are suspended in butex_wait().
+    usleep(20000);
+    butil::Timer tm;
+    tm.start();
+    if (from_bthread) {
+        bthread_t waker;
+        EXPECT_EQ(0, bthread_start_background(&waker, NULL,
+                                              wake_all_in_bthread, &args));
+        EXPECT_EQ(0, bthread_join(waker, NULL));
+    } else {
+        args.butex->store(1, butil::memory_order_release);
+        args.nwakeup = bthread::butex_wake_all(args.butex);
+    }
+    EXPECT_EQ(n, args.nwakeup);
+    while (args.nwoken.load() != n) {
+        sched_yield();
+    }
+    tm.stop();
+    for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(0, bthread_join(th[i], NULL));
+    }
+    bthread::butex_destroy(args.butex);
+    return tm.u_elapsed();
+}
+
+TEST(ButexTest, wake_all_in_batch) {
+    const int ns[] = { 16, 256, 1024 };
+    for (size_t i = 0; i < arraysize(ns); ++i) {
+        for (int from_bthread = 0; from_bthread < 2; ++from_bthread) {
+            FLAGS_butex_batch_wake = false;
+            const int64_t one_by_one_us = wake_all_waiters(ns[i], from_bthread);
+            FLAGS_butex_batch_wake = true;
+            const int64_t batch_us = wake_all_waiters(ns[i], from_bthread);
+            FLAGS_butex_wake_spread_size = 16;
+            const int64_t spread_us = wake_all_waiters(ns[i], from_bthread);
+            FLAGS_butex_wake_spread_size = 0;
+            LOG(INFO) << "Wake " << ns[i] << " waiters from "
+                      << (from_bthread ? "bthread" : "pthread")
+                      << ": one_by_one=" << one_by_one_us
+                      << "us batch=" << batch_us
+                      << "us batch_spread=" << spread_us << "us";
+        }
+    }
+}
+
+TEST(ButexTest, wake_all_more_than_runqueue_capacity) {
+    // Waiters woken from a bthread are pushed into the runqueue of the
+    // worker, which is full in the middle of the batch. The waker must
+    // signal other workers to steal tasks rather than waiting forever.
+    FLAGS_butex_batch_wake = true;
+    const int n = FLAGS_task_group_runqueue_capacity + 1024;
+    const int64_t us = wake_all_waiters(n, true);
+    LOG(INFO) << "Wake " << n << " waiters in " << us << "us";
+}
 } // namespace
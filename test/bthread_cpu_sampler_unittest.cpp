@@ -0,0 +1,211 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "bvar/variable.h"
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"
+#include "bthread/cpu_sampler.h"
+
+namespace {
+
+int64_t get_var(const char* name) {
+    return atoll(bvar::Variable::describe_exposed(name).c_str());
+}
+
+volatile uint64_t g_sink = 0;
+
+inline __attribute__((always_inline)) void spin_inline(int64_t duration_us) {
+    butil::Timer tm;
+    tm.start();
+    uint64_t x = 1;
+    do {
+        for (int i = 0; i < 10000; ++i) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+        tm.stop();
+    } while (tm.u_elapsed() < duration_us);
+    g_sink = x;
+}
+
+__attribute__((noinline)) void spin(int64_t duration_us) {
+    spin_inline(duration_us);
+}
+
+// Samples inside following functions are of the pthreads below.
+__attribute__((noinline)) void spin_registered(int64_t duration_us) {
+    spin_inline(duration_us);
+}
+
+__attribute__((noinline)) void spin_unregistered(int64_t duration_us) {
+    spin_inline(duration_us);
+}
+
+void* spin_in_registered_pthread(void*) {
+    bthread::register_cpu_sampled_thread();
+    spin_registered(500000L);
+    return NULL;
+}
+
+void* spin_in_unregistered_pthread(void*) {
+    spin_unregistered(500000L);
+    return NULL;
+}
+
+void* spin_one_second(void*) {
+    spin(1000000L);
+    return NULL;
+}
+
+struct Profile {
+    uintptr_t period_us;
+    int64_t nsample;
+    std::vector<std::vector<uintptr_t> > stacks;
+};
+
+// Parse the binary part of a cpu profile of gperftools.
+bool parse_profile(const std::string& data, Profile* prof) {
+    const uintptr_t* p = (const uintptr_t*)data.data();
+    const uintptr_t* const end = p + data.size() / sizeof(uintptr_t);
+    if (end - p < 5 || p[0] != 0 || p[1] != 3 || p[2] != 0 || p[4] != 0) {
+        return false;
+    }
+    prof->period_us = p[3];
+    prof->nsample = 0;
+    for (p += 5; end - p >= 2; ) {
+        const uintptr_t count = p[0];
+        const uintptr_t depth = p[1];
+        if (count == 0 && depth == 1) {
+            // Trailer.
+            return end - p >= 3 && p[2] == 0;
+        }
+        if ((uintptr_t)(end - p) < 2 + depth) {
+            return false;
+        }
+        prof->nsample += count;
+        prof->stacks.push_back(std::vector<uintptr_t>(p + 2, p + 2 + depth));
+        p += 2 + depth;
+    }
+    return false;
+}
+
+TEST(CpuSamplerTest, sample_bthreads_by_account) {
+    ASSERT_TRUE(GFLAGS_NS::SetCommandLineOption(
+                    "bthread_cpu_sampling_hz", "-1").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bthread_cpu_sampling_hz", "1000").empty());
+    const int64_t nsample0 = get_var("bthread_cpu_sample_count");
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.cpu_account = bthread_cpu_account_get("cpu_sampler_test");
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, &attr, spin_one_second, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_GT(get_var("bthread_cpu_sample_count"), nsample0);
+
+    // Samples of the last minute may be at the end of the previous minute.
+    std::string data;
+    const int64_t n = bthread::dump_sampled_cpu(2, 0, "cpu_sampler_test", &data);
+    Profile prof;
+    ASSERT_TRUE(parse_profile(data, &prof));
+    ASSERT_EQ(1000u, prof.period_us);
+    ASSERT_EQ(n, prof.nsample);
+    // Timers are not precise, a few samples are enough.
+    ASSERT_GT(n, 10);
+    // Most samples are inside spin() which is small.
+    int64_t nspin = 0;
+    for (size_t i = 0; i < prof.stacks.size(); ++i) {
+        for (size_t j = 0; j < prof.stacks[i].size() && j < 2; ++j) {
+            const uintptr_t pc = prof.stacks[i][j];
+            if (pc >= (uintptr_t)spin && pc < (uintptr_t)spin + 512) {
+                ++nspin;
+                break;
+            }
+        }
+    }
+    ASSERT_GT(nspin, 0);
+
+    ASSERT_EQ(0, bthread::dump_sampled_cpu(2, 0, "no_such_account", &data));
+    ASSERT_TRUE(parse_profile(data, &prof));
+
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bthread_cpu_sampling_hz", "0").empty());
+}
+
+TEST(CpuSamplerTest, suspend) {
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bthread_cpu_sampling_hz", "1000").empty());
+    bthread::suspend_cpu_sampling();
+    const int64_t nsample0 = get_var("bthread_cpu_sample_count");
+    spin(300000);
+    ASSERT_EQ(nsample0, get_var("bthread_cpu_sample_count"));
+    bthread::resume_cpu_sampling();
+    spin(300000);
+    ASSERT_GT(get_var("bthread_cpu_sample_count"), nsample0);
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bthread_cpu_sampling_hz", "0").empty());
+    const int64_t nsample1 = get_var("bthread_cpu_sample_count");
+    spin(300000);
+    ASSERT_EQ(nsample1, get_var("bthread_cpu_sample_count"));
+}
+
+TEST(CpuSamplerTest, walk_stacks_of_registered_pthreads) {
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bthread_cpu_sampling_hz", "1000").empty());
+    pthread_t th[2];
+    ASSERT_EQ(0, pthread_create(&th[0], NULL, spin_in_registered_pthread, NULL));
+    ASSERT_EQ(0, pthread_create(&th[1], NULL, spin_in_unregistered_pthread, NULL));
+    ASSERT_EQ(0, pthread_join(th[0], NULL));
+    ASSERT_EQ(0, pthread_join(th[1], NULL));
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bthread_cpu_sampling_hz", "0").empty());
+
+    std::string data;
+    bthread::dump_sampled_cpu(2, 0, NULL, &data);
+    Profile prof;
+    ASSERT_TRUE(parse_profile(data, &prof));
+    size_t max_registered_depth = 0;
+    size_t max_unregistered_depth = 0;
+    for (size_t i = 0; i < prof.stacks.size(); ++i) {
+        // The functions are small and may be adjacent, the pc belongs to
+        // the nearest one before it.
+        const uintptr_t pc = prof.stacks[i][0];
+        const size_t depth = prof.stacks[i].size();
+        const uintptr_t f1 = (uintptr_t)spin_registered;
+        const uintptr_t f2 = (uintptr_t)spin_unregistered;
+        const uintptr_t f = (pc >= std::max(f1, f2) ? std::max(f1, f2)
+                             : pc >= std::min(f1, f2) ? std::min(f1, f2) : 0);
+        if (f == 0 || pc >= f + 512) {
+            continue;
+        }
+        if (f == f1) {
+            max_registered_depth = std::max(max_registered_depth, depth);
+        } else {
+            max_unregistered_depth = std::max(max_unregistered_depth, depth);
+        }
+    }
+    // Callers are walked in the registered pthread only.
+    ASSERT_GE(max_registered_depth, 2u);
+    ASSERT_EQ(1u, max_unregistered_depth);
+}
+
+} // namespace
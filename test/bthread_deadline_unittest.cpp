@@ -0,0 +1,132 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdlib.h>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "bvar/variable.h"
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"
+#include "bthread/deadline_task_queue.h"
+
+namespace {
+
+TEST(DeadlineTest, queue_pops_earliest_deadline) {
+    bthread::DeadlineTaskQueue q;
+    bthread_t tid = 0;
+    int64_t deadline_us = 0;
+    ASSERT_FALSE(q.pop(&tid, &deadline_us));
+    const int64_t deadlines[] = { 30, 10, 50, 20, 40 };
+    for (size_t i = 0; i < arraysize(deadlines); ++i) {
+        q.push(deadlines[i] * 100, deadlines[i]);
+    }
+    ASSERT_EQ(arraysize(deadlines), q.size());
+    for (int64_t expected = 10; expected <= 50; expected += 10) {
+        ASSERT_TRUE(q.pop(&tid, &deadline_us));
+        ASSERT_EQ(expected, deadline_us);
+        ASSERT_EQ((bthread_t)expected * 100, tid);
+    }
+    ASSERT_EQ(0u, q.size());
+    ASSERT_FALSE(q.pop(&tid, &deadline_us));
+}
+
+void* get_deadline(void* arg) {
+    *static_cast<int64_t*>(arg) = bthread_self_deadline_us();
+    return NULL;
+}
+
+void* set_deadline(void* arg) {
+    EXPECT_EQ(-1, bthread_self_deadline_us());
+    EXPECT_EQ(0, bthread_set_self_deadline_us(12345));
+    EXPECT_EQ(12345, bthread_self_deadline_us());
+    EXPECT_EQ(0, bthread_set_self_deadline_us(-100));
+    EXPECT_EQ(-1, bthread_self_deadline_us());
+    return NULL;
+}
+
+TEST(DeadlineTest, self_deadline) {
+    ASSERT_EQ(-1, bthread_self_deadline_us());
+    ASSERT_EQ(EPERM, bthread_set_self_deadline_us(1));
+
+    const int64_t deadline_us = butil::gettimeofday_us() + 1000000L;
+    int64_t got = 0;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background_with_deadline(
+                  &th, NULL, get_deadline, &got, deadline_us));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(deadline_us, got);
+
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, get_deadline, &got));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(-1, got);
+
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, set_deadline, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+}
+
+int64_t get_expired_count() {
+    return atoll(bvar::Variable::describe_exposed(
+                     "bthread_expired_before_execution").c_str());
+}
+
+void* do_nothing(void*) {
+    return NULL;
+}
+
+struct StartArgs {
+    int n;
+    int64_t deadline_us;
+};
+
+void* start_with_deadline(void* void_args) {
+    StartArgs* args = static_cast<StartArgs*>(void_args);
+    std::vector<bthread_t> tids(args->n);
+    for (int i = 0; i < args->n; ++i) {
+        EXPECT_EQ(0, bthread_start_background_with_deadline(
+                      &tids[i], NULL, do_nothing, NULL, args->deadline_us));
+    }
+    for (int i = 0; i < args->n; ++i) {
+        EXPECT_EQ(0, bthread_join(tids[i], NULL));
+    }
+    return NULL;
+}
+
+TEST(DeadlineTest, expired_tasks_still_run) {
+    // Make sure the TaskControl and the bvar are created.
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, do_nothing, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+
+    const int N = 100;
+    const int64_t expired0 = get_expired_count();
+    // From both workers and non-workers.
+    StartArgs args = { N, 1 };
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, start_with_deadline,
+                                          &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    start_with_deadline(&args);
+    ASSERT_EQ(expired0 + 2 * N, get_expired_count());
+
+    StartArgs args2 = { N, butil::gettimeofday_us() + 10000000L };
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, start_with_deadline,
+                                          &args2));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    start_with_deadline(&args2);
+    ASSERT_EQ(expired0 + 2 * N, get_expired_count());
+}
+
+} // namespace
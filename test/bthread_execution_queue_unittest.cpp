@@ -15,9 +15,11 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <vector>
 #include <gtest/gtest.h>
 
 #include <bthread/execution_queue.h>
+#include <bthread/sharded_execution_queue.h>
 #include <bthread/sys_futex.h>
 #include <bthread/countdown_event.h>
 #include "butil/time.h"
@@ -708,4 +710,173 @@ TEST_F(ExecutionQueueTest, cancel_unexecuted_high_priority_task) {
 
     ASSERT_EQ(12345, result);
 }
+
+struct KeyedTask {
+    int key;
+    int seq;
+};
+
+struct KeyedState {
+    explicit KeyedState(int nkey)
+        : last_seq(nkey, 0), nexecuted(0), nstopped(0), nunordered(0) {}
+    // Only touched by the shard which the key belongs to.
+    std::vector<int> last_seq;
+    butil::atomic<int64_t> nexecuted;
+    butil::atomic<int> nstopped;
+    butil::atomic<int> nunordered;
+};
+
+int execute_keyed(void* meta, bthread::TaskIterator<KeyedTask>& iter) {
+    KeyedState* state = (KeyedState*)meta;
+    if (iter.is_queue_stopped()) {
+        state->nstopped.fetch_add(1);
+        return 0;
+    }
+    int64_t n = 0;
+    for (; iter; ++iter, ++n) {
+        if (iter->seq != state->last_seq[iter->key] + 1) {
+            state->nunordered.fetch_add(1);
+        }
+        state->last_seq[iter->key] = iter->seq;
+    }
+    state->nexecuted.fetch_add(n, butil::memory_order_relaxed);
+    return 0;
+}
+
+struct KeyedProducerArg {
+    bthread::ShardedExecutionQueue<KeyedTask>* sharded;
+    // Used when `sharded' is NULL, one queue for each key.
+    std::vector<bthread::ExecutionQueueId<KeyedTask> >* queues;
+    int index;
+    int nproducer;
+    int nkey;
+    int nseq;
+};
+
+void* produce_keyed_tasks(void* void_arg) {
+    KeyedProducerArg* arg = (KeyedProducerArg*)void_arg;
+    for (int seq = 1; seq <= arg->nseq; ++seq) {
+        // Each producer owns keys that key % nproducer == index.
+        for (int key = arg->index; key < arg->nkey; key += arg->nproducer) {
+            const KeyedTask task = { key, seq };
+            if (arg->sharded) {
+                EXPECT_EQ(0, arg->sharded->execute(key, task));
+            } else {
+                EXPECT_EQ(0, bthread::execution_queue_execute(
+                              (*arg->queues)[key], task));
+            }
+        }
+    }
+    return NULL;
+}
+
+// Returns microseconds to execute all tasks.
+int64_t run_keyed_tasks(bthread::ShardedExecutionQueue<KeyedTask>* sharded,
+                        std::vector<bthread::ExecutionQueueId<KeyedTask> >* queues,
+                        int nkey, int nseq) {
+    pthread_t threads[4];
+    KeyedProducerArg args[ARRAY_SIZE(threads)];
+    butil::Timer timer;
+    timer.start();
+    for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+        const KeyedProducerArg arg = { sharded, queues, (int)i,
+                                       (int)ARRAY_SIZE(threads), nkey, nseq };
+        args[i] = arg;
+        pthread_create(&threads[i], NULL, produce_keyed_tasks, &args[i]);
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    if (sharded) {
+        EXPECT_EQ(0, sharded->stop());
+        EXPECT_EQ(0, sharded->join());
+    } else {
+        for (size_t i = 0; i < queues->size(); ++i) {
+            EXPECT_EQ(0, bthread::execution_queue_stop((*queues)[i]));
+        }
+        for (size_t i = 0; i < queues->size(); ++i) {
+            EXPECT_EQ(0, bthread::execution_queue_join((*queues)[i]));
+        }
+    }
+    timer.stop();
+    return timer.u_elapsed();
+}
+
+TEST_F(ExecutionQueueTest, sharded_keeps_order_of_keys) {
+    const int NKEY = 64;
+    const int NSEQ = 500;
+    KeyedState state(NKEY);
+    bthread::ShardedExecutionQueue<KeyedTask> q;
+    bthread::ShardedExecutionQueueOptions options;
+    options.num_shards = 4;
+    ASSERT_EQ(0, q.start(&options, execute_keyed, &state));
+    ASSERT_EQ(4, q.num_shards());
+    ASSERT_EQ(EINVAL, q.start(&options, execute_keyed, &state));
+    run_keyed_tasks(&q, NULL, NKEY, NSEQ);
+    ASSERT_EQ((int64_t)NKEY * NSEQ, state.nexecuted.load());
+    ASSERT_EQ(0, state.nunordered.load());
+    // Called with the stop task once for all shards.
+    ASSERT_EQ(1, state.nstopped.load());
+    for (int i = 0; i < NKEY; ++i) {
+        ASSERT_EQ(NSEQ, state.last_seq[i]);
+    }
+    const KeyedTask task = { 0, NSEQ + 1 };
+    ASSERT_NE(0, q.execute(0, task));
+}
+
+TEST_F(ExecutionQueueTest, sharded_high_priority_task) {
+    g_should_be_urgent = false;
+    g_suspending = false;
+    urgent_times = 0;
+    int64_t result = 0;
+    bthread::ShardedExecutionQueue<LongIntTask> q;
+    bthread::ShardedExecutionQueueOptions options;
+    options.num_shards = 2;
+    ASSERT_EQ(0, q.start(&options, add_with_suspend, &result));
+    const uint64_t key = 10;
+    // Suspend the shard of `key'.
+    ASSERT_EQ(0, q.execute(key, -100));
+    while (!g_suspending) {
+        usleep(10);
+    }
+    ASSERT_EQ(0, q.execute(key, 1));
+    bthread::CountdownEvent event;
+    ASSERT_EQ(0, q.execute(key, LongIntTask(-1, &event),
+                           &bthread::TASK_OPTIONS_URGENT));
+    g_suspending = false;
+    event.wait();
+    ASSERT_EQ(0, q.stop());
+    ASSERT_EQ(0, q.join());
+    // The urgent task is executed before the normal one, see
+    // add_with_suspend().
+    ASSERT_EQ(1, urgent_times);
+    ASSERT_EQ(1, result);
+    ASSERT_TRUE(stopped);
+}
+
+TEST_F(ExecutionQueueTest, sharded_performance) {
+    const int NKEY = 1024;
+    const int NSEQ = 100;
+    KeyedState state(NKEY);
+    bthread::ShardedExecutionQueue<KeyedTask> q;
+    ASSERT_EQ(0, q.start(NULL, execute_keyed, &state));
+    const int64_t sharded_us = run_keyed_tasks(&q, NULL, NKEY, NSEQ);
+    ASSERT_EQ((int64_t)NKEY * NSEQ, state.nexecuted.load());
+    ASSERT_EQ(0, state.nunordered.load());
+
+    KeyedState state2(NKEY);
+    std::vector<bthread::ExecutionQueueId<KeyedTask> > queues(NKEY);
+    for (int i = 0; i < NKEY; ++i) {
+        ASSERT_EQ(0, bthread::execution_queue_start(&queues[i], NULL,
+                                                    execute_keyed, &state2));
+    }
+    const int64_t per_key_us = run_keyed_tasks(NULL, &queues, NKEY, NSEQ);
+    ASSERT_EQ((int64_t)NKEY * NSEQ, state2.nexecuted.load());
+    ASSERT_EQ(0, state2.nunordered.load());
+    ASSERT_EQ(NKEY, state2.nstopped.load());
+    LOG(INFO) << "Executing " << NKEY * NSEQ << " tasks of " << NKEY
+              << " keys takes " << sharded_us << "us with "
+              << q.num_shards() << " shards, " << per_key_us
+              << "us with one queue for each key";
+}
 } // namespace
@@ -25,8 +25,14 @@
 #include "bthread/butex.h"
 #include "bthread/task_control.h"
 #include "bthread/mutex.h"
+#include "bthread/contention_sampler.h"
+#include "bvar/variable.h"
 #include "butil/gperftools_profiler.h"
 
+namespace bthread {
+DECLARE_int32(bthread_contention_sampling_interval);
+}
+
 namespace {
 inline unsigned* get_butex(bthread_mutex_t & m) {
     return m.butex;
@@ -172,7 +178,7 @@ int g_prof_name_counter = 0;
 
 template <typename Mutex, typename ThreadId,
           typename ThreadCreateFn, typename ThreadJoinFn>
-void PerfTest(Mutex* mutex,
+double PerfTest(Mutex* mutex,
               ThreadId* /*dummy*/,
               int thread_num,
               const ThreadCreateFn& create_fn,
@@ -217,6 +223,7 @@ void PerfTest(Mutex* mutex,
               << " thread_num=" << thread_num
               << " count=" << count
               << " average_time=" << wait_time / (double)count;
+    return wait_time / (double)count;
 }
 
 TEST(MutexTest, performance) {
@@ -229,6 +236,171 @@ TEST(MutexTest, performance) {
     PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
 }
 
+void* lock_and_sleep(void* arg) {
+    bthread::Mutex* m = (bthread::Mutex*)arg;
+    while (!g_stopped) {
+        BAIDU_SCOPED_LOCK(*m);
+        bthread_usleep(100);
+    }
+    return NULL;
+}
+
+void* pthread_lock_and_sleep(void* arg) {
+    butil::Mutex* m = (butil::Mutex*)arg;
+    while (!g_stopped) {
+        BAIDU_SCOPED_LOCK(*m);
+        usleep(100);
+    }
+    return NULL;
+}
+
+int64_t get_var(const char* name) {
+    return atoll(bvar::Variable::describe_exposed(name).c_str());
+}
+
+TEST(MutexTest, sampled_contention) {
+    const int saved_interval = bthread::FLAGS_bthread_contention_sampling_interval;
+    bthread::FLAGS_bthread_contention_sampling_interval = 1;
+    const int64_t bthread_mutex_count0 =
+        get_var("bthread_contention_bthread_mutex_count");
+    const int64_t pthread_mutex_count0 =
+        get_var("bthread_contention_pthread_mutex_count");
+    g_stopped = false;
+    const int N = 4;
+    bthread::Mutex bth_mutex;
+    butil::Mutex base_mutex;
+    bthread_t bthreads[N];
+    pthread_t pthreads[N];
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_start_background(
+                      &bthreads[i], NULL, lock_and_sleep, &bth_mutex));
+        ASSERT_EQ(0, pthread_create(
+                      &pthreads[i], NULL, pthread_lock_and_sleep, &base_mutex));
+    }
+    // Countdowns set with the previous interval have to expire first.
+    for (int i = 0; i < 500; ++i) {
+        usleep(10000);
+        if (get_var("bthread_contention_bthread_mutex_count") >
+            bthread_mutex_count0 &&
+            get_var("bthread_contention_pthread_mutex_count") >
+            pthread_mutex_count0) {
+            break;
+        }
+    }
+    g_stopped = true;
+    for (int i = 0; i < N; ++i) {
+        bthread_join(bthreads[i], NULL);
+        pthread_join(pthreads[i], NULL);
+    }
+    bthread::FLAGS_bthread_contention_sampling_interval = saved_interval;
+    ASSERT_GT(get_var("bthread_contention_bthread_mutex_count"),
+              bthread_mutex_count0);
+    ASSERT_GT(get_var("bthread_contention_pthread_mutex_count"),
+              pthread_mutex_count0);
+    ASSERT_GT(get_var("bthread_contention_pthread_mutex_wait_us"), 0);
+    const std::string top_sites =
+        bvar::Variable::describe_exposed("bthread_contention_top_sites");
+    ASSERT_NE(std::string::npos, top_sites.find("bthread_mutex wait_us="))
+        << top_sites;
+    ASSERT_NE(std::string::npos, top_sites.find("pthread_mutex wait_us="))
+        << top_sites;
+
+    std::string prof;
+    bthread::dump_sampled_contentions(&prof);
+    ASSERT_EQ(0UL, prof.find("--- contention\ncycles/second=1000000000\n"));
+    ASSERT_NE(std::string::npos, prof.find(" @ 0x")) << prof;
+}
+
+const int64_t KNOWN_WAIT_US = 2000;
+
+struct KnownWaitArgs {
+    bthread::Mutex mutex;
+    butil::atomic<bool> held;
+    int nround;
+};
+
+// Hold the mutex for KNOWN_WAIT_US in each round, the waiter is blocked
+// meanwhile. The holder itself never waits.
+void* hold_mutex_for_known_time(void* arg) {
+    KnownWaitArgs* a = (KnownWaitArgs*)arg;
+    for (int i = 0; i < a->nround; ++i) {
+        a->mutex.lock();
+        a->held.store(true);
+        usleep(KNOWN_WAIT_US);
+        a->mutex.unlock();
+        while (a->held.load()) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void* wait_mutex_for_known_time(void* arg) {
+    KnownWaitArgs* a = (KnownWaitArgs*)arg;
+    for (int i = 0; i < a->nround; ++i) {
+        while (!a->held.load()) {
+            sched_yield();
+        }
+        a->mutex.lock();
+        a->mutex.unlock();
+        a->held.store(false);
+    }
+    return NULL;
+}
+
+TEST(MutexTest, sampled_contention_wait_time) {
+    // One of 8 contentions is sampled, the estimated waiting time should
+    // still be close to the real one.
+    const int saved_interval = bthread::FLAGS_bthread_contention_sampling_interval;
+    bthread::FLAGS_bthread_contention_sampling_interval = 8;
+    const int64_t count0 = get_var("bthread_contention_bthread_mutex_count");
+    const int64_t wait_us0 = get_var("bthread_contention_bthread_mutex_wait_us");
+    KnownWaitArgs args;
+    args.held.store(false);
+    args.nround = 200;
+    // Countdowns of new threads are not set with the previous interval.
+    pthread_t holder;
+    pthread_t waiter;
+    ASSERT_EQ(0, pthread_create(&holder, NULL, hold_mutex_for_known_time, &args));
+    ASSERT_EQ(0, pthread_create(&waiter, NULL, wait_mutex_for_known_time, &args));
+    pthread_join(holder, NULL);
+    pthread_join(waiter, NULL);
+    bthread::FLAGS_bthread_contention_sampling_interval = saved_interval;
+
+    const int64_t count = get_var("bthread_contention_bthread_mutex_count") - count0;
+    const int64_t wait_us =
+        get_var("bthread_contention_bthread_mutex_wait_us") - wait_us0;
+    const int64_t real_wait_us = args.nround * KNOWN_WAIT_US;
+    LOG(INFO) << "Estimated count=" << count << " wait_us=" << wait_us
+              << ", real count=" << args.nround << " wait_us=" << real_wait_us;
+    ASSERT_GT(count, 0);
+    ASSERT_GT(wait_us, real_wait_us / 4);
+    ASSERT_LT(wait_us, real_wait_us * 4);
+    // Each contention waits a little less than KNOWN_WAIT_US.
+    ASSERT_GT(wait_us / count, KNOWN_WAIT_US / 4);
+}
+
+TEST(MutexTest, contention_sampling_overhead) {
+    const int thread_num = 12;
+    butil::Mutex base_mutex;
+    bthread::Mutex bth_mutex;
+    const int saved_interval = bthread::FLAGS_bthread_contention_sampling_interval;
+    bthread::FLAGS_bthread_contention_sampling_interval = 0;
+    const double base_off =
+        PerfTest(&base_mutex, (pthread_t*)NULL, thread_num, pthread_create, pthread_join);
+    const double bth_off =
+        PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
+    bthread::FLAGS_bthread_contention_sampling_interval = 1000;
+    const double base_on =
+        PerfTest(&base_mutex, (pthread_t*)NULL, thread_num, pthread_create, pthread_join);
+    const double bth_on =
+        PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
+    bthread::FLAGS_bthread_contention_sampling_interval = saved_interval;
+    LOG(INFO) << "Sampling contentions changes average time of butil::Mutex by "
+              << (base_on / base_off - 1) * 100 << "% and bthread::Mutex by "
+              << (bth_on / bth_off - 1) * 100 << '%';
+}
+
 void* loop_until_stopped(void* arg) {
     bthread::Mutex *m = (bthread::Mutex*)arg;
     while (!g_stopped) {
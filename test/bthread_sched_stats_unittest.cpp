@@ -0,0 +1,205 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdlib.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "bvar/variable.h"
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"
+#include "bthread/cpu_account.h"
+
+DECLARE_int32(bthread_worker_spin_max_us);
+DECLARE_int32(bthread_max_spinning_workers);
+
+namespace bthread {
+DECLARE_bool(show_bthread_runqueue_wait_in_vars);
+void print_sched_stats(std::ostream& os);
+}
+
+namespace {
+
+void spin_for(int64_t us) {
+    const int64_t end_us = butil::cpuwide_time_us() + us;
+    while (butil::cpuwide_time_us() < end_us) {}
+}
+
+void* spin(void* arg) {
+    spin_for((intptr_t)arg);
+    return NULL;
+}
+
+// Accounts are never destroyed, tests compare values before and after
+// running bthreads so that they do not depend on each other.
+TEST(SchedStatsTest, account_cpu_by_attr) {
+    bthread_cpu_account_t* account = bthread_cpu_account_get("test_by_attr");
+    ASSERT_TRUE(account != NULL);
+    ASSERT_EQ(account, bthread_cpu_account_get("test_by_attr"));
+    ASSERT_TRUE(bvar::Variable::describe_exposed(
+                    "bthread_cpu_usage_test_by_attr") != "");
+    const int64_t nattach0 = account->nattach.get_value();
+    const int64_t cputime0 = account->cputime_ns.get_value();
+
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.cpu_account = account;
+    bthread_t th[2];
+    butil::Timer tm;
+    tm.start();
+    ASSERT_EQ(0, bthread_start_background(&th[0], &attr, spin, (void*)50000));
+    // Not accounted.
+    ASSERT_EQ(0, bthread_start_background(&th[1], NULL, spin, (void*)50000));
+    ASSERT_EQ(0, bthread_join(th[0], NULL));
+    ASSERT_EQ(0, bthread_join(th[1], NULL));
+    tm.stop();
+    ASSERT_EQ(1, account->nattach.get_value() - nattach0);
+    const int64_t cputime = account->cputime_ns.get_value() - cputime0;
+    ASSERT_GE(cputime, 50000000L);
+    // Time of the other bthread is not charged, no matter whether the two
+    // bthreads run in parallel.
+    ASSERT_LE(cputime, tm.n_elapsed());
+}
+
+struct SpinWithAccountArgs {
+    bthread_cpu_account_t* account;
+    int64_t accounted_ns;
+};
+
+void* spin_with_account(void* arg) {
+    SpinWithAccountArgs* args = static_cast<SpinWithAccountArgs*>(arg);
+    spin_for(30000);
+    butil::Timer tm;
+    tm.start();
+    const int64_t cputime0 = args->account->cputime_ns.get_value();
+    EXPECT_TRUE(bthread_self_cpu_account() == NULL);
+    EXPECT_EQ(0, bthread_set_self_cpu_account(args->account));
+    EXPECT_EQ(args->account, bthread_self_cpu_account());
+    // Nothing is charged to the account in advance.
+    EXPECT_EQ(cputime0, args->account->cputime_ns.get_value());
+    spin_for(30000);
+    EXPECT_EQ(0, bthread_set_self_cpu_account(NULL));
+    EXPECT_TRUE(bthread_self_cpu_account() == NULL);
+    tm.stop();
+    args->accounted_ns = tm.n_elapsed();
+    spin_for(30000);
+    return NULL;
+}
+
+TEST(SchedStatsTest, account_cpu_of_self) {
+    bthread_cpu_account_t* account = bthread_cpu_account_get("test_of_self");
+    ASSERT_EQ(EPERM, bthread_set_self_cpu_account(account));
+    ASSERT_TRUE(bthread_self_cpu_account() == NULL);
+    const int64_t nattach0 = account->nattach.get_value();
+    const int64_t cputime0 = account->cputime_ns.get_value();
+    SpinWithAccountArgs args = { account, 0 };
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, spin_with_account,
+                                          &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(1, account->nattach.get_value() - nattach0);
+    // Only the middle part is accounted.
+    const int64_t cputime = account->cputime_ns.get_value() - cputime0;
+    ASSERT_GE(cputime, 30000000L);
+    ASSERT_LE(cputime, args.accounted_ns + 1000000L);
+}
+
+void* do_nothing(void*) {
+    return NULL;
+}
+
+TEST(SchedStatsTest, runqueue_wait_and_steals) {
+    ASSERT_TRUE(bthread_cpu_account_get("test_sched_stats") != NULL);
+    bthread::FLAGS_show_bthread_runqueue_wait_in_vars = true;
+    const int N = 1000;
+    std::vector<bthread_t> th(N);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, do_nothing, NULL));
+    }
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    bthread::FLAGS_show_bthread_runqueue_wait_in_vars = false;
+    ASSERT_TRUE(bvar::Variable::describe_exposed(
+                    "bthread_runqueue_wait_count") != "");
+    ASSERT_TRUE(bvar::Variable::describe_exposed(
+                    "bthread_steal_second") != "");
+
+    std::ostringstream os;
+    bthread::print_sched_stats(os);
+    ASSERT_NE(std::string::npos, os.str().find("runqueue_wait_us: avg="))
+        << os.str();
+    ASSERT_NE(std::string::npos, os.str().find("test_sched_stats"))
+        << os.str();
+}
+
+
+int64_t get_var(const char* name) {
+    return atoll(bvar::Variable::describe_exposed(name).c_str());
+}
+
+void* start_tasks_periodically(void* arg) {
+    const int n = (intptr_t)arg;
+    for (int i = 0; i < n; ++i) {
+        bthread_t th;
+        EXPECT_EQ(0, bthread_start_background(&th, NULL, do_nothing, NULL));
+        bthread_usleep(100);
+    }
+    return NULL;
+}
+
+TEST(SchedStatsTest, spin_before_parking) {
+    // Make sure the TaskControl is created.
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, do_nothing, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    const int64_t nspin0 = get_var("bthread_worker_spin_count");
+    const int32_t saved_spin_max_us = FLAGS_bthread_worker_spin_max_us;
+    const int32_t saved_max_spinning_workers =
+        FLAGS_bthread_max_spinning_workers;
+
+    FLAGS_bthread_worker_spin_max_us = 2000;
+    FLAGS_bthread_max_spinning_workers = 1;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, start_tasks_periodically,
+                                          (void*)1000));
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_LE(get_var("bthread_spinning_worker_count"), 1);
+        usleep(1000);
+    }
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    const int64_t nspin1 = get_var("bthread_worker_spin_count");
+    ASSERT_GT(nspin1, nspin0);
+    LOG(INFO) << "spin=" << nspin1 - nspin0 << " success="
+              << get_var("bthread_worker_spin_success_count");
+
+    // Not spinning when disabled.
+    FLAGS_bthread_max_spinning_workers = 0;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, start_tasks_periodically,
+                                          (void*)100));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, get_var("bthread_spinning_worker_count"));
+    const int64_t nspin2 = get_var("bthread_worker_spin_count");
+    FLAGS_bthread_worker_spin_max_us = 0;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, start_tasks_periodically,
+                                          (void*)100));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    // Workers spinning before the flag is cleared may have ended.
+    ASSERT_LE(get_var("bthread_worker_spin_count") - nspin2, 1);
+    FLAGS_bthread_worker_spin_max_us = saved_spin_max_us;
+    FLAGS_bthread_max_spinning_workers = saved_max_spinning_workers;
+}
+} // namespace
@@ -0,0 +1,124 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <gtest/gtest.h>
+#include "bvar/variable.h"
+#include "bthread/bthread.h"
+#include "bthread/stack.h"
+
+DECLARE_int32(stack_trim_watermark);
+DECLARE_int32(max_cached_stack_normal);
+DECLARE_int32(stack_size_normal);
+
+namespace {
+
+int64_t get_var(const char* name) {
+    return atoll(bvar::Variable::describe_exposed(name).c_str());
+}
+
+TEST(StackTest, trim_deep_stack) {
+    const int STACK_SIZE = 1024 * 1024;
+    const int DEPTH = 512 * 1024;
+    bthread::StackStorage s;
+    ASSERT_EQ(0, bthread::allocate_stack_storage(&s, STACK_SIZE, 4096));
+    const int64_t reserved = get_var("bthread_stack_reserved_bytes");
+    ASSERT_GE(reserved, STACK_SIZE + 4096);
+    const int64_t committed0 = get_var("bthread_stack_committed_bytes");
+    // Touch pages like a deep call stack.
+    memset((char*)s.bottom - DEPTH, 1, DEPTH);
+    const int64_t committed1 = get_var("bthread_stack_committed_bytes");
+    ASSERT_GE(committed1 - committed0, DEPTH);
+
+    // Disabled by default.
+    ASSERT_EQ(0, bthread::trim_stack_storage(&s, NULL));
+    FLAGS_stack_trim_watermark = 64 * 1024;
+    // Pages above sp are kept.
+    ASSERT_EQ(STACK_SIZE - DEPTH / 2 - 4096,
+              bthread::trim_stack_storage(&s, (char*)s.bottom - DEPTH / 2));
+    memset((char*)s.bottom - DEPTH, 1, DEPTH);
+    ASSERT_EQ(STACK_SIZE - 64 * 1024, bthread::trim_stack_storage(&s, NULL));
+    const int64_t committed2 = get_var("bthread_stack_committed_bytes");
+    ASSERT_LE(committed2 - committed0, 64 * 1024);
+    // Untouched since the last trim.
+    ASSERT_EQ(0, bthread::trim_stack_storage(&s, NULL));
+    FLAGS_stack_trim_watermark = 0;
+
+    bthread::deallocate_stack_storage(&s);
+    ASSERT_EQ(reserved - STACK_SIZE - 4096,
+              get_var("bthread_stack_reserved_bytes"));
+}
+
+void dummy_entry(intptr_t) {}
+
+TEST(StackTest, limit_cached_stacks) {
+    typedef bthread::StackFactory<bthread::NormalStackClass> Factory;
+    const int N = 8;
+    bthread::ContextualStack* stacks[N];
+    for (int i = 0; i < N; ++i) {
+        stacks[i] = Factory::get_stack(dummy_entry);
+        ASSERT_TRUE(stacks[i] != NULL);
+        ASSERT_TRUE(stacks[i]->context != NULL);
+    }
+    const int64_t reserved = get_var("bthread_stack_reserved_bytes");
+    const int64_t ncached0 = bthread::NormalStackClass::ncached.load(butil::memory_order_relaxed);
+    FLAGS_max_cached_stack_normal = ncached0 + 2;
+    for (int i = 0; i < N; ++i) {
+        Factory::return_stack(stacks[i]);
+    }
+    ASSERT_EQ(ncached0 + 2, bthread::NormalStackClass::ncached.load(butil::memory_order_relaxed));
+    ASSERT_LT(get_var("bthread_stack_reserved_bytes"),
+              reserved - (N - 3) * FLAGS_stack_size_normal);
+
+    // Released storages are allocated again.
+    for (int i = 0; i < N; ++i) {
+        stacks[i] = Factory::get_stack(dummy_entry);
+        ASSERT_TRUE(stacks[i] != NULL);
+        ASSERT_TRUE(stacks[i]->context != NULL);
+        ASSERT_EQ(bthread::STACK_TYPE_NORMAL, stacks[i]->stacktype);
+    }
+    ASSERT_EQ(reserved, get_var("bthread_stack_reserved_bytes"));
+    FLAGS_max_cached_stack_normal = 0;
+    for (int i = 0; i < N; ++i) {
+        Factory::return_stack(stacks[i]);
+    }
+}
+
+void* run_deep(void*) {
+    char buf[256 * 1024];
+    char* volatile p = buf;
+    memset(p, 1, sizeof(buf));
+    return (void*)(intptr_t)p[sizeof(buf) / 2];
+}
+
+TEST(StackTest, trim_stacks_of_bthreads) {
+    FLAGS_stack_trim_watermark = 64 * 1024;
+    const int N = 16;
+    bthread_t th[N];
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, run_deep, NULL));
+    }
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    ASSERT_LT(get_var("bthread_stack_committed_bytes"),
+              get_var("bthread_stack_count") * 128 * 1024);
+    FLAGS_stack_trim_watermark = 0;
+}
+
+} // namespace
@@ -0,0 +1,193 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/butex.h"
+
+DECLARE_int32(task_group_ntags);
+
+namespace {
+
+const int NTAGS = 3;
+
+class BthreadTagTest : public ::testing::Test {
+protected:
+    BthreadTagTest() {
+        // Must be set before any bthread is created.
+        FLAGS_task_group_ntags = NTAGS;
+    }
+};
+
+struct TagArgs {
+    bthread_tag_t tag_at_start;
+    bthread_tag_t tag_of_child;
+    bthread_tag_t tag_after_sleep;
+    bthread_tag_t child_tag;
+};
+
+void* record_tag(void* arg) {
+    *static_cast<bthread_tag_t*>(arg) = bthread_self_tag();
+    return NULL;
+}
+
+void* check_tag(void* arg) {
+    TagArgs* a = static_cast<TagArgs*>(arg);
+    a->tag_at_start = bthread_self_tag();
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = a->child_tag;
+    bthread_t th;
+    EXPECT_EQ(0, bthread_start_urgent(&th, &attr, record_tag,
+                                      &a->tag_of_child));
+    EXPECT_EQ(0, bthread_join(th, NULL));
+    bthread_usleep(1000);
+    a->tag_after_sleep = bthread_self_tag();
+    return NULL;
+}
+
+TEST_F(BthreadTagTest, run_in_pool_of_tag) {
+    ASSERT_EQ(BTHREAD_TAG_INVALID, bthread_self_tag());
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = NTAGS;
+    bthread_t th;
+    ASSERT_EQ(EINVAL, bthread_start_background(&th, &attr, check_tag, NULL));
+    for (int i = 0; i < NTAGS; ++i) {
+        ASSERT_LE(1, bthread_getconcurrency_by_tag(i));
+    }
+    ASSERT_EQ(0, bthread_getconcurrency_by_tag(NTAGS));
+
+    // Tag of the child is inherited from the parent if it's not set.
+    TagArgs args[NTAGS * 2];
+    bthread_t tids[NTAGS * 2];
+    for (int i = 0; i < NTAGS * 2; ++i) {
+        args[i].tag_at_start = BTHREAD_TAG_INVALID;
+        args[i].tag_of_child = BTHREAD_TAG_INVALID;
+        args[i].tag_after_sleep = BTHREAD_TAG_INVALID;
+        args[i].child_tag = (i < NTAGS ? BTHREAD_TAG_INVALID
+                             : (i + 1) % NTAGS);
+        attr.tag = i % NTAGS;
+        ASSERT_EQ(0, bthread_start_background(&tids[i], &attr,
+                                              check_tag, &args[i]));
+    }
+    for (int i = 0; i < NTAGS * 2; ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+        ASSERT_EQ(i % NTAGS, args[i].tag_at_start);
+        ASSERT_EQ(i % NTAGS, args[i].tag_after_sleep);
+        if (i < NTAGS) {
+            ASSERT_EQ(i % NTAGS, args[i].tag_of_child);
+        } else {
+            ASSERT_EQ((i + 1) % NTAGS, args[i].tag_of_child);
+        }
+    }
+}
+
+struct WaiterArgs {
+    butil::atomic<int>* butex;
+    bthread_tag_t tag_after_wait;
+};
+
+void* wait_butex(void* arg) {
+    WaiterArgs* a = static_cast<WaiterArgs*>(arg);
+    while (a->butex->load() == 0) {
+        bthread::butex_wait(a->butex, 0, NULL);
+    }
+    a->tag_after_wait = bthread_self_tag();
+    return NULL;
+}
+
+void* wake_butex(void* arg) {
+    butil::atomic<int>* b = static_cast<butil::atomic<int>*>(arg);
+    b->store(1);
+    bthread::butex_wake_all(b);
+    return NULL;
+}
+
+TEST_F(BthreadTagTest, woken_up_in_pool_of_tag) {
+    butil::atomic<int>* b = bthread::butex_create_checked<butil::atomic<int> >();
+    b->store(0);
+    const int N = 8;
+    WaiterArgs args[N];
+    bthread_t tids[N];
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    for (int i = 0; i < N; ++i) {
+        args[i].butex = b;
+        args[i].tag_after_wait = BTHREAD_TAG_INVALID;
+        attr.tag = i % 2;
+        ASSERT_EQ(0, bthread_start_background(&tids[i], &attr,
+                                              wait_butex, &args[i]));
+    }
+    usleep(10000);
+    // Waiters are woken up by a bthread in another pool.
+    attr.tag = 2;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, &attr, wake_butex, b));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+        ASSERT_EQ(i % 2, args[i].tag_after_wait);
+    }
+    bthread::butex_destroy(b);
+}
+
+butil::atomic<bool> g_stop_hogs(false);
+
+void* hog_cpu(void*) {
+    while (!g_stop_hogs.load(butil::memory_order_relaxed)) {}
+    return NULL;
+}
+
+void* noop(void*) {
+    return NULL;
+}
+
+TEST_F(BthreadTagTest, isolated_from_busy_pool) {
+    // Occupy all workers of tag 1, bthreads of tag 0 are still scheduled.
+    const int nhog = bthread_getconcurrency_by_tag(1) * 2;
+    std::vector<bthread_t> hogs(nhog);
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = 1;
+    for (int i = 0; i < nhog; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&hogs[i], &attr, hog_cpu, NULL));
+    }
+    attr.tag = 0;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < 100; ++i) {
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, &attr, noop, NULL));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+    }
+    tm.stop();
+    g_stop_hogs = true;
+    for (int i = 0; i < nhog; ++i) {
+        ASSERT_EQ(0, bthread_join(hogs[i], NULL));
+    }
+    ASSERT_LT(tm.m_elapsed(), 1000);
+
+    // The pool can be enlarged separately.
+    const int nworker = bthread_getconcurrency_by_tag(2);
+    ASSERT_EQ(0, bthread_setconcurrency_by_tag(nworker + 1, 2));
+    ASSERT_EQ(nworker + 1, bthread_getconcurrency_by_tag(2));
+    ASSERT_EQ(EPERM, bthread_setconcurrency_by_tag(nworker, 2));
+    ASSERT_EQ(EINVAL, bthread_setconcurrency_by_tag(1, NTAGS));
+}
+
+} // namespace
@@ -20,6 +20,8 @@
 #include "bthread/sys_futex.h"
 #include "bthread/timer_thread.h"
 #include "bthread/bthread.h"
+#include "butil/atomicops.h"
+#include "butil/fast_rand.h"
 #include "butil/logging.h"
 
 namespace {
@@ -254,4 +256,121 @@ TEST(TimerThreadTest, schedule_and_unschedule_in_task) {
     keeper5.expect_first_run();
 }
 
+struct OrderedTask {
+    int64_t expected_us;
+    int64_t run_us;
+
+    static void routine(void* arg) {
+        OrderedTask* t = (OrderedTask*)arg;
+        t->run_us = butil::gettimeofday_us();
+    }
+};
+
+// Tasks spread over multiple levels of the timing wheel run neither early
+// nor much late.
+TEST(TimerThreadTest, run_tasks_at_different_distances) {
+    bthread::TimerThread timer_thread;
+    bthread::TimerThreadOptions options;
+    options.num_threads = 2;
+    ASSERT_EQ(0, timer_thread.start(&options));
+    const int N = 300;
+    std::vector<OrderedTask> tasks(N);
+    const int64_t start_us = butil::gettimeofday_us();
+    for (int i = 0; i < N; ++i) {
+        // The wheel has 256 slots of 1ms at the lowest level.
+        tasks[i].expected_us = start_us + butil::fast_rand_less_than(1500000);
+        tasks[i].run_us = 0;
+        ASSERT_NE(bthread::TimerThread::INVALID_TASK_ID, timer_thread.schedule(
+                      OrderedTask::routine, &tasks[i],
+                      butil::microseconds_to_timespec(tasks[i].expected_us)));
+    }
+    usleep(1600000);
+    timer_thread.stop_and_join();
+    for (int i = 0; i < N; ++i) {
+        ASSERT_GE(tasks[i].run_us, tasks[i].expected_us);
+        ASSERT_LE(tasks[i].run_us - tasks[i].expected_us, 50000);
+    }
+}
+
+butil::atomic<int> g_ntriggered(0);
+
+void count_trigger(void*) {
+    g_ntriggered.fetch_add(1, butil::memory_order_relaxed);
+}
+
+struct ScheduleArgs {
+    bthread::TimerThread* timer_thread;
+    int ntask;
+    int nkept;
+    int64_t elapsed_ns;
+};
+
+// Like RPC timeouts: schedule tasks in next seconds and unschedule most of
+// them shortly.
+void* schedule_and_unschedule(void* void_arg) {
+    ScheduleArgs* args = (ScheduleArgs*)void_arg;
+    std::vector<bthread::TimerThread::TaskId> ids;
+    ids.reserve(100);
+    args->nkept = 0;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < args->ntask; ++i) {
+        const timespec abstime = butil::milliseconds_from_now(500 + i % 1000);
+        ids.push_back(args->timer_thread->schedule(count_trigger, NULL, abstime));
+        if (ids.size() == 100) {
+            // Keep one of every 100 tasks.
+            for (size_t j = 1; j < ids.size(); ++j) {
+                EXPECT_EQ(0, args->timer_thread->unschedule(ids[j]));
+            }
+            ++args->nkept;
+            ids.clear();
+        }
+    }
+    tm.stop();
+    args->nkept += ids.size();
+    args->elapsed_ns = tm.n_elapsed();
+    return NULL;
+}
+
+TEST(TimerThreadTest, mostly_unscheduled_tasks_perf) {
+    bthread::TimerThread timer_thread;
+    bthread::TimerThreadOptions options;
+    options.num_threads = 2;
+    ASSERT_EQ(0, timer_thread.start(&options));
+    const int NTHREAD = 4;
+    const int NTASK = 500000;
+    pthread_t th[NTHREAD];
+    ScheduleArgs args[NTHREAD];
+    g_ntriggered.store(0);
+    for (int i = 0; i < NTHREAD; ++i) {
+        args[i].timer_thread = &timer_thread;
+        args[i].ntask = NTASK;
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, schedule_and_unschedule,
+                                    &args[i]));
+    }
+    int nkept = 0;
+    int64_t elapsed_ns = 0;
+    for (int i = 0; i < NTHREAD; ++i) {
+        pthread_join(th[i], NULL);
+        nkept += args[i].nkept;
+        elapsed_ns += args[i].elapsed_ns;
+    }
+    LOG(INFO) << "schedule+unschedule " << NTHREAD * NTASK << " tasks in "
+              << NTHREAD << " threads: " << elapsed_ns / (NTHREAD * NTASK)
+              << "ns per task";
+    // All kept tasks run within 1.5s
+    for (int i = 0; i < 40 && g_ntriggered.load() != nkept; ++i) {
+        usleep(100000);
+    }
+    ASSERT_EQ(nkept, g_ntriggered.load());
+    timer_thread.stop_and_join();
+}
+
+TEST(TimerThreadTest, invalid_options) {
+    bthread::TimerThread timer_thread;
+    bthread::TimerThreadOptions options;
+    options.num_threads = 0;
+    ASSERT_EQ(EINVAL, timer_thread.start(&options));
+}
+
 } // end namespace
@@ -0,0 +1,329 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <map>
+#include <gtest/gtest.h>
+#include "butil/files/scoped_temp_dir.h"
+#include "butil/time.h"
+#include "bvar/bvar.h"
+#include "bvar/detail/dump_ring.h"
+
+namespace {
+
+typedef bvar::detail::DumpRingReader::Frame Frame;
+
+class DumpRingTest : public testing::Test {
+protected:
+    void SetUp() {
+        ASSERT_TRUE(_dir.CreateUniqueTempDir());
+        _path = _dir.path().Append("bvar.ring").value();
+    }
+
+    butil::ScopedTempDir _dir;
+    std::string _path;
+};
+
+bvar::NumericValue int_value(int64_t v) {
+    bvar::NumericValue value;
+    value.type = bvar::NumericValue::TYPE_INT64;
+    value.i64 = v;
+    return value;
+}
+
+bvar::NumericValue double_value(double v) {
+    bvar::NumericValue value;
+    value.type = bvar::NumericValue::TYPE_DOUBLE;
+    value.f64 = v;
+    return value;
+}
+
+TEST_F(DumpRingTest, write_and_read) {
+    bvar::detail::DumpRingOptions options;
+    options.max_frames = 4;
+    options.max_records = 3;
+    options.names_capacity = 64;
+    options.interval_s = 1;
+    options.app = "dump_ring_test";
+    bvar::detail::DumpRingWriter writer;
+    ASSERT_EQ(0, writer.open(_path, options));
+    for (int i = 0; i < 6; ++i) {
+        writer.begin_frame(1000 + i);
+        ASSERT_TRUE(writer.dump("foo_count", int_value(i)));
+        ASSERT_TRUE(writer.dump("bar_qps", double_value(i * 0.5)));
+        if (i >= 3) {
+            ASSERT_TRUE(writer.dump("baz", int_value(-i)));
+            // The frame is full.
+            ASSERT_TRUE(writer.dump("qux", int_value(i)));
+        }
+        writer.end_frame();
+    }
+
+    bvar::detail::DumpRingReader reader;
+    ASSERT_EQ(0, reader.open(_path));
+    ASSERT_STREQ("dump_ring_test", reader.header().app);
+    ASSERT_EQ(1, reader.header().interval_s);
+    std::vector<std::string> names;
+    reader.get_names(&names);
+    ASSERT_EQ(3u, names.size());
+    ASSERT_EQ("foo_count", names[0]);
+    ASSERT_EQ("bar_qps", names[1]);
+    ASSERT_EQ("baz", names[2]);
+
+    std::vector<Frame> frames;
+    reader.get_frames(&frames);
+    ASSERT_EQ(4u, frames.size());
+    for (int i = 2; i < 6; ++i) {
+        const Frame& f = frames[i - 2];
+        ASSERT_EQ(1000 + i, f.time_us);
+        ASSERT_EQ((uint64_t)i + 1, f.seq);
+        ASSERT_EQ(i >= 3 ? 3u : 2u, f.records.size());
+        ASSERT_EQ(i >= 3 ? 1u : 0u, f.ndropped);
+        ASSERT_EQ(0u, f.records[0].name_id);
+        ASSERT_EQ(bvar::NumericValue::TYPE_INT64, f.records[0].value.type);
+        ASSERT_EQ(i, f.records[0].value.i64);
+        ASSERT_EQ(1u, f.records[1].name_id);
+        ASSERT_EQ(bvar::NumericValue::TYPE_DOUBLE, f.records[1].value.type);
+        ASSERT_EQ(i * 0.5, f.records[1].value.f64);
+        if (i >= 3) {
+            ASSERT_EQ(2u, f.records[2].name_id);
+            ASSERT_EQ(-i, f.records[2].value.i64);
+        }
+    }
+
+    // Names are full.
+    writer.begin_frame(2000);
+    ASSERT_TRUE(writer.dump("a_very_long_name_which_does_not_fit_in_names",
+                            int_value(1)));
+    writer.end_frame();
+    reader.get_names(&names);
+    ASSERT_EQ(3u, names.size());
+    reader.get_frames(&frames);
+    ASSERT_EQ(4u, frames.size());
+    ASSERT_EQ(2000, frames.back().time_us);
+    ASSERT_EQ(0u, frames.back().records.size());
+    ASSERT_EQ(1u, frames.back().ndropped);
+}
+
+TEST_F(DumpRingTest, incomplete_frame_is_skipped) {
+    bvar::detail::DumpRingOptions options;
+    options.max_frames = 3;
+    options.max_records = 4;
+    bvar::detail::DumpRingWriter writer;
+    ASSERT_EQ(0, writer.open(_path, options));
+    for (int i = 0; i < 3; ++i) {
+        writer.begin_frame(i);
+        writer.dump("x", int_value(i));
+        writer.end_frame();
+    }
+    // Crashed during writing, which overwrites the oldest frame.
+    writer.begin_frame(3);
+    writer.dump("x", int_value(3));
+
+    bvar::detail::DumpRingReader reader;
+    ASSERT_EQ(0, reader.open(_path));
+    std::vector<Frame> frames;
+    reader.get_frames(&frames);
+    ASSERT_EQ(2u, frames.size());
+    ASSERT_EQ(1, frames[0].time_us);
+    ASSERT_EQ(2, frames[1].time_us);
+    writer.end_frame();
+    reader.get_frames(&frames);
+    ASSERT_EQ(3u, frames.size());
+    ASSERT_EQ(3, frames[2].time_us);
+}
+
+TEST_F(DumpRingTest, previous_file_is_kept) {
+    bvar::detail::DumpRingOptions options;
+    options.max_frames = 2;
+    options.max_records = 2;
+    bvar::detail::DumpRingWriter writer;
+    ASSERT_EQ(0, writer.open(_path, options));
+    writer.begin_frame(1);
+    writer.dump("x", int_value(1));
+    writer.end_frame();
+    writer.close();
+
+    // Like restarting after crash.
+    ASSERT_EQ(0, writer.open(_path, options));
+    bvar::detail::DumpRingReader reader;
+    ASSERT_EQ(0, reader.open(_path));
+    std::vector<Frame> frames;
+    reader.get_frames(&frames);
+    ASSERT_TRUE(frames.empty());
+    ASSERT_EQ(0, reader.open(_path + ".prev"));
+    reader.get_frames(&frames);
+    ASSERT_EQ(1u, frames.size());
+    ASSERT_EQ(1, frames[0].records[0].value.i64);
+
+    ASSERT_EQ(-1, reader.open(_dir.path().Append("not_exist").value()));
+}
+
+class CollectNumerics : public bvar::NumericDumper {
+public:
+    bool dump(const std::string& name,
+              const bvar::NumericValue& value) override {
+        values[name] = value;
+        return true;
+    }
+    std::map<std::string, bvar::NumericValue> values;
+};
+
+class CollectAll : public CollectNumerics, public bvar::Dumper {
+public:
+    using CollectNumerics::dump;
+    bool dump(const std::string& name,
+              const butil::StringPiece& desc) override {
+        descs[name] = desc.as_string();
+        return true;
+    }
+    bvar::Dumper* non_numeric_dumper() override { return this; }
+    std::map<std::string, std::string> descs;
+};
+
+int get_ten(void*) { return 10; }
+
+TEST_F(DumpRingTest, dump_exposed_numerics) {
+    bvar::Adder<int> adder("dump_ring_adder");
+    adder << 1 << 2;
+    bvar::Maxer<uint64_t> maxer("dump_ring_maxer");
+    maxer << 5 << 3;
+    bvar::Status<double> status("dump_ring_status", 0.25);
+    bvar::PassiveStatus<int> passive("dump_ring_passive", get_ten, NULL);
+    bvar::Status<std::string> str("dump_ring_string", "hello");
+    bvar::Adder<int> excluded("dump_ring_excluded");
+
+    bvar::NumericValue value;
+    ASSERT_EQ(0, bvar::Variable::get_numeric_exposed("dump_ring_adder",
+                                                     &value));
+    ASSERT_EQ(bvar::NumericValue::TYPE_INT64, value.type);
+    ASSERT_EQ(3, value.i64);
+    ASSERT_EQ(-1, bvar::Variable::get_numeric_exposed("dump_ring_string",
+                                                      &value));
+    ASSERT_EQ(-1, bvar::Variable::get_numeric_exposed("not_exist", &value));
+
+    CollectNumerics dumper;
+    bvar::DumpOptions options;
+    options.white_wildcards = "dump_ring_*";
+    options.black_wildcards = "*_excluded";
+    ASSERT_EQ(4, bvar::Variable::dump_exposed_numerics(&dumper, &options));
+    ASSERT_EQ(4u, dumper.values.size());
+    ASSERT_EQ(bvar::NumericValue::TYPE_UINT64,
+              dumper.values["dump_ring_maxer"].type);
+    ASSERT_EQ(5u, dumper.values["dump_ring_maxer"].u64);
+    ASSERT_EQ(bvar::NumericValue::TYPE_DOUBLE,
+              dumper.values["dump_ring_status"].type);
+    ASSERT_EQ(0.25, dumper.values["dump_ring_status"].f64);
+    ASSERT_EQ(10, dumper.values["dump_ring_passive"].i64);
+
+    // Exact names.
+    dumper.values.clear();
+    options.white_wildcards = "dump_ring_adder;dump_ring_string";
+    options.black_wildcards.clear();
+    ASSERT_EQ(1, bvar::Variable::dump_exposed_numerics(&dumper, &options));
+    ASSERT_EQ(1u, dumper.values.count("dump_ring_adder"));
+
+    // Descriptions of non-numeric variables.
+    CollectAll all;
+    ASSERT_EQ(2, bvar::Variable::dump_exposed_numerics(&all, &options));
+    ASSERT_EQ(1u, all.values.count("dump_ring_adder"));
+    ASSERT_EQ("\"hello\"", all.descs["dump_ring_string"]);
+    all.values.clear();
+    options.white_wildcards = "dump_ring_*";
+    options.black_wildcards = "*_excluded";
+    ASSERT_EQ(5, bvar::Variable::dump_exposed_numerics(&all, &options));
+    ASSERT_EQ(4u, all.values.size());
+    ASSERT_EQ(1u, all.descs.size());
+
+    // Variables not displayed on plain text are filtered like dump_exposed().
+    bvar::Adder<int> html_only;
+    ASSERT_EQ(0, html_only.expose("dump_ring_html_only", bvar::DISPLAY_ON_HTML));
+    ASSERT_EQ(0, bvar::Variable::get_numeric_exposed("dump_ring_html_only",
+                                                     &value));
+    ASSERT_EQ(-1, bvar::Variable::get_numeric_exposed(
+                  "dump_ring_html_only", &value, bvar::DISPLAY_ON_PLAIN_TEXT));
+    options.display_filter = bvar::DISPLAY_ON_PLAIN_TEXT;
+    all.values.clear();
+    all.descs.clear();
+    ASSERT_EQ(5, bvar::Variable::dump_exposed_numerics(&all, &options));
+    options.white_wildcards = "dump_ring_adder;dump_ring_html_only";
+    options.black_wildcards.clear();
+    all.values.clear();
+    ASSERT_EQ(1, bvar::Variable::dump_exposed_numerics(&all, &options));
+    ASSERT_EQ(0u, all.values.count("dump_ring_html_only"));
+}
+
+// Like the FileDumper used by the dumping thread.
+class TextFileDumper : public bvar::Dumper {
+public:
+    explicit TextFileDumper(const std::string& path)
+        : _fp(fopen(path.c_str(), "w")) {}
+    ~TextFileDumper() { fclose(_fp); }
+    bool dump(const std::string& name,
+              const butil::StringPiece& desc) override {
+        return fprintf(_fp, "%.*s : %.*s\r\n",
+                       (int)name.size(), name.data(),
+                       (int)desc.size(), desc.data()) >= 0;
+    }
+private:
+    FILE* _fp;
+};
+
+TEST_F(DumpRingTest, performance) {
+    const int N = 10000;
+    std::vector<bvar::Adder<int64_t>*> adders;
+    for (int i = 0; i < N; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "dump_ring_perf_%d", i);
+        adders.push_back(new bvar::Adder<int64_t>(name));
+        *adders.back() << i;
+    }
+    bvar::DumpOptions options;
+    options.white_wildcards = "dump_ring_perf_*";
+    bvar::detail::DumpRingOptions ring_options;
+    ring_options.max_frames = 4;
+    ring_options.max_records = N;
+    bvar::detail::DumpRingWriter writer;
+    ASSERT_EQ(0, writer.open(_path, ring_options));
+    const std::string text_path = _dir.path().Append("bvar.data").value();
+    butil::Timer tm;
+    const int ROUNDS = 5;
+    tm.start();
+    for (int i = 0; i < ROUNDS; ++i) {
+        TextFileDumper text_dumper(text_path);
+        ASSERT_EQ(N, bvar::Variable::dump_exposed(&text_dumper, &options));
+    }
+    tm.stop();
+    const int64_t text_us = tm.u_elapsed() / ROUNDS;
+    tm.start();
+    for (int i = 0; i < ROUNDS; ++i) {
+        writer.begin_frame(i);
+        ASSERT_EQ(N, bvar::Variable::dump_exposed_numerics(&writer, &options));
+        writer.end_frame();
+    }
+    tm.stop();
+    const int64_t ring_us = tm.u_elapsed() / ROUNDS;
+    LOG(INFO) << "Dump " << N << " bvar: text=" << text_us
+              << "us binary ring=" << ring_us << "us";
+    for (int i = 0; i < N; ++i) {
+        delete adders[i];
+    }
+}
+
+}  // namespace
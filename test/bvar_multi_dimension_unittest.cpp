@@ -0,0 +1,289 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <pthread.h>
+#include <unistd.h>
+#include <map>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "butil/macros.h"
+#include "bvar/reducer.h"
+#include "bvar/multi_dimension.h"
+
+namespace bvar {
+DECLARE_int32(bvar_latency_p1);
+}
+
+namespace {
+
+typedef std::vector<std::string> Labels;
+
+Labels make_labels(const std::string& a, const std::string& b) {
+    Labels l;
+    l.push_back(a);
+    l.push_back(b);
+    return l;
+}
+
+class MapDumper : public bvar::Dumper {
+public:
+    bool dump(const std::string& name, const butil::StringPiece& desc) {
+        m[name] = desc.as_string();
+        return true;
+    }
+    std::map<std::string, std::string> m;
+};
+
+class NumericMapDumper : public bvar::NumericDumper {
+public:
+    bool dump(const std::string& name, const bvar::NumericValue& value) {
+        m[name] = value;
+        return true;
+    }
+    bvar::Dumper* non_numeric_dumper() { return &text; }
+    std::map<std::string, bvar::NumericValue> m;
+    MapDumper text;
+};
+
+TEST(MultiDimensionTest, sanity) {
+    bvar::MultiDimension<bvar::Adder<int> > md(make_labels("method", "peer"));
+    ASSERT_TRUE(md.name().empty());
+    ASSERT_EQ(2UL, md.labels().size());
+    ASSERT_EQ(0UL, md.count_stats());
+
+    // Wrong number of label values.
+    ASSERT_TRUE(md.get_stats(Labels(1, "Echo")) == NULL);
+
+    bvar::Adder<int>* a = md.get_stats(make_labels("Echo", "127.0.0.1"));
+    ASSERT_TRUE(a != NULL);
+    *a << 1;
+    ASSERT_EQ(a, md.get_stats(make_labels("Echo", "127.0.0.1")));
+    bvar::Adder<int>* b = md.get_stats(make_labels("Echo", "127.0.0.2"));
+    ASSERT_TRUE(b != NULL);
+    ASSERT_NE(a, b);
+    *b << 2;
+    ASSERT_EQ(1, a->get_value());
+    ASSERT_EQ(2, b->get_value());
+    ASSERT_EQ(2UL, md.count_stats());
+    ASSERT_TRUE(md.has_stats(make_labels("Echo", "127.0.0.1")));
+    ASSERT_FALSE(md.has_stats(make_labels("Echo", "127.0.0.3")));
+    std::vector<Labels> all;
+    md.list_stats(&all);
+    ASSERT_EQ(2UL, all.size());
+
+    md.delete_stats(make_labels("Echo", "127.0.0.1"));
+    ASSERT_EQ(1UL, md.count_stats());
+    ASSERT_FALSE(md.has_stats(make_labels("Echo", "127.0.0.1")));
+    md.clear_stats();
+    ASSERT_EQ(0UL, md.count_stats());
+}
+
+TEST(MultiDimensionTest, expose) {
+    const size_t count0 = bvar::MVariable::count_exposed();
+    {
+        bvar::MultiDimension<bvar::Adder<int> > md(
+            "MultiDimensionTest", "Expose", Labels(1, "l"));
+        ASSERT_EQ("multi_dimension_test_expose", md.name());
+        ASSERT_EQ(count0 + 1, bvar::MVariable::count_exposed());
+        std::ostringstream os;
+        ASSERT_EQ(0, bvar::MVariable::describe_exposed(md.name(), os));
+        ASSERT_NE(std::string::npos, os.str().find("\"stats_count\":0"));
+        // Same name is rejected.
+        bvar::MultiDimension<bvar::Adder<int> > md2(Labels(1, "l"));
+        ASSERT_EQ(-1, md2.expose_as("MultiDimensionTest", "Expose"));
+        ASSERT_TRUE(md2.name().empty());
+    }
+    ASSERT_EQ(count0, bvar::MVariable::count_exposed());
+}
+
+TEST(MultiDimensionTest, limit_stats_count) {
+    bvar::MultiDimension<bvar::Adder<int> > md(Labels(1, "l"));
+    md.set_max_stats_count(4);
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(md.get_stats(Labels(1, std::string(1, 'a' + i))) != NULL);
+    }
+    ASSERT_TRUE(md.get_stats(Labels(1, "e")) == NULL);
+    ASSERT_EQ(1, md.rejected_count());
+    // Existing label sets are still got.
+    ASSERT_TRUE(md.get_stats(Labels(1, "a")) != NULL);
+    md.delete_stats(Labels(1, "a"));
+    ASSERT_TRUE(md.get_stats(Labels(1, "e")) != NULL);
+    ASSERT_EQ(4UL, md.count_stats());
+}
+
+TEST(MultiDimensionTest, evict_idle_stats) {
+    bvar::MultiDimension<bvar::Adder<int> > md(Labels(1, "l"));
+    md.set_idle_seconds(1);
+    ASSERT_TRUE(md.get_stats(Labels(1, "idle")) != NULL);
+    ASSERT_TRUE(md.get_stats(Labels(1, "busy")) != NULL);
+    // Updated through the cached pointer only.
+    bvar::Adder<int>* pinned = md.get_pinned_stats(Labels(1, "pinned"));
+    ASSERT_TRUE(pinned != NULL);
+    ASSERT_EQ(pinned, md.get_pinned_stats(Labels(1, "pinned")));
+    ASSERT_EQ(0UL, md.evict_idle_stats());
+    for (int i = 0; i < 22; ++i) {
+        usleep(100000);
+        ASSERT_TRUE(md.get_stats(Labels(1, "busy")) != NULL);
+        *pinned << 1;
+    }
+    // Evicted here or in the sampling thread.
+    md.evict_idle_stats();
+    ASSERT_FALSE(md.has_stats(Labels(1, "idle")));
+    ASSERT_TRUE(md.has_stats(Labels(1, "busy")));
+    ASSERT_TRUE(md.has_stats(Labels(1, "pinned")));
+    ASSERT_EQ(pinned, md.get_stats(Labels(1, "pinned")));
+    ASSERT_EQ(22, pinned->get_value());
+
+    // Evicted by the sampling thread without calling evict_idle_stats(),
+    // the bvar is still usable right after the eviction, even if scraped
+    // (evicting) repeatedly.
+    bvar::Adder<int>* evicted = md.get_stats(Labels(1, "evicted"));
+    ASSERT_TRUE(evicted != NULL);
+    for (int i = 0; i < 50 && md.has_stats(Labels(1, "evicted")); ++i) {
+        usleep(100000);
+        ASSERT_TRUE(md.get_stats(Labels(1, "busy")) != NULL);
+    }
+    ASSERT_FALSE(md.has_stats(Labels(1, "evicted")));
+    md.evict_idle_stats();
+    md.evict_idle_stats();
+    *evicted << 1;
+    ASSERT_EQ(1, evicted->get_value());
+
+    // Disabled.
+    md.set_idle_seconds(0);
+    usleep(2100000);
+    ASSERT_EQ(0UL, md.evict_idle_stats());
+    ASSERT_EQ(2UL, md.count_stats());
+}
+
+TEST(MultiDimensionTest, dump) {
+    bvar::MultiDimension<bvar::Adder<int> > md(
+        "multi_dimension_dump", make_labels("method", "peer"));
+    *md.get_stats(make_labels("Echo", "a\"b\\c")) << 3;
+    MapDumper dumper;
+    ASSERT_EQ(1, bvar::MVariable::dump_exposed(&dumper, NULL));
+    ASSERT_EQ("3", dumper.m[
+        "multi_dimension_dump{method=\"Echo\",peer=\"a\\\"b\\\\c\"}"]);
+
+    bvar::MultiDimension<bvar::LatencyRecorder> lmd(
+        "multi_dimension_latency", Labels(1, "method"));
+    *lmd.get_stats(Labels(1, "Echo")) << 100;
+    MapDumper dumper2;
+    ASSERT_EQ(10, bvar::MVariable::dump_exposed(&dumper2, NULL));
+    ASSERT_EQ("1", dumper2.m["multi_dimension_latency_count{method=\"Echo\"}"]);
+    char name[64];
+    snprintf(name, sizeof(name), "multi_dimension_latency_latency_%d{method=\"Echo\"}",
+             (int)bvar::FLAGS_bvar_latency_p1);
+    ASSERT_EQ(1UL, dumper2.m.count(name));
+    ASSERT_EQ(1UL, dumper2.m.count("multi_dimension_latency_max_latency{method=\"Echo\"}"));
+
+    // Filtered by names.
+    bvar::DumpOptions options;
+    options.white_wildcards = "multi_dimension_l*";
+    MapDumper dumper3;
+    ASSERT_EQ(9, bvar::MVariable::dump_exposed(&dumper3, &options));
+    ASSERT_EQ(0UL, dumper3.m.count(
+                  "multi_dimension_dump{method=\"Echo\",peer=\"a\\\"b\\\\c\"}"));
+    options.black_wildcards = "multi_dimension_latency";
+    MapDumper dumper4;
+    ASSERT_EQ(0, bvar::MVariable::dump_exposed(&dumper4, &options));
+    ASSERT_EQ(0UL, md.dump(&dumper4, &options));
+    options.white_wildcards = "multi_dimension_dump";
+    ASSERT_EQ(1UL, md.dump(&dumper4, &options));
+}
+
+TEST(MultiDimensionTest, dump_numerics) {
+    bvar::MultiDimension<bvar::Adder<int> > md(
+        "multi_dimension_numerics", Labels(1, "method"));
+    *md.get_stats(Labels(1, "Echo")) << 3;
+    bvar::MultiDimension<bvar::Adder<std::string> > smd(
+        "multi_dimension_numerics_str", Labels(1, "method"));
+    *smd.get_stats(Labels(1, "Echo")) << "x";
+    bvar::MultiDimension<bvar::LatencyRecorder> lmd(
+        "multi_dimension_numerics_latency", Labels(1, "method"));
+    *lmd.get_stats(Labels(1, "Echo")) << 100;
+    NumericMapDumper dumper;
+    ASSERT_EQ(11, bvar::MVariable::dump_exposed_numerics(&dumper, NULL));
+    const bvar::NumericValue& v =
+        dumper.m["multi_dimension_numerics{method=\"Echo\"}"];
+    ASSERT_EQ(bvar::NumericValue::TYPE_INT64, v.type);
+    ASSERT_EQ(3, v.i64);
+    const bvar::NumericValue& count =
+        dumper.m["multi_dimension_numerics_latency_count{method=\"Echo\"}"];
+    ASSERT_EQ(bvar::NumericValue::TYPE_INT64, count.type);
+    ASSERT_EQ(1, count.i64);
+    // Non-numeric bvars are described.
+    ASSERT_EQ(1UL, dumper.text.m.size());
+    ASSERT_EQ("\"x\"", dumper.text.m[
+                  "multi_dimension_numerics_str{method=\"Echo\"}"]);
+}
+
+const int OPS_PER_THREAD = 2000000;
+
+struct UpdateArgs {
+    bvar::Adder<int>* adder;
+    bvar::MultiDimension<bvar::Adder<int> >* md;
+    Labels labels;
+};
+
+void* update_unlabeled(void* arg) {
+    bvar::Adder<int>* adder = static_cast<UpdateArgs*>(arg)->adder;
+    for (int i = 0; i < OPS_PER_THREAD; ++i) {
+        *adder << 1;
+    }
+    return NULL;
+}
+
+void* update_labeled(void* arg) {
+    UpdateArgs* args = static_cast<UpdateArgs*>(arg);
+    for (int i = 0; i < OPS_PER_THREAD; ++i) {
+        *args->md->get_stats(args->labels) << 1;
+    }
+    return NULL;
+}
+
+TEST(MultiDimensionTest, performance) {
+    const int NTHREAD = 4;
+    bvar::Adder<int> adder;
+    bvar::MultiDimension<bvar::Adder<int> > md(make_labels("method", "peer"));
+    void* (*fns[])(void*) = { update_unlabeled, update_labeled };
+    const char* names[] = { "unlabeled", "labeled" };
+    for (size_t f = 0; f < arraysize(fns); ++f) {
+        UpdateArgs args[NTHREAD];
+        pthread_t th[NTHREAD];
+        butil::Timer tm;
+        tm.start();
+        for (int i = 0; i < NTHREAD; ++i) {
+            args[i].adder = &adder;
+            args[i].md = &md;
+            args[i].labels = make_labels("Echo", (i % 2 ? "peer1" : "peer2"));
+            ASSERT_EQ(0, pthread_create(&th[i], NULL, fns[f], &args[i]));
+        }
+        for (int i = 0; i < NTHREAD; ++i) {
+            pthread_join(th[i], NULL);
+        }
+        tm.stop();
+        LOG(INFO) << names[f] << " update takes "
+                  << tm.n_elapsed() / (NTHREAD * OPS_PER_THREAD) << "ns";
+    }
+    ASSERT_EQ(NTHREAD * OPS_PER_THREAD, adder.get_value());
+    ASSERT_EQ(NTHREAD / 2 * OPS_PER_THREAD,
+              md.get_stats(make_labels("Echo", "peer1"))->get_value());
+}
+
+} // namespace
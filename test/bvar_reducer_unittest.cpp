@@ -18,6 +18,7 @@
 #include <limits>                           //std::numeric_limits
 
 #include "bvar/reducer.h"
+#include "bvar/percpu_adder.h"
 
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -342,4 +343,111 @@ TEST_F(ReducerTest, simple_window) {
     const int64_t v = w.get_value();
     ASSERT_EQ(100, v) << "v=" << v;
 }
+
+TEST_F(ReducerTest, percpu_adder) {
+    LOG(INFO) << "rseq is " << (bvar::PerCpuAdder<int>::percpu_enabled()
+                                ? "available" : "not available");
+    bvar::PerCpuAdder<int64_t> a;
+    ASSERT_EQ(0, a.get_value());
+    a << 1 << 2 << -4;
+    ASSERT_EQ(-1, a.get_value());
+    ASSERT_EQ(-1, a.reset());
+    ASSERT_EQ(0, a.get_value());
+    a << 10;
+    ASSERT_EQ(10, a.get_value());
+    // The fallback Adder is only created when values can't be added into
+    // per-cpu slots.
+    ASSERT_EQ(!bvar::PerCpuAdder<int>::percpu_enabled(), a._fallback != NULL);
+
+    // Add into the fallback Adder as if rseq were not available.
+    bvar::PerCpuAdder<int64_t> c;
+    int64_t* slot = c._slot;
+    c._slot = NULL;
+    c << 5 << 6;
+    c._slot = slot;
+    ASSERT_TRUE(c._fallback != NULL);
+    c << 1;
+    ASSERT_EQ(12, c.get_value());
+    ASSERT_EQ(12, c.reset());
+    ASSERT_EQ(0, c.get_value());
+
+    bvar::PerCpuAdder<uint32_t> b("percpu_adder_b");
+    b << 3;
+    ASSERT_EQ("3", bvar::Variable::describe_exposed("percpu_adder_b"));
+    bvar::Window<bvar::PerCpuAdder<int64_t> > w(&a, 10);
+    bvar::PerSecond<bvar::PerCpuAdder<int64_t> > ps(&a, 10);
+    a << 100;
+    sleep(3);
+    ASSERT_EQ(100, w.get_value());
+    ASSERT_GT(ps.get_value(10), 0);
+}
+
+static void* percpu_counter(void* arg) {
+    bvar::PerCpuAdder<uint64_t>* adder = (bvar::PerCpuAdder<uint64_t>*)arg;
+    butil::Timer timer;
+    timer.start();
+    for (size_t i = 0; i < OPS_PER_THREAD; ++i) {
+        (*adder) << 2;
+    }
+    timer.stop();
+    return (void*)(timer.n_elapsed());
+}
+
+static long start_perf_test_with_percpu_adder(size_t num_thread) {
+    bvar::PerCpuAdder<uint64_t> adder;
+    pthread_t threads[num_thread];
+    for (size_t i = 0; i < num_thread; ++i) {
+        pthread_create(&threads[i], NULL, &percpu_counter, (void*)&adder);
+    }
+    long totol_time = 0;
+    for (size_t i = 0; i < num_thread; ++i) {
+        void* ret = NULL;
+        pthread_join(threads[i], &ret);
+        totol_time += (long)ret;
+    }
+    long avg_time = totol_time / (OPS_PER_THREAD * num_thread);
+    EXPECT_EQ(2ul * num_thread * OPS_PER_THREAD, adder.get_value());
+    return avg_time;
+}
+
+TEST_F(ReducerTest, percpu_adder_perf) {
+    std::ostringstream oss;
+    for (size_t i = 1; i <= 24; i *= 2) {
+        oss << i << '\t' << start_perf_test_with_adder(i)
+            << '\t' << start_perf_test_with_percpu_adder(i) << '\n';
+    }
+    LOG(INFO) << "Adder vs PerCpuAdder performance:\n" << oss.str();
+
+    // Reading walks agents of all threads in Adder, but sums a fixed array
+    // in PerCpuAdder.
+    const size_t NVAR = 10000;
+    std::vector<bvar::Adder<int64_t>*> adders(NVAR);
+    std::vector<bvar::PerCpuAdder<int64_t>*> percpu_adders(NVAR);
+    for (size_t i = 0; i < NVAR; ++i) {
+        adders[i] = new bvar::Adder<int64_t>;
+        *adders[i] << 1;
+        percpu_adders[i] = new bvar::PerCpuAdder<int64_t>;
+        *percpu_adders[i] << 1;
+    }
+    int64_t sum = 0;
+    butil::Timer timer;
+    timer.start();
+    for (size_t i = 0; i < NVAR; ++i) {
+        sum += adders[i]->get_value();
+    }
+    timer.stop();
+    const long adder_read_ns = timer.n_elapsed() / NVAR;
+    timer.start();
+    for (size_t i = 0; i < NVAR; ++i) {
+        sum += percpu_adders[i]->get_value();
+    }
+    timer.stop();
+    ASSERT_EQ(2 * (int64_t)NVAR, sum);
+    LOG(INFO) << "get_value() of Adder takes " << adder_read_ns
+              << "ns, of PerCpuAdder takes " << timer.n_elapsed() / NVAR << "ns";
+    for (size_t i = 0; i < NVAR; ++i) {
+        delete adders[i];
+        delete percpu_adders[i];
+    }
+}
 } // namespace
@@ -16,11 +16,18 @@
 // under the License.
 
 #include <limits>                           //std::numeric_limits
+#include <set>
+#include <gflags/gflags.h>
 #include "bvar/detail/sampler.h"
+#include "butil/atomicops.h"
 #include "butil/time.h"
 #include "butil/logging.h"
 #include <gtest/gtest.h>
 
+namespace bvar {
+DECLARE_int32(bvar_sampler_thread_num);
+}
+
 namespace {
 
 TEST(SamplerTest, linked_list) {
@@ -136,4 +143,43 @@ TEST(SamplerTest, multi_threaded) {
     }
 #endif
 }
+
+// Called in sampling threads and read in the test thread.
+class ThreadRecordingSampler : public bvar::detail::Sampler {
+public:
+    ThreadRecordingSampler() : _ncalled(0), _tid(0) {}
+    void take_sample() {
+        _ncalled.fetch_add(1, butil::memory_order_relaxed);
+        _tid.store(pthread_self(), butil::memory_order_relaxed);
+    }
+    int called_count() const
+    { return _ncalled.load(butil::memory_order_relaxed); }
+    pthread_t sampling_thread() const
+    { return _tid.load(butil::memory_order_relaxed); }
+private:
+    butil::atomic<int> _ncalled;
+    butil::atomic<pthread_t> _tid;
+};
+
+TEST(SamplerTest, sharded) {
+    const int N = 1000;
+    ThreadRecordingSampler* s[N];
+    for (int i = 0; i < N; ++i) {
+        s[i] = new ThreadRecordingSampler;
+        s[i]->schedule();
+    }
+    usleep(1010000);
+    bvar::FLAGS_bvar_sampler_thread_num = 4;
+    // Shards are added and samplers are rebalanced in next round.
+    usleep(2020000);
+    std::set<pthread_t> threads;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_LE(2, s[i]->called_count()) << "i=" << i;
+        threads.insert(s[i]->sampling_thread());
+    }
+    ASSERT_EQ(4UL, threads.size());
+    for (int i = 0; i < N; ++i) {
+        s[i]->destroy();
+    }
+}
 } // namespace
@@ -0,0 +1,248 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <limits>
+#include <gtest/gtest.h>
+#include "butil/fast_rand.h"
+#include "bvar/reducer.h"
+#include "bvar/vector.h"
+#include "bvar/detail/series.h"
+
+namespace {
+
+// The primary template stores values in arrays.
+template <typename T>
+struct UncompressedData : public bvar::detail::SeriesData<T, int> {};
+
+template <typename T>
+void check_same_values(const bvar::detail::SeriesData<T>& data,
+                       const UncompressedData<T>& expected) {
+    T values[bvar::detail::SERIES_NVALUE];
+    T expected_values[bvar::detail::SERIES_NVALUE];
+    data.get_values(values);
+    expected.get_values(expected_values);
+    for (int i = 0; i < bvar::detail::SERIES_NVALUE; ++i) {
+        ASSERT_TRUE(values[i] == expected_values[i]) << "i=" << i;
+    }
+}
+
+template <typename T>
+void append_to_both(bvar::detail::SeriesData<T>* data,
+                    UncompressedData<T>* expected, int level, const T& value) {
+    data->append(level, value);
+    expected->append(level, value);
+}
+
+TEST(SeriesTest, int_codec) {
+    bvar::detail::SeriesData<int64_t> data;
+    UncompressedData<int64_t> expected;
+    check_same_values(data, expected);
+    const int64_t specials[] = {
+        0, 1, -1, 63, -64, 64, 255, -256, 2047, -2048, 2048,
+        std::numeric_limits<int64_t>::max(),
+        std::numeric_limits<int64_t>::min(), 0 };
+    for (int level = 0; level < bvar::detail::SERIES_NLEVEL; ++level) {
+        for (size_t i = 0; i < arraysize(specials); ++i) {
+            append_to_both(&data, &expected, level, specials[i]);
+            check_same_values(data, expected);
+        }
+        // Rings are re-encoded for many times.
+        for (int i = 0; i < 300; ++i) {
+            const int64_t v = (i % 3 == 0 ? (int64_t)butil::fast_rand() :
+                               (int64_t)(i * 7 - 1000));
+            append_to_both(&data, &expected, level, v);
+            check_same_values(data, expected);
+        }
+    }
+}
+
+TEST(SeriesTest, full_bits) {
+    bvar::detail::SeriesBits bits;
+    bvar::detail::IntSeriesCodec::State st;
+    std::vector<int64_t> values;
+    // Values changing randomly take 68 bits each.
+    for (int i = 0; ; ++i) {
+        const uint32_t size = bits.size();
+        const int64_t v = (int64_t)butil::fast_rand();
+        if (!bvar::detail::IntSeriesCodec::encode(&bits, &st, i, v)) {
+            // Failed encoding does not leave partial bits.
+            ASSERT_EQ(size, bits.size());
+            break;
+        }
+        values.push_back(v);
+    }
+    const uint32_t max_bits = bvar::detail::SeriesBits::MAX_WORDS * 64;
+    ASSERT_GT(bits.size() + 68, max_bits);
+    ASSERT_FALSE(bits.append(0, 64));
+    bvar::detail::IntSeriesCodec::State decode_st;
+    uint32_t pos = 0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        ASSERT_EQ(values[i], bvar::detail::IntSeriesCodec::decode(
+                      bits, &pos, &decode_st, i));
+    }
+    ASSERT_EQ(bits.size(), pos);
+}
+
+TEST(SeriesTest, double_codec) {
+    bvar::detail::SeriesData<double> data;
+    UncompressedData<double> expected;
+    const double specials[] = {
+        0.0, -0.0, 1.0, 1.5, -3.25, 1e300, -1e-300,
+        std::numeric_limits<double>::infinity(),
+        std::numeric_limits<double>::min(),
+        std::numeric_limits<double>::denorm_min(), 0.1, 0.1 };
+    for (int level = 0; level < bvar::detail::SERIES_NLEVEL; ++level) {
+        for (size_t i = 0; i < arraysize(specials); ++i) {
+            append_to_both(&data, &expected, level, specials[i]);
+            check_same_values(data, expected);
+        }
+        for (int i = 0; i < 300; ++i) {
+            const double v = (i % 2 ? butil::fast_rand_double() * 100 :
+                              floor(i / 10.0) * 0.5);
+            append_to_both(&data, &expected, level, v);
+            check_same_values(data, expected);
+        }
+    }
+}
+
+TEST(SeriesTest, vector_codec) {
+    typedef bvar::Vector<int64_t, 4> V;
+    bvar::detail::SeriesData<V> data;
+    UncompressedData<V> expected;
+    for (int level = 0; level < bvar::detail::SERIES_NLEVEL; ++level) {
+        for (int i = 0; i < 200; ++i) {
+            V v;
+            v[0] = i;
+            v[1] = -i * i;
+            v[2] = butil::fast_rand();
+            v[3] = 42;
+            append_to_both(&data, &expected, level, v);
+            check_same_values(data, expected);
+        }
+    }
+}
+
+TEST(SeriesTest, aggregate) {
+    bvar::detail::Series<int64_t, bvar::detail::AddTo<int64_t> > series(
+        (bvar::detail::AddTo<int64_t>()));
+    int64_t values[bvar::detail::SERIES_NVALUE];
+    const int second_off = bvar::detail::series_level_offset(
+        bvar::detail::SERIES_SECOND);
+    const int minute_off = bvar::detail::series_level_offset(
+        bvar::detail::SERIES_MINUTE);
+    const int hour_off = bvar::detail::series_level_offset(
+        bvar::detail::SERIES_HOUR);
+    for (int i = 1; i <= 60; ++i) {
+        series.append(i);
+    }
+    series.get_values(values);
+    for (int i = 0; i < 60; ++i) {
+        ASSERT_EQ(i + 1, values[second_off + i]);
+    }
+    // Average of 1..60 is 30.5
+    ASSERT_EQ(31, values[minute_off + 59]);
+    ASSERT_EQ(0, values[minute_off + 58]);
+
+    for (int i = 60; i < 3600; ++i) {
+        series.append(10);
+    }
+    series.get_values(values);
+    ASSERT_EQ(10, values[hour_off + 23]);
+    for (int i = 1; i < 59; ++i) {
+        ASSERT_EQ(10, values[minute_off + i]);
+    }
+
+    std::ostringstream os;
+    series.describe(os, NULL);
+    ASSERT_EQ(0u, os.str().find("{\"label\":\"trend\",\"data\":[[0,0],"));
+}
+
+// Memory used by series of a process: most of them are idle, some change
+// slowly and a few are noisy.
+TEST(SeriesTest, memory_usage) {
+    typedef bvar::detail::Series<int64_t, bvar::detail::AddTo<int64_t> >
+        IntSeries;
+    typedef bvar::detail::Series<double, bvar::detail::AddTo<double> >
+        DoubleSeries;
+    const int N = 300;
+    std::vector<IntSeries*> int_series;
+    std::vector<DoubleSeries*> double_series;
+    for (int i = 0; i < N; ++i) {
+        int_series.push_back(new IntSeries(bvar::detail::AddTo<int64_t>()));
+        double_series.push_back(
+            new DoubleSeries(bvar::detail::AddTo<double>()));
+    }
+    // 2 hours.
+    for (int t = 0; t < 7200; ++t) {
+        for (int i = 0; i < N; ++i) {
+            int64_t v = 0;
+            double d = 0;
+            if (i % 10 == 0) {
+                // e.g. qps and latency.
+                v = 5000 + butil::fast_rand_less_than(200);
+                d = 1.5 + butil::fast_rand_double();
+            } else if (i % 10 < 4) {
+                v = 1000 + t / 100;
+                d = 0.5 + t / 100;
+            }
+            int_series[i]->append(v);
+            double_series[i]->append(d);
+        }
+    }
+    size_t int_mem = 0;
+    size_t double_mem = 0;
+    for (int i = 0; i < N; ++i) {
+        int_mem += int_series[i]->memory_usage();
+        double_mem += double_series[i]->memory_usage();
+        delete int_series[i];
+        delete double_series[i];
+    }
+    const size_t uncompressed =
+        N * bvar::detail::SERIES_NVALUE * sizeof(int64_t);
+    LOG(INFO) << "int series: " << int_mem / N << "B/series"
+              << " double series: " << double_mem / N << "B/series"
+              << " uncompressed: " << uncompressed / N << "B/series";
+    ASSERT_LT(int_mem * 3, uncompressed);
+    // Random doubles are hardly compressed.
+    ASSERT_LT(double_mem * 2, uncompressed);
+}
+
+TEST(SeriesTest, perf) {
+    bvar::detail::Series<int64_t, bvar::detail::AddTo<int64_t> > series(
+        (bvar::detail::AddTo<int64_t>()));
+    butil::Timer tm;
+    const int N = 100000;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        series.append(butil::fast_rand_less_than(1000));
+    }
+    tm.stop();
+    LOG(INFO) << "append takes " << tm.n_elapsed() / N << "ns";
+    std::ostringstream os;
+    tm.start();
+    for (int i = 0; i < 100; ++i) {
+        os.str("");
+        series.describe(os, NULL);
+    }
+    tm.stop();
+    LOG(INFO) << "describe takes " << tm.u_elapsed() / 100 << "us";
+}
+
+}  // namespace
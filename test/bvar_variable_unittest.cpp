@@ -18,6 +18,7 @@
 // Date: Fri Jul 24 17:19:40 CST 2015
 
 #include <pthread.h>                                // pthread_*
+#include <stdio.h>                                  // snprintf
 
 #include <cstddef>
 #include <memory>
@@ -387,6 +388,208 @@ TEST_F(VariableTest, recursive_mutex) {
     LOG(INFO) << "Each recursive mutex lock/unlock pair take "
               << timer.n_elapsed() / N << "ns";
 }
+TEST_F(VariableTest, batch) {
+    bvar::Status<int> st1(1);
+    bvar::Status<int> st2(2);
+    bvar::Status<int> st3(3);
+    ASSERT_EQ(0, st1.expose("batch_var1"));
+    {
+        bvar::VariableBatch batch;
+        batch.expose(&st2, "batch_var2");
+        batch.expose_as(&st3, "batch", "var3");
+        // Not exposed before commit().
+        ASSERT_EQ("", bvar::Variable::describe_exposed("batch_var2"));
+    }
+    ASSERT_EQ("1", bvar::Variable::describe_exposed("batch_var1"));
+    ASSERT_EQ("2", bvar::Variable::describe_exposed("batch_var2"));
+    ASSERT_EQ("3", bvar::Variable::describe_exposed("batch_var3"));
+
+    // Hides are applied before exposes, so names can be swapped.
+    bvar::VariableBatch batch;
+    batch.hide(&st1);
+    batch.hide(&st2);
+    batch.expose(&st1, "batch_var2");
+    batch.expose(&st2, "batch_var1");
+    ASSERT_EQ(0, batch.commit());
+    ASSERT_EQ("2", bvar::Variable::describe_exposed("batch_var1"));
+    ASSERT_EQ("1", bvar::Variable::describe_exposed("batch_var2"));
+    ASSERT_EQ("batch_var2", st1.name());
+
+    // Conflict with an exposed variable and another one in the batch.
+    bvar::Status<int> st4(4);
+    bvar::Status<int> st5(5);
+    batch.expose(&st4, "batch_var3");
+    batch.expose(&st4, "batch_var4");
+    batch.expose(&st5, "batch_var4");
+    ASSERT_EQ(2, batch.commit());
+    ASSERT_EQ("3", bvar::Variable::describe_exposed("batch_var3"));
+    ASSERT_EQ("4", bvar::Variable::describe_exposed("batch_var4"));
+    ASSERT_TRUE(st5.name().empty());
+
+    batch.hide(&st1);
+    batch.hide(&st2);
+    batch.hide(&st3);
+    batch.hide(&st4);
+    ASSERT_EQ(0, batch.commit());
+    ASSERT_EQ("", bvar::Variable::describe_exposed("batch_var1"));
+    ASSERT_EQ("", bvar::Variable::describe_exposed("batch_var4"));
+    ASSERT_FALSE(st1.hide());
+}
+
+// Hide itself after being exposed with name "hide_me".
+class HideOnExpose : public bvar::Status<int> {
+public:
+    HideOnExpose() : bvar::Status<int>(7) {}
+protected:
+    int expose_impl(const butil::StringPiece& prefix,
+                    const butil::StringPiece& name,
+                    bvar::DisplayFilter display_filter) override {
+        const int rc = bvar::Status<int>::expose_impl(
+            prefix, name, display_filter);
+        if (rc == 0 && name == "hide_me") {
+            hide();
+        }
+        return rc;
+    }
+};
+
+TEST_F(VariableTest, batch_expose_pending) {
+    // The last name wins if a variable is exposed more than once.
+    bvar::Status<int> st(1);
+    {
+        bvar::VariableBatch batch;
+        batch.expose(&st, "batch_pending1");
+        batch.expose(&st, "batch_pending2");
+        ASSERT_EQ(0, batch.commit());
+    }
+    ASSERT_EQ("", bvar::Variable::describe_exposed("batch_pending1"));
+    ASSERT_EQ("1", bvar::Variable::describe_exposed("batch_pending2"));
+    ASSERT_EQ("batch_pending2", st.name());
+
+    // Names dropped in the batch can be used by other variables.
+    bvar::Status<int> st2(2);
+    {
+        bvar::VariableBatch batch;
+        batch.expose(&st, "batch_pending3");
+        batch.expose(&st, "batch_pending4");
+        batch.expose(&st2, "batch_pending3");
+        ASSERT_EQ(0, batch.commit());
+    }
+    ASSERT_EQ("", bvar::Variable::describe_exposed("batch_pending2"));
+    ASSERT_EQ("2", bvar::Variable::describe_exposed("batch_pending3"));
+    ASSERT_EQ("1", bvar::Variable::describe_exposed("batch_pending4"));
+
+    // Hidden while its expose is pending.
+    HideOnExpose h;
+    {
+        bvar::VariableBatch batch;
+        batch.expose(&h, "hide_me");
+        ASSERT_EQ(0, batch.commit());
+    }
+    ASSERT_TRUE(h.name().empty());
+    ASSERT_EQ("", bvar::Variable::describe_exposed("hide_me"));
+    ASSERT_EQ(0, h.expose("hide_me_not"));
+    ASSERT_EQ("7", bvar::Variable::describe_exposed("hide_me_not"));
+}
+
+struct ChurnArg {
+    int index;
+    butil::atomic<bool>* stop;
+    int64_t niter;
+};
+
+static void* expose_and_hide(void* void_arg) {
+    ChurnArg* arg = (ChurnArg*)void_arg;
+    char name[64];
+    for (int64_t i = 0; !arg->stop->load(butil::memory_order_relaxed); ++i) {
+        snprintf(name, sizeof(name), "churn_%d_%d", arg->index, (int)(i % 64));
+        bvar::Adder<int> adder(name);
+        adder << 1;
+        ++arg->niter;
+    }
+    return NULL;
+}
+
+class CountNumericDumper : public bvar::NumericDumper {
+public:
+    CountNumericDumper() : count(0) {}
+    bool dump(const std::string&, const bvar::NumericValue&) override {
+        ++count;
+        return true;
+    }
+    int count;
+};
+
+TEST_F(VariableTest, churn_while_scraping) {
+    // Variables of other modules being scraped.
+    const size_t NVAR = 10000;
+    std::vector<bvar::Adder<int>*> vars(NVAR);
+    {
+        bvar::VariableBatch batch;
+        char name[32];
+        for (size_t i = 0; i < NVAR; ++i) {
+            vars[i] = new bvar::Adder<int>;
+            snprintf(name, sizeof(name), "scraped_%lu", i);
+            batch.expose(vars[i], name);
+        }
+    }
+    butil::atomic<bool> stop(false);
+    const int NTHREAD = 4;
+    ChurnArg args[NTHREAD];
+    pthread_t th[NTHREAD];
+    for (int i = 0; i < NTHREAD; ++i) {
+        args[i].index = i;
+        args[i].stop = &stop;
+        args[i].niter = 0;
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, expose_and_hide, &args[i]));
+    }
+    std::vector<std::string> names;
+    CountNumericDumper dumper;
+    butil::Timer timer;
+    const int NSCRAPE = 20;
+    int64_t list_ns = 0;
+    int64_t dump_ns = 0;
+    for (int i = 0; i < NSCRAPE; ++i) {
+        timer.start();
+        bvar::Variable::list_exposed(&names);
+        timer.stop();
+        list_ns += timer.n_elapsed();
+        ASSERT_GE(names.size(), NVAR);
+        dumper.count = 0;
+        timer.start();
+        const int ndumped = bvar::Variable::dump_exposed_numerics(&dumper, NULL);
+        timer.stop();
+        dump_ns += timer.n_elapsed();
+        ASSERT_GE(ndumped, (int)NVAR);
+        ASSERT_EQ(ndumped, dumper.count);
+    }
+    stop.store(true);
+    int64_t niter = 0;
+    for (int i = 0; i < NTHREAD; ++i) {
+        pthread_join(th[i], NULL);
+        niter += args[i].niter;
+    }
+    LOG(INFO) << "list_exposed takes " << list_ns / NSCRAPE / 1000
+              << "us and dump_exposed_numerics takes "
+              << dump_ns / NSCRAPE / 1000 << "us with " << names.size()
+              << " variables, " << niter << " variables are exposed and"
+              " hidden by " << NTHREAD << " threads meanwhile";
+
+    timer.start();
+    {
+        bvar::VariableBatch batch;
+        for (size_t i = 0; i < NVAR; ++i) {
+            batch.hide(vars[i]);
+        }
+    }
+    timer.stop();
+    LOG(INFO) << "Hiding " << NVAR << " variables in a batch takes "
+              << timer.m_elapsed() << "ms";
+    for (size_t i = 0; i < NVAR; ++i) {
+        ASSERT_TRUE(vars[i]->name().empty());
+        delete vars[i];
+    }
+}
 } // namespace
 
 int main(int argc, char** argv) {
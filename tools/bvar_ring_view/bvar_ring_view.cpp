@@ -0,0 +1,176 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+// Print values in a ring file written by bvar when -bvar_dump_ring is on,
+// as text or json.
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <cmath>
+#include <gflags/gflags.h>
+#include <butil/string_splitter.h>
+#include <bvar/detail/dump_ring.h>
+
+DEFINE_bool(json, false, "Print as json");
+DEFINE_string(name_filter, "", "Print variables whose names match these "
+              "wildcards (separated by comma or semicolon), empty means all");
+DEFINE_int64(since_us, 0, "Print frames written since this time "
+             "(microseconds since epoch)");
+
+static bool match_name(const std::vector<std::string>& wildcards,
+                       const std::string& name) {
+    if (wildcards.empty()) {
+        return true;
+    }
+    for (size_t i = 0; i < wildcards.size(); ++i) {
+        if (fnmatch(wildcards[i].c_str(), name.c_str(), 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_value(const bvar::NumericValue& value) {
+    switch (value.type) {
+    case bvar::NumericValue::TYPE_INT64:
+        printf("%lld", (long long)value.i64);
+        break;
+    case bvar::NumericValue::TYPE_UINT64:
+        printf("%llu", (unsigned long long)value.u64);
+        break;
+    case bvar::NumericValue::TYPE_DOUBLE:
+        if (FLAGS_json && !std::isfinite(value.f64)) {
+            // nan and inf are not valid json numbers.
+            printf("null");
+        } else {
+            printf("%.17g", value.f64);
+        }
+        break;
+    default:
+        printf(FLAGS_json ? "null" : "?");
+        break;
+    }
+}
+
+static void print_json_string(const std::string& s) {
+    putchar('"');
+    for (size_t i = 0; i < s.size(); ++i) {
+        const char c = s[i];
+        if (c == '"' || c == '\\') {
+            putchar('\\');
+            putchar(c);
+        } else if ((unsigned char)c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s [-json] [-name_filter=wildcards] "
+                "[-since_us=time] ring_file\n", argv[0]);
+        return 1;
+    }
+    bvar::detail::DumpRingReader reader;
+    if (reader.open(argv[1]) != 0) {
+        return 1;
+    }
+    std::vector<std::string> wildcards;
+    for (butil::StringMultiSplitter sp(FLAGS_name_filter.c_str(), ",;");
+         sp; ++sp) {
+        if (sp.length()) {
+            wildcards.push_back(std::string(sp.field(), sp.length()));
+        }
+    }
+    std::vector<std::string> names;
+    reader.get_names(&names);
+    std::vector<bvar::detail::DumpRingReader::Frame> frames;
+    reader.get_frames(&frames);
+
+    const bvar::detail::DumpRingHeader& h = reader.header();
+    if (FLAGS_json) {
+        printf("{\"app\":");
+        print_json_string(std::string(h.app, strnlen(h.app, sizeof(h.app))));
+        printf(",\"pid\":%d,\"interval_s\":%d,\"frames\":[",
+               h.pid, h.interval_s);
+    } else {
+        printf("# app=%.*s pid=%d interval_s=%d frames=%lu\n",
+               (int)strnlen(h.app, sizeof(h.app)), h.app, h.pid,
+               h.interval_s, (unsigned long)frames.size());
+    }
+    bool first_frame = true;
+    for (size_t i = 0; i < frames.size(); ++i) {
+        const bvar::detail::DumpRingReader::Frame& f = frames[i];
+        if (f.time_us < FLAGS_since_us) {
+            continue;
+        }
+        if (FLAGS_json) {
+            printf("%s{\"time_us\":%lld,\"dropped\":%u,\"values\":{",
+                   (first_frame ? "" : ","), (long long)f.time_us,
+                   f.ndropped);
+        } else {
+            time_t t = f.time_us / 1000000L;
+            struct tm tm;
+            localtime_r(&t, &tm);
+            char buf[64];
+            strftime(buf, sizeof(buf), "%Y/%m/%d-%H:%M:%S", &tm);
+            printf("# %s.%06d", buf, (int)(f.time_us % 1000000L));
+            if (f.ndropped) {
+                printf(" dropped=%u", f.ndropped);
+            }
+            putchar('\n');
+        }
+        first_frame = false;
+        bool first_value = true;
+        for (size_t j = 0; j < f.records.size(); ++j) {
+            const bvar::detail::DumpRingReader::Record& r = f.records[j];
+            const std::string name = (r.name_id < names.size() ?
+                                      names[r.name_id] : "<unknown>");
+            if (!match_name(wildcards, name)) {
+                continue;
+            }
+            if (FLAGS_json) {
+                if (!first_value) {
+                    putchar(',');
+                }
+                print_json_string(name);
+                putchar(':');
+                print_value(r.value);
+            } else {
+                printf("%s : ", name.c_str());
+                print_value(r.value);
+                putchar('\n');
+            }
+            first_value = false;
+        }
+        if (FLAGS_json) {
+            printf("}}");
+        }
+    }
+    if (FLAGS_json) {
+        printf("]}\n");
+    }
+    return 0;
+}